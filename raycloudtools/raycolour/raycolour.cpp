@@ -6,11 +6,12 @@
 #include "raylib/extraction/raysegment.h"
 #include "raylib/raycloud.h"
 #include "raylib/raycloudwriter.h"
+#include "raylib/rayneighbours.h"
 #include "raylib/rayparse.h"
+#include "raylib/raytransform.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "raylib/imageread.h"
 
-#include <nabo/nabo.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -32,6 +33,7 @@ void usage(int exit_code = 1)
   std::cout << "                   branches      - red and green are lidar intensity and cylindricality respectively, greater for branches than for leaves" << std::endl;
   std::cout << "                   image planview.png - colour all points from image, stretched to fit the point bounds" << std::endl;
   std::cout << "                         --lit   - shaded (slow on large datasets)" << std::endl;
+  std::cout << "                         --neighbour_cache dir - saves the point neighbours in the existing directory dir, for reuse by later runs" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -44,15 +46,6 @@ double areaMeasure(const Eigen::Matrix3d &mat)
          mat(1, 1) * mat(2, 2) - mat(1, 2) * mat(2, 1);
 }
 
-// shortcut, to place the red green blue spectrum into the RGBA structure
-void spectrumRGB(double value, ray::RGBA &colour)
-{
-  const Eigen::Vector3d col = ray::redGreenBlueSpectrum(value);
-  colour.red = static_cast<uint8_t>(255.0 * col[0]);
-  colour.green = static_cast<uint8_t>(255.0 * col[1]);
-  colour.blue = static_cast<uint8_t>(255.0 * col[2]);
-}
-
 /// Function to colour the cloud from a horizontal projection of a supplied image, stretching to match the cloud bounds.
 void colourFromImage(const std::string &cloud_file, const std::string &image_file, ray::CloudWriter &writer)
 {
@@ -101,13 +94,15 @@ int rayColour(int argc, char *argv[])
   ray::FileArgument cloud_file, image_file;
   ray::KeyChoice colour_type({ "time", "height", "shape", "normal", "alpha", "branches" });
   ray::OptionalFlagArgument lit("lit", 'l');
+  ray::FileArgument cache_dir(false);
+  ray::OptionalKeyValueArgument cache_option("neighbour_cache", 'n', &cache_dir);
   ray::Vector3dArgument col(0.0, 1.0);
   ray::DoubleArgument alpha(0.0, 1.0);
   ray::TextArgument alpha_text("alpha"), image_text("image");
-  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, { &lit });
-  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, { &lit });
-  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, { &lit });
-  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, { &lit });
+  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, { &lit, &cache_option });
+  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, { &lit, &cache_option });
+  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, { &lit, &cache_option });
+  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, { &lit, &cache_option });
   if (!standard_format && !flat_colour && !flat_alpha && !image_format)
     usage();
 
@@ -127,47 +122,28 @@ int rayColour(int argc, char *argv[])
                          std::vector<double> &times, std::vector<ray::RGBA> &colours) {
       if (flat_colour)
       {
-        for (auto &colour : colours)
-        {
-          colour.red = (uint8_t)(255.0 * col.value()[0]);
-          colour.green = (uint8_t)(255.0 * col.value()[1]);
-          colour.blue = (uint8_t)(255.0 * col.value()[2]);
-        }
+        ray::setRayColours(colours, ray::RGBA((uint8_t)(255.0 * col.value()[0]), (uint8_t)(255.0 * col.value()[1]),
+                                              (uint8_t)(255.0 * col.value()[2]), 255));
       }
       else if (flat_alpha)
       {
-        for (auto &colour : colours)
-        {
-          colour.alpha = (uint8_t)(255.0 * alpha.value());
-        }
+        ray::setRayAlphas(colours, (uint8_t)(255.0 * alpha.value()));
       }
       else  // standard_format
       {
         if (type == "time")
         {
           const double colour_repeat_period = 60.0;  // repeating per minute gives a quick way to assess the scan length
-          for (size_t i = 0; i < ends.size(); i++)
-          {
-            spectrumRGB(times[i] / colour_repeat_period, colours[i]);
-          }
+          ray::colourRaysBySpectrum(times, colour_repeat_period, colours);
         }
         else if (type == "height")
         {
           const double wavelength = 10.0;
-          for (size_t i = 0; i < ends.size(); i++)
-          {
-            spectrumRGB(ends[i][2] / wavelength, colours[i]);
-          }
+          ray::colourRaysByHeight(ends, wavelength, colours);
         }
         else if (type == "alpha")
         {
-          for (auto &colour : colours)
-          {
-            const Eigen::Vector3d col_vec = ray::redGreenBlueGradient(colour.alpha / 255.0);
-            colour.red = uint8_t(255.0 * col_vec[0]);
-            colour.green = uint8_t(255.0 * col_vec[1]);
-            colour.blue = uint8_t(255.0 * col_vec[2]);
-          }
+          ray::colourRaysByAlpha(colours);
         }
         else
           usage();
@@ -179,7 +155,7 @@ int rayColour(int argc, char *argv[])
     {
       colourFromImage(cloud_file.name(), image_file.name(), writer);
     }
-    else if (!ray::Cloud::read(cloud_file.name(), colour_rays))
+    else if (!ray::Cloud::read(cloud_file.name(), colour_rays, 1))
     {
       usage();
     }
@@ -192,6 +168,8 @@ int rayColour(int argc, char *argv[])
 
   // The remainder cannot currently be done with chunk loading
   ray::Cloud cloud;
+  if (cache_option.isSet())
+    cloud.neighbour_cache_dir = cache_dir.name();
   if (!cloud.load(in_file))
     usage();
 
@@ -275,7 +253,7 @@ int rayColour(int argc, char *argv[])
       // we use the median of the neighbour points to be robust to noise
       cols.clear();
       cols.push_back(cloud.colours[i].alpha);
-      for (int j = 0; j < 4 && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < 4 && indices(j, i) != ray::Neighbours::kInvalidIndex; j++)
       {
         cols.push_back(cloud.colours[indices(j, i)].alpha);
       }
@@ -295,7 +273,7 @@ int rayColour(int argc, char *argv[])
       // 2. green is cylindricality
       Eigen::Vector3d mean = cloud.ends[i];  // centroid
       int num = 1;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::Neighbours::kInvalidIndex; j++)
       {
         mean += cloud.ends[indices(j, i)];
         num++;
@@ -303,7 +281,7 @@ int rayColour(int argc, char *argv[])
       mean /= (double)num;
       // get teh scatter matrix of the neighbourhood of points
       Eigen::Matrix3d scatter = (cloud.ends[i] - mean) * (cloud.ends[i] - mean).transpose();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::Neighbours::kInvalidIndex; j++)
       {
         Eigen::Vector3d v = cloud.ends[indices(j, i)] - mean;
         scatter += v * v.transpose();
@@ -329,7 +307,7 @@ int rayColour(int argc, char *argv[])
       if (!cloud.rayBounded(i))
         continue;
       double sum_x = 0, sum_y = 0, sum_xy = 0, sum_xx = 0, sum_yy = 0, n = 0;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::Neighbours::kInvalidIndex; j++)
       {
         int id = indices(j, i);
         Eigen::Vector3d flat = cloud.ends[id] - centroids[i];
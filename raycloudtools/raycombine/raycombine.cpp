@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
 #include "raylib/raymerger.h"
 #include "raylib/raymesh.h"
 #include "raylib/rayparse.h"
@@ -33,6 +34,8 @@ void usage(int exit_code = 1)
   std::cout << "raycombine basecloud min raycloud1 raycloud2 20 rays - 3-way merge, choses the changed geometry (from basecloud) at any differences. " << std::endl;
   std::cout << "                                                       For merge conflicts it uses the specified merge type." << std::endl;
   std::cout << "        --output raycloud_combined.ply               - optionally specify the output file name." << std::endl;
+  std::cout << "        --ellipsoid_cache dir                        - saves each cloud's ellipsoids in the existing directory dir," << std::endl;
+  std::cout << "                                                       and reuses them on later runs, such as merging new scans into one base cloud." << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -48,17 +51,19 @@ int rayCombine(int argc, char *argv[])
   // Below: false = allow unusual file extensions, for auto-merging, which occurs on non-standard temporary file names
   ray::FileArgument base_cloud(false), cloud_1(false), cloud_2(false), output_file(false);
   ray::OptionalKeyValueArgument output("output", 'o', &output_file);
+  ray::FileArgument cache_dir(false);
+  ray::OptionalKeyValueArgument cache_option("ellipsoid_cache", 'e', &cache_dir);
 
   // three-way merge option
-  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output });
-  bool concatenate_all = ray::parseCommandLine(argc, argv, { &all_text, &cloud_files }, { &output });
+  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output, &cache_option });
+  bool concatenate_all = ray::parseCommandLine(argc, argv, { &all_text, &cloud_files }, { &output, &cache_option });
   bool threeway = ray::parseCommandLine(
-    argc, argv, { &base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text }, { &output });
+    argc, argv, { &base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text }, { &output, &cache_option });
   bool threeway_concatenate =
-    ray::parseCommandLine(argc, argv, { &base_cloud, &all_text, &cloud_1, &cloud_2 }, { &output });
+    ray::parseCommandLine(argc, argv, { &base_cloud, &all_text, &cloud_1, &cloud_2 }, { &output, &cache_option });
   if (!standard_format && !concatenate_all && !threeway && !threeway_concatenate)
   {
-    concatenate_all = ray::parseCommandLine(argc, argv, { &cloud_files }, { &output }); // a bit more ambiguous, so only try if the other formats failed
+    concatenate_all = ray::parseCommandLine(argc, argv, { &cloud_files }, { &output, &cache_option }); // a bit more ambiguous, so only try if the other formats failed
     if (!concatenate_all)
     {
       usage();
@@ -70,6 +75,8 @@ int rayCombine(int argc, char *argv[])
     (threeway || threeway_concatenate) ? base_cloud.nameStub() : cloud_files.files()[0].nameStub();
 
   std::vector<ray::Cloud> clouds;
+  // the clouds of a multi-merge are held compactly, and the results streamed to file
+  std::vector<ray::CompactCloud> compact_clouds;
   if (threeway || threeway_concatenate)
   {
     clouds.resize(2);
@@ -80,9 +87,9 @@ int rayCombine(int argc, char *argv[])
   }
   else if (!concatenate_all)
   {
-    clouds.resize(cloud_files.files().size());
+    compact_clouds.resize(cloud_files.files().size());
     for (int i = 0; i < (int)cloud_files.files().size(); i++)
-      if (!clouds[i].load(cloud_files.files()[i].name()))
+      if (!compact_clouds[i].load(cloud_files.files()[i].name()))
         usage();
   }
 
@@ -91,6 +98,10 @@ int rayCombine(int argc, char *argv[])
   config.voxel_size = 0.0;  // Infer voxel size
   config.num_rays_filter_threshold = num_rays.value();
   config.merge_type = ray::MergeType::Mininum;
+  if (cache_option.isSet())
+  {
+    config.ellipsoid_cache = cache_dir.name();
+  }
 
   if (merge_type.selectedKey() == "order")
   {
@@ -146,8 +157,6 @@ int rayCombine(int argc, char *argv[])
   ray::Merger merger(config);
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
-  ray::Cloud concatenated_cloud;
-  const ray::Cloud *fixed_cloud = &merger.fixedCloud();
 
   if (threeway || threeway_concatenate)
   {
@@ -155,17 +164,16 @@ int rayCombine(int argc, char *argv[])
     if (!base_cloud.load(argv[1], false))
       usage();
     merger.mergeThreeWay(base_cloud, clouds[0], clouds[1], &progress);
+    progress_thread.join();
+    merger.fixedCloud().save(combined_file);
   }
   else
   {
-    merger.mergeMultiple(clouds, &progress);
-    std::cout << merger.differenceCloud().rayCount() << " transients, " << merger.fixedCloud().rayCount()
-              << " fixed rays." << std::endl;
-    merger.differenceCloud().save(file_stub + "_differences.ply");
+    const bool success = merger.mergeMultiple(compact_clouds, combined_file, file_stub + "_differences.ply", &progress);
+    progress_thread.join();
+    if (!success)
+      usage();
   }
-
-  progress_thread.join();
-  fixed_cloud->save(combined_file);
   return 0;
 }
 
@@ -26,6 +26,7 @@ void usage(int exit_code = 1)
   std::cout << "raydecimate raycloud 20 cm 64 points - A maximum of 64 end points per cubic 20 cm. Retains small-scale details compared to spatial decimation" << std::endl;
   std::cout << "raydecimate raycloud 20 cm/ray - If all cells overlapping the ray intersect a ray then ray not added. Maintains distribution of rays for e.g. raycombine" << std::endl;
   std::cout << "raydecimate raycloud 3 cm/m - reduces to ray ends spaced 3 cm apart for each metre of their length. Good for maintaining a range of point densities" << std::endl;
+  std::cout << "                           --max_memory 4 - (for cm) limits memory use to about 4 GB by sorting the voxels on disk. For very large clouds" << std::endl;
   // clang-format off
   exit(exit_code);
 }
@@ -55,7 +56,9 @@ int rayDecimate(int argc, char *argv[])
   ray::DoubleArgument radius_per_length(0.01, 100.0);
   ray::ValueKeyChoice quantity({ &vox_width, &num_rays, &radius_per_length, &width_for_ray }, { "cm", "rays", "cm/m", "cm/ray" });
   ray::TextArgument cm("cm"), points("points"); 
-  bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &quantity });
+  ray::DoubleArgument max_memory(0.001, 100000.0);
+  ray::OptionalKeyValueArgument max_memory_option("max_memory", 'm', &max_memory);
+  bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &quantity }, { &max_memory_option });
   bool double_format_points = ray::parseCommandLine(argc, argv, { &cloud_file, &vox_width, &cm, &num_rays, &points });
   if (!standard_format && !double_format_points)
     usage();
@@ -71,7 +74,8 @@ int rayDecimate(int argc, char *argv[])
   }
   else if (quantity.selectedKey() == "cm")
   {
-    res = ray::decimateSpatial(cloud_file.nameStub(), vox_width.value());
+    size_t memory_bytes = max_memory_option.isSet() ? (size_t)(max_memory.value() * 1e9) : 0;
+    res = ray::decimateSpatial(cloud_file.nameStub(), vox_width.value(), memory_bytes);
   }
   else if (quantity.selectedKey() == "rays")
   {
@@ -3,10 +3,12 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
-#include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
+#include "raylib/raydenoise.h"
+#include "raylib/rayneighbours.h"
 #include "raylib/rayparse.h"
 
-#include <nabo/nabo.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -20,6 +22,8 @@ void usage(int exit_code = 1)
   std::cout << "raydenoise raycloud 4 cm     - removes rays that contact more than 4 cm from any other," << std::endl;
   std::cout << "raydenoise raycloud 3 sigmas - removes points more than 3 sigmas from nearest points" << std::endl;
   std::cout << "                    range 4 cm - remove mixed-signal noise that occurs at a range gap." << std::endl;
+  std::cout << "                    --tile 50     - (-t) process cm and sigmas in tiles of this width (m), for clouds larger than memory" << std::endl;
+  std::cout << "         --neighbour_cache dir - saves the point neighbours in the existing directory dir, for reuse by later runs (not with --tile)" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -34,122 +38,91 @@ int rayDenoise(int argc, char *argv[])
   ray::TextArgument cm_text("cm");
   ray::ValueKeyChoice quantity({ &vox_width, &sigmas, &range }, { "cm", "sigmas" });
 
-  bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &quantity });
-  bool range_noise = ray::parseCommandLine(argc, argv, { &cloud_file, &range_text, &range, &cm_text });
+  ray::FileArgument cache_dir(false);
+  ray::OptionalKeyValueArgument cache_option("neighbour_cache", 'n', &cache_dir);
+
+  ray::DoubleArgument tile_width(1.0, 100000.0);
+  ray::OptionalKeyValueArgument tile_option("tile", 't', &tile_width);
+
+  bool standard_format =
+    ray::parseCommandLine(argc, argv, { &cloud_file, &quantity }, { &tile_option, &cache_option });
+  bool range_noise =
+    ray::parseCommandLine(argc, argv, { &cloud_file, &range_text, &range, &cm_text }, { &cache_option });
   if (!standard_format && !range_noise)
     usage();
 
-  ray::Cloud cloud;
+  if (standard_format && tile_option.isSet())  // stream the cloud a tile at a time
+  {
+    size_t num_removed = 0;
+    if (quantity.selectedKey() == "cm")
+    {
+      double distance = 0.01 * vox_width.value();
+      if (!ray::denoiseIsolatedTiled(cloud_file.nameStub(), distance, tile_width.value(), &num_removed))
+        usage();
+      std::cout << num_removed << " rays removed with ends further than " << distance * 100.0 << " cm from any other."
+                << std::endl;
+    }
+    else if (quantity.selectedKey() == "sigmas")
+    {
+      ray::OutlierStats stats;
+      if (!ray::denoiseOutliersTiled(cloud_file.nameStub(), sigmas.value(), tile_width.value(), stats, &num_removed))
+        usage();
+      std::cout << "average dimensions: " << (stats.dimensions / stats.count).transpose()
+                << ", average num neighbours: " << stats.num_neighbours / stats.count << std::endl;
+      std::cout << num_removed << " rays removed with nearest neighbour sigma more than " << sigmas.value()
+                << std::endl;
+    }
+    return 0;
+  }
+
+  // the compact cloud holds the rays in 36 bytes each, and the denoised rays are streamed to file rather than copied
+  ray::CompactCloud cloud;
+  if (cache_option.isSet())
+    cloud.neighbour_cache_dir = cache_dir.name();
   if (!cloud.load(cloud_file.name()))
     usage();
 
-  ray::Cloud new_cloud;
+  std::vector<bool> noise;
   if (range_noise)  // range-based distance measure. For mixed-points where lidar has contacted two surfaces.
   {
     double range_distance = 0.01 * range.value();
-    new_cloud.starts.reserve(cloud.starts.size());
-    new_cloud.ends.reserve(cloud.ends.size());
-    new_cloud.times.reserve(cloud.times.size());
-    new_cloud.colours.reserve(cloud.colours.size());
     // Firstly look at adjacent rays by range. We don't want to throw away large changes,
     // instead, the intermediate of 3 adjacent ranges that is too far from both ends...
-    for (int i = 1; i < (int)cloud.starts.size() - 1; i++)
+    // The first and last rays have no neighbours either side, so are always removed.
+    noise.assign(cloud.rayCount(), true);
+    for (int i = 1; i < (int)cloud.rayCount() - 1; i++)
     {
-      double range0 = (cloud.ends[i - 1] - cloud.starts[i - 1]).norm();
-      double range1 = (cloud.ends[i] - cloud.starts[i]).norm();
-      double range2 = (cloud.ends[i + 1] - cloud.starts[i + 1]).norm();
+      double range0 = (cloud.end(i - 1) - cloud.start(i - 1)).norm();
+      double range1 = (cloud.end(i) - cloud.start(i)).norm();
+      double range2 = (cloud.end(i + 1) - cloud.start(i + 1)).norm();
       double min_dist =
         std::min(std::abs(range0 - range2), std::min(std::abs(range1 - range0), std::abs(range2 - range1)));
       if (!cloud.rayBounded(i) || min_dist < range_distance)
-        new_cloud.addRay(cloud, i);
+        noise[i] = false;
     }
-    std::cout << cloud.starts.size() - new_cloud.starts.size() << " rays removed with range gaps > "
+    std::cout << std::count(noise.begin(), noise.end(), true) << " rays removed with range gaps > "
               << range_distance * 100.0 << " cm." << std::endl;
   }
   else if (quantity.selectedKey() == "cm")  // absolute distance measure
   {
     double distance = 0.01 * vox_width.value();
-    Eigen::MatrixXi indices;
-    Eigen::MatrixXd dists2;
-
-    Nabo::NNSearchD *nns;
-    Nabo::Parameters params("bucketSize", 8);
-    std::vector<Eigen::Vector3d> &points = cloud.ends;
-    Eigen::MatrixXd points_p(3, points.size());
-    for (unsigned int i = 0; i < points.size(); i++) 
-    {
-      points_p.col(i) = points[i];
-    }
-    nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
-
-    // Run the search
-    const int search_size = 1;
-    indices.resize(search_size, points.size());
-    dists2.resize(search_size, points.size());
-    nns->knn(points_p, indices, dists2, search_size, ray::kNearestNeighbourEpsilon, 0);
-    indices.resize(0, 0);
-    delete nns;
-
-    new_cloud.starts.reserve(cloud.starts.size());
-    new_cloud.ends.reserve(cloud.ends.size());
-    new_cloud.times.reserve(cloud.times.size());
-    new_cloud.colours.reserve(cloud.colours.size());
-    for (int i = 0; i < (int)points.size(); i++)
-    {
-      if (!cloud.rayBounded(i) || (dists2(0, i) < 1e10 && dists2(0, i) < ray::sqr(distance)))
-        new_cloud.addRay(cloud, i);
-    }
-    std::cout << cloud.starts.size() - new_cloud.starts.size() << " rays removed with ends further than "
+    ray::findIsolated(cloud, distance, noise);
+    std::cout << std::count(noise.begin(), noise.end(), true) << " rays removed with ends further than "
               << distance * 100.0 << " cm from any other." << std::endl;
   }
   else if (quantity.selectedKey() == "sigmas")  // scale-invariant distance measure. Same as Mahalanobis distance
   {
-    std::vector<Eigen::Vector3d> centroids;
-    std::vector<Eigen::Vector3d> dimensions;
-    std::vector<Eigen::Matrix3d> matrices;
-    Eigen::MatrixXi indices;
-
-    const int search_size = std::min(10, (int)cloud.ends.size() - 1);
-    cloud.getSurfels(search_size, &centroids, nullptr, &dimensions, &matrices, &indices);
-
-    new_cloud.starts.reserve(cloud.starts.size());
-    new_cloud.ends.reserve(cloud.ends.size());
-    new_cloud.times.reserve(cloud.times.size());
-    new_cloud.colours.reserve(cloud.colours.size());
-    Eigen::Vector3d dims(0, 0, 0);
-    double cnt = 0.0;
-    double nums = 0;
-    for (size_t i = 0; i < matrices.size(); i++)
-    {
-      bool is_noise = false;
-      if (cloud.rayBounded(i))
-      {
-        if (indices(0, i) == Nabo::NNSearchD::InvalidIndex)  // no neighbours in range, we consider this as noise
-          continue;
-        int other_i = indices(0, i);
-        Eigen::Vector3d vec = cloud.ends[i] - centroids[other_i];
-        Eigen::Vector3d newVec = matrices[other_i].transpose() * vec;
-        newVec[0] /= dimensions[other_i][0];
-        newVec[1] /= dimensions[other_i][1];
-        newVec[2] /= dimensions[other_i][2];
-        int num = 0;
-        for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) num = j + 1;
-        nums += (double)num;
-        dims += dimensions[other_i];
-        cnt++;
-        double scale2 = newVec.squaredNorm();
-        is_noise = scale2 > sigmas.value() * sigmas.value();
-      }
-      if (!is_noise)
-        new_cloud.addRay(cloud, i);
-    }
-    dims /= cnt;
-    std::cout << "average dimensions: " << dims.transpose() << ", average num neighbours: " << nums / cnt << std::endl;
-    std::cout << cloud.starts.size() - new_cloud.starts.size()
+    const int search_size = std::min(10, (int)cloud.rayCount() - 1);
+    ray::OutlierStats stats;
+    ray::findOutliers(cloud, sigmas.value(), search_size, noise, stats);
+    std::cout << "average dimensions: " << (stats.dimensions / stats.count).transpose()
+              << ", average num neighbours: " << stats.num_neighbours / stats.count << std::endl;
+    std::cout << std::count(noise.begin(), noise.end(), true)
               << " rays removed with nearest neighbour sigma more than " << sigmas.value() << std::endl;
   }
 
-  new_cloud.save(cloud_file.nameStub() + "_denoised.ply");
+  if (!cloud.save(cloud_file.nameStub() + "_denoised.ply", [&noise](size_t i) { return !noise[i]; }))
+    usage();
   return 0;
 }
 
@@ -4,12 +4,14 @@
 //
 // Author: Thomas Lowe
 #include "raylib/extraction/rayclusters.h"
+#include "raylib/extraction/rayextracttiles.h"
 #include "raylib/extraction/rayforest.h"
 #include "raylib/extraction/rayterrain.h"
 #include "raylib/extraction/raytrees.h"
 #include "raylib/extraction/raytrunks.h"
 #include "raylib/extraction/rayleaves.h"
 #include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
 #include "raylib/rayforestgen.h"
 #include "raylib/rayforeststructure.h"
 #include "raylib/raymesh.h"
@@ -33,11 +35,15 @@ void usage(int exit_code = 1)
   {
     std::cout << "rayextract terrain cloud.ply                - extract terrain undersurface to mesh. Slow, so consider decimating first." << std::endl;
     std::cout << "                            --gradient 1    - maximum gradient counted as terrain" << std::endl;
+    std::cout << "                            --tile 100      - (-t) extract in tiles of this width (m), for clouds too large for memory" << std::endl;
   }
   if (extract_type == "trunks" || none)
   {
     std::cout << "rayextract trunks cloud.ply                 - extract tree trunk base locations and radii to text file" << std::endl;
     std::cout << "                            --exclude_rays  - does not use rays to exclude candidates with rays passing through" << std::endl;
+    std::cout << "                            --tile 100      - (-t) extract in overlapping tiles of this width (m), several at once, for large clouds" << std::endl;
+    std::cout << "                            --tile_overlap 10 - (-l) tiles overlap by this distance (m), which should exceed a tree's radius" << std::endl;
+    std::cout << "                            --tile_memory 8 - (-y) approximate memory (GB) for the tiles being extracted at once" << std::endl;
   }
   if (extract_type == "forest" || none)
   {
@@ -62,6 +68,9 @@ void usage(int exit_code = 1)
     std::cout << "                            --branch_segmentation- (-b) _segmented.ply is per branch segment" << std::endl;
     std::cout << "                            --grid_width 10      - (-w) crops results assuming cloud has been gridded with given width" << std::endl;
     std::cout << "                            --use_rays           - (-u) use rays to reduce trunk radius overestimation in noisy cloud data" << std::endl;
+    std::cout << "                            --tile 100           - (-t) extract in overlapping tiles of this width (m), several at once, for large clouds" << std::endl;
+    std::cout << "                            --tile_overlap 10    - (-l) tiles overlap by this distance (m), which should exceed a tree's crown radius" << std::endl;
+    std::cout << "                            --tile_memory 8      - (-y) approximate memory (GB) for the tiles being extracted at once" << std::endl;
     std::cout << "                            (for internal constants -c -g -s see source file rayextract)" << std::endl;
   // These are the internal parameters that I don't expose as they are 'advanced' only, you shouldn't need to adjust them
   //  std::cout << "                            --cylinder_length_to_width 4- (-c) how slender the cylinders are" << std::endl;
@@ -121,6 +130,10 @@ int rayExtract(int argc, char *argv[])
   ray::OptionalKeyValueArgument leaf_option("leaf", 'l', &leaf_file);
   ray::OptionalKeyValueArgument leaf_area_option("leaf_area", 'a', &leaf_area);
   ray::OptionalKeyValueArgument leaf_droop_option("leaf_droop", 'd', &leaf_droop);
+  ray::DoubleArgument tile_width(1.0, 100000.0), tile_overlap(0.0, 1000.0), tile_memory(0.01, 100000.0);
+  ray::OptionalKeyValueArgument tile_option("tile", 't', &tile_width);
+  ray::OptionalKeyValueArgument tile_overlap_option("tile_overlap", 'l', &tile_overlap);
+  ray::OptionalKeyValueArgument tile_memory_option("tile_memory", 'y', &tile_memory);
 
   ray::IntArgument smooth(0, 50);
   ray::OptionalKeyValueArgument width_option("width", 'w', &width), smooth_option("smooth", 's', &smooth),
@@ -128,8 +141,8 @@ int rayExtract(int argc, char *argv[])
 
   ray::OptionalFlagArgument verbose("verbose", 'v');
 
-  bool extract_terrain = ray::parseCommandLine(argc, argv, { &terrain, &cloud_file }, { &gradient_option, &verbose });
-  bool extract_trunks = ray::parseCommandLine(argc, argv, { &trunks, &cloud_file }, { &exclude_rays, &verbose });
+  bool extract_terrain = ray::parseCommandLine(argc, argv, { &terrain, &cloud_file }, { &gradient_option, &tile_option, &verbose });
+  bool extract_trunks = ray::parseCommandLine(argc, argv, { &trunks, &cloud_file }, { &exclude_rays, &tile_option, &tile_overlap_option, &tile_memory_option, &verbose });
   bool extract_forest = ray::parseCommandLine(
     argc, argv, { &forest, &cloud_file },
     { &groundmesh_option, &trunks_option, &width_option, &smooth_option, &drop_option, &verbose });
@@ -137,7 +150,8 @@ int rayExtract(int argc, char *argv[])
     argc, argv, { &trees, &cloud_file, &mesh_file },
     { &max_diameter_option, &distance_limit_option, &height_min_option, &crop_length_option, &girth_height_ratio_option,
       &cylinder_length_to_width_option, &gap_ratio_option, &span_ratio_option, &gravity_factor_option,
-      &segment_branches, &grid_width_option, &global_taper_option, &global_taper_factor_option, &use_rays, &verbose });
+      &segment_branches, &grid_width_option, &global_taper_option, &global_taper_factor_option, &use_rays, &tile_option, &tile_overlap_option,
+      &tile_memory_option, &verbose });
   bool extract_leaves = ray::parseCommandLine(argc, argv, { &leaves, &cloud_file, &trees_file }, { &leaf_option, &leaf_area_option, &leaf_droop_option, &stalks });
 
 
@@ -146,8 +160,49 @@ int rayExtract(int argc, char *argv[])
     usage();
   }
 
+  ray::ExtractTilesParams tile_params;
+  if (tile_option.isSet())
+  {
+    tile_params.tile_width = tile_width.value();
+    if (tile_overlap_option.isSet())
+    {
+      tile_params.overlap = tile_overlap.value();
+    }
+    if (tile_memory_option.isSet())
+    {
+      tile_params.memory_gb = tile_memory.value();
+    }
+  }
+
   // finds cylindrical trunks in the data and saves them to an _trunks.txt file
-  if (extract_trunks)
+  if (extract_trunks && tile_option.isSet())
+  {
+    const double radius = 0.1;  // ~ /2 up to *2. So tree diameters 10 cm up to 40 cm
+    auto extract_tile = [&](ray::Cloud &tile_cloud, const Eigen::Vector3d &tile_offset, const std::string &tile_stub,
+                            ray::ForestStructure &tile_forest) {
+      ray::Trunks trunks(tile_cloud, tile_offset, radius, false, exclude_rays.isSet());
+      const std::string tile_file = tile_stub + "_trunks.txt";
+      trunks.save(tile_file, tile_offset);
+      if (!tile_forest.load(tile_file))
+      {
+        tile_forest.trees.clear();  // a tile without trunks
+      }
+      std::remove(tile_file.c_str());
+      return true;
+    };
+    ray::ForestStructure forest;
+    if (!ray::extractTiled(cloud_file.nameStub(), tile_params, extract_tile, forest))
+    {
+      usage(true);
+    }
+    std::vector<std::pair<Eigen::Vector3d, double>> trunk_bases;
+    for (auto &tree : forest.trees)
+    {
+      trunk_bases.push_back(std::make_pair(tree.segments()[0].tip, tree.segments()[0].radius));
+    }
+    ray::Trunks::save(cloud_file.nameStub() + "_trunks.txt", trunk_bases);
+  }
+  else if (extract_trunks)
   {
     ray::Cloud cloud;
     if (!cloud.load(cloud_file.name()))
@@ -163,21 +218,6 @@ int rayExtract(int argc, char *argv[])
   // finds full tree structures (piecewise cylindrical representation) and saves to file
   else if (extract_trees)
   {
-    ray::Cloud cloud;
-    const int min_num_rays = 40;
-    if (!cloud.load(cloud_file.name(), true, min_num_rays))
-    {
-      usage(true);
-    }
-    Eigen::Vector3d offset = cloud.removeStartPos();
-
-    ray::Mesh mesh;
-    if (!ray::readPlyMesh(mesh_file.name(), mesh))
-    {
-      usage(true);
-    }
-    mesh.translate(-offset);
-
     ray::TreesParams params;
     if (max_diameter_option.isSet())
     {
@@ -230,13 +270,70 @@ int rayExtract(int argc, char *argv[])
     params.use_rays = use_rays.isSet(); 
     params.segment_branches = segment_branches.isSet();
 
-    ray::Trees trees(cloud, offset, mesh, params, verbose.isSet());
+    ray::Mesh mesh;
+    if (!ray::readPlyMesh(mesh_file.name(), mesh))
+    {
+      usage(true);
+    }
+    const int min_num_rays = 40;
+    if (tile_option.isSet())
+    {
+      // each tile is extracted with the ground mesh and the trees' file in its own local coordinates.
+      // The tiles are cropped by extractTiled, which needs the tile's rays left in place
+      ray::TreesParams tile_trees_params = params;
+      tile_trees_params.grid_width = 0.0;
+      auto extract_tile = [&](ray::Cloud &tile_cloud, const Eigen::Vector3d &tile_offset, const std::string &tile_stub,
+                              ray::ForestStructure &tile_forest) {
+        if (tile_cloud.rayCount() < (size_t)min_num_rays)
+        {
+          for (auto &colour : tile_cloud.colours)
+          {
+            colour.red = colour.green = colour.blue = 0;  // too few rays for any trees
+          }
+          return true;
+        }
+        ray::Mesh tile_mesh = mesh;
+        tile_mesh.translate(-tile_offset);
+        ray::Trees trees(tile_cloud, tile_offset, tile_mesh, tile_trees_params, false);
+        const std::string tile_file = tile_stub + "_trees.txt";
+        trees.save(tile_file, tile_offset, verbose.isSet());
+        if (!tile_forest.load(tile_file))
+        {
+          tile_forest.trees.clear();  // a tile without trees
+        }
+        std::remove(tile_file.c_str());
+        return true;
+      };
+      ray::ForestStructure forest;
+      if (!ray::extractTiled(cloud_file.nameStub(), tile_params, extract_tile, forest,
+                             cloud_file.nameStub() + "_segmented.ply"))
+      {
+        usage(true);
+      }
+      forest.save(cloud_file.nameStub() + "_trees.txt");
+    }
+    else
+    {
+      // the compact cloud holds the rays in 36 bytes each
+      ray::CompactCloud cloud;
+      if (!cloud.load(cloud_file.name(), min_num_rays))
+      {
+        usage(true);
+      }
+      Eigen::Vector3d offset = cloud.removeStartPos();
+      mesh.translate(-offset);
+
+      ray::Trees trees(cloud, offset, mesh, params, verbose.isSet());
 
-    // output the picewise cylindrical description of the trees
-    trees.save(cloud_file.nameStub() + "_trees.txt", offset, verbose.isSet());
-    // we also save a segmented (one colour per tree) file, as this is a useful output
-    cloud.translate(offset);
-    cloud.save(cloud_file.nameStub() + "_segmented.ply");
+      // output the picewise cylindrical description of the trees
+      trees.save(cloud_file.nameStub() + "_trees.txt", offset, verbose.isSet());
+      // we also save a segmented (one colour per tree) file, as this is a useful output
+      cloud.translate(offset);
+      if (!cloud.save(cloud_file.nameStub() + "_segmented.ply"))
+      {
+        usage(true);
+      }
+    }
     // let's also save the trees out as a mesh
     // it is a bit inefficient to load from file just to convert it into the forest structure, but
     // it works OK for now. Better would be for ray::Trees so store the result as a ray::ForestStructure
@@ -291,6 +388,14 @@ int rayExtract(int argc, char *argv[])
   // extract the terrain to a .ply mesh file
   // this uses a sand model (no terrain is sloped more than 'gradient') which is a
   // highest lower bound
+  else if (extract_terrain && tile_option.isSet())
+  {
+    ray::Terrain terrain;
+    if (!terrain.extractTiled(cloud_file.nameStub(), gradient.value(), tile_width.value(), verbose.isSet()))
+    {
+      usage(true);
+    }
+  }
   else if (extract_terrain)
   {
     ray::Cloud cloud;
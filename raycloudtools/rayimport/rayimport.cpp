@@ -12,6 +12,7 @@
 #include "raylib/raylaz.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
+#include "raylib/raytileindex.h"
 #include "raylib/raytrajectory.h"
 
 void usage(int exit_code = 1)
@@ -93,6 +94,8 @@ int rayImport(int argc, char *argv[])
   size_t num_bounded;
   std::ofstream ofs;
   ray::RayPlyBuffer buffer;
+  ray::RayCloudStats stats;
+  ray::TimeIndex time_index;
   if (!ray::writeRayCloudChunkStart(save_file + ".ply", ofs))
     usage();
   Eigen::Vector3d start_pos(0, 0, 0);
@@ -164,7 +167,8 @@ int rayImport(int argc, char *argv[])
         c.alpha = 255;
       }
     }
-    if (!ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours, has_warned))
+    time_index.add(times);
+    if (!ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours, has_warned, &stats))
     {
       usage();
     }
@@ -217,7 +221,13 @@ int rayImport(int argc, char *argv[])
     std::cout << "If your sensor lacks intensity information, set them to full using:" << std::endl;
     std::cout << "rayimport <point cloud> <trajectory file> --max_intensity 0" << std::endl;
   }
-  ray::writeRayCloudChunkEnd(ofs);
+  ray::writeRayCloudChunkEnd(ofs, &stats);
+  ofs.close();
+  if (!time_index.end(save_file + ".ply"))
+  {
+    std::cerr << "Error: could not write the time index " << ray::TimeIndex::fileName(save_file + ".ply") << std::endl;
+    usage();
+  }
   // if we remove the start position, then it is useful to print this value that is removed
   // so that the user hasn't lost information
   if (remove.isSet())
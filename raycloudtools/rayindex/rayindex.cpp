@@ -0,0 +1,44 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycloud.h"
+#include "raylib/rayparse.h"
+#include "raylib/raytileindex.h"
+
+#include <cstdlib>
+#include <iostream>
+
+void usage(int exit_code = 1)
+{
+  // clang-format off
+  std::cout << "Group a ray cloud into square tiles, with an index so that tools can read just the tiles they need" << std::endl;
+  std::cout << "usage:" << std::endl;
+  std::cout << "rayindex raycloud 50 m - writes raycloud_indexed.ply in 50 m wide tiles, and its index raycloud_indexed_tiles.txt" << std::endl;
+  std::cout << "                         The indexed cloud is an ordinary ray cloud. Its index is ignored once the cloud is modified." << std::endl;
+  // clang-format on
+  exit(exit_code);
+}
+
+// Writes a tile indexed copy of the ray cloud
+int rayIndex(int argc, char *argv[])
+{
+  ray::FileArgument cloud_file;
+  ray::DoubleArgument tile_width(0.01, 100000.0);
+  ray::TextArgument m("m");
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &tile_width, &m }))
+  {
+    usage();
+  }
+  if (!ray::indexCloud(cloud_file.name(), cloud_file.nameStub() + "_indexed.ply", tile_width.value()))
+  {
+    usage();
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  return ray::runWithMemoryCheck(rayIndex, argc, argv);
+}
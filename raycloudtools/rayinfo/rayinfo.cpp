@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycloudpasses.h"
 #include "raylib/rayparse.h"
 #include "raylib/raycuboid.h"
 #include "raylib/rayply.h"
@@ -59,8 +60,10 @@ int rayInfo(int argc, char *argv[])
     usage();
   }
 
+  // the general information and the statistics below are found in the same read of the cloud
+  ray::CloudPasses passes;
   ray::Cloud::Info info;
-  ray::Cloud::getInfo(cloud.name(), info);
+  passes.addInfo(info);
 
   std::set<Eigen::Vector2i, Vector2iLess> vox_set; 
 
@@ -141,7 +144,8 @@ int rayInfo(int argc, char *argv[])
       }
     }
   };
-  if (!ray::readPly(cloud.name(), true, get_info, 0))
+  passes.add(get_info);
+  if (!passes.run(cloud.name(), true))
   {
     usage();
   }
@@ -6,6 +6,8 @@
 #include "raylib/raycloud.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
+#include "raylib/raytileindex.h"
+#include "raylib/raytransform.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -37,14 +39,13 @@ int rayRotate(int argc, char *argv[])
 
   const std::string temp_name = cloud_file.name() + "~";  // tilde is a common suffix for temporary files
 
-  auto rotate = [&](Eigen::Vector3d &start, Eigen::Vector3d &end, double &, ray::RGBA &) {
-    start = rotation * start;
-    end = rotation * end;
-  };
-  if (!ray::convertCloud(cloud_file.name(), temp_name, rotate))
+  auto rotate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                    std::vector<ray::RGBA> &) { ray::rotateRays(starts, ends, rotation); };
+  if (!ray::convertCloudChunks(cloud_file.name(), temp_name, rotate))
     usage();
 
   std::rename(temp_name.c_str(), cloud_file.name().c_str());
+  ray::TimeIndex::renameFile(temp_name, cloud_file.name());
   return 0;
 }
 
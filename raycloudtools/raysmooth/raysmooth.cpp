@@ -4,9 +4,9 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/rayneighbours.h"
 #include "raylib/rayparse.h"
 
-#include <nabo/nabo.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -19,6 +19,7 @@ void usage(int exit_code = 1)
   std::cout << "Smooth a ray cloud. Nearby off-surface points are moved onto the nearest surface." << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "raysmooth raycloud" << std::endl;
+  std::cout << "         --neighbour_cache dir - saves the point neighbours in the existing directory dir, for reuse by later runs" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -26,10 +27,14 @@ void usage(int exit_code = 1)
 int raySmooth(int argc, char *argv[])
 {
   ray::FileArgument cloud_file;
-  if (!ray::parseCommandLine(argc, argv, { &cloud_file }))
+  ray::FileArgument cache_dir(false);
+  ray::OptionalKeyValueArgument cache_option("neighbour_cache", 'n', &cache_dir);
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file }, { &cache_option }))
     usage();
 
   ray::Cloud cloud;
+  if (cache_option.isSet())
+    cloud.neighbour_cache_dir = cache_dir.name();
   if (!cloud.load(cloud_file.name()))
     usage();
 
@@ -49,7 +54,7 @@ int raySmooth(int argc, char *argv[])
       continue;
     double total_weight = 0.2;  // more averaging if it uses less of the central position, but 0 risks a divide by 0
     Eigen::Vector3d weighted_sum = cloud.ends[i] * total_weight;
-    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) != ray::Neighbours::kInvalidIndex; j++)
     {
       int k = neighbour_indices(j, i);
       double weight = std::max(0.0, 1.0 - (normals[k] - normals[i]).squaredNorm());
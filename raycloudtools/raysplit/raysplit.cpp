@@ -31,7 +31,9 @@ void usage(int exit_code = 1)
   std::cout << "                  raydir 0,0,0.8         - splits based on ray direction, here around nearly vertical rays" << std::endl;
   std::cout << "                  range 10               - splits out rays more than 10 m long" << std::endl;
   std::cout << "                  time 1000 (or time 3 %)- splits at given time stamp (or percentage along)" << std::endl;
+  std::cout << "                  time 1000 1300         - splits out the rays from 1000 to 1300 s, with no outside file. Fast on clouds with a time index" << std::endl;
   std::cout << "                  box x,y,z rx,ry,rz     - splits around a given XYZ centred axis-aligned box of the given radii" << std::endl;  
+  std::cout << "                  box x,y,z rx,ry,rz inside - splits out the rays in the box, with no outside file. Fast on clouds with a tile index" << std::endl;
   std::cout << "                  gap 0.1                - splits into largest cloud connected within this gap, and the remainder." << std::endl;
   std::cout << "                  grid wx,wy,wz          - splits into a 0,0,0 centred grid of files, cell width wx,wy,wz. 0 for unused axes." << std::endl;
   std::cout << "                  grid wx,wy,wz 1        - same as above, but with a 1 metre overlap between cells." << std::endl;
@@ -50,26 +52,28 @@ int raySplit(int argc, char *argv[])
     box_centre, box_radius(0.0, max_val), cell_width(0.0, max_val), capsule_start, capsule_end;
   ray::Vector4dArgument cell_width2(0.0, max_val);
   ray::DoubleArgument overlap(0.0, 10000.0);
-  ray::DoubleArgument time, alpha(0.0, 1.0), range(0.0, 1000.0), capsule_radius(0.001, 1000.0), gap(0.000001, 10000.0);
+  ray::DoubleArgument time, time_end, alpha(0.0, 1.0), range(0.0, 1000.0), capsule_radius(0.001, 1000.0), gap(0.000001, 10000.0);
   ray::KeyValueChoice choice({ "plane", "time", "colour", "single_colour", "alpha", "raydir", "range", "gap" },
                              { &plane, &time, &colour, &single_colour, &alpha, &raydir, &range, &gap });
   ray::FileArgument mesh_file, tree_file;
-  ray::TextArgument distance_text("distance"), time_text("time"), percent_text("%");
+  ray::TextArgument distance_text("distance"), time_text("time"), percent_text("%"), inside_text("inside");
   ray::TextArgument box_text("box"), grid_text("grid"), colour_text("colour"), seg_colour_text("seg_colour"), capsule_text("capsule");
   ray::DoubleArgument mesh_offset;
   bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &choice });
   bool colour_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_text });
   bool seg_colour_format = ray::parseCommandLine(argc, argv, { &cloud_file, &seg_colour_text });
   bool time_percent = ray::parseCommandLine(argc, argv, { &cloud_file, &time_text, &time, &percent_text });
+  bool time_window = ray::parseCommandLine(argc, argv, { &cloud_file, &time_text, &time, &time_end });
   bool box_format = ray::parseCommandLine(argc, argv, { &cloud_file, &box_text, &box_centre, &box_radius });
+  bool box_inside = ray::parseCommandLine(argc, argv, { &cloud_file, &box_text, &box_centre, &box_radius, &inside_text });
   bool grid_format = ray::parseCommandLine(argc, argv, { &cloud_file, &grid_text, &cell_width });
   bool grid_format2 = ray::parseCommandLine(argc, argv, { &cloud_file, &grid_text, &cell_width2 });
   bool grid_format3 = ray::parseCommandLine(argc, argv, { &cloud_file, &grid_text, &cell_width, &overlap });
   bool mesh_split = ray::parseCommandLine(argc, argv, { &cloud_file, &mesh_file, &distance_text, &mesh_offset });
   bool capsule_split =
     ray::parseCommandLine(argc, argv, { &cloud_file, &capsule_text, &capsule_start, &capsule_end, &capsule_radius });
-  if (!standard_format && !colour_format && !seg_colour_format && !box_format && !grid_format && !grid_format2 && !grid_format3 &&
-      !mesh_split && !time_percent && !capsule_split)
+  if (!standard_format && !colour_format && !seg_colour_format && !box_format && !box_inside && !grid_format && !grid_format2 && !grid_format3 &&
+      !mesh_split && !time_percent && !time_window && !capsule_split)
   {
     usage();
   }
@@ -120,19 +124,12 @@ int raySplit(int argc, char *argv[])
   }
   else if (time_percent)
   {
-    // chunk load the file just to get the time bounds
-    double min_time = std::numeric_limits<double>::max();
-    double max_time = std::numeric_limits<double>::lowest();
-    auto time_bounds = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &, std::vector<double> &times,
-                           std::vector<ray::RGBA> &) {
-      for (auto &time : times)
-      {
-        min_time = std::min(min_time, time);
-        max_time = std::max(max_time, time);
-      }
-    };
-    if (!ray::Cloud::read(cloud_file.name(), time_bounds))
+    // the time bounds, which are stored in the file header when the cloud has statistics
+    ray::Cloud::Info info;
+    if (!ray::Cloud::getInfo(cloud_file.name(), info))
       usage();
+    const double min_time = info.min_time;
+    const double max_time = info.max_time;
     std::cout << "Splitting cloud at " << (max_time - min_time) * time.value() / 100.0 << " seconds into the "
               << max_time - min_time << " time period of this ray cloud." << std::endl;
 
@@ -141,7 +138,15 @@ int raySplit(int argc, char *argv[])
     res = ray::split(rc_name, in_name, out_name,
                      [&](const ray::Cloud &cloud, int i) -> bool { return cloud.times[i] > time_thresh; });
   }
-  else if (box_format)
+  else if (time_window)
+  {
+    if (time_end.value() < time.value())
+    {
+      usage();
+    }
+    res = ray::splitTimeWindow(rc_name, in_name, time.value(), time_end.value());
+  }
+  else if (box_format || box_inside)
   {
     Eigen::Vector3d extents = box_radius.value();
     for (int i = 0; i<3; i++) // use 0 for unbounded on an axis, for useability purposes, and to match the grid method
@@ -152,7 +157,14 @@ int raySplit(int argc, char *argv[])
         extents[i] = big_dimension;
       }
     }
-    res = ray::splitBox(rc_name, in_name, out_name, box_centre.value(), extents);
+    if (box_inside)
+    {
+      res = ray::splitBoxInside(rc_name, in_name, box_centre.value(), extents);
+    }
+    else
+    {
+      res = ray::splitBox(rc_name, in_name, out_name, box_centre.value(), extents);
+    }
   }
   else if (grid_format)  // standard 3D grid of cuboids
   {
@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
 #include "raylib/raymerger.h"
 #include "raylib/raymesh.h"
 #include "raylib/rayparse.h"
@@ -30,6 +31,8 @@ void usage(int exit_code = 1)
   std::cout << "              oldest - keeps the oldest geometry when there is a difference over time." << std::endl;
   std::cout << "              newest - uses the newest geometry when there is a difference over time." << std::endl;
   std::cout << " --colour     - also colours the clouds, to help tweak numRays. blue: opacity, green: pass throughs." << std::endl;
+  std::cout << " --tile 50    - filters in 50 m tiles, for clouds larger than memory." << std::endl;
+  std::cout << " --ellipsoid_cache dir - saves the cloud's ellipsoids in the existing directory dir, and reuses them on later runs (not with --tile)." << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -41,11 +44,12 @@ int rayTransients(int argc, char *argv[])
   ray::DoubleArgument num_rays(0.1, 100.0);
   ray::TextArgument text("rays");
   ray::OptionalFlagArgument colour("colour", 'c');
-  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text }, { &colour }))
-    usage();
-
-  ray::Cloud cloud;
-  if (!cloud.load(cloud_file.name()))
+  ray::DoubleArgument tile_width(1.0, 100000.0);
+  ray::OptionalKeyValueArgument tile_option("tile", 't', &tile_width);
+  ray::FileArgument cache_dir(false);
+  ray::OptionalKeyValueArgument cache_option("ellipsoid_cache", 'e', &cache_dir);
+  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text },
+                             { &colour, &tile_option, &cache_option }))
     usage();
 
   ray::Threads::init();
@@ -55,6 +59,10 @@ int rayTransients(int argc, char *argv[])
   config.num_rays_filter_threshold = num_rays.value();
   config.merge_type = ray::MergeType::Mininum;
   config.colour_cloud = colour.isSet();
+  if (cache_option.isSet())
+  {
+    config.ellipsoid_cache = cache_dir.name();
+  }
 
   if (merge_type.selectedKey() == "oldest")
   {
@@ -75,18 +83,31 @@ int rayTransients(int argc, char *argv[])
 
   ray::Merger filter(config);
   ray::Progress progress;
+  if (tile_option.isSet())
+  {
+    ray::ProgressThread progress_thread(progress);
+    const bool success = filter.filterTiled(cloud_file.nameStub(), tile_width.value(), &progress);
+    progress_thread.requestQuit();
+    progress_thread.join();
+    if (!success)
+      usage();
+    return 0;
+  }
+
+  // the compact cloud holds the rays in 36 bytes each, and the results are streamed to file rather than copied
+  ray::CompactCloud cloud;
+  if (!cloud.load(cloud_file.name()))
+    usage();
+
   ray::ProgressThread progress_thread(progress);
 
-  filter.filter(cloud, &progress);
+  const bool success =
+    filter.filter(cloud, cloud_file.nameStub() + "_transient.ply", cloud_file.nameStub() + "_fixed.ply", &progress);
 
   progress_thread.requestQuit();
   progress_thread.join();
-
-  const ray::Cloud &transient = filter.differenceCloud();
-  const ray::Cloud &fixed = filter.fixedCloud();
-
-  transient.save(cloud_file.nameStub() + "_transient.ply");
-  fixed.save(cloud_file.nameStub() + "_fixed.ply");
+  if (!success)
+    usage();
   return 0;
 }
 
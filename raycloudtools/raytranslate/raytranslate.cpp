@@ -6,6 +6,8 @@
 #include "raylib/raycloud.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
+#include "raylib/raytileindex.h"
+#include "raylib/raytransform.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -46,15 +48,15 @@ int rayTranslate(int argc, char *argv[])
 
   const std::string temp_name = cloud_file.nameStub() + "~.ply";  // tilde is a common suffix for temporary files
 
-  auto translate = [&](Eigen::Vector3d &start, Eigen::Vector3d &end, double &time, ray::RGBA &) {
-    start += translation;
-    end += translation;
-    time += time_delta;
+  auto translate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<ray::RGBA> &) {
+    ray::translateRays(starts, ends, times, translation, time_delta);
   };
-  if (!ray::convertCloud(cloud_file.name(), temp_name, translate))
+  if (!ray::convertCloudChunks(cloud_file.name(), temp_name, translate))
     usage();
 
   std::rename(temp_name.c_str(), cloud_file.name().c_str());
+  ray::TimeIndex::renameFile(temp_name, cloud_file.name());
 
   return 0;
 }
@@ -0,0 +1,356 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayextracttiles.h"
+#include "raytrees.h"
+#include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
+#include "raylib/rayexternalsort.h"
+#include "raylib/rayparallel.h"
+
+#include <limits>
+
+namespace ray
+{
+namespace
+{
+/// A ray copied into each tile whose overlap region contains its end point. Also used for each tile's segmented copy
+/// of a ray, coloured with the tile's section id when it is in a tree kept by the tile, and black otherwise
+struct TileRay
+{
+  uint32_t tile;
+  uint64_t index;  // in the cloud file
+  double start[3];
+  double end[3];
+  double time;
+  RGBA colour;
+};
+
+/// Orders the rays by tile, and within each tile by their order in the cloud file
+struct TileRayLess
+{
+  inline bool operator()(const TileRay &a, const TileRay &b) const
+  {
+    if (a.tile != b.tile)
+      return a.tile < b.tile;
+    return a.index < b.index;
+  }
+};
+
+/// Orders the rays by their order in the cloud file, and the copies of each ray by tile
+struct RayIndexLess
+{
+  inline bool operator()(const TileRay &a, const TileRay &b) const
+  {
+    if (a.index != b.index)
+      return a.index < b.index;
+    return a.tile < b.tile;
+  }
+};
+
+/// The trees kept from one tile, with their section ids renumbered from 0
+struct TileResult
+{
+  std::vector<TreeStructure> trees;
+  int num_ids = 0;
+  std::vector<TileRay> segmented;  // the rays in the kept trees, and the other rays that end in the tile
+};
+
+/// the index of the section_id attribute of the trees, or -1 if there is none
+int sectionIdAttribute(const ForestStructure &forest)
+{
+  if (forest.trees.empty())
+  {
+    return -1;
+  }
+  const auto &names = forest.trees[0].attributeNames();
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    if (names[i] == "section_id")
+    {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+}  // namespace
+
+bool extractTiled(const std::string &file_stub, const ExtractTilesParams &params, const TileExtractor &extract,
+                  ForestStructure &forest, const std::string &segmented_file)
+{
+  const std::string file_name = file_stub + ".ply";
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+  {
+    return false;
+  }
+  const double tile_width = params.tile_width;
+  const double overlap = params.overlap;
+  const size_t max_rays = params.maxRays();
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d extent = info.rays_bound.max_bound_ - min_bound;
+  const int tiles_x = 1 + static_cast<int>(extent[0] / tile_width);
+  const int tiles_y = 1 + static_cast<int>(extent[1] / tile_width);
+  if ((double)tiles_x * (double)tiles_y > (double)std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "Error: tile width " << tile_width << " m is too small for the cloud extent" << std::endl;
+    return false;
+  }
+  std::cout << "extracting in " << tiles_x << " x " << tiles_y << " tiles" << std::endl;
+  auto tile_x = [&](double x) {
+    return std::max(0, std::min(static_cast<int>(std::floor((x - min_bound[0]) / tile_width)), tiles_x - 1));
+  };
+  auto tile_y = [&](double y) {
+    return std::max(0, std::min(static_cast<int>(std::floor((y - min_bound[1]) / tile_width)), tiles_y - 1));
+  };
+  auto tile_of = [&](const Eigen::Vector3d &pos) { return static_cast<uint32_t>(tile_x(pos[0]) + tiles_x * tile_y(pos[1])); };
+
+  // 1. copy each ray into every tile whose overlap region contains its end point, sorting them by tile on disk
+  const size_t sort_memory = size_t(1) << 29;
+  ExternalSorter<TileRay, TileRayLess> tile_rays(file_stub + "_extract_tiles", sort_memory / sizeof(TileRay));
+  std::vector<size_t> tile_counts(static_cast<size_t>(tiles_x) * static_cast<size_t>(tiles_y), 0);
+  uint64_t num_rays = 0;
+  bool success = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+    {
+      for (int ty = tile_y(ends[i][1] - overlap); ty <= tile_y(ends[i][1] + overlap); ty++)
+      {
+        for (int tx = tile_x(ends[i][0] - overlap); tx <= tile_x(ends[i][0] + overlap); tx++)
+        {
+          TileRay ray;
+          ray.tile = static_cast<uint32_t>(tx + tiles_x * ty);
+          ray.index = num_rays;
+          for (int j = 0; j < 3; j++)
+          {
+            ray.start[j] = starts[i][j];
+            ray.end[j] = ends[i][j];
+          }
+          ray.time = times[i];
+          ray.colour = colours[i];
+          tile_counts[ray.tile]++;
+          success = tile_rays.add(ray);
+        }
+      }
+    }
+  };
+  if (!Cloud::read(file_name, add_rays, 1) || !success || !tile_rays.sort())
+  {
+    return false;
+  }
+
+  // 2. extract each tile, several at a time, keeping the trees that are based in the tile
+  ExternalSorter<TileRay, RayIndexLess> segmented_rays(file_stub + "_extract_segmented", sort_memory / sizeof(TileRay));
+  auto tileStub = [&](uint32_t tile) { return file_stub + "_tile_" + std::to_string(tile); };
+  auto extractTile = [&](uint32_t tile, Cloud &cloud, const std::vector<uint64_t> &indices, TileResult &result) {
+    auto in_tile = [&](const Eigen::Vector3d &pos) { return tile_of(pos) == tile; };
+    const Eigen::Vector3d offset = cloud.removeStartPos();
+    ForestStructure tile_forest;
+    if (!extract(cloud, offset, tileStub(tile), tile_forest))
+    {
+      return false;
+    }
+    if (cloud.rayCount() != indices.size())
+    {
+      std::cerr << "Error: the extraction of tile " << tile << " changed its number of rays" << std::endl;
+      return false;
+    }
+
+    // renumber the section ids of the kept trees, so that they can be offset to be unique over all the tiles
+    const int section_id = sectionIdAttribute(tile_forest);
+    std::vector<int> new_ids;
+    for (auto &tree : tile_forest.trees)
+    {
+      if (!in_tile(tree.root()))
+      {
+        continue;
+      }
+      if (section_id != -1)
+      {
+        for (auto &segment : tree.segments())
+        {
+          const int id = static_cast<int>(segment.attributes[section_id]);
+          if (id >= static_cast<int>(new_ids.size()))
+          {
+            new_ids.resize(id + 1, -1);
+          }
+          new_ids[id] = result.num_ids;
+          segment.attributes[section_id] = static_cast<double>(result.num_ids++);
+        }
+      }
+      result.trees.push_back(tree);
+    }
+    if (segmented_file.empty())
+    {
+      return true;
+    }
+
+    // this tile's claim on the rays of its kept trees, and its black copy of the other rays that end in the tile.
+    // Other tiles may have a claim on the same rays, so one copy of each ray is chosen once every tile is extracted
+    cloud.translate(offset);
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      TileRay ray;
+      ray.colour = cloud.colours[i];
+      int id = convertColourToInt(ray.colour);
+      id = id >= 0 && id < static_cast<int>(new_ids.size()) ? new_ids[id] : -1;
+      if (id < 0 && !in_tile(cloud.ends[i]))
+      {
+        continue;
+      }
+      if (id >= 0)
+      {
+        convertIntToColour(id, ray.colour);
+      }
+      else
+      {
+        ray.colour.red = ray.colour.green = ray.colour.blue = 0;
+      }
+      ray.tile = tile;
+      ray.index = indices[i];
+      for (int j = 0; j < 3; j++)
+      {
+        ray.start[j] = cloud.starts[i][j];
+        ray.end[j] = cloud.ends[i][j];
+      }
+      ray.time = cloud.times[i];
+      result.segmented.push_back(ray);
+    }
+    return true;
+  };
+
+  std::vector<uint32_t> tiles;
+  std::vector<TileResult> results;
+  std::vector<uint32_t> batch_tiles;
+  std::vector<Cloud> batch_clouds;
+  std::vector<std::vector<uint64_t>> batch_indices;
+  TileRay tile_ray;
+  bool has_ray = tile_rays.next(tile_ray);
+  while (has_ray && success)
+  {
+    // load as many tiles as fit in the ray budget, and at least one
+    batch_tiles.clear();
+    batch_clouds.clear();
+    batch_indices.clear();
+    size_t batch_rays = 0;
+    while (has_ray && (batch_tiles.empty() || batch_rays + tile_counts[tile_ray.tile] <= max_rays))
+    {
+      const uint32_t tile = tile_ray.tile;
+      batch_rays += tile_counts[tile];
+      batch_tiles.push_back(tile);
+      batch_clouds.emplace_back();
+      batch_indices.emplace_back();
+      Cloud &cloud = batch_clouds.back();
+      std::vector<uint64_t> &indices = batch_indices.back();
+      cloud.reserve(tile_counts[tile]);
+      indices.reserve(tile_counts[tile]);
+      for (; has_ray && tile_ray.tile == tile; has_ray = tile_rays.next(tile_ray))
+      {
+        cloud.addRay(Eigen::Vector3d(tile_ray.start[0], tile_ray.start[1], tile_ray.start[2]),
+                     Eigen::Vector3d(tile_ray.end[0], tile_ray.end[1], tile_ray.end[2]), tile_ray.time,
+                     tile_ray.colour);
+        indices.push_back(tile_ray.index);
+      }
+    }
+    std::cout << "extracting tiles " << tiles.size() + 1 << " to " << tiles.size() + batch_tiles.size() << std::endl;
+    const size_t batch_start = results.size();
+    results.resize(batch_start + batch_tiles.size());
+    std::vector<char> batch_success(batch_tiles.size(), 1);
+    parallelFor(batch_tiles.size(), [&](size_t i) {
+      batch_success[i] = extractTile(batch_tiles[i], batch_clouds[i], batch_indices[i], results[batch_start + i]) ? 1 : 0;
+      batch_clouds[i].clear();
+    }, 1);
+    tiles.insert(tiles.end(), batch_tiles.begin(), batch_tiles.end());
+    for (size_t i = 0; i < batch_tiles.size(); i++)
+    {
+      success &= batch_success[i] != 0;
+      std::vector<TileRay> &segmented = results[batch_start + i].segmented;
+      for (size_t j = 0; j < segmented.size() && success; j++)
+      {
+        success = segmented_rays.add(segmented[j]);
+      }
+      std::vector<TileRay>().swap(segmented);
+    }
+  }
+  tile_rays.clear();
+
+  // 3. merge the tiles' trees in tile order, offsetting the section ids of each tile
+  std::vector<int> id_offsets(tile_counts.size(), 0);
+  int id_offset = 0;
+  for (size_t t = 0; t < tiles.size() && success; t++)
+  {
+    TileResult &result = results[t];
+    ForestStructure tile_forest;
+    tile_forest.trees = std::move(result.trees);
+    const int section_id = sectionIdAttribute(tile_forest);
+    for (auto &tree : tile_forest.trees)
+    {
+      if (section_id != -1)
+      {
+        for (auto &segment : tree.segments())
+        {
+          segment.attributes[section_id] += static_cast<double>(id_offset);
+        }
+      }
+      forest.trees.push_back(std::move(tree));
+    }
+    id_offsets[tiles[t]] = id_offset;
+    id_offset += result.num_ids;
+  }
+  if (!success || segmented_file.empty())
+  {
+    return success;
+  }
+
+  // 4. write one copy of each ray, in the cloud's order. A ray in a kept tree is taken from the tile that kept it,
+  // which is the tile that it ends in if several tiles kept it, otherwise the lowest of them. Every other ray is taken
+  // from the tile that it ends in, which always holds a copy of it
+  CloudWriter writer;
+  if (!segmented_rays.sort() || !writer.begin(segmented_file))
+  {
+    return false;
+  }
+  auto priority = [&](const TileRay &ray) {
+    if (convertColourToInt(ray.colour) < 0)
+    {
+      return 2;
+    }
+    return ray.tile == tile_of(Eigen::Vector3d(ray.end[0], ray.end[1], ray.end[2])) ? 0 : 1;
+  };
+  const size_t chunk_size = 1000000;
+  Cloud chunk;
+  TileRay copy;
+  bool has_copy = segmented_rays.next(copy);
+  while (has_copy && success)
+  {
+    TileRay best = copy;
+    int best_priority = priority(best);
+    for (has_copy = segmented_rays.next(copy); has_copy && copy.index == best.index; has_copy = segmented_rays.next(copy))
+    {
+      const int copy_priority = priority(copy);
+      if (copy_priority < best_priority)  // the copies are in tile order, so ties go to the lower tile
+      {
+        best = copy;
+        best_priority = copy_priority;
+      }
+    }
+    const int id = convertColourToInt(best.colour);
+    if (id >= 0)
+    {
+      convertIntToColour(id + id_offsets[best.tile], best.colour);
+    }
+    chunk.addRay(Eigen::Vector3d(best.start[0], best.start[1], best.start[2]),
+                 Eigen::Vector3d(best.end[0], best.end[1], best.end[2]), best.time, best.colour);
+    if (chunk.rayCount() >= chunk_size || !has_copy)
+    {
+      success = writer.writeChunk(chunk);
+      chunk.clear();
+    }
+  }
+  segmented_rays.clear();
+  return writer.end() && success;
+}
+}  // namespace ray
@@ -0,0 +1,51 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYEXTRACTTILES_H
+#define RAYLIB_RAYEXTRACTTILES_H
+
+#include "raylib/raylibconfig.h"
+#include "../rayforeststructure.h"
+#include "../rayutils.h"
+
+#include <functional>
+
+namespace ray
+{
+class Cloud;
+
+/// structure containing the parameters used in tiled extraction
+struct RAYLIB_EXPORT ExtractTilesParams
+{
+  double tile_width = 100.0;  // width of the square tiles in metres
+  double overlap = 10.0;      // each tile also holds the rays within this distance of it. Should exceed a tree's radius
+  double memory_gb = 8.0;     // approximate memory for the tiles being extracted at once
+
+  /// an estimate of the memory used per ray during extraction, mostly in the neighbour and point structures
+  static constexpr double kBytesPerRay = 1000.0;
+  /// the tiles held in memory at once hold no more rays than this, unless one tile is larger
+  inline size_t maxRays() const { return static_cast<size_t>(memory_gb * 1e9 / kBytesPerRay); }
+};
+
+/// The extraction run on each tile. @c cloud holds the tile's rays, shifted by -@c offset. The extracted trees are
+/// returned in @c forest, in world coordinates. Trees are segmented by colouring the rays of @c cloud with
+/// @c convertIntToColour of their section_id attribute, and black when not in a tree. The rays must not be reordered,
+/// added or removed. Temporary files can be named from @c tile_stub. Returns false on failure.
+typedef std::function<bool(Cloud &cloud, const Eigen::Vector3d &offset, const std::string &tile_stub,
+                           ForestStructure &forest)>
+  TileExtractor;
+
+/// Run @c extract on each overlapping square tile of the ray cloud file @c file_stub.ply, then merge the results into
+/// @c forest. Only one copy is kept of the trees extracted from more than one tile, that of the tile containing the
+/// tree's base. Several tiles are extracted at once, with their total ray count limited by @c params.maxRays().
+/// If @c segmented_file is given, the segmented tile clouds are merged into this file in the cloud's ray order, with
+/// section ids made unique across the tiles. Each ray is written once: from the tile that kept its tree (preferring
+/// the tile it ends in, if several did), otherwise unsegmented from the tile that it ends in.
+bool RAYLIB_EXPORT extractTiled(const std::string &file_stub, const ExtractTilesParams &params,
+                                const TileExtractor &extract, ForestStructure &forest,
+                                const std::string &segmented_file = "");
+}  // namespace ray
+
+#endif  // RAYLIB_RAYEXTRACTTILES_H
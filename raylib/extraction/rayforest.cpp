@@ -5,6 +5,7 @@
 // Author: Thomas Lowe
 #include "rayforest.h"
 #include "../rayconvexhull.h"
+#include "../raycloudpasses.h"
 #include "../raycuboid.h"
 #include "../rayforestgen.h"
 #include "../raymesh.h"
@@ -83,21 +84,44 @@ ray::ForestStructure Forest::extract(const std::string &cloud_name_stub, Mesh &m
                                      const std::vector<std::pair<Eigen::Vector3d, double>> &trunks, double voxel_width)
 {
   trunks_ = trunks;
+  // the cloud is read by a set of passes, those that are independent sharing a read
+  CloudPasses passes;
   // firstly, get the bounds of the ray cloud
   Cloud::Info info;
-  if (!Cloud::getInfo(cloud_name_stub + ".ply", info))
-  {
-    return ray::ForestStructure();
-  }
-  min_bounds_ = info.ends_bound.min_bound_;
-  max_bounds_ = info.ends_bound.max_bound_;
+  const int info_pass = passes.addInfo(info);
 
   // then we need to generate some height fields, these are 2D arrays
-  const double width = (max_bounds_[0] - min_bounds_[0]) / voxel_width;
-  const double length = (max_bounds_[1] - min_bounds_[1]) / voxel_width;
-  const Eigen::Vector2i grid_dims(ceil(width), ceil(length));
-  std::cout << "dims for heightfield: " << grid_dims.transpose() << std::endl;
-  Eigen::ArrayXXd highs = Eigen::ArrayXXd::Constant(grid_dims[0], grid_dims[1], std::numeric_limits<double>::lowest());
+  Eigen::ArrayXXd highs, lows;
+  OccupancyGrid2D grid2D;
+  const bool has_grid = grid2D.load(cloud_name_stub + "_occupied.dat");
+  auto initialise = [&]() {
+    min_bounds_ = info.ends_bound.min_bound_;
+    max_bounds_ = info.ends_bound.max_bound_;
+    const double width = (max_bounds_[0] - min_bounds_[0]) / voxel_width;
+    const double length = (max_bounds_[1] - min_bounds_[1]) / voxel_width;
+    const Eigen::Vector2i grid_dims(ceil(width), ceil(length));
+    std::cout << "dims for heightfield: " << grid_dims.transpose() << std::endl;
+    highs = Eigen::ArrayXXd::Constant(grid_dims[0], grid_dims[1], std::numeric_limits<double>::lowest());
+
+    // next fill in the lowest points using the supplied ground mesh
+    if (mesh.vertices().empty())
+    {
+      lows = Eigen::ArrayXXd::Constant(highs.rows(), highs.cols(), min_bounds_[2]);
+    }
+    else
+    {
+      mesh.toHeightField(lows, min_bounds_, max_bounds_, voxel_width);
+    }
+    if (lows.rows() != highs.rows() || lows.cols() != highs.cols())
+    {
+      std::cerr << "error: arrays are different widths " << lows.rows() << "!=" << highs.rows() << " or "
+                << lows.cols() << "!=" << highs.cols() << std::endl;
+    }
+    if (!has_grid)
+    {
+      grid2D.init(min_bounds_, max_bounds_, voxel_width);
+    }
+  };
 
   // fill in the highest points on the input cloud
   auto fillHeightField = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
@@ -113,34 +137,21 @@ ray::ForestStructure Forest::extract(const std::string &cloud_name_stub, Mesh &m
       h = std::max(h, ends[i][2]);
     }
   };
-  if (!ray::Cloud::read(cloud_name_stub + ".ply", fillHeightField))
-  {
-    return ray::ForestStructure();
-  }
+  passes.add(fillHeightField, { info_pass }, initialise);
 
-  // next fill in the lowest points using the supplied ground mesh
-  Eigen::ArrayXXd lows;
-  if (mesh.vertices().empty())
-  {
-    lows = Eigen::ArrayXXd::Constant(highs.rows(), highs.cols(), min_bounds_[2]);
-  }
-  else
+  // generate a 2D grid in order to fill in the 'space field' a 2D array of free space (where the rays are)
+  // by walking the rays through the grid. This shares its read with the height field
+  if (!has_grid)
   {
-    mesh.toHeightField(lows, min_bounds_, max_bounds_, voxel_width);
+    grid2D.addDensityPass(passes, lows, 1.0, 1.5, { info_pass });
   }
-  if (lows.rows() != highs.rows() || lows.cols() != highs.cols())
+  // the density pass is parallel within each chunk, so the passes are run one after the other
+  if (!passes.run(cloud_name_stub + ".ply"))
   {
-    std::cerr << "error: arrays are different widths " << lows.rows() << "!=" << highs.rows() << " or " << lows.cols()
-              << "!=" << highs.cols() << std::endl;
+    return ray::ForestStructure();
   }
-
-  // generate a 2D grid in order to fill in the 'space field' a 2D array of free space (where the rays are)
-  OccupancyGrid2D grid2D;
-  if (!grid2D.load(cloud_name_stub + "_occupied.dat"))
+  if (!has_grid)
   {
-    grid2D.init(min_bounds_, max_bounds_, voxel_width);
-    // walk the rays to fill densities based on walking the rays through the grid
-    grid2D.fillDensities(cloud_name_stub + ".ply", lows, 1.0, 1.5);
     grid2D.save(cloud_name_stub + "_occupied.dat");
   }
   if (grid2D.dims()[0] != lows.rows() || grid2D.dims()[1] != lows.cols())
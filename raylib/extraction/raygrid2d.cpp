@@ -4,9 +4,49 @@
 //
 // Author: Thomas Lowe
 #include "raygrid2d.h"
+#include "../raycloudpasses.h"
+#include "../rayparallel.h"
+
+#include <atomic>
+#include <memory>
 
 namespace ray
 {
+namespace
+{
+/// The subpixels of each pixel that are found while filling in the densities, by several threads at once
+struct SubpixelMasks
+{
+  void init(size_t size)
+  {
+    free.reset(size > 0 ? new std::atomic<uint16_t>[size]() : nullptr);
+    occupied.reset(size > 0 ? new std::atomic<uint16_t>[size]() : nullptr);
+  }
+  inline void setFree(int id, uint16_t bits)
+  {
+    if (id >= 0 && bits)
+      free[id].fetch_or(bits, std::memory_order_relaxed);
+  }
+  inline void setOccupied(int id, uint16_t bits)
+  {
+    if (id >= 0)
+      occupied[id].fetch_or(bits, std::memory_order_relaxed);
+  }
+  std::unique_ptr<std::atomic<uint16_t>[]> free;      // subpixels that rays pass through
+  std::unique_ptr<std::atomic<uint16_t>[]> occupied;  // subpixels that contain end points
+};
+
+/// the number of set bits in @c bits, without branches so that it vectorises
+inline uint16_t bitCount(uint16_t bits)
+{
+  uint32_t x = bits;
+  x = x - ((x >> 1) & 0x5555u);
+  x = (x & 0x3333u) + ((x >> 2) & 0x3333u);
+  x = (x + (x >> 4)) & 0x0F0Fu;
+  return static_cast<uint16_t>((x + (x >> 8)) & 0x1Fu);
+}
+}  // namespace
+
 /// initialise for a given bounds and pixel width
 void OccupancyGrid2D::init(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double pixel_width)
 {
@@ -53,22 +93,36 @@ bool OccupancyGrid2D::load(const std::string &filename)
 void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::ArrayXXd &lows, double clip_min,
                                     double clip_max)
 {
-  ray::Cuboid bounds_;
-  const double eps = 1e-9;
-  bounds_.min_bound_ = min_bound_ + Eigen::Vector3d(eps, eps, eps);
-  bounds_.max_bound_ = min_bound_ + dims_.cast<double>() * pixel_width_ - Eigen::Vector3d(eps, eps, eps);
+  CloudPasses passes;
+  addDensityPass(passes, lows, clip_min, clip_max);
+  passes.run(cloudname);
+}
+
+/// add the filling of the occupancy data to @c passes. The grid must be initialised before the pass starts
+int OccupancyGrid2D::addDensityPass(CloudPasses &passes, const Eigen::ArrayXXd &lows, double clip_min,
+                                    double clip_max, const std::vector<int> &dependencies)
+{
+  auto bounds = std::make_shared<ray::Cuboid>();
+  auto masks = std::make_shared<SubpixelMasks>();
   const double scale = static_cast<double>(GRID2D_SUBPIXELS);
+  auto start_pass = [this, bounds, masks]() {
+    const double eps = 1e-9;
+    bounds->min_bound_ = min_bound_ + Eigen::Vector3d(eps, eps, eps);
+    bounds->max_bound_ = min_bound_ + dims_.cast<double>() * pixel_width_ - Eigen::Vector3d(eps, eps, eps);
+    masks->init(pixels_.size());
+  };
 
   // filling in the free space per chunk of ray cloud
-  auto addFreeSpace = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                          std::vector<double> &, std::vector<ray::RGBA> &) {
-    for (size_t i = 0; i < ends.size(); ++i)
-    {
+  // the rays are walked in parallel, with the subpixels of each pixel set together as one atomic operation
+  auto addFreeSpace = [this, bounds, masks, scale, &lows, clip_min, clip_max](
+                        std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &, std::vector<ray::RGBA> &) {
+    parallelFor(ends.size(), [&](size_t i) {
       Eigen::Vector3d start = starts[i];
       Eigen::Vector3d end = ends[i];
-      if (!bounds_.clipRay(start, end)) // clip the ray within the bounds
+      if (!bounds->clipRay(start, end)) // clip the ray within the bounds
       {
-        continue;
+        return;
       }  
 
       // now walk the pixels
@@ -100,6 +154,8 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
       Eigen::Vector3d p = source;  // our moving variable as we walk over the grid
       Eigen::Vector3i inds = p.cast<int>();
       double depth = 0;
+      int pixel_id = -1;  // the pixel currently being walked through, and its subpixels that the ray has covered
+      uint16_t pixel_bits = 0;
       // walk over the grid, one pixel at a time.
       do
       {
@@ -131,21 +187,30 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
           // some bit trickery to fill in part of the 4x4 grid per pixel
           const Eigen::Vector3i rem = inds - GRID2D_SUBPIXELS * index;
           const uint16_t bit = uint16_t(GRID2D_SUBPIXELS * rem[0] + rem[1]);
-          pixel(index).bits |= uint16_t(1 << bit);
+          const int id = dims_[1] * index[0] + index[1];
+          if (id != pixel_id)
+          {
+            masks->setFree(pixel_id, pixel_bits);
+            pixel_id = id;
+            pixel_bits = 0;
+          }
+          pixel_bits |= uint16_t(1 << bit);
         }
       } while (depth <= maxDist);
-    }
+      masks->setFree(pixel_id, pixel_bits);
+    }, 1024);
   };
-  ray::Cloud::read(cloudname, addFreeSpace);
 
-  // wherever these is an end point, we want to remove it as free space
-  auto removeOccupiedSpace = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
-                                 std::vector<double> &, std::vector<ray::RGBA> &colours) {
-    for (size_t i = 0; i < ends.size(); ++i)
-    {
+  // wherever these is an end point, we want to remove it as free space. These are recorded separately and removed
+  // once all of the free space is filled in, so that both can be found in the same pass
+  auto removeOccupiedSpace = [this, masks, scale, &lows, clip_min, clip_max](std::vector<Eigen::Vector3d> &,
+                                                                             std::vector<Eigen::Vector3d> &ends,
+                                                                             std::vector<double> &,
+                                                                             std::vector<ray::RGBA> &colours) {
+    parallelFor(ends.size(), [&](size_t i) {
       if (colours[i].alpha == 0)
       {
-        continue;
+        return;
       }
 //#define REMOVE_WHOLE_VOXEL
 #if defined REMOVE_WHOLE_VOXEL
@@ -154,7 +219,7 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
 
       double height = ends[i][2] - lows(index[0], index[1]);
       if (height > 0.5 && height < clip_height)
-        pixel(index).bits = 0;
+        masks->setOccupied(pixelId(index), 0xFFFF);
 #else
       // find the subpixel that this point is in
       const Eigen::Vector3d p = scale * (ends[i] - min_bound_) / pixel_width_;
@@ -164,33 +229,41 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
       uint16_t bit = uint16_t(GRID2D_SUBPIXELS * rem[0] + rem[1]);
 
       double height = ends[i][2] - lows(index[0], index[1]);
-      if (height > clip_min && height < clip_max)               // if within the height window
-        pixel(index).bits &= (uint16_t) ~(uint16_t(1 << bit));  // then remove it
+      if (height > clip_min && height < clip_max)                // if within the height window
+        masks->setOccupied(pixelId(index), uint16_t(1 << bit));  // then remove it
 #endif
-    }
+    }, 1024);
   };
-  ray::Cloud::read(cloudname, removeOccupiedSpace);
 
   // convert the bit fields into subpixel counts
-  unsigned long bitcount = 0;
-  for (auto &vox : pixels_)
-  {
-    uint16_t count = 0;
-    for (unsigned long i = 0; i < 16; i++)
+  auto finish_pass = [this, masks]() {
+    parallelFor(pixels_.size(), [&](size_t p) {
+      Pixel &vox = pixels_[p];
+      const uint16_t bits = (vox.bits | masks->free[p].load(std::memory_order_relaxed)) &
+                            (uint16_t)~masks->occupied[p].load(std::memory_order_relaxed);
+      vox.bits = bitCount(bits);
+    }, 1024);
+    masks->init(0);
+    unsigned long bitcount = 0;
+    for (auto &vox : pixels_)
     {
-      if (vox.bits & ((uint16_t)1 << i))
-      {
-        count++;
-      }
+      bitcount += vox.bits;
     }
-    vox.bits = count;
-    bitcount += vox.bits;
-  }
 
-  std::cout << "average bit count: " << static_cast<double>(bitcount) / static_cast<double>(pixels_.size())
-            << std::endl;
+    std::cout << "average bit count: " << static_cast<double>(bitcount) / static_cast<double>(pixels_.size())
+              << std::endl;
+  };
+
+  auto fill = [addFreeSpace, removeOccupiedSpace](std::vector<Eigen::Vector3d> &starts,
+                                                   std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                   std::vector<ray::RGBA> &colours) {
+    addFreeSpace(starts, ends, times, colours);
+    removeOccupiedSpace(starts, ends, times, colours);
+  };
+  return passes.add(fill, dependencies, start_pass, finish_pass);
 }
 
+
 void RayIndexGrid2D::init(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double pixel_width)
 {
   min_bound_ = min_bound;
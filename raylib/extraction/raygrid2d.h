@@ -63,12 +63,25 @@ public:
   /// within a height window @c clip_min to @c clip_max
   void fillDensities(const std::string &cloudname, const Eigen::ArrayXXd &lows, double clip_min, double clip_max);
 
+  /// add the filling of the occupancy data to @c passes, so that it can share a read of the cloud with other
+  /// passes. The grid must be initialised by the time the pass starts, and @c lows filled in. Returns the pass id
+  int addDensityPass(class CloudPasses &passes, const Eigen::ArrayXXd &lows, double clip_min, double clip_max,
+                     const std::vector<int> &dependencies = {});
+
   /// draw the occupancy grid
   void draw(const std::string &filename);
 
   const Eigen::Vector3i &dims() const { return dims_; }
 
 private:
+  /// the position of the pixel at @c index in pixels_, or -1 if it is outside the grid
+  inline int pixelId(const Eigen::Vector3i &index) const
+  {
+    if (index[0] < 0 || index[1] < 0 || index[0] >= dims_[0] || index[1] >= dims_[1])
+      return -1;
+    return dims_[1] * index[0] + index[1];
+  }
+
   Eigen::Vector3i dims_;
   Eigen::Vector3d min_bound_;
   double pixel_width_;
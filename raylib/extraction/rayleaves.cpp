@@ -45,7 +45,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
   std::vector<int> segment_ids;
   std::vector<std::vector<int> > neighbour_segments; // this looks up into the above two structures
   ForestStructure forest;
-  std::vector<int> dense_voxel_indices(grid.voxels().size(), -1);
+  std::vector<int> dense_voxel_indices(grid.numVoxels(), -1);
   { // Tim: this block looks for the closest cylindrical branch segments to each voxel, in order to give the leaves a 'direction' value
     // The reason I use knn (K-nearest neighbour search) is that there is no maximum distance to worry about, and it is fast
     if (!forest.load(trees_file))
@@ -59,22 +59,20 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
       num_segments += tree.segments().size() - 1;
     }
     size_t num_dense_voxels = 0;
-    int i = 0;
-    for (auto &vox: grid.voxels())
+    for (size_t i = 0; i < grid.numVoxels(); i++)
     {
-      if (vox.density() > 0.0)
+      if (grid.voxel((int64_t)i).density() > 0.0)
       {
         dense_voxel_indices[i] = (int)num_dense_voxels;
         num_dense_voxels++;
       }
-      i++;
     }
 
     const int search_size = 12; // find the twelve nearest branch segments. For larger voxels a larger value here would be helpful
     size_t p_size = num_segments;
     size_t q_size = num_dense_voxels;
     Eigen::MatrixXd points_p(3, p_size);
-    i = 0;
+    int i = 0;
     // 1. get branch centre positions
     for (int tree_id = 0; tree_id < (int)forest.trees.size(); tree_id++)
     {
@@ -92,7 +90,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
       }
     }
     // 2. get 
-    neighbour_segments.resize(grid.voxels().size());
+    neighbour_segments.resize(grid.numVoxels());
     Eigen::MatrixXd points_q(3, q_size);
     int c = 0;
     for (int k = 0; k<dims[2]; k++)
@@ -101,8 +99,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
       {
         for (int i = 0; i<dims[0]; i++)
         {
-          int index = grid.getIndex(Eigen::Vector3i(i,j,k));
-          double density = grid.voxels()[index].density();
+          double density = grid.voxel(Eigen::Vector3i(i,j,k)).density();
           if (density > 0.0)
           {
             points_q.col(c++) = grid_bounds.min_bound_ + vox_width * Eigen::Vector3d((double)i+0.5, (double)j+0.5, (double)k+0.5);
@@ -120,7 +117,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     delete nns;
 
     // Convert these set of nearest neighbours into surfels
-    for (int i = 0; i < (int)grid.voxels().size(); i++)
+    for (size_t i = 0; i < grid.numVoxels(); i++)
     {
       int id = dense_voxel_indices[i];
       if (id != -1)
@@ -134,7 +131,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
   }
 
 
-  // the density is now stored in grid.voxels()[grid.getIndex(Eigen::Vector3i )].density().
+  // the density is now stored in grid.voxel(Eigen::Vector3i ).density().
   struct Leaf
   {
     Eigen::Vector3d centre;
@@ -143,9 +140,9 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     double grad0;
   };
   std::vector<Leaf> leaves;
-  std::vector<double> leaf_counter(grid.voxels().size());
+  std::vector<double> leaf_counter(grid.numVoxels());
   std::srand(1);
-  for (size_t i = 0; i<grid.voxels().size(); i++)
+  for (size_t i = 0; i<grid.numVoxels(); i++)
   {
     leaf_counter[i] = (double)(std::rand()%10000) / 10000.0; // a random start stops regions of low density have 0 leaves
   }
@@ -159,8 +156,8 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     {
       if (colours[i].alpha == 0)
         continue;
-      int index = grid.getIndexFromPos(ends[i]);
-      auto &voxel = grid.voxels()[index];
+      int64_t index = grid.getIndexFromPos(ends[i]);
+      auto &voxel = grid.voxel(index);
       double leaf_area_per_voxel_volume = voxel.density();
       if (leaf_area_per_voxel_volume <= 0.0)
       {
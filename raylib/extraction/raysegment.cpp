@@ -4,8 +4,10 @@
 //
 // Author: Thomas Lowe
 #include "raysegment.h"
-#include <nabo/nabo.h>
+#include "../raycompactcloud.h"
+#include "../rayneighbours.h"
 #include "rayterrain.h"
+#include "../rayparallel.h"
 #include <queue>
 
 namespace ray
@@ -35,11 +37,64 @@ public:
   bool operator()(const QueueNode &p1, const QueueNode &p2) { return p1.score > p2.score; }
 };
 
+namespace
+{
+/// The neighbours of each point in compressed sparse row form. The neighbours of point i, nearest first, are entries
+/// offsets[i] to offsets[i+1]-1 of ids and dists2
+struct NeighbourGraph
+{
+  std::vector<size_t> offsets;
+  std::vector<int> ids;
+  std::vector<double> dists2;
+};
+
+/// Fill @c graph with up to @c search_size nearest neighbours of each of @c points, within @c distance_limit.
+/// The points are searched a block at a time, and each block's neighbours appended to the graph, so the fixed size
+/// search results are only held for one block
+void getNeighbourGraph(const std::vector<Vertex> &points, int search_size, double distance_limit,
+                       NeighbourGraph &graph)
+{
+  Eigen::MatrixXd points_p(3, points.size());
+  for (unsigned int i = 0; i < points.size(); i++)
+  {
+    points_p.col(i) = points[i].pos;
+  }
+  Neighbours neighbours(points_p);
+
+  graph.offsets.assign(1, 0);
+  graph.offsets.reserve(points.size() + 1);
+  graph.ids.clear();
+  graph.dists2.clear();
+  const Eigen::Index block_size = 1 << 16;
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  for (Eigen::Index first = 0; first < points_p.cols(); first += block_size)
+  {
+    const Eigen::Index count = std::min(block_size, points_p.cols() - first);
+    const Eigen::MatrixXd queries = points_p.middleCols(first, count);
+    neighbours.knn(queries, search_size, indices, dists2, distance_limit);
+    for (Eigen::Index i = 0; i < count; i++)
+    {
+      for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; j++)
+      {
+        graph.ids.push_back(indices(j, i));
+        graph.dists2.push_back(dists2(j, i));
+      }
+      graph.offsets.push_back(graph.ids.size());
+    }
+  }
+}
+}  // namespace
+
 /// Connect the supplied set of points @c points according to the shortest path to the ground, by filling in their
 /// parent indices
 /// @c distance_limit maximum distance between points that can be connected
 /// @c gravity_factor controls how far laterally the shortest paths can travel
 /// @c closest_node a priority queue
+/// This is Dijkstra's algorithm, settling the points in phases. Each edge score is at least the squared distance to
+/// the point's nearest neighbour, times its gravity scale, over its tree radius. So every queued point with a score
+/// below the lowest queued score plus this bound is already final. These points have their edges scored in
+/// parallel, then the scores are applied in the order the points were popped, matching the one-at-a-time result.
 void connectPointsShortestPath(
   std::vector<Vertex> &points,
   std::priority_queue<QueueNode, std::vector<QueueNode>, QueueNodeComparator> &closest_node, double distance_limit,
@@ -47,98 +102,178 @@ void connectPointsShortestPath(
 {
   // 1. get nearest neighbours
   const int search_size = std::min(20, static_cast<int>(points.size()) - 1);
-  Eigen::MatrixXd points_p(3, points.size());
-  for (unsigned int i = 0; i < points.size(); i++)
+  NeighbourGraph graph;
+  getNeighbourGraph(points, search_size, distance_limit, graph);
+  std::vector<double> min_dists2(points.size(), std::numeric_limits<double>::infinity());
+  parallelFor(points.size(), [&](size_t i) {
+    if (graph.offsets[i + 1] > graph.offsets[i])
+    {
+      min_dists2[i] = graph.dists2[graph.offsets[i]];  // nearest first
+    }
+  }, 16, 64);
+
+  // the tree radius of each point's path, as carried by its queue node
+  std::vector<double> radii(points.size(), 0.0);
+  // the lowest score that each queued point can give its neighbours, used to find which points are final
+  struct BoundNode
   {
-    points_p.col(i) = points[i].pos;
+    double bound;
+    double score;
+    int id;
+  };
+  auto bound_compare = [](const BoundNode &p1, const BoundNode &p2) { return p1.bound > p2.bound; };
+  std::priority_queue<BoundNode, std::vector<BoundNode>, decltype(bound_compare)> bound_nodes(bound_compare);
+
+  // the gravity scale penalises paths that are hard to hold up against gravity (lateral direction)
+  auto gravityScale = [&](const Vertex &node) {
+    Eigen::Vector3d to_node = node.pos - points[node.root].pos;
+    to_node[2] = 0.0;
+    const double lateral_sqr = to_node.squaredNorm();
+    return 1.0 + gravity_factor * lateral_sqr;  // the squaring means gravity plays little role for normal trees,
+                                                // kicking in stronger on outlier lateral ones
+  };
+  auto pushBound = [&](int id) {
+    const Vertex &node = points[id];
+    double bound = min_dists2[id];
+    if (gravity_factor > 0.0)
+    {
+      bound *= gravityScale(node);
+    }
+    bound /= radii[id];
+    // the direction term can round to just under 1, so the bound is lowered to stay below any edge's score
+    const double rounding_margin = 1.0 - 1e-9;
+    bound_nodes.push(BoundNode{ node.score + bound * rounding_margin, node.score, id });
+  };
+  // the score of the path to point @c id then along its edge @c j
+  auto edgeScore = [&](int id, size_t j) {
+    const Vertex &node = points[id];
+    const int child = graph.ids[j];
+    const double dist2 = graph.dists2[j];  // square distance to neighbour
+    const Eigen::Vector3d dif = (points[child].pos - node.pos).normalized();
+    Eigen::Vector3d dir(0, 0, 1);
+    // estimate direction of path from parent of parent if possible
+    const int ppar = node.parent;
+    if (ppar != -1)
+    {
+      if (points[ppar].parent != -1)  // this is a bit smoother than...
+      {
+        dir = (node.pos - points[points[ppar].parent].pos).normalized();
+      }
+      else  // ..just this
+      {
+        dir = (node.pos - points[ppar].pos).normalized();
+      }
+    }
+    const double d = std::max(0.001, dif.dot(dir));
+    // we are looking for a minimum score, so large distances are bad, but new points in line with the
+    // path direction are good
+    double score = dist2 / (d * d);
+
+    if (gravity_factor > 0.0)
+    {
+      score *= gravityScale(node);
+    }
+
+    // scale score according to size of each tree, this prevents small trees from
+    // capturing the branches of larger trees
+    score /= radii[id];
+
+    return node.score + score;
+  };
+
+  std::vector<QueueNode> seeds;
+  for (auto queue = closest_node; !queue.empty(); queue.pop())
+  {
+    seeds.push_back(queue.top());
+  }
+  for (auto &seed : seeds)
+  {
+    radii[seed.id] = seed.radius;
+    pushBound(seed.id);
   }
-  Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
-  // Run the search
-  Eigen::MatrixXi indices;
-  Eigen::MatrixXd dists2;
-  indices.resize(search_size, points.size());
-  dists2.resize(search_size, points.size());
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, distance_limit);
 
   // 2. climb up from lowest points, this part is based on Djikstra's algorithm
+  std::vector<int> batch;
+  std::vector<size_t> batch_offsets;
+  std::vector<double> edge_scores;
   while (!closest_node.empty())
   {
-    QueueNode node = closest_node.top();
-    closest_node.pop();
-    if (!points[node.id].visited)
+    // 2a. pop the lowest point, and all others that can no longer be improved upon
+    while (!bound_nodes.empty() &&
+           (points[bound_nodes.top().id].visited || points[bound_nodes.top().id].score != bound_nodes.top().score))
     {
-      // for each unvisited point, look at its nearest neighbours
-      for (int i = 0; i < search_size && indices(i, node.id) != Nabo::NNSearchD::InvalidIndex; i++)
+      bound_nodes.pop();  // stale entry
+    }
+    const double threshold = bound_nodes.empty() ? std::numeric_limits<double>::infinity() : bound_nodes.top().bound;
+    batch.clear();
+    while (!closest_node.empty() && (batch.empty() || closest_node.top().score < threshold))
+    {
+      const int id = closest_node.top().id;
+      closest_node.pop();
+      if (!points[id].visited)
       {
-        const int child = indices(i, node.id);
-        const double dist2 = dists2(i, node.id);  // square distance to neighbour
-        const double dist = std::sqrt(dist2);
-        double new_score = 0;
-        const Eigen::Vector3d dif = (points[child].pos - points[node.id].pos).normalized();
-        Eigen::Vector3d dir(0, 0, 1);
-        // estimate direction of path from parent of parent if possible
-        const int ppar = points[node.id].parent;
-        if (ppar != -1)
-        {
-          if (points[ppar].parent != -1)  // this is a bit smoother than...
-          {
-            dir = (points[node.id].pos - points[points[ppar].parent].pos).normalized();
-          }
-          else  // ..just this
-          {
-            dir = (points[node.id].pos - points[ppar].pos).normalized();
-          }
-        }
-        const double d = std::max(0.001, dif.dot(dir));
-        // we are looking for a minimum score, so large distances are bad, but new points in line with the
-        // path direction are good
-        double score = dist2 / (d * d);
-
-        if (gravity_factor > 0.0)  // penalise paths that are hard to hold up against gravity (lateral direction)
-        {
-          Eigen::Vector3d to_node = points[node.id].pos - points[node.root].pos;
-          to_node[2] = 0.0;
-          const double lateral_sqr = to_node.squaredNorm();
-          const double gravity_scale =
-            1.0 + gravity_factor * lateral_sqr;  // the squaring means gravity plays little role for normal trees,
-                                                 // kicking in stronger on outlier lateral ones
-          score *= gravity_scale;
-        }
+        points[id].visited = true;
+        batch.push_back(id);
+      }
+    }
 
-        // scale score according to size of each tree, this prevents small trees from
-        // capturing the branches of larger trees
-        score /= node.radius;
+    // 2b. score the edges of these points, in parallel
+    batch_offsets.resize(batch.size() + 1);
+    batch_offsets[0] = 0;
+    for (size_t b = 0; b < batch.size(); b++)
+    {
+      batch_offsets[b + 1] = batch_offsets[b] + graph.offsets[batch[b] + 1] - graph.offsets[batch[b]];
+    }
+    edge_scores.resize(batch_offsets.back());
+    parallelFor(batch.size(), [&](size_t b) {
+      const int id = batch[b];
+      for (size_t j = graph.offsets[id], k = batch_offsets[b]; j < graph.offsets[id + 1]; j++, k++)
+      {
+        edge_scores[k] = edgeScore(id, j);
+      }
+    }, 16, 64);
 
-        new_score = node.score + score;
+    // 2c. apply the scores in the order that the points were popped
+    for (size_t b = 0; b < batch.size(); b++)
+    {
+      const int id = batch[b];
+      for (size_t j = graph.offsets[id], k = batch_offsets[b]; j < graph.offsets[id + 1]; j++, k++)
+      {
+        const int child = graph.ids[j];
+        const double new_score = edge_scores[k];
         if (new_score < points[child].score)
         {
           points[child].score = new_score;
           // we also maintain the distance to ground value
-          points[child].distance_to_ground = node.distance_to_ground + dist;
-          points[child].parent = node.id;
-          points[child].root = node.root;
+          points[child].distance_to_ground = points[id].distance_to_ground + std::sqrt(graph.dists2[j]);
+          points[child].parent = id;
+          points[child].root = points[id].root;
+          radii[child] = radii[id];
           closest_node.push(
-            QueueNode(points[child].distance_to_ground, points[child].score, node.radius, node.root, child));
+            QueueNode(points[child].distance_to_ground, points[child].score, radii[child], points[child].root, child));
+          pushBound(child);
         }
       }
-      points[node.id].visited = true;
     }
   }
 }
 
+namespace
+{
 /// Converts a ray cloud to a set of points @c points connected by the shortest path to the ground @c mesh
 /// the returned vector of index sets provides the root points for each separated tree
-std::vector<std::vector<int>> getRootsAndSegment(std::vector<Vertex> &points, const Cloud &cloud, const Mesh &mesh,
-                                                 double max_diameter, double distance_limit, double height_min,
-                                                 double gravity_factor)
+template <class CloudT>
+std::vector<std::vector<int>> getCloudRootsAndSegment(std::vector<Vertex> &points, const CloudT &cloud,
+                                                      const Mesh &mesh, double max_diameter, double distance_limit,
+                                                      double height_min, double gravity_factor)
 {
   // first fill in the basic attributes of the points structure
-  points.reserve(cloud.ends.size());
-  for (unsigned int i = 0; i < cloud.ends.size(); i++)
+  points.reserve(cloud.rayCount());
+  for (unsigned int i = 0; i < cloud.rayCount(); i++)
   {
     if (cloud.rayBounded(i))
     {
-      points.push_back(Vertex(cloud.ends[i], cloud.starts[i]));
+      points.push_back(Vertex(cloud.end(i), cloud.start(i)));
     }
   }
 
@@ -297,5 +432,20 @@ std::vector<std::vector<int>> getRootsAndSegment(std::vector<Vertex> &points, co
 
   return roots_set;
 }
+}  // namespace
+
+std::vector<std::vector<int>> getRootsAndSegment(std::vector<Vertex> &points, const Cloud &cloud, const Mesh &mesh,
+                                                 double max_diameter, double distance_limit, double height_min,
+                                                 double gravity_factor)
+{
+  return getCloudRootsAndSegment(points, cloud, mesh, max_diameter, distance_limit, height_min, gravity_factor);
+}
+
+std::vector<std::vector<int>> getRootsAndSegment(std::vector<Vertex> &points, const CompactCloud &cloud,
+                                                 const Mesh &mesh, double max_diameter, double distance_limit,
+                                                 double height_min, double gravity_factor)
+{
+  return getCloudRootsAndSegment(points, cloud, mesh, max_diameter, distance_limit, height_min, gravity_factor);
+}
 
 }  // namespace ray
@@ -45,6 +45,9 @@ struct RAYLIB_EXPORT Vertex
 std::vector<std::vector<int>> RAYLIB_EXPORT getRootsAndSegment(std::vector<Vertex> &points, const Cloud &cloud, const Mesh &mesh,
                                                                double max_diameter, double distance_limit, double height_min,
                                                                double gravity_factor);
+std::vector<std::vector<int>> RAYLIB_EXPORT getRootsAndSegment(std::vector<Vertex> &points, const class CompactCloud &cloud,
+                                                               const Mesh &mesh, double max_diameter, double distance_limit,
+                                                               double height_min, double gravity_factor);
 
 }  // namespace ray
 #endif  // RAYLIB_RAYSEGMENT_H
\ No newline at end of file
@@ -9,17 +9,29 @@
 #include "../rayply.h"
 #include "../rayprogress.h"
 #include "../rayprogressthread.h"
+#include "../rayexternalsort.h"
+#include "../rayparallel.h"
+#include "../rayunused.h"
+#include <array>
+#include <atomic>
 
 #if RAYLIB_WITH_TBB
 #include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
 #endif  // RAYLIB_WITH_TBB
-static int num_visits = 0;
-static int num_cone_tests = 0;
-
 
 namespace ray
 {
+namespace
+{
+/// counts of the work done in the pareto front queries, for reporting
+struct ParetoStats
+{
+  size_t num_visits = 0;
+  size_t num_cone_tests = 0;
+};
+}  // namespace
+
 /// The node structure used in calculating the pareto front
 struct Node
 {
@@ -45,9 +57,9 @@ struct Node
   int dir_ids[2][2][2];
 
   // returns whether there is a smaller node than the supplied @c corner point
-  bool somethingSmaller(std::vector<Node> &nodes, const Vector4d &corner)
+  bool somethingSmaller(std::vector<Node> &nodes, const Vector4d &corner, ParetoStats &stats)
   {
-    num_visits++;
+    stats.num_visits++;
 // This checks in a cone rather than just the corner of a cube shape that you would get
 // from a raw Pareto front calculation    
 #define CONE_CHECK  
@@ -59,7 +71,7 @@ struct Node
       {
         return false;
       }
-      return nodes[dir_ids[0][0][0]].somethingSmaller(nodes, corner);
+      return nodes[dir_ids[0][0][0]].somethingSmaller(nodes, corner, stats);
 #else
       return dir_ids[0][0][0] != -1;
 #endif
@@ -75,7 +87,7 @@ struct Node
     if (i == 0 && j == 0 && k == 0)  // corner is smaller, so deactivate current node
     {
 #if defined CONE_CHECK
-      num_cone_tests++;
+      stats.num_cone_tests++;
       const Eigen::Vector3d dir = -Eigen::Vector3d(dif[0], dif[1], dif[2]).normalized();
       if (dir.dot(diagonal) > cos_ang)
         found = 1;
@@ -86,7 +98,7 @@ struct Node
     else if (i == 1 && j == 1 && k == 1)  // corner is larger, so this node is indeed smaller
     {
 #if defined CONE_CHECK
-      num_cone_tests++;
+      stats.num_cone_tests++;
       const Eigen::Vector3d dir = Eigen::Vector3d(dif[0], dif[1], dif[2]).normalized();
       if (dir.dot(diagonal) > cos_ang)
       {
@@ -104,7 +116,7 @@ struct Node
         {
           if (dir_ids[I][J][K] != -1)
           {
-            if (nodes[dir_ids[I][J][K]].somethingSmaller(nodes, corner))
+            if (nodes[dir_ids[I][J][K]].somethingSmaller(nodes, corner, stats))
             {
               return true;
             }
@@ -116,43 +128,116 @@ struct Node
   }
 };
 
-/// construct an octal space partition tree
-void constructOctalSpacePartition(std::vector<Node> &nodes, std::vector<Vector4d> points)
+/// construct an octal space partition tree, where the children of each node are the points in each of its 8 octants.
+/// The tree is bulk loaded one level at a time. Each range of points takes as its node the point closest to the
+/// range's median, and the other points are partitioned into its octants, which are the ranges of the next level.
+/// This gives a balanced tree that does not depend on the input order, and the ranges of a level are built in parallel
+void constructOctalSpacePartition(std::vector<Node> &nodes, const std::vector<Vector4d> &points)
 {
   nodes.resize(points.size());
-  int i = 0;
-  while (points.size() > 0)
+  if (points.empty())
   {
-    const int ind = rand() % static_cast<int>(points.size());
-    nodes[i++].pos = points[ind];
-    points[ind] = points.back();
-    points.pop_back();
+    return;
   }
-  // n log n on average, for each node, trace the tree to add correct direction ids
-  for (size_t n = 1; n < nodes.size(); n++)
+  // the points are reordered so that each node is followed by the points in its octants
+  std::vector<Vector4d> ordered = points;
+  std::vector<Vector4d> buffer(points.size());
+  struct Range
   {
-    const Eigen::Vector4d &pos = nodes[n].pos;
-    int head = 0;
-    for (;;)
+    size_t begin, end;
+  };
+  std::vector<Range> level(1, Range{ 0, points.size() });
+  std::vector<Range> next_level;
+  std::vector<std::array<Range, 8>> octants;
+  while (!level.empty())
+  {
+    octants.resize(level.size());
+    parallelFor(level.size(), [&](size_t r) {
+      const size_t begin = level[r].begin;
+      const size_t end = level[r].end;
+      // estimate the median from up to max_samples evenly spaced points
+      const size_t max_samples = 256;
+      const size_t step = std::max<size_t>(1, (end - begin) / max_samples);
+      Eigen::Vector3d median;
+      std::vector<double> values;
+      for (int axis = 0; axis < 3; axis++)
+      {
+        values.clear();
+        for (size_t i = begin; i < end; i += step)
+        {
+          values.push_back(ordered[i][axis]);
+        }
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        median[axis] = values[values.size() / 2];
+      }
+      size_t pivot = begin;
+      double min_dist = std::numeric_limits<double>::max();
+      for (size_t i = begin; i < end; i += step)
+      {
+        const double dist = (ordered[i].head<3>() - median).cwiseAbs().sum();
+        if (dist < min_dist)
+        {
+          min_dist = dist;
+          pivot = i;
+        }
+      }
+      std::swap(ordered[begin], ordered[pivot]);
+      Node &node = nodes[begin];
+      node.pos = ordered[begin];
+
+      // partition the remaining points by octant, in a stable order
+      auto octant = [&node](const Vector4d &pos) {
+        const Vector4d dif = pos - node.pos;
+        return 4 * static_cast<int>(dif[0] > 0.0) + 2 * static_cast<int>(dif[1] > 0.0) + static_cast<int>(dif[2] > 0.0);
+      };
+      size_t counts[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+      for (size_t i = begin + 1; i < end; i++)
+      {
+        counts[octant(ordered[i])]++;
+      }
+      size_t starts[8];
+      size_t start = begin + 1;
+      for (int o = 0; o < 8; o++)
+      {
+        starts[o] = start;
+        octants[r][o] = Range{ start, start + counts[o] };
+        start += counts[o];
+      }
+      for (size_t i = begin + 1; i < end; i++)
+      {
+        buffer[starts[octant(ordered[i])]++] = ordered[i];
+      }
+      std::copy(buffer.begin() + (begin + 1), buffer.begin() + end, ordered.begin() + (begin + 1));
+      for (int o = 0; o < 8; o++)
+      {
+        if (counts[o] > 0)
+        {
+          node.dir_ids[o / 4][(o / 2) % 2][o % 2] = static_cast<int>(octants[r][o].begin);
+        }
+      }
+    }, 64);
+    next_level.clear();
+    for (auto &ranges : octants)
     {
-      const Vector4d dif = pos - nodes[head].pos;
-      const int i = static_cast<int>(dif[0] > 0.0);
-      const int j = static_cast<int>(dif[1] > 0.0);
-      const int k = static_cast<int>(dif[2] > 0.0);
-      const int new_head = nodes[head].dir_ids[i][j][k];
-      if (new_head == -1)
+      for (auto &range : ranges)
       {
-        nodes[head].dir_ids[i][j][k] = static_cast<int>(n);
-        break;
+        if (range.end > range.begin)
+        {
+          next_level.push_back(range);
+        }
       }
-      head = new_head;
     }
+    level.swap(next_level);
   }
 }
 
 // get 3D pareto front, the 4D vectors' last element is its index, to aid with book keeping
 void Terrain::getParetoFront(const std::vector<Vector4d> &points, std::vector<Vector4d> &front)
 {
+  if (points.empty())
+  {
+    return;
+  }
   // this is an acceleration structure for faster lookup
   std::vector<Node> nodes;
   constructOctalSpacePartition(nodes, points);
@@ -162,27 +247,23 @@ void Terrain::getParetoFront(const std::vector<Vector4d> &points, std::vector<Ve
   ProgressThread progress_thread(progress);
   progress.begin("rays processed:", nodes.size());
 
-  const auto process_rays = [&nodes, &root, &front, &progress](size_t n) {
+  std::atomic<size_t> num_visits(0), num_cone_tests(0);
+  const auto process_rays = [&nodes, &root, &progress, &num_visits, &num_cone_tests](size_t n) {
     progress.increment();
     if (nodes[n].found == 1)
     {
       return;
     }
-    bool dominated = root.somethingSmaller(nodes, nodes[n].pos);
+    ParetoStats stats;
+    bool dominated = root.somethingSmaller(nodes, nodes[n].pos, stats);
     if (dominated)
       nodes[n].found = 1;
     else
       nodes[n].is_set = 1;
+    num_visits += stats.num_visits;
+    num_cone_tests += stats.num_cone_tests;
   };
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, nodes.size(), process_rays);
-#else
-  #pragma omp parallel for
-  for (size_t n = 0; n < nodes.size(); n++)
-  {
-    process_rays(n);
-  }
-#endif
+  parallelFor(nodes.size(), process_rays, 64);
   for (auto &node : nodes)
   {
     if (node.is_set)
@@ -197,9 +278,9 @@ void Terrain::getParetoFront(const std::vector<Vector4d> &points, std::vector<Ve
             << ", number of cone tests: " << num_cone_tests << std::endl;
 }
 
-void Terrain::growUpwards(const std::vector<Eigen::Vector3d> &positions, double gradient)
+void Terrain::paretoFrontPoints(const std::vector<Eigen::Vector3d> &positions, double gradient,
+                                std::vector<Eigen::Vector3d> &front_points)
 {
-#if RAYLIB_WITH_QHULL
   // The idea behind ground extraction is to tilt the upwards vector to the (1,1,1) direction then 
   // find the Pareto front in the three principle axes. https://en.wikipedia.org/wiki/Pareto_front
   //
@@ -238,14 +319,21 @@ void Terrain::growUpwards(const std::vector<Eigen::Vector3d> &positions, double
   getParetoFront(points, front);
   std::cout << "number of pareto front points: " << front.size() << std::endl;
 
-  // then convert it into a mesh
-  std::vector<Eigen::Vector3d> vecs(front.size());
-  std::vector<Eigen::Vector3d> vecs_flat(front.size());
+  front_points.resize(front.size());
   for (size_t i = 0; i < front.size(); i++)
   {
     // we convert the points back to world space
-    vecs[i] = imat * Eigen::Vector3d(front[i][0], front[i][1], front[i][2]);
-    vecs[i][2] *= grad_scale;
+    front_points[i] = imat * Eigen::Vector3d(front[i][0], front[i][1], front[i][2]);
+    front_points[i][2] *= grad_scale;
+  }
+}
+
+void Terrain::triangulate(const std::vector<Eigen::Vector3d> &vecs)
+{
+#if RAYLIB_WITH_QHULL
+  std::vector<Eigen::Vector3d> vecs_flat(vecs.size());
+  for (size_t i = 0; i < vecs.size(); i++)
+  {
     // flattened points are used to get the Delauney triangulation below
     vecs_flat[i] = vecs[i];
     vecs_flat[i][2] = 0.0;
@@ -258,6 +346,14 @@ void Terrain::growUpwards(const std::vector<Eigen::Vector3d> &positions, double
 #endif
 }
 
+void Terrain::growUpwards(const std::vector<Eigen::Vector3d> &positions, double gradient)
+{
+  std::vector<Eigen::Vector3d> front_points;
+  paretoFrontPoints(positions, gradient, front_points);
+  // then convert it into a mesh
+  triangulate(front_points);
+}
+
 void Terrain::growDownwards(const std::vector<Eigen::Vector3d> &positions, double gradient)
 {
   // as you might imagine, this is just the reverse of growupwards
@@ -273,11 +369,11 @@ void Terrain::growDownwards(const std::vector<Eigen::Vector3d> &positions, doubl
   }
 }
 
-// a faster version of the growupwards algorithm
-void Terrain::growUpwardsFast(const std::vector<Eigen::Vector3d> &ends, double pixel_width,
-                              const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double gradient)
+// remove the points that are clearly above the ground, as there are lower points beside them
+void Terrain::cullRaisedPoints(const std::vector<Eigen::Vector3d> &ends, double pixel_width,
+                               const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
+                               std::vector<Eigen::Vector3d> &points)
 {
-#if RAYLIB_WITH_QHULL
   // the speed up is one of removing lots of 'above ground' points before running the growUpwards function
   // thereby making the problem size smaller.
 
@@ -305,7 +401,7 @@ void Terrain::growUpwardsFast(const std::vector<Eigen::Vector3d> &ends, double p
     }
   }
 
-  std::vector<Eigen::Vector3d> points;
+  points.clear();
   // then for each point
   for (size_t i = 0; i < ends.size(); i++)
   {
@@ -347,7 +443,15 @@ void Terrain::growUpwardsFast(const std::vector<Eigen::Vector3d> &ends, double p
     points.push_back(p);
   }
   std::cout << "size before: " << ends.size() << ", size after: " << points.size() << std::endl;
+}
 
+// a faster version of the growupwards algorithm
+void Terrain::growUpwardsFast(const std::vector<Eigen::Vector3d> &ends, double pixel_width,
+                              const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double gradient)
+{
+#if RAYLIB_WITH_QHULL
+  std::vector<Eigen::Vector3d> points;
+  cullRaisedPoints(ends, pixel_width, min_bound, max_bound, points);
   growUpwards(points, gradient);
 #endif
 }
@@ -370,6 +474,14 @@ void Terrain::extract(const Cloud &cloud, const Eigen::Vector3d &offset, const s
     }
   }
   growUpwardsFast(ends, pixel_width, min_bound, max_bound, gradient);
+  saveMesh(offset, file_prefix, verbose);
+#else
+  std::cerr << "Error: extracting terrain requires QHull, see README instructions for installation" << std::endl;
+#endif
+}
+
+void Terrain::saveMesh(const Eigen::Vector3d &offset, const std::string &file_prefix, bool verbose)
+{
   mesh_.reduce();  // remove disconnected vertices in the mesh
   mesh_.colours() = std::vector<RGBA>(mesh_.vertices().size(), RGBA::terrain());
 
@@ -385,8 +497,219 @@ void Terrain::extract(const Cloud &cloud, const Eigen::Vector3d &offset, const s
     }
     local_cloud.save(file_prefix + "_terrain.ply");
   }
+}
+
+namespace
+{
+/// An end point copied into each tile whose halo contains it
+struct TerrainPoint
+{
+  uint32_t tile;
+  uint64_t index;  // in the cloud file
+  double pos[3];
+};
+
+/// Orders the points by tile, and within each tile by their order in the cloud file
+struct TerrainPointLess
+{
+  inline bool operator()(const TerrainPoint &a, const TerrainPoint &b) const
+  {
+    if (a.tile != b.tile)
+      return a.tile < b.tile;
+    return a.index < b.index;
+  }
+};
+}  // namespace
+
+bool Terrain::extractTiled(const std::string &file_stub, double gradient, double tile_width, bool verbose)
+{
+#if RAYLIB_WITH_QHULL
+  const std::string file_name = file_stub + ".ply";
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+  {
+    return false;
+  }
+  if (info.num_bounded == 0)
+  {
+    std::cerr << "Error: no bounded rays in " << file_name << std::endl;
+    return false;
+  }
+  // the points are processed relative to the lower bound, for floating point accuracy
+  const Eigen::Vector3d offset = info.ends_bound.min_bound_;
+  const Eigen::Vector3d extent = info.ends_bound.max_bound_ - offset;
+  const double spacing = Cloud::estimatePointSpacing(file_name, info.ends_bound, info.num_bounded);
+  const double pixel_width = 2.0 * spacing;
+  const int tiles_x = 1 + static_cast<int>(extent[0] / tile_width);
+  const int tiles_y = 1 + static_cast<int>(extent[1] / tile_width);
+  if ((double)tiles_x * (double)tiles_y > (double)std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "Error: tile width " << tile_width << " m is too small for the cloud extent" << std::endl;
+    return false;
+  }
+  auto tile_x = [&](double x) {
+    return std::max(0, std::min(static_cast<int>(std::floor(x / tile_width)), tiles_x - 1));
+  };
+  auto tile_y = [&](double y) {
+    return std::max(0, std::min(static_cast<int>(std::floor(y / tile_width)), tiles_y - 1));
+  };
+
+  // 1. find the height range of the end points in each tile
+  const size_t num_tiles = static_cast<size_t>(tiles_x) * static_cast<size_t>(tiles_y);
+  std::vector<double> tile_min_z(num_tiles, std::numeric_limits<double>::max());
+  std::vector<double> tile_max_z(num_tiles, std::numeric_limits<double>::lowest());
+  auto add_heights = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (colours[i].alpha == 0)
+      {
+        continue;
+      }
+      const Eigen::Vector3d pos = ends[i] - offset;
+      const size_t tile = static_cast<size_t>(tile_x(pos[0]) + tiles_x * tile_y(pos[1]));
+      tile_min_z[tile] = std::min(tile_min_z[tile], pos[2]);
+      tile_max_z[tile] = std::max(tile_max_z[tile], pos[2]);
+    }
+  };
+  if (!Cloud::read(file_name, add_heights, 1))
+  {
+    return false;
+  }
+
+  // points are only removed by lower points within their gradient cone. So a tile's halo must hold the points that
+  // are lower than the tile's highest point by the halo width times the gradient, and is grown until it holds the
+  // lowest of them. The culling also compares with the lowest points up to two pixels away.
+  // Tiles without points have no halo, as they have no front points to find
+  std::vector<double> halos(num_tiles, -1.0);
+  double max_halo = 0.0;
+  for (int ty = 0; ty < tiles_y; ty++)
+  {
+    for (int tx = 0; tx < tiles_x; tx++)
+    {
+      const size_t tile = static_cast<size_t>(tx + tiles_x * ty);
+      if (tile_max_z[tile] < tile_min_z[tile])
+      {
+        continue;
+      }
+      double halo = 0.0;
+      for (;;)
+      {
+        double min_z = tile_min_z[tile];
+        for (int y = tile_y(ty * tile_width - halo); y <= tile_y((ty + 1) * tile_width + halo); y++)
+        {
+          for (int x = tile_x(tx * tile_width - halo); x <= tile_x((tx + 1) * tile_width + halo); x++)
+          {
+            min_z = std::min(min_z, tile_min_z[static_cast<size_t>(x + tiles_x * y)]);
+          }
+        }
+        const double needed = (tile_max_z[tile] - min_z) / gradient;
+        if (needed <= halo)
+        {
+          break;
+        }
+        halo = needed;
+      }
+      halos[tile] = halo + 2.0 * pixel_width;
+      max_halo = std::max(max_halo, halos[tile]);
+    }
+  }
+  std::cout << "extracting terrain in " << tiles_x << " x " << tiles_y << " tiles, with halos of up to " << max_halo
+            << " m" << std::endl;
+
+  // 2. copy each end point into every tile whose halo contains it, sorting them by tile on disk
+  const size_t sort_memory = size_t(1) << 29;
+  ExternalSorter<TerrainPoint, TerrainPointLess> tile_points(file_stub + "_terrain_tiles",
+                                                             sort_memory / sizeof(TerrainPoint));
+  uint64_t num_rays = 0;
+  bool success = true;
+  auto add_points = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+    {
+      if (colours[i].alpha == 0)
+      {
+        continue;
+      }
+      const Eigen::Vector3d pos = ends[i] - offset;
+      for (int ty = tile_y(pos[1] - max_halo); ty <= tile_y(pos[1] + max_halo) && success; ty++)
+      {
+        // the distance from the point to the tile in each axis
+        const double dist_y = std::max({ 0.0, ty * tile_width - pos[1], pos[1] - (ty + 1) * tile_width });
+        for (int tx = tile_x(pos[0] - max_halo); tx <= tile_x(pos[0] + max_halo) && success; tx++)
+        {
+          const double dist_x = std::max({ 0.0, tx * tile_width - pos[0], pos[0] - (tx + 1) * tile_width });
+          const size_t tile = static_cast<size_t>(tx + tiles_x * ty);
+          if (std::max(dist_x, dist_y) > halos[tile])
+          {
+            continue;
+          }
+          TerrainPoint point;
+          point.tile = static_cast<uint32_t>(tile);
+          point.index = num_rays;
+          for (int j = 0; j < 3; j++)
+          {
+            point.pos[j] = pos[j];
+          }
+          success = tile_points.add(point);
+        }
+      }
+    }
+  };
+  if (!Cloud::read(file_name, add_points, 1) || !success || !tile_points.sort())
+  {
+    return false;
+  }
+
+  // 3. find the pareto front of each tile, keeping the front points that are in the tile
+  std::vector<Eigen::Vector3d> front;
+  std::vector<Eigen::Vector3d> ends, points, tile_front;
+  TerrainPoint tile_point;
+  bool has_point = tile_points.next(tile_point);
+  while (has_point)
+  {
+    const uint32_t tile = tile_point.tile;
+    const int tx = static_cast<int>(tile % (uint32_t)tiles_x);
+    const int ty = static_cast<int>(tile / (uint32_t)tiles_x);
+    ends.clear();
+    for (; has_point && tile_point.tile == tile; has_point = tile_points.next(tile_point))
+    {
+      ends.push_back(Eigen::Vector3d(tile_point.pos[0], tile_point.pos[1], tile_point.pos[2]));
+    }
+    // the culling grid is aligned with that of the whole cloud
+    Eigen::Vector3d min_bound = ends[0], max_bound = ends[0];
+    for (auto &end : ends)
+    {
+      min_bound = min_bound.cwiseMin(end);
+      max_bound = max_bound.cwiseMax(end);
+    }
+    min_bound[0] = std::floor(min_bound[0] / pixel_width) * pixel_width;
+    min_bound[1] = std::floor(min_bound[1] / pixel_width) * pixel_width;
+    max_bound += Eigen::Vector3d(pixel_width, pixel_width, 0.0);  // so no point is on the far edge of the grid
+    cullRaisedPoints(ends, pixel_width, min_bound, max_bound, points);
+    paretoFrontPoints(points, gradient, tile_front);
+    for (auto &point : tile_front)
+    {
+      if (tile_x(point[0]) == tx && tile_y(point[1]) == ty)
+      {
+        front.push_back(point);
+      }
+    }
+  }
+  tile_points.clear();
+  std::cout << "number of pareto front points over all tiles: " << front.size() << std::endl;
+
+  // 4. triangulate the whole front at once
+  triangulate(front);
+  saveMesh(offset, file_stub, verbose);
+  return true;
 #else
+  RAYLIB_UNUSED(file_stub);
+  RAYLIB_UNUSED(gradient);
+  RAYLIB_UNUSED(tile_width);
+  RAYLIB_UNUSED(verbose);
   std::cerr << "Error: extracting terrain requires QHull, see README instructions for installation" << std::endl;
+  return false;
 #endif
 }
 }  // namespace ray
@@ -29,6 +29,11 @@ public:
   /// The output is the stored mesh, which is accessed with the mesh() accessor.
   void extract(const Cloud &cloud, const Eigen::Vector3d &offset, const std::string &file_prefix, double gradient, bool verbose);
 
+  /// Extracts the terrain mesh of the ray cloud file @c file_stub.ply, one square tile of width @c tile_width at a
+  /// time, so that the cloud need not fit in memory. Each tile is grown with a halo wide enough to hold every point
+  /// that can affect it, so the tiles join without seams. The mesh is saved to @c file_stub_mesh.ply
+  bool extractTiled(const std::string &file_stub, double gradient, double tile_width, bool verbose);
+
   /// Direct extraction of the pareto front points
   void growUpwards(const std::vector<Eigen::Vector3d> &positions, double gradient);
   void growDownwards(const std::vector<Eigen::Vector3d> &positions, double gradient);
@@ -42,6 +47,18 @@ public:
   const Mesh &mesh() const { return mesh_; }
 
 private:
+  /// the pareto front of @c positions, for a maximum ground gradient of @c gradient
+  static void paretoFrontPoints(const std::vector<Eigen::Vector3d> &positions, double gradient,
+                                std::vector<Eigen::Vector3d> &front_points);
+  /// removes the @c ends that have a lower point in the neighbouring pixels, beyond the 45 degree cone above it
+  static void cullRaisedPoints(const std::vector<Eigen::Vector3d> &ends, double pixel_width,
+                               const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
+                               std::vector<Eigen::Vector3d> &points);
+  /// sets the mesh as the horizontal Delauney triangulation of @c vecs
+  void triangulate(const std::vector<Eigen::Vector3d> &vecs);
+  /// finalises the mesh, shifts it by @c offset and saves it to @c file_prefix_mesh.ply
+  void saveMesh(const Eigen::Vector3d &offset, const std::string &file_prefix, bool verbose);
+
   Mesh mesh_;
   static void getParetoFront(const std::vector<Vector4d> &points, std::vector<Vector4d> &front);
 };
@@ -6,6 +6,8 @@
 #include "raytrees.h"
 #include <nabo/nabo.h>
 #include "rayclusters.h"
+#include "../rayparallel.h"
+#include <sstream>
 
 namespace ray
 {
@@ -25,10 +27,155 @@ TreesParams::TreesParams()
   , global_taper_factor(0.3)
 {}
 
+namespace
+{
+/// remove ray @c i from @c cloud, by moving the last ray into its place
+void removeRay(Cloud &cloud, size_t i)
+{
+  cloud.starts[i] = cloud.starts.back();
+  cloud.starts.pop_back();
+  cloud.ends[i] = cloud.ends.back();
+  cloud.ends.pop_back();
+  cloud.colours[i] = cloud.colours.back();
+  cloud.colours.pop_back();
+  cloud.times[i] = cloud.times.back();
+  cloud.times.pop_back();
+}
+void removeRay(CompactCloud &cloud, size_t i)
+{
+  cloud.removeRay(i);
+}
+
+/// the taper of the tree with trunk @c root_section (section id @c root), blended with the forest's mean taper.
+/// Problems are reported to @c log
+double blendTaper(const BranchSection &root_section, int root, double forest_taper, double forest_weight,
+                  double forest_weight_squared, const TreesParams &params, std::ostream &log)
+{
+  double mean_taper = params.global_taper ? params.global_taper : (forest_taper / forest_weight);
+  double mean_weight = forest_weight_squared / forest_weight;
+  double taper = root_section.total_taper / root_section.total_weight;
+  double weight = root_section.total_weight;
+  double blend = params.global_taper_factor * params.global_taper_factor * params.global_taper_factor;
+  mean_weight *= blend;
+  weight *= 1.0 - blend;
+
+  double result = (mean_taper * mean_weight + taper*weight) / (mean_weight + weight);
+  if (!(result == result))
+  {
+    log << "bad taper estimate" << std::endl;
+    log << "root: " << root << " estimated taper: " << result << ", mt: " << mean_taper << ", mw: " << mean_weight << ", t: " << taper << ", w: " << weight << ", blend: " << blend << std::endl;
+  }
+  return result;
+}
+
+/// Reconstructs the trees grown from a single root section. No point is reached from more than one root section, so
+/// separate builders can run concurrently on the shared @c points and children lists. The parent, root and
+/// children indices of the sections are local to the builder, and @c ids_ converts them to the forest's section ids
+class TreeBuilder
+{
+public:
+  TreeBuilder(std::vector<Vertex> &points, const TreesParams &params, const BranchSection &base, int id)
+    : params_(&params)
+    , points_(points)
+  {
+    sections_.push_back(base);
+    sections_[0].root = 0;
+    ids_.push_back(id);
+  }
+
+  /// The result of processing one section. These are merged into the forest in section id order, so that the ids,
+  /// messages and taper sums are the same as processing every section in a single loop
+  struct Step
+  {
+    int new_begin, new_end;  // the local ids of the sections that were added while processing it
+    double taper{0}, weight{0};  // its contribution to the forest's taper estimate
+    size_t debug_begin, debug_end;  // the rays that it added to debug_cloud_
+    std::string log, error_log;
+  };
+
+  /// reconstruct the trunks added since the last call
+  void extractTrunks(std::vector<std::vector<int>> &children, bool verbose);
+  /// reconstruct the branches added since the last call, using @c forest_taper, @c forest_weight and
+  /// @c forest_weight_squared as the forest's taper estimate so far
+  void extractBranches(std::vector<std::vector<int>> &children, double forest_taper, double forest_weight,
+                       double forest_weight_squared);
+  /// start a new pass through the sections, from the first trunk
+  void restart() { next_ = 0; }
+
+  std::vector<BranchSection> sections_;
+  std::vector<int> ids_;  // the forest's section id of each of the sections, once it is known
+  std::vector<Step> steps_;  // one for each section processed in the last call to extractTrunks or extractBranches
+  ray::Cloud debug_cloud_;
+
+private:
+  /// process the sections added since the last call using @c extract, recording a Step for each
+  template <class Extract>
+  void extractNewSections(Extract extract);
+  /// reconstruct the trunk section, returns false if it was split, in which case it must be processed again
+  bool extractTrunk(std::vector<std::vector<int>> &children, bool verbose);
+  /// reconstruct the branch section, adding any sections above it
+  void extractBranch(std::vector<std::vector<int>> &children);
+  /// finalise the attributes of an end (tip) of a branch
+  void setBranchTip();
+  /// get the root position for the current section
+  Eigen::Vector3d getRootPosition() const;
+  /// find the points and end points within this branch section
+  void extractNodesAndEndsFromRoots(std::vector<int> &nodes, const Eigen::Vector3d &base,
+                                    const std::vector<std::vector<int>> &children, double min_dist, double max_dist);
+  /// find separate clusters of points within the branch section
+  std::vector<std::vector<int>> findPointClusters(const Eigen::Vector3d &base, bool &points_removed,
+                                                  double thickness, double span, double gap);
+  /// split the branch section to one branch for each cluster
+  void bifurcate(const std::vector<std::vector<int>> &clusters, double thickness, std::vector<std::vector<int>> &children, bool clip_tree, bool add_offshoots);
+  /// find the points within the branch section from its end points
+  void extractNodesFromEnds(std::vector<int> &nodes);
+  /// set the branch section tip position from the supplied list of Vertex IDs
+  Eigen::Vector3d calculateTipFromVertices(const std::vector<int> &nodes) const;
+  /// estimate the vector to the cylinder centre from the set of nodes
+  Eigen::Vector3d vectorToCylinderCentre(const std::vector<int> &nodes, const Eigen::Vector3d &dir) const;
+  /// estimate the cylinder's radius
+  double estimateCylinderRadius(const std::vector<int> &nodes, const Eigen::Vector3d &dir, double &accuracy);
+  /// estimate the cylinder's taper rate from its centre, @c dir and set of nodes
+  void estimateCylinderTaper(double radius, double accuracy, bool extract_from_ends);
+  /// add a new section to continue reconstructing the branch
+  void addChildSection();
+  /// estimate the radius for the specified section
+  double radius(const BranchSection &section) const;
+  /// remove elements of nodes that are too distant to the set of end points
+  bool removeDistantPoints(std::vector<int> &nodes);
+
+  int sec_{0};
+  int next_{0};  // the first section that has not been processed in this pass
+  Step step_;  // the result of processing sec_
+  const TreesParams *params_;
+  std::vector<Vertex> &points_;
+  // the forest's taper estimate, used for the branch radii
+  double forest_taper_{0};
+  double forest_weight_{0};
+  double forest_weight_squared_{0};
+  // messages are held until the step is merged, so that the threads do not print over each other
+  mutable std::ostringstream log_;
+  mutable std::ostringstream error_log_;
+};
+}  // namespace
+
 /// The main reconstruction algorithm
 /// It is based on finding the shortest paths using Djikstra's algorithm, followed
 /// by an agglomeration of paths, with repeated splitting from root to tips
 Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params, bool verbose)
+{
+  build(cloud, offset, mesh, params, verbose);
+}
+
+Trees::Trees(CompactCloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params,
+             bool verbose)
+{
+  build(cloud, offset, mesh, params, verbose);
+}
+
+template <class CloudT>
+void Trees::build(CloudT &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params,
+                  bool verbose)
 {
   // firstly, get the full set of shortest paths from ground to tips, and the set of roots
   params_ = &params;
@@ -55,130 +202,70 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
     }
   }
 
-  // first do a special case for all the trunks. This is where we estimate mean taper
-  ray::Cloud debug_cloud;
-  for (sec_ = 0; sec_ < (int)sections_.size(); sec_++)
+  // each root section only reaches its own points, so each is reconstructed by a separate builder.
+  // order lists the (builder, local id) of each section, indexed by section id
+  std::vector<TreeBuilder> builders;
+  std::vector<std::pair<int, int>> order;
+  builders.reserve(sections_.size());
+  for (size_t i = 0; i < sections_.size(); i++)
   {
-    double best_accuracy = -1.0;
-    std::vector<int> nodes;  // all the points in the section
+    builders.emplace_back(points_, params, sections_[i], static_cast<int>(i));
+    order.emplace_back(static_cast<int>(i), 0);
+  }
 
-    // find height to tip by following the children:
-    std::vector<int> list = sections_[sec_].roots;
-    double max_height = -1e10;
-    for (size_t j = 0; j < list.size(); j++)
+  // Each pass visits the sections in id order, and the sections added while processing one are given the next ids.
+  // So the sections are processed a generation at a time, with each builder processing its sections of the
+  // generation in parallel, then the steps are merged in id order. This gives the same ids, messages and taper sums
+  // as a single loop, except that the branch radii use the forest's taper from the start of the generation
+  ray::Cloud debug_cloud;
+  auto extract_pass = [&](bool trunks) {
+    for (auto &builder : builders)
     {
-      max_height = std::max(max_height, points_[list[j]].pos[2]);
-      list.insert(list.end(), children[list[j]].begin(), children[list[j]].end());
+      builder.restart();
     }
-    Eigen::Vector3d base = getRootPosition();
-    double tree_height = std::max(0.01, max_height - base[2]);
-    sections_[sec_].tree_height = tree_height;
-
-    // Use a usr defined taper to control the height up the trunk to calculate the radius at
-    double girth_height = params_->girth_height_ratio * tree_height; // sections_[sec_].max_distance_to_end;
-    double estimated_radius = 1e10;
-    double best_dist = 0.0;
-    Eigen::Vector3d best_tip;
-    
-    std::vector<int> best_nodes;
-    std::vector<int> best_ends;
-    for (int j = 1; j<=3; j++)
+    for (size_t begin = 0, end = order.size(); begin < end; begin = end, end = order.size())
     {
-      double max_dist = girth_height * (double)j / 2.0; // range from 0.5 to 1.5 times the specified height
-      nodes.clear();
-      sections_[sec_].ends.clear();
-      extractNodesAndEndsFromRoots(nodes, base, children, max_dist * 2.0/3.0, max_dist);
-      if (nodes.size() < 2)
-      {
-        continue;
-      }
-      sections_[sec_].tip = calculateTipFromVertices(nodes);
-      if (verbose)
-      {
-        for (auto &node: nodes)
+      const double taper = forest_taper_, weight = forest_weight_, weight_squared = forest_weight_squared_;
+      parallelFor(builders.size(), [&](size_t i) {
+        if (trunks)
         {
-          debug_cloud.addRay(Eigen::Vector3d(0,0,0), points_[node].pos, 0.0, ray::RGBA(j==1 ? 255 : 0, j==2 ? 255:0, j==3 ? 255:0, 255));
+          builders[i].extractTrunks(children, verbose);
         }
-      }         
-      if (removeDistantPoints(nodes))
-      {
-        sections_[sec_].tip = calculateTipFromVertices(nodes);
-      }
-      if (verbose)
-      {
-        debug_cloud.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip + Eigen::Vector3d(0,0,0.03), 0.0, ray::RGBA(255,255,0, 255));
-      }
-      // shift to cylinder's centre
-      Eigen::Vector3d up(0,0,1);
-      sections_[sec_].tip += vectorToCylinderCentre(nodes, up);
-      // now find the segment radius
-      double accuracy;
-      double radius = estimateCylinderRadius(nodes, up, accuracy);
-
-      ray::RGBA col(j==1 ? 255 : 127, j==2 ? 255:127, j==3 ? 255:127, 255);
-      if (verbose)
-      {
-        debug_cloud.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip, 0.0, col);
-        for (double ang = 0; ang < 2.0*ray::kPi; ang += 0.1)
+        else
         {
-          debug_cloud.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip + radius * Eigen::Vector3d(std::sin(ang), std::cos(ang),0), 0.0, col);
+          builders[i].extractBranches(children, taper, weight, weight_squared);
         }
-      }
-      if (radius < estimated_radius)
+      }, 1);
+      std::vector<size_t> step_ids(builders.size(), 0);
+      for (size_t id = begin; id < end; id++)
       {
-        best_accuracy = accuracy;
-        estimated_radius = radius;
-        best_dist = max_dist;
-        best_tip = sections_[sec_].tip;
-        best_nodes = nodes;
-        best_ends = sections_[sec_].ends;
-      }
-    }
-    if (best_dist == 0.0)
-    {
-      std::cout << "warning: could not find any points on trunk " << sec_ << " at " << base.transpose() << " so removing the whole section" << std::endl;
-      sections_[sec_].tip = base + Eigen::Vector3d(0,0,0.01);
-      sections_[sec_].total_weight = 1e-10;
-      sections_[sec_].ends.clear(); // so this trunk is not ever used
-      continue; 
-    }    
-    sections_[sec_].tip = best_tip;
-    sections_[sec_].ends = best_ends;
-    nodes = best_nodes;
-    if (sections_[sec_].split_count < 2)
-    {
-      double thickness = best_dist; 
-      bool points_removed = false;
-      double gap = params_->gap_ratio * sections_[sec_].max_distance_to_end; // gap threshold for splitting
-      double span = params_->span_ratio * estimated_radius; // span threshold for splitting
-      std::vector<std::vector<int>> clusters = findPointClusters(base, points_removed, thickness, span, gap);
-
-      if (clusters.size() > 1 || (points_removed && clusters.size() > 0))  // a bifurcation (or an alteration)
-      {
-        sections_[sec_].split_count++;
-        bifurcate(clusters, thickness, children, true, true);
-        sec_--;
-        continue;
-      }
-    }
-    if (verbose)
-    {
-      for (auto &node: sections_[sec_].ends)
-      {
-        debug_cloud.addRay(Eigen::Vector3d(0,0,0), points_[node].pos + Eigen::Vector3d(0,0,0.02), 0.0, ray::RGBA(255, 0, 255, 255));
-      }
-      for (double ang = 0; ang < 2.0*ray::kPi; ang += 0.1)
-      {
-        uint8_t shade = 255; // (uint8_t)(best_accuracy * 255.0);
-        debug_cloud.addRay(Eigen::Vector3d(0,0,0), best_tip + (estimated_radius + 0.01) * Eigen::Vector3d(std::sin(ang), std::cos(ang),0), 0.0, ray::RGBA(shade,shade,shade,255));
+        const int b = order[id].first;
+        TreeBuilder &builder = builders[b];
+        const TreeBuilder::Step &step = builder.steps_[step_ids[b]++];
+        if (!trunks && builder.sections_[order[id].second].parent != -1 && !(id % 10000))
+        {
+          std::cout << "generating segment " << id << std::endl;
+        }
+        std::cout << step.log;
+        std::cerr << step.error_log;
+        forest_taper_ += step.taper;
+        forest_weight_ += step.weight;
+        forest_weight_squared_ += step.weight*step.weight;
+        for (size_t i = step.debug_begin; i < step.debug_end; i++)
+        {
+          debug_cloud.addRay(builder.debug_cloud_, i);
+        }
+        for (int i = step.new_begin; i < step.new_end; i++)
+        {
+          builder.ids_.push_back(static_cast<int>(order.size()));
+          order.emplace_back(b, i);
+        }
       }
     }
+  };
 
-    nodes.clear();
-    sections_[sec_].ends.clear();
-    extractNodesAndEndsFromRoots(nodes, base, children, 0.0, best_dist/2.0); // make it lower
-    estimateCylinderTaper(estimated_radius, best_accuracy, false); // update the expected taper
-  }
+  // first do a special case for all the trunks. This is where we estimate mean taper
+  extract_pass(true);
   if (verbose)
   {
     debug_cloud.translate(offset);
@@ -187,120 +274,298 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
 
   // now trace from root tree nodes upwards, getting node centroids
   // create new BranchSections as we go
-  for (sec_ = 0; sec_ < (int)sections_.size(); sec_++)
+  extract_pass(false);
+
+  // gather the sections in id order
+  sections_.resize(order.size());
+  for (auto &builder : builders)
   {
-    const int par = sections_[sec_].parent;
-    if (par == -1)
+    for (size_t j = 0; j < builder.sections_.size(); j++)
     {
-      // now add the single child for this particular tree node, assuming there are still ends
-      if (sections_[sec_].ends.size() > 0)
+      BranchSection &section = builder.sections_[j];
+      section.parent = section.parent == -1 ? -1 : builder.ids_[section.parent];
+      section.root = builder.ids_[section.root];
+      for (auto &child : section.children)
       {
-        addChildSection();
-        for (const auto &i: sections_[sec_].roots)
-        {
-          sections_[sec_].tip[2] = std::min(sections_[sec_].tip[2], points_[i].pos[2]);
-        }
-      }      
-      else
-      {
-        std::cout << "weird, a trunk without end points! " << sec_ << std::endl;
+        child = builder.ids_[child];
       }
-      continue;
+      sections_[builder.ids_[j]] = std::move(section);
     }
-    if (!(sec_ % 10000))
+  }
+
+  // Now calculate the section ids for all of the points, for the segmented cloud
+  std::vector<int> section_ids(points_.size(), -1);
+  calculateSectionIds(section_ids, children);
+
+  generateLocalSectionIds();
+
+  Eigen::Vector3d min_bound(0, 0, 0), max_bound(0, 0, 0);
+  // remove all sections with a root out of bounds, if we have gridded the cloud with an overlap
+  if (params_->grid_width)
+  {
+    removeOutOfBoundSections(cloud, min_bound, max_bound, offset);
+  }
+
+  std::vector<int> root_segs(cloud.rayCount(), -1);
+  // now colour the ray cloud based on the segmentation
+  segmentCloud(cloud, root_segs, section_ids);
+
+  if (params_->grid_width)  // also remove rays from the segmented cloud
+  {
+    removeOutOfBoundRays(cloud, min_bound, max_bound, root_segs);
+  }
+
+  std::cout << "cloud's estimated mean taper ratio (diameter / length): " << 2.0 * forest_taper_ / forest_weight_ << std::endl;
+}
+
+template <class Extract>
+void TreeBuilder::extractNewSections(Extract extract)
+{
+  steps_.clear();
+  const int end = static_cast<int>(sections_.size());
+  for (sec_ = next_; sec_ < end; sec_++)
+  {
+    step_ = Step();
+    step_.new_begin = static_cast<int>(sections_.size());
+    step_.debug_begin = debug_cloud_.ends.size();
+    extract();
+    step_.new_end = static_cast<int>(sections_.size());
+    step_.debug_end = debug_cloud_.ends.size();
+    step_.log = log_.str();
+    step_.error_log = error_log_.str();
+    log_.str("");
+    error_log_.str("");
+    steps_.push_back(std::move(step_));
+  }
+  next_ = end;
+}
+
+void TreeBuilder::extractTrunks(std::vector<std::vector<int>> &children, bool verbose)
+{
+  extractNewSections([&]() {
+    while (!extractTrunk(children, verbose))
     {
-      std::cout << "generating segment " << sec_ << std::endl;
     }
+  });
+}
+
+void TreeBuilder::extractBranches(std::vector<std::vector<int>> &children, double forest_taper, double forest_weight,
+                                  double forest_weight_squared)
+{
+  forest_taper_ = forest_taper;
+  forest_weight_ = forest_weight;
+  forest_weight_squared_ = forest_weight_squared;
+  extractNewSections([&]() { extractBranch(children); });
+}
 
-    // this branch can come to an end as it is now too small
-    if (sections_[sec_].max_distance_to_end < params_->crop_length)
+bool TreeBuilder::extractTrunk(std::vector<std::vector<int>> &children, bool verbose)
+{
+  double best_accuracy = -1.0;
+  std::vector<int> nodes;  // all the points in the section
+
+  // find height to tip by following the children:
+  std::vector<int> list = sections_[sec_].roots;
+  double max_height = -1e10;
+  for (size_t j = 0; j < list.size(); j++)
+  {
+    max_height = std::max(max_height, points_[list[j]].pos[2]);
+    list.insert(list.end(), children[list[j]].begin(), children[list[j]].end());
+  }
+  Eigen::Vector3d base = getRootPosition();
+  double tree_height = std::max(0.01, max_height - base[2]);
+  sections_[sec_].tree_height = tree_height;
+
+  // Use a usr defined taper to control the height up the trunk to calculate the radius at
+  double girth_height = params_->girth_height_ratio * tree_height; // sections_[sec_].max_distance_to_end;
+  double estimated_radius = 1e10;
+  double best_dist = 0.0;
+  Eigen::Vector3d best_tip;
+  
+  std::vector<int> best_nodes;
+  std::vector<int> best_ends;
+  for (int j = 1; j<=3; j++)
+  {
+    double max_dist = girth_height * (double)j / 2.0; // range from 0.5 to 1.5 times the specified height
+    nodes.clear();
+    sections_[sec_].ends.clear();
+    extractNodesAndEndsFromRoots(nodes, base, children, max_dist * 2.0/3.0, max_dist);
+    if (nodes.size() < 2)
     {
-      setBranchTip();
       continue;
     }
-
-    std::vector<int> nodes;  // all the points in the section
-    bool extract_from_ends = sections_[sec_].ends.size() > 0;
-    // if the branch section has no end points recorded, then we need to examine this branch to
-    // find end points and potentially branch (bifurcate)
-    if (!extract_from_ends)
+    sections_[sec_].tip = calculateTipFromVertices(nodes);
+    if (verbose)
     {
-      Eigen::Vector3d base = getRootPosition();
-      double span_rad = radius(sections_[sec_]); 
-      double thickness = params_->cylinder_length_to_width * span_rad;
-      extractNodesAndEndsFromRoots(nodes, base, children, 0.0, thickness);
-      
-      bool points_removed = false;
-      double gap = params_->gap_ratio * sections_[sec_].max_distance_to_end; // gap threshold for splitting
-      double span = params_->span_ratio * span_rad; // span thershold for splitting
-      std::vector<std::vector<int>> clusters = findPointClusters(base, points_removed, thickness, span, gap);
-
-      if (clusters.size() > 1 || (points_removed && clusters.size() > 0))  // a bifurcation (or an alteration)
+      for (auto &node: nodes)
       {
-        extract_from_ends = true; // don't trust the found nodes as it is now two separate tree nodes
-        bool add_offshoots = true; // par != -1 && sections_[par].parent != -1;  // when this is false it can lead to whole branches missing.
-        // if points have been removed then this only resets the current section's points
-        // otherwise it creates new branch sections_ for each cluster and adds to the end of the sections_ list
-        bifurcate(clusters, thickness, children, false, add_offshoots);
+        debug_cloud_.addRay(Eigen::Vector3d(0,0,0), points_[node].pos, 0.0, ray::RGBA(j==1 ? 255 : 0, j==2 ? 255:0, j==3 ? 255:0, 255));
       }
+    }         
+    if (removeDistantPoints(nodes))
+    {
+      sections_[sec_].tip = calculateTipFromVertices(nodes);
     }
-
-    if (extract_from_ends) // we have split the ends, so we need to extract the set of nodes in a backwards manner
+    if (verbose)
     {
-      extractNodesFromEnds(nodes);
+      debug_cloud_.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip + Eigen::Vector3d(0,0,0.03), 0.0, ray::RGBA(255,255,0, 255));
     }
-    // estimate the section's tip (the centre of the cylinder of points)
-    sections_[sec_].tip = calculateTipFromVertices(nodes);
-    // get section's direction
-    Eigen::Vector3d dir = par >= 0 ? (sections_[sec_].tip - sections_[par].tip).normalized() : Eigen::Vector3d(0, 0, 1);
     // shift to cylinder's centre
-    sections_[sec_].tip += vectorToCylinderCentre(nodes, dir);
-    // re-estimate direction
-    dir = par >= 0 ? (sections_[sec_].tip - sections_[par].tip).normalized() : Eigen::Vector3d(0, 0, 1);
+    Eigen::Vector3d up(0,0,1);
+    sections_[sec_].tip += vectorToCylinderCentre(nodes, up);
     // now find the segment radius
-    double accuracy = 0.0;
-    double rad = estimateCylinderRadius(nodes, dir, accuracy);
-    // and estimate taper
-    estimateCylinderTaper(rad / sections_[sec_].radius_scale, accuracy, extract_from_ends);
+    double accuracy;
+    double radius = estimateCylinderRadius(nodes, up, accuracy);
+
+    ray::RGBA col(j==1 ? 255 : 127, j==2 ? 255:127, j==3 ? 255:127, 255);
+    if (verbose)
+    {
+      debug_cloud_.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip, 0.0, col);
+      for (double ang = 0; ang < 2.0*ray::kPi; ang += 0.1)
+      {
+        debug_cloud_.addRay(Eigen::Vector3d(0,0,0), sections_[sec_].tip + radius * Eigen::Vector3d(std::sin(ang), std::cos(ang),0), 0.0, col);
+      }
+    }
+    if (radius < estimated_radius)
+    {
+      best_accuracy = accuracy;
+      estimated_radius = radius;
+      best_dist = max_dist;
+      best_tip = sections_[sec_].tip;
+      best_nodes = nodes;
+      best_ends = sections_[sec_].ends;
+    }
+  }
+  if (best_dist == 0.0)
+  {
+    log_ << "warning: could not find any points on trunk " << ids_[sec_] << " at " << base.transpose() << " so removing the whole section" << std::endl;
+    sections_[sec_].tip = base + Eigen::Vector3d(0,0,0.01);
+    sections_[sec_].total_weight = 1e-10;
+    sections_[sec_].ends.clear(); // so this trunk is not ever used
+    return true;
+  }    
+  sections_[sec_].tip = best_tip;
+  sections_[sec_].ends = best_ends;
+  nodes = best_nodes;
+  if (sections_[sec_].split_count < 2)
+  {
+    double thickness = best_dist; 
+    bool points_removed = false;
+    double gap = params_->gap_ratio * sections_[sec_].max_distance_to_end; // gap threshold for splitting
+    double span = params_->span_ratio * estimated_radius; // span threshold for splitting
+    std::vector<std::vector<int>> clusters = findPointClusters(base, points_removed, thickness, span, gap);
 
+    if (clusters.size() > 1 || (points_removed && clusters.size() > 0))  // a bifurcation (or an alteration)
+    {
+      sections_[sec_].split_count++;
+      bifurcate(clusters, thickness, children, true, true);
+      return false;
+    }
+  }
+  if (verbose)
+  {
+    for (auto &node: sections_[sec_].ends)
+    {
+      debug_cloud_.addRay(Eigen::Vector3d(0,0,0), points_[node].pos + Eigen::Vector3d(0,0,0.02), 0.0, ray::RGBA(255, 0, 255, 255));
+    }
+    for (double ang = 0; ang < 2.0*ray::kPi; ang += 0.1)
+    {
+      uint8_t shade = 255; // (uint8_t)(best_accuracy * 255.0);
+      debug_cloud_.addRay(Eigen::Vector3d(0,0,0), best_tip + (estimated_radius + 0.01) * Eigen::Vector3d(std::sin(ang), std::cos(ang),0), 0.0, ray::RGBA(shade,shade,shade,255));
+    }
+  }
+
+  nodes.clear();
+  sections_[sec_].ends.clear();
+  extractNodesAndEndsFromRoots(nodes, base, children, 0.0, best_dist/2.0); // make it lower
+  estimateCylinderTaper(estimated_radius, best_accuracy, false); // update the expected taper
+  return true;
+}
+
+void TreeBuilder::extractBranch(std::vector<std::vector<int>> &children)
+{
+  const int par = sections_[sec_].parent;
+  if (par == -1)
+  {
     // now add the single child for this particular tree node, assuming there are still ends
     if (sections_[sec_].ends.size() > 0)
     {
       addChildSection();
+      for (const auto &i: sections_[sec_].roots)
+      {
+        sections_[sec_].tip[2] = std::min(sections_[sec_].tip[2], points_[i].pos[2]);
+      }
+    }      
+    else
+    {
+      log_ << "weird, a trunk without end points! " << ids_[sec_] << std::endl;
     }
-  }  // end of loop. We now have created all of the BranchSections
+    return;
+  }
+  // this branch can come to an end as it is now too small
+  if (sections_[sec_].max_distance_to_end < params_->crop_length)
+  {
+    setBranchTip();
+    return;
+  }
 
-  // Now calculate the section ids for all of the points, for the segmented cloud
-  std::vector<int> section_ids(points_.size(), -1);
-  calculateSectionIds(section_ids, children);
+  std::vector<int> nodes;  // all the points in the section
+  bool extract_from_ends = sections_[sec_].ends.size() > 0;
+  // if the branch section has no end points recorded, then we need to examine this branch to
+  // find end points and potentially branch (bifurcate)
+  if (!extract_from_ends)
+  {
+    Eigen::Vector3d base = getRootPosition();
+    double span_rad = radius(sections_[sec_]); 
+    double thickness = params_->cylinder_length_to_width * span_rad;
+    extractNodesAndEndsFromRoots(nodes, base, children, 0.0, thickness);
+    
+    bool points_removed = false;
+    double gap = params_->gap_ratio * sections_[sec_].max_distance_to_end; // gap threshold for splitting
+    double span = params_->span_ratio * span_rad; // span thershold for splitting
+    std::vector<std::vector<int>> clusters = findPointClusters(base, points_removed, thickness, span, gap);
 
-  generateLocalSectionIds();
+    if (clusters.size() > 1 || (points_removed && clusters.size() > 0))  // a bifurcation (or an alteration)
+    {
+      extract_from_ends = true; // don't trust the found nodes as it is now two separate tree nodes
+      bool add_offshoots = true; // par != -1 && sections_[par].parent != -1;  // when this is false it can lead to whole branches missing.
+      // if points have been removed then this only resets the current section's points
+      // otherwise it creates new branch sections_ for each cluster and adds to the end of the sections_ list
+      bifurcate(clusters, thickness, children, false, add_offshoots);
+    }
+  }
 
-  Eigen::Vector3d min_bound(0, 0, 0), max_bound(0, 0, 0);
-  // remove all sections with a root out of bounds, if we have gridded the cloud with an overlap
-  if (params_->grid_width)
+  if (extract_from_ends) // we have split the ends, so we need to extract the set of nodes in a backwards manner
   {
-    removeOutOfBoundSections(cloud, min_bound, max_bound, offset);
+    extractNodesFromEnds(nodes);
   }
-
-  std::vector<int> root_segs(cloud.ends.size(), -1);
-  // now colour the ray cloud based on the segmentation
-  segmentCloud(cloud, root_segs, section_ids);
-
-  if (params_->grid_width)  // also remove rays from the segmented cloud
+  // estimate the section's tip (the centre of the cylinder of points)
+  sections_[sec_].tip = calculateTipFromVertices(nodes);
+  // get section's direction
+  Eigen::Vector3d dir = par >= 0 ? (sections_[sec_].tip - sections_[par].tip).normalized() : Eigen::Vector3d(0, 0, 1);
+  // shift to cylinder's centre
+  sections_[sec_].tip += vectorToCylinderCentre(nodes, dir);
+  // re-estimate direction
+  dir = par >= 0 ? (sections_[sec_].tip - sections_[par].tip).normalized() : Eigen::Vector3d(0, 0, 1);
+  // now find the segment radius
+  double accuracy = 0.0;
+  double rad = estimateCylinderRadius(nodes, dir, accuracy);
+  // and estimate taper
+  estimateCylinderTaper(rad / sections_[sec_].radius_scale, accuracy, extract_from_ends);
+
+  // now add the single child for this particular tree node, assuming there are still ends
+  if (sections_[sec_].ends.size() > 0)
   {
-    removeOutOfBoundRays(cloud, min_bound, max_bound, root_segs);
+    addChildSection();
   }
-
-  std::cout << "cloud's estimated mean taper ratio (diameter / length): " << 2.0 * forest_taper_ / forest_weight_ << std::endl;
 }
 
+
 // If 1 tree plus some low lying foliage is in the node, then it won't be split if the foliage doesn't reach to the 
 // top of the section (so doesn't have an end point), but it can create a very large radius estimate. 
 // here we remove points that are too far from any end position. 
 // this allows us to use most nodes to get an accurate radius estimate, but still uses only the end nodes to decide whether
 // to split
-bool Trees::removeDistantPoints(std::vector<int> &nodes)
+bool TreeBuilder::removeDistantPoints(std::vector<int> &nodes)
 {
   Eigen::Vector3d up(0,0,1);
   double max_rad = params_->gap_ratio * sections_[sec_].max_distance_to_end; // gap threshold for splitting
@@ -336,22 +601,8 @@ bool Trees::removeDistantPoints(std::vector<int> &nodes)
 
 double Trees::meanTaper(const BranchSection &section) const
 {
-  int root = section.root;
-  double mean_taper = params_->global_taper ? params_->global_taper : (forest_taper_ / forest_weight_);
-  double mean_weight = forest_weight_squared_ / forest_weight_;
-  double taper = sections_[root].total_taper / sections_[root].total_weight;
-  double weight = sections_[root].total_weight;
-  double blend = params_->global_taper_factor * params_->global_taper_factor * params_->global_taper_factor;
-  mean_weight *= blend;
-  weight *= 1.0 - blend;
-
-  double result = (mean_taper * mean_weight + taper*weight) / (mean_weight + weight);
-  if (!(result == result))
-  {
-    std::cout << "bad taper estimate" << std::endl;
-    std::cout << "root: " << root << " estimated taper: " << result << ", mt: " << mean_taper << ", mw: " << mean_weight << ", t: " << taper << ", w: " << weight << ", blend: " << blend << std::endl;
-  }
-  return result;
+  return blendTaper(sections_[section.root], section.root, forest_taper_, forest_weight_, forest_weight_squared_, *params_,
+                    std::cout);
 }
 
 double Trees::radius(const BranchSection &section) const 
@@ -359,6 +610,14 @@ double Trees::radius(const BranchSection &section) const
   return sections_[section.root].tree_height * meanTaper(section) * section.radius_scale; // scaled down from root's estimated radius
 }
 
+double TreeBuilder::radius(const BranchSection &section) const
+{
+  return sections_[section.root].tree_height *
+         blendTaper(sections_[section.root], ids_[section.root], forest_taper_, forest_weight_, forest_weight_squared_,
+                    *params_, log_) *
+         section.radius_scale;
+}
+
 void Trees::calculatePointDistancesToEnd()
 {
   for (size_t i = 0; i < points_.size(); i++)
@@ -406,7 +665,7 @@ void Trees::generateRootSections(const std::vector<std::vector<int>> &roots_list
   }
 }
 
-void Trees::setBranchTip()
+void TreeBuilder::setBranchTip()
 {
   // before we finish, we need to calculate the tip of this branch, from its end points
   sections_[sec_].tip.setZero();
@@ -430,7 +689,7 @@ void Trees::setBranchTip()
   }
 }
 
-Eigen::Vector3d Trees::getRootPosition() const
+Eigen::Vector3d TreeBuilder::getRootPosition() const
 {
   // get a base position for the section
   Eigen::Vector3d base(0, 0, 0);
@@ -446,7 +705,7 @@ Eigen::Vector3d Trees::getRootPosition() const
 // find the node and end points for this section, from the root points
 // note that the nodes contain everything between min_dist and max_dist and also the adjacent nodes either side
 // i.e. a root node and an end node. This means the minimum number of nodes is 2
-void Trees::extractNodesAndEndsFromRoots(std::vector<int> &nodes, const Eigen::Vector3d &base,
+void TreeBuilder::extractNodesAndEndsFromRoots(std::vector<int> &nodes, const Eigen::Vector3d &base,
                                          const std::vector<std::vector<int>> &children, double min_dist, double max_dist)
 {
   const int par = sections_[sec_].parent;
@@ -486,7 +745,7 @@ void Trees::extractNodesAndEndsFromRoots(std::vector<int> &nodes, const Eigen::V
 }
 
 // find clusters of points from the root points up the shortest paths, up to the cylinder length
-std::vector<std::vector<int>> Trees::findPointClusters(const Eigen::Vector3d &base, bool &points_removed,
+std::vector<std::vector<int>> TreeBuilder::findPointClusters(const Eigen::Vector3d &base, bool &points_removed,
                               double thickness, double span, double gap)
 {
   const int par = sections_[sec_].parent;
@@ -548,7 +807,7 @@ std::vector<std::vector<int>> Trees::findPointClusters(const Eigen::Vector3d &ba
 
 // split into multiple branches and add as new branch sections to the end of the sections_ list
 // that is being iterated through.
-void Trees::bifurcate(const std::vector<std::vector<int>> &clusters, double thickness, std::vector<std::vector<int>> &children, bool clip_tree, bool add_offshoots)
+void TreeBuilder::bifurcate(const std::vector<std::vector<int>> &clusters, double thickness, std::vector<std::vector<int>> &children, bool clip_tree, bool add_offshoots)
 {
   const int par = sections_[sec_].parent;
   // find the maximum distance (to tip) for each cluster
@@ -710,7 +969,7 @@ void Trees::bifurcate(const std::vector<std::vector<int>> &clusters, double thic
 }
 
 // find the nodes between the section end points and the section root points
-void Trees::extractNodesFromEnds(std::vector<int> &nodes)
+void TreeBuilder::extractNodesFromEnds(std::vector<int> &nodes)
 {
   nodes = sections_[sec_].ends;
   for (auto &end : sections_[sec_].ends)
@@ -718,7 +977,7 @@ void Trees::extractNodesFromEnds(std::vector<int> &nodes)
     int node = points_[end].parent;
     if (node == -1)
     {
-      std::cout << "shouldn't be parentless here" << std::endl;
+      log_ << "shouldn't be parentless here" << std::endl;
       continue;
     }
     while (node != -1)
@@ -738,12 +997,12 @@ void Trees::extractNodesFromEnds(std::vector<int> &nodes)
 }
 
 // use the list of Vertex IDs to estimate a tip location
-Eigen::Vector3d Trees::calculateTipFromVertices(const std::vector<int> &vertices) const
+Eigen::Vector3d TreeBuilder::calculateTipFromVertices(const std::vector<int> &vertices) const
 {
   Eigen::Vector3d tip(0, 0, 0);
   if (vertices.empty())
   {
-    std::cerr << "error: there shouldn't be empty nodes at this point in the processing" << std::endl;
+    error_log_ << "error: there shouldn't be empty nodes at this point in the processing" << std::endl;
   }
   for (auto &i : vertices)
   {
@@ -757,7 +1016,7 @@ Eigen::Vector3d Trees::calculateTipFromVertices(const std::vector<int> &vertices
   return tip;
 }
 
-Eigen::Vector3d Trees::vectorToCylinderCentre(const std::vector<int> &nodes, const Eigen::Vector3d &dir) const
+Eigen::Vector3d TreeBuilder::vectorToCylinderCentre(const std::vector<int> &nodes, const Eigen::Vector3d &dir) const
 {
 #define REAL_CENTROID  // finds a new centroid that is robust to branches scanned from a single side
 #if defined REAL_CENTROID
@@ -828,7 +1087,7 @@ Eigen::Vector3d Trees::vectorToCylinderCentre(const std::vector<int> &nodes, con
   return Eigen::Vector3d(0, 0, 0);
 }
 
-double Trees::estimateCylinderRadius(const std::vector<int> &nodes, const Eigen::Vector3d &dir, double &accuracy)
+double TreeBuilder::estimateCylinderRadius(const std::vector<int> &nodes, const Eigen::Vector3d &dir, double &accuracy)
 {
   double rad = 0.0;
   // get the mean radius
@@ -884,7 +1143,7 @@ double Trees::estimateCylinderRadius(const std::vector<int> &nodes, const Eigen:
   return rad;
 }
 
-void Trees::estimateCylinderTaper(double radius, double accuracy, bool extract_from_ends)
+void TreeBuilder::estimateCylinderTaper(double radius, double accuracy, bool extract_from_ends)
 {
   int par = sections_[sec_].parent;
   int root = sections_[sec_].root;
@@ -905,13 +1164,15 @@ void Trees::estimateCylinderTaper(double radius, double accuracy, bool extract_f
   forest_taper_ += taper;
   forest_weight_ += weight;
   forest_weight_squared_ += weight*weight;
+  step_.taper = taper;
+  step_.weight = weight;
 
   sections_[root].total_taper += taper;
   sections_[root].total_weight += weight;
   if (sections_[root].total_weight == 0.0)
   {
-    std::cout << "bad section weight: " << l << "," << accuracy << "," << junction_weight << std::endl;
-    std::cout << "sec: " << sec_ << ", root: " << root << std::endl;
+    log_ << "bad section weight: " << l << "," << accuracy << "," << junction_weight << std::endl;
+    log_ << "sec: " << ids_[sec_] << ", root: " << ids_[root] << std::endl;
   }
 
   sections_[sec_].taper = taper;
@@ -922,7 +1183,7 @@ void Trees::estimateCylinderTaper(double radius, double accuracy, bool extract_f
 }
 
 // add a child section to continue reconstructing the tree segments
-void Trees::addChildSection()
+void TreeBuilder::addChildSection()
 {
   BranchSection new_node;
   new_node.parent = static_cast<int>(sec_);
@@ -1046,7 +1307,8 @@ void Trees::generateLocalSectionIds()
   std::cout << num << " trees saved" << std::endl;
 }
 
-void Trees::removeOutOfBoundSections(const Cloud &cloud, Eigen::Vector3d &min_bound, Eigen::Vector3d &max_bound, const Eigen::Vector3d &offset)
+template <class CloudT>
+void Trees::removeOutOfBoundSections(const CloudT &cloud, Eigen::Vector3d &min_bound, Eigen::Vector3d &max_bound, const Eigen::Vector3d &offset)
 {
   const double width = params_->grid_width;
   cloud.calcBounds(&min_bound, &max_bound);
@@ -1074,7 +1336,8 @@ void Trees::removeOutOfBoundSections(const Cloud &cloud, Eigen::Vector3d &min_bo
 }
 
 // colour the cloud by tree id, or by branch segment id
-void Trees::segmentCloud(Cloud &cloud, std::vector<int> &root_segs, const std::vector<int> &section_ids)
+template <class CloudT>
+void Trees::segmentCloud(CloudT &cloud, std::vector<int> &root_segs, const std::vector<int> &section_ids)
 {
   contiguous_section_ids_.resize(sections_.size(), -1); // these are different to the root section IDs as they exclude empty trees
   int num_trees = 0;
@@ -1096,9 +1359,9 @@ void Trees::segmentCloud(Cloud &cloud, std::vector<int> &root_segs, const std::v
   }
 
   int j = -1;
-  for (size_t i = 0; i < cloud.ends.size(); i++)
+  for (size_t i = 0; i < cloud.rayCount(); i++)
   {
-    RGBA &colour = cloud.colours[i];
+    RGBA &colour = cloud.colour(i);
     if (cloud.rayBounded(i))
     {
       j++;
@@ -1117,7 +1380,7 @@ void Trees::segmentCloud(Cloud &cloud, std::vector<int> &root_segs, const std::v
         dir.normalize();
         const double grad = 2.0; // larger cuts out a steeper (narrower) cone
         Eigen::Vector3d base = sections_[seg].tip - grad*dir*radius(sections_[seg]);
-        Eigen::Vector3d dif = cloud.ends[i] - base;
+        Eigen::Vector3d dif = cloud.end(i) - base;
         double h = dif.dot(dir);
         double w = (dif - dir*h).norm();
         if (grad*w > h)
@@ -1151,28 +1414,22 @@ void Trees::segmentCloud(Cloud &cloud, std::vector<int> &root_segs, const std::v
 }
 
 // remove rays from the ray cloud where the end points are out of bounds
-void Trees::removeOutOfBoundRays(Cloud &cloud, const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
+template <class CloudT>
+void Trees::removeOutOfBoundRays(CloudT &cloud, const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
                                  const std::vector<int> &root_segs)
 {
-  for (int i = static_cast<int>(cloud.ends.size()) - 1; i >= 0; i--)
+  for (int i = static_cast<int>(cloud.rayCount()) - 1; i >= 0; i--)
   {
     if (!cloud.rayBounded(i))
     {
       continue;
     }
-    const Eigen::Vector3d pos = root_segs[i] == -1 ? cloud.ends[i] : sections_[root_segs[i]].tip;
+    const Eigen::Vector3d pos = root_segs[i] == -1 ? cloud.end(i) : sections_[root_segs[i]].tip;
 
     if (pos[0] < min_bound[0] || pos[0] > max_bound[0] || pos[1] < min_bound[1] ||
         pos[1] > max_bound[1])  // nope, can't do this here!
     {
-      cloud.starts[i] = cloud.starts.back();
-      cloud.starts.pop_back();
-      cloud.ends[i] = cloud.ends.back();
-      cloud.ends.pop_back();
-      cloud.colours[i] = cloud.colours.back();
-      cloud.colours.pop_back();
-      cloud.times[i] = cloud.times.back();
-      cloud.times.pop_back();
+      removeRay(cloud, i);
     }
   }
 }
@@ -7,6 +7,7 @@
 #define RAYLIB_RAYEXTRACT_TREES_H
 
 #include "../raycloud.h"
+#include "../raycompactcloud.h"
 #include "../raymesh.h"
 #include "../rayutils.h"
 #include "raylib/raylibconfig.h"
@@ -46,6 +47,8 @@ public:
   /// Constructs the piecewise cylindrical tree structures from the input ray cloud @c cloud
   /// The ground @c mesh defines the ground and @params are used to control the reconstruction
   Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params, bool verbose);
+  /// As above, for a cloud held in a CompactCloud
+  Trees(CompactCloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params, bool verbose);
 
   /// save the trees representation to a text file
   bool save(const std::string &filename, const Eigen::Vector3d &offset, bool verbose) const;
@@ -54,51 +57,31 @@ private:
   /// The piecewise cylindrical represenation of all of the trees
   std::vector<BranchSection> sections_;
 
+  /// the reconstruction, for either type of cloud
+  template <class CloudT>
+  void build(CloudT &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params, bool verbose);
   /// calculate the distance to farthest connected branch tip, for each point in the cloud
   void calculatePointDistancesToEnd();
   /// create the start branch segments at the root positions
   void generateRootSections(const std::vector<std::vector<int>> &roots_list);
-  /// finalise the attributes of an end (tip) of a branch
-  void setBranchTip();
-  /// get the root position for the current section
-  Eigen::Vector3d getRootPosition() const;
-  /// find the points and end points within this branch section
-  void extractNodesAndEndsFromRoots(std::vector<int> &nodes, const Eigen::Vector3d &base,
-                                    const std::vector<std::vector<int>> &children, double min_dist, double max_dist);
-  /// find separate clusters of points within the branch section
-  std::vector<std::vector<int>> findPointClusters(const Eigen::Vector3d &base, bool &points_removed,
-                                                  double thickness, double span, double gap);
-  /// split the branch section to one branch for each cluster
-  void bifurcate(const std::vector<std::vector<int>> &clusters, double thickness, std::vector<std::vector<int>> &children, bool clip_tree, bool add_offshoots);
-  /// find the points within the branch section from its end points
-  void extractNodesFromEnds(std::vector<int> &nodes);
-  /// set the branch section tip position from the supplied list of Vertex IDs
-  Eigen::Vector3d calculateTipFromVertices(const std::vector<int> &nodes) const;
-  /// estimate the vector to the cylinder centre from the set of nodes
-  Eigen::Vector3d vectorToCylinderCentre(const std::vector<int> &nodes, const Eigen::Vector3d &dir) const;
-  /// estimate the cylinder's radius
-  double estimateCylinderRadius(const std::vector<int> &nodes, const Eigen::Vector3d &dir, double &accuracy);
-  /// estimate the cylinder's taper rate from its centre, @c dir and set of nodes
-  void estimateCylinderTaper(double radius, double accuracy, bool extract_from_ends);
-  /// add a new section to continue reconstructing the branch
-  void addChildSection();
   /// calculate the ownership, what branch section does each point belong to
   void calculateSectionIds(std::vector<int> &section_ids, const std::vector<std::vector<int>> &children);
   /// set ids that are locel (0-based) per tree
   void generateLocalSectionIds();
   /// if using an overlapping grid, then remove trees with base outside the non-overlapping cell bounds
-  void removeOutOfBoundSections(const Cloud &cloud, Eigen::Vector3d &min_bound, Eigen::Vector3d &max_bound, const Eigen::Vector3d &offset);
+  template <class CloudT>
+  void removeOutOfBoundSections(const CloudT &cloud, Eigen::Vector3d &min_bound, Eigen::Vector3d &max_bound, const Eigen::Vector3d &offset);
   /// colour the cloud based on the section id for each point
-  void segmentCloud(Cloud &cloud, std::vector<int> &root_segs, const std::vector<int> &section_ids);
+  template <class CloudT>
+  void segmentCloud(CloudT &cloud, std::vector<int> &root_segs, const std::vector<int> &section_ids);
   /// remove points from the ray cloud if outside of the non-overlapping grid cell bounds
-  void removeOutOfBoundRays(Cloud &cloud, const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
+  template <class CloudT>
+  void removeOutOfBoundRays(CloudT &cloud, const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound,
                             const std::vector<int> &root_segs);
   /// estimate the mean taper for the specified section
   double meanTaper(const BranchSection &section) const;
   /// estimate the radius for the specified section
   double radius(const BranchSection &section) const;
-  /// remove elements of nodes that are too distant to the set of end points
-  bool removeDistantPoints(std::vector<int> &nodes);
 
   // cached data that is used throughout the processing method
   int sec_;
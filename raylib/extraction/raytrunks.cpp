@@ -676,6 +676,21 @@ void Trunks::saveDebugTrunks(const std::string &filename, bool verbose, const st
 }
 
 bool Trunks::save(const std::string &filename, const Eigen::Vector3d &offset) const
+{
+  std::vector<std::pair<Eigen::Vector3d, double>> trunks;
+  for (auto &trunk : best_trunks_)
+  {
+    if (!trunk.active)
+    {
+      continue;
+    }
+    Eigen::Vector3d base = trunk.centre - trunk.dir * trunk.length * 0.5;
+    trunks.push_back(std::pair<Eigen::Vector3d, double>(base + offset, trunk.radius));
+  }
+  return save(filename, trunks);
+}
+
+bool Trunks::save(const std::string &filename, const std::vector<std::pair<Eigen::Vector3d, double>> &trunks)
 {
   std::ofstream ofs(filename.c_str(), std::ios::out);
   if (!ofs.is_open())
@@ -685,14 +700,10 @@ bool Trunks::save(const std::string &filename, const Eigen::Vector3d &offset) co
   }
   ofs << "# tree trunks file:" << std::endl;
   ofs << "x,y,z,radius" << std::endl;
-  for (auto &trunk : best_trunks_)
+  for (auto &trunk : trunks)
   {
-    if (!trunk.active)
-    {
-      continue;
-    }
-    Eigen::Vector3d base = trunk.centre - trunk.dir * trunk.length * 0.5;
-    ofs << base[0]+offset[0] << ", " << base[1]+offset[1] << ", " << base[2]+offset[2] << ", " << trunk.radius << std::endl;
+    const Eigen::Vector3d &base = trunk.first;
+    ofs << base[0] << ", " << base[1] << ", " << base[2] << ", " << trunk.second << std::endl;
   }
   return true;
 }
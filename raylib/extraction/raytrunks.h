@@ -28,6 +28,8 @@ public:
 
   /// Save the trunks to a text file
   bool save(const std::string &filename, const Eigen::Vector3d &offset) const;
+  /// Save trunks given as base and radius, in the same format
+  static bool save(const std::string &filename, const std::vector<std::pair<Eigen::Vector3d, double>> &trunks);
 
   /// Load the trunks from a text file
   static std::vector<std::pair<Eigen::Vector3d, double>> load(const std::string &filename);
@@ -5,11 +5,13 @@
 // Author: Thomas Lowe
 #include "raycloud.h"
 
+#include "raycompactcloud.h"
 #include "raylaz.h"
+#include "rayneighbours.h"
+#include "rayparallel.h"
 #include "rayply.h"
 #include "rayprogress.h"
-
-#include <nabo/nabo.h>
+#include "raytileindex.h"
 
 #include <iostream>
 #include <limits>
@@ -60,41 +62,69 @@ bool Cloud::loadPLY(const std::string &file, int min_num_rays)
   return res;
 }
 
-Eigen::Vector3d Cloud::calcMinBound() const
+namespace
+{
+template <class CloudT>
+Eigen::Vector3d calcCloudMinBound(const CloudT &cloud)
 {
   Eigen::Vector3d min_v(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
                         std::numeric_limits<double>::max());
-  for (int i = 0; i < (int)ends.size(); i++)
+  for (int i = 0; i < (int)cloud.rayCount(); i++)
   {
-    if (rayBounded(i))
-      min_v = minVector(min_v, minVector(starts[i], ends[i]));
+    if (cloud.rayBounded(i))
+      min_v = minVector(min_v, minVector(cloud.start(i), cloud.end(i)));
   }
   return min_v;
 }
 
-Eigen::Vector3d Cloud::calcMaxBound() const
+template <class CloudT>
+Eigen::Vector3d calcCloudMaxBound(const CloudT &cloud)
 {
   Eigen::Vector3d max_v(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
                         std::numeric_limits<double>::lowest());
-  for (int i = 0; i < (int)ends.size(); i++)
+  for (int i = 0; i < (int)cloud.rayCount(); i++)
   {
-    if (rayBounded(i))
-      max_v = maxVector(max_v, maxVector(starts[i], ends[i]));
+    if (cloud.rayBounded(i))
+      max_v = maxVector(max_v, maxVector(cloud.start(i), cloud.end(i)));
   }
   return max_v;
 }
+}  // namespace
 
-bool Cloud::calcBounds(Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds, unsigned flags,
-                       Progress *progress) const
+Eigen::Vector3d Cloud::calcMinBound() const
+{
+  return calcCloudMinBound(*this);
+}
+
+Eigen::Vector3d Cloud::calcMaxBound() const
+{
+  return calcCloudMaxBound(*this);
+}
+
+Eigen::Vector3d CompactCloud::calcMinBound() const
+{
+  return calcCloudMinBound(*this);
+}
+
+Eigen::Vector3d CompactCloud::calcMaxBound() const
 {
-  if (rayCount() == 0)
+  return calcCloudMaxBound(*this);
+}
+
+namespace
+{
+template <class CloudT>
+bool calcCloudBounds(const CloudT &cloud, Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds, unsigned flags,
+                     Progress *progress)
+{
+  if (cloud.rayCount() == 0)
   {
     return false;
   }
 
   if (progress)
   {
-    progress->begin("calcBounds", rayCount());
+    progress->begin("calcBounds", cloud.rayCount());
   }
 
   *min_bounds = Eigen::Vector3d(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
@@ -102,20 +132,20 @@ bool Cloud::calcBounds(Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds,
   *max_bounds = Eigen::Vector3d(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
                                 std::numeric_limits<double>::lowest());
   bool invalid_bounds = true;
-  for (size_t i = 0; i < rayCount(); ++i)
+  for (size_t i = 0; i < cloud.rayCount(); ++i)
   {
-    if (rayBounded(i))
+    if (cloud.rayBounded(i))
     {
       invalid_bounds = false;
       if (flags & kBFEnd)
       {
-        *min_bounds = minVector(*min_bounds, ends[i]);
-        *max_bounds = maxVector(*max_bounds, ends[i]);
+        *min_bounds = minVector(*min_bounds, cloud.end(i));
+        *max_bounds = maxVector(*max_bounds, cloud.end(i));
       }
       if (flags & kBFStart)
       {
-        *min_bounds = minVector(*min_bounds, starts[i]);
-        *max_bounds = maxVector(*max_bounds, starts[i]);
+        *min_bounds = minVector(*min_bounds, cloud.start(i));
+        *max_bounds = maxVector(*max_bounds, cloud.start(i));
       }
     }
 
@@ -128,64 +158,20 @@ bool Cloud::calcBounds(Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds,
   return !invalid_bounds;
 }
 
-void Cloud::transform(const Pose &pose, double time_delta)
-{
-  for (int i = 0; i < (int)starts.size(); i++)
-  {
-    starts[i] = pose * starts[i];
-    ends[i] = pose * ends[i];
-    times[i] += time_delta;
-  }
-}
-
-void Cloud::removeUnboundedRays()
-{
-  std::vector<int> valids;
-  for (int i = 0; i < (int)ends.size(); i++)
-    if (rayBounded(i))
-      valids.push_back(i);
-  for (int i = 0; i < (int)valids.size(); i++)
-  {
-    starts[i] = starts[valids[i]];
-    ends[i] = ends[valids[i]];
-    times[i] = times[valids[i]];
-    colours[i] = colours[valids[i]];
-  }
-  starts.resize(valids.size());
-  ends.resize(valids.size());
-  times.resize(valids.size());
-  colours.resize(valids.size());
-}
-
-void Cloud::decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set)
-{
-  std::vector<int64_t> subsample;
-  voxelSubsample(ends, voxel_width, subsample, voxel_set);
-  for (int64_t i = 0; i < (int64_t)subsample.size(); i++)
-  {
-    const int64_t id = subsample[i];
-    starts[i] = starts[id];
-    ends[i] = ends[id];
-    colours[i] = colours[id];
-    times[i] = times[id];
-  }
-  starts.resize(subsample.size());
-  ends.resize(subsample.size());
-  colours.resize(subsample.size());
-  times.resize(subsample.size());
-}
-
-void Cloud::eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &indices, int index, int num_neighbours,
-                       Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> &solver, Eigen::Vector3d &centroid) const
+// Convert the set of neighbouring indices into a eigen solution, which is an ellipsoid of best fit.
+template <class CloudT>
+inline void eigenSolve(const CloudT &cloud, const std::vector<int> &ray_ids, const Eigen::MatrixXi &indices, int index,
+                       int num_neighbours, Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> &solver,
+                       Eigen::Vector3d &centroid)
 {
   int ray_id = ray_ids[index];
-  centroid = ends[ray_id];
-  for (int j = 0; j < num_neighbours; j++) centroid += ends[ray_ids[indices(j, index)]];
+  centroid = cloud.end(ray_id);
+  for (int j = 0; j < num_neighbours; j++) centroid += cloud.end(ray_ids[indices(j, index)]);
   centroid /= (double)(num_neighbours + 1);
-  Eigen::Matrix3d scatter = (ends[ray_id] - centroid) * (ends[ray_id] - centroid).transpose();
+  Eigen::Matrix3d scatter = (cloud.end(ray_id) - centroid) * (cloud.end(ray_id) - centroid).transpose();
   for (int j = 0; j < num_neighbours; j++)
   {
-    Eigen::Vector3d offset = ends[ray_ids[indices(j, index)]] - centroid;
+    Eigen::Vector3d offset = cloud.end(ray_ids[indices(j, index)]) - centroid;
     scatter += offset * offset.transpose();
   }
   scatter /= (double)(num_neighbours + 1);
@@ -193,43 +179,37 @@ void Cloud::eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &i
   ASSERT(solver.info() == Eigen::ComputationInfo::Success);
 }
 
-void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
-                       std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
-                       Eigen::MatrixXi *neighbour_indices, double max_distance, bool reject_back_facing_rays) const
+template <class CloudT>
+void getCloudSurfels(const CloudT &cloud, int search_size, std::vector<Eigen::Vector3d> *centroids,
+                     std::vector<Eigen::Vector3d> *normals, std::vector<Eigen::Vector3d> *dimensions,
+                     std::vector<Eigen::Matrix3d> *mats, Eigen::MatrixXi *neighbour_indices, double max_distance,
+                     bool reject_back_facing_rays)
 {
   // simplest scheme... find 3 nearest neighbours and do cross product
   if (centroids)
-    centroids->resize(ends.size());
+    centroids->resize(cloud.rayCount());
   if (normals)
-    normals->resize(ends.size());
+    normals->resize(cloud.rayCount());
   if (dimensions)
-    dimensions->resize(ends.size());
+    dimensions->resize(cloud.rayCount());
   if (mats)
-    mats->resize(ends.size());
-  Nabo::NNSearchD *nns;
+    mats->resize(cloud.rayCount());
   std::vector<int> ray_ids;
-  ray_ids.reserve(ends.size());
-  for (unsigned int i = 0; i < ends.size(); i++)
-    if (rayBounded(i))
+  ray_ids.reserve(cloud.rayCount());
+  for (unsigned int i = 0; i < cloud.rayCount(); i++)
+    if (cloud.rayBounded(i))
       ray_ids.push_back(i);
   Eigen::MatrixXd points_p(3, ray_ids.size());
-  for (unsigned int i = 0; i < ray_ids.size(); i++) points_p.col(i) = ends[ray_ids[i]];
-  nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+  for (unsigned int i = 0; i < ray_ids.size(); i++) points_p.col(i) = cloud.end(ray_ids[i]);
 
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, ray_ids.size());
-  dists2.resize(search_size, ray_ids.size());
-  if (max_distance != 0.0)
-    nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, max_distance);
-  else
-    nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  delete nns;
+  findNeighbours(points_p, search_size, indices, dists2, max_distance, cloud.neighbour_cache_dir);
 
   if (neighbour_indices)
   {
-    neighbour_indices->resize(search_size, ends.size());
+    neighbour_indices->resize(search_size, cloud.rayCount());
     for (int i = 0; i<neighbour_indices->rows(); i++)
     {
       for (int j = 0; j < neighbour_indices->cols(); j++)
@@ -240,7 +220,7 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
     for (int i = 0; i < (int)ray_ids.size(); i++)
     {
       int ray_id = ray_ids[i];
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) 
+      for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; j++) 
       {
         (*neighbour_indices)(j, ray_id) = ray_ids[indices(j, i)];
       }
@@ -248,25 +228,26 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
   }
   if (centroids || normals || dimensions || mats)
   {
-    for (int i = 0; i < (int)ray_ids.size(); i++)
+    // each point only writes its own outputs and its own column of indices, so they are found in parallel
+    const auto surfel = [&](int i)
     {
       int ray_id = ray_ids[i];
       Eigen::Vector3d centroid;
       int num_neighbours;
-      for (num_neighbours = 0; num_neighbours < search_size && indices(num_neighbours, i) != Nabo::NNSearchD::InvalidIndex; num_neighbours++){}
+      for (num_neighbours = 0; num_neighbours < search_size && indices(num_neighbours, i) != Neighbours::kInvalidIndex; num_neighbours++){}
 
       Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(3);
-      eigenSolve(ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
+      eigenSolve(cloud, ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
       if (reject_back_facing_rays)
       {
         Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
-        if ((ends[ray_id] - starts[ray_id]).dot(normal) > 0.0)
+        if ((cloud.end(ray_id) - cloud.start(ray_id)).dot(normal) > 0.0)
           normal = -normal;
         bool changed = false;
         for (int j = num_neighbours - 1; j >= 0; j--)
         {
           int id = ray_ids[indices(j, i)];
-          if ((ends[id] - starts[id]).dot(normal) > 0.0)
+          if ((cloud.end(id) - cloud.start(id)).dot(normal) > 0.0)
           {
             indices(j, i) = indices(--num_neighbours, i);
             changed = true;
@@ -274,7 +255,7 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
         }
         if (changed)
         {
-          eigenSolve(ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
+          eigenSolve(cloud, ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
         }
       }   
       if (centroids)
@@ -282,7 +263,7 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
       if (normals)
       {
         Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
-        if ((ends[ray_id] - starts[ray_id]).dot(normal) > 0.0)
+        if ((cloud.end(ray_id) - cloud.start(ray_id)).dot(normal) > 0.0)
           normal = -normal;
         (*normals)[ray_id] = normal;
       }
@@ -294,8 +275,124 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
       }
       if (mats)
         (*mats)[ray_id] = eigen_solver.eigenvectors();
+    };
+    parallelFor(ray_ids.size(), [&](size_t i) { surfel(static_cast<int>(i)); }, 1024);
+  }
+}
+
+template <class CloudT>
+double estimateCloudPointSpacing(const CloudT &cloud)
+{
+  // two-iteration estimation, modelling the point distribution by the below exponent.
+  // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
+  const double cloud_exponent = 2.0;  // model num_points = (cloud_width/voxel_width)^cloud_exponent
+
+  Eigen::Vector3d min_bound, max_bound;
+  cloud.calcBounds(&min_bound, &max_bound, kBFEnd);
+  Eigen::Vector3d extent = max_bound - min_bound;
+  int num_points = 0;
+  for (unsigned int i = 0; i < cloud.rayCount(); i++)
+    if (cloud.rayBounded(i))
+      num_points++;
+  double cloud_width = pow(extent[0] * extent[1] * extent[2], 1.0 / 3.0);  // an average
+  double voxel_width = cloud_width / pow((double)num_points, 1.0 / cloud_exponent);
+  voxel_width *=
+    5.0;  // we want to use a larger width because this process only works when the width is an overestimation
+  std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
+  double num_voxels = 0;
+  VoxelSet test_set;
+  for (unsigned int i = 0; i < cloud.rayCount(); i++)
+  {
+    if (cloud.rayBounded(i))
+    {
+      if (test_set.insert(voxelOf(cloud.end(i), voxel_width)))
+      {
+        num_voxels++;
+      }
     }
   }
+  double points_per_voxel = (double)num_points / num_voxels;
+  double width = voxel_width / pow(points_per_voxel, 1.0 / cloud_exponent);
+  std::cout << "estimated point spacing: " << width << std::endl;
+  return width;
+}
+
+}  // namespace
+
+bool Cloud::calcBounds(Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds, unsigned flags,
+                       Progress *progress) const
+{
+  return calcCloudBounds(*this, min_bounds, max_bounds, flags, progress);
+}
+
+bool CompactCloud::calcBounds(Eigen::Vector3d *min_bounds, Eigen::Vector3d *max_bounds, unsigned flags,
+                              Progress *progress) const
+{
+  return calcCloudBounds(*this, min_bounds, max_bounds, flags, progress);
+}
+
+void Cloud::transform(const Pose &pose, double time_delta)
+{
+  for (int i = 0; i < (int)starts.size(); i++)
+  {
+    starts[i] = pose * starts[i];
+    ends[i] = pose * ends[i];
+    times[i] += time_delta;
+  }
+}
+
+void Cloud::removeUnboundedRays()
+{
+  std::vector<int> valids;
+  for (int i = 0; i < (int)ends.size(); i++)
+    if (rayBounded(i))
+      valids.push_back(i);
+  for (int i = 0; i < (int)valids.size(); i++)
+  {
+    starts[i] = starts[valids[i]];
+    ends[i] = ends[valids[i]];
+    times[i] = times[valids[i]];
+    colours[i] = colours[valids[i]];
+  }
+  starts.resize(valids.size());
+  ends.resize(valids.size());
+  times.resize(valids.size());
+  colours.resize(valids.size());
+}
+
+void Cloud::decimate(double voxel_width, VoxelSet &voxel_set)
+{
+  std::vector<int64_t> subsample;
+  voxelSubsample(ends, voxel_width, subsample, voxel_set);
+  for (int64_t i = 0; i < (int64_t)subsample.size(); i++)
+  {
+    const int64_t id = subsample[i];
+    starts[i] = starts[id];
+    ends[i] = ends[id];
+    colours[i] = colours[id];
+    times[i] = times[id];
+  }
+  starts.resize(subsample.size());
+  ends.resize(subsample.size());
+  colours.resize(subsample.size());
+  times.resize(subsample.size());
+}
+
+void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
+                       std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
+                       Eigen::MatrixXi *neighbour_indices, double max_distance, bool reject_back_facing_rays) const
+{
+  getCloudSurfels(*this, search_size, centroids, normals, dimensions, mats, neighbour_indices, max_distance,
+                  reject_back_facing_rays);
+}
+
+void CompactCloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
+                              std::vector<Eigen::Vector3d> *normals, std::vector<Eigen::Vector3d> *dimensions,
+                              std::vector<Eigen::Matrix3d> *mats, Eigen::MatrixXi *neighbour_indices,
+                              double max_distance, bool reject_back_facing_rays) const
+{
+  getCloudSurfels(*this, search_size, centroids, normals, dimensions, mats, neighbour_indices, max_distance,
+                  reject_back_facing_rays);
 }
 
 // starts are required to get the normal the right way around
@@ -308,51 +405,39 @@ std::vector<Eigen::Vector3d> Cloud::generateNormals(int search_size)
 
 bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
 {
-  double min_s = std::numeric_limits<double>::max();
-  double max_s = std::numeric_limits<double>::lowest();
-  Eigen::Vector3d min_v(min_s, min_s, min_s);
-  Eigen::Vector3d max_v(max_s, max_s, max_s);
-  Cuboid unbounded(min_v, max_v);
-  info.ends_bound = info.starts_bound = info.rays_bound = unbounded;
-  info.num_rays = info.num_bounded = 0;
-  info.min_time = min_s;
-  info.max_time = max_s;
-  info.centroid.setZero();
-  info.start_pos.setZero();
-  info.end_pos.setZero();
-  auto find_bounds = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                         std::vector<double> &times, std::vector<ray::RGBA> &colours) {
-    for (size_t i = 0; i < ends.size(); i++)
-    {
-      if (colours[i].alpha > 0)
-      {
-        info.ends_bound.min_bound_ = minVector(info.ends_bound.min_bound_, ends[i]);
-        info.ends_bound.max_bound_ = maxVector(info.ends_bound.max_bound_, ends[i]);
-        info.num_bounded++;
-        info.centroid += ends[i];
-      }
-      info.num_rays++;
-      info.starts_bound.min_bound_ = minVector(info.starts_bound.min_bound_, starts[i]);
-      info.starts_bound.max_bound_ = maxVector(info.starts_bound.max_bound_, starts[i]);
-      info.rays_bound.min_bound_ = minVector(info.rays_bound.min_bound_, ends[i]);
-      info.rays_bound.max_bound_ = maxVector(info.rays_bound.max_bound_, ends[i]);
-      if (times[i] < info.min_time)
-      {
-        info.start_pos = starts[i];
-      }
-      info.min_time = std::min(info.min_time, times[i]);
-      if (times[i] > info.max_time)
+  // use the statistics stored when the file was written, if it has them
+  RayCloudStats stats;
+  if (!readRayCloudStats(file_name, stats))
+  {
+    stats.clear();  // otherwise accumulate them from the rays
+    auto find_bounds = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                           std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); i++)
       {
-        info.end_pos = starts[i];
+        stats.add(starts[i], ends[i], times[i], colours[i]);
       }
-      info.max_time = std::max(info.max_time, times[i]);
+    };
+    if (!readPly(file_name, true, find_bounds, 0))
+    {
+      return false;
     }
-    info.rays_bound.min_bound_ = minVector(info.rays_bound.min_bound_, info.starts_bound.min_bound_);
-    info.rays_bound.max_bound_ = maxVector(info.rays_bound.max_bound_, info.starts_bound.max_bound_);
-  };
-  bool success = readPly(file_name, true, find_bounds, 0);
-  info.centroid /= static_cast<double>(info.num_bounded);
-  return success;
+  }
+  getInfo(stats, info);
+  return true;
+}
+
+void RAYLIB_EXPORT Cloud::getInfo(const RayCloudStats &stats, Info &info)
+{
+  info.ends_bound = Cuboid(stats.ends_min, stats.ends_max);
+  info.starts_bound = Cuboid(stats.starts_min, stats.starts_max);
+  info.rays_bound = Cuboid(stats.rays_min, stats.rays_max);
+  info.num_rays = static_cast<int>(stats.num_rays);
+  info.num_bounded = static_cast<int>(stats.num_bounded);
+  info.min_time = stats.min_time;
+  info.max_time = stats.max_time;
+  info.centroid = stats.ends_sum / static_cast<double>(stats.num_bounded);
+  info.start_pos = stats.start_pos;
+  info.end_pos = stats.end_pos;
 }
 
 
@@ -369,7 +454,7 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
     5.0;  // we want to use a larger width because this process only works when the width is an overestimation
   std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
   double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
+  VoxelSet test_set;
 
   auto estimate_size = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
                            std::vector<ray::RGBA> &colours) {
@@ -378,10 +463,7 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
       if (colours[i].alpha == 0)
         continue;
 
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.insert(place).second)
+      if (test_set.insert(voxelOf(ends[i], voxel_width)))
       {
         num_voxels++;
       }
@@ -398,41 +480,12 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
 
 double Cloud::estimatePointSpacing() const
 {
-  // two-iteration estimation, modelling the point distribution by the below exponent.
-  // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
-  const double cloud_exponent = 2.0;  // model num_points = (cloud_width/voxel_width)^cloud_exponent
+  return estimateCloudPointSpacing(*this);
+}
 
-  Eigen::Vector3d min_bound, max_bound;
-  calcBounds(&min_bound, &max_bound, kBFEnd);
-  Eigen::Vector3d extent = max_bound - min_bound;
-  int num_points = 0;
-  for (unsigned int i = 0; i < ends.size(); i++)
-    if (rayBounded(i))
-      num_points++;
-  double cloud_width = pow(extent[0] * extent[1] * extent[2], 1.0 / 3.0);  // an average
-  double voxel_width = cloud_width / pow((double)num_points, 1.0 / cloud_exponent);
-  voxel_width *=
-    5.0;  // we want to use a larger width because this process only works when the width is an overestimation
-  std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
-  double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
-  for (unsigned int i = 0; i < ends.size(); i++)
-  {
-    if (rayBounded(i))
-    {
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.insert(place).second)
-      {
-        num_voxels++;
-      }
-    }
-  }
-  double points_per_voxel = (double)num_points / num_voxels;
-  double width = voxel_width / pow(points_per_voxel, 1.0 / cloud_exponent);
-  std::cout << "estimated point spacing: " << width << std::endl;
-  return width;
+double CompactCloud::estimatePointSpacing() const
+{
+  return estimateCloudPointSpacing(*this);
 }
 
 void Cloud::split(Cloud &cloud1, Cloud &cloud2, std::function<bool(int i)> fptr)
@@ -525,9 +578,46 @@ Eigen::Array<double, 22, 1> Cloud::getMoments() const
 bool Cloud::read(const std::string &file_name,
                  std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                     std::vector<double> &times, std::vector<RGBA> &colours)>
-                   apply)
+                   apply,
+                 size_t prefetch_chunks)
 {
-  return readPly(file_name, true, apply, 0);
+  return readPly(file_name, true, apply, 0, false, 1000000, prefetch_chunks);
+}
+
+bool Cloud::read(const std::string &file_name, const Cuboid &bounds,
+                 std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                    std::vector<double> &times, std::vector<RGBA> &colours)>
+                   apply,
+                 size_t prefetch_chunks)
+{
+  TileIndex index;
+  if (!index.load(file_name))
+  {
+    return read(file_name, apply, prefetch_chunks);
+  }
+  const std::vector<std::pair<size_t, size_t>> ranges = index.rowRanges(bounds);
+  size_t num_rows = 0;
+  for (auto &range : ranges) num_rows += range.second;
+  std::cout << "tile index: reading " << num_rows << " of " << index.stats.num_rows << " rays" << std::endl;
+  return readRayCloudRows(file_name, ranges, apply, 1000000, prefetch_chunks);
+}
+
+bool Cloud::read(const std::string &file_name, double min_time, double max_time,
+                 std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                    std::vector<double> &times, std::vector<RGBA> &colours)>
+                   apply,
+                 size_t prefetch_chunks)
+{
+  TimeIndex index;
+  if (!index.load(file_name))
+  {
+    return read(file_name, apply, prefetch_chunks);
+  }
+  const std::vector<std::pair<size_t, size_t>> ranges = index.rowRanges(min_time, max_time);
+  size_t num_rows = 0;
+  for (auto &range : ranges) num_rows += range.second;
+  std::cout << "time index: reading " << num_rows << " of " << index.num_rows << " rays" << std::endl;
+  return readRayCloudRows(file_name, ranges, apply, 1000000, prefetch_chunks);
 }
 
 }  // namespace ray
@@ -13,6 +13,7 @@
 #include "raygrid.h"
 #include "raypose.h"
 #include "rayutils.h"
+#include "rayvoxelset.h"
 
 namespace ray
 {
@@ -38,6 +39,9 @@ public:
   std::vector<Eigen::Vector3d> ends;
   std::vector<double> times;
   std::vector<RGBA> colours;
+  /// an existing directory in which the neighbour searches on this cloud are saved for reuse, as @c findNeighbours.
+  /// Empty, the default, disables the cache
+  std::string neighbour_cache_dir;
 
   void clear();
   /// reserve the cloud's vectors
@@ -54,6 +58,13 @@ public:
   /// the number of rays
   inline size_t rayCount() const { return ends.size(); }
 
+  /// per-ray access, as in CompactCloud, for the algorithms that operate on either type of cloud
+  inline const Eigen::Vector3d &start(size_t i) const { return starts[i]; }
+  inline const Eigen::Vector3d &end(size_t i) const { return ends[i]; }
+  inline double time(size_t i) const { return times[i]; }
+  inline const RGBA &colour(size_t i) const { return colours[i]; }
+  inline RGBA &colour(size_t i) { return colours[i]; }
+
   void save(const std::string &file_name) const;
   /// load a ray cloud file. @c check_extension checks the file extension before proceeding
   bool load(const std::string &file_name, bool check_extension = true, int min_num_rays = 4);
@@ -92,7 +103,7 @@ public:
   /// apply a Euclidean transform and time shift to the ray cloud
   void transform(const Pose &pose, double time_delta);
   /// spatial decimation of the ray cloud, into one end point per voxel of width @c voxel_width
-  void decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set);
+  void decimate(double voxel_width, VoxelSet &voxel_set);
   /// add a new ray to the ray cloud
   void addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
   /// add a new ray to the ray cloud, from another cloud
@@ -160,19 +171,38 @@ public:
     Eigen::Vector3d start_pos, end_pos;
   };
   static bool RAYLIB_EXPORT getInfo(const std::string &file_name, Info &info);
+  /// Fill @c info from the statistics of a ray cloud's rays
+  static void RAYLIB_EXPORT getInfo(const struct RayCloudStats &stats, Info &info);
 
   /// Reads a ray cloud from file, and calls the function for each ray
   /// This forwards the call to a function appropriate to the ray cloud file format
+  /// @c prefetch_chunks > 0 decodes that many chunks ahead on a background thread, overlapping reading with @c apply
   static bool read(const std::string &file_name,
                    std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                       std::vector<double> &times, std::vector<RGBA> &colours)>
-                     apply);
+                     apply,
+                   size_t prefetch_chunks = 0);
+
+  /// Reads the rays of a ray cloud file that may overlap @c bounds. If the file has a tile index (see indexCloud) then
+  /// only its tiles that overlap @c bounds are read, otherwise the whole file is. So @c apply is given a superset of
+  /// the overlapping rays, and must still check each ray against @c bounds
+  static bool read(const std::string &file_name, const Cuboid &bounds,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply,
+                   size_t prefetch_chunks = 0);
+
+  /// Reads the rays of a ray cloud file that may have times from @c min_time to @c max_time. If the file has a time
+  /// index (see TimeIndex) then only the blocks of rows in this interval are read, otherwise the whole file is. So
+  /// @c apply must still check each ray's time
+  static bool read(const std::string &file_name, double min_time, double max_time,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply,
+                   size_t prefetch_chunks = 0);
 
 private:
   bool loadPLY(const std::string &file, int min_num_rays);
-  // Convert the set of neighbouring indices into a eigen solution, which is an ellipsoid of best fit.
-  inline void eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &indices, int index, int num_neighbours,
-                         Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> &solver, Eigen::Vector3d &centroid) const;
 };
 
 }  // namespace ray
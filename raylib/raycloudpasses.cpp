@@ -0,0 +1,116 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycloudpasses.h"
+#include "raylib/rayply.h"
+#include "raylib/rayparallel.h"
+
+#include <memory>
+
+namespace ray
+{
+int CloudPasses::add(const Apply &apply, const std::vector<int> &dependencies, const std::function<void()> &start,
+                     const std::function<void()> &finish)
+{
+  const int id = static_cast<int>(consumers_.size());
+  for (auto &dependency : dependencies)
+  {
+    if (dependency < 0 || dependency >= id)
+    {
+      std::cerr << "Error: cloud pass " << id << " depends on unknown pass " << dependency << std::endl;
+      return -1;
+    }
+  }
+  Consumer consumer;
+  consumer.apply = apply;
+  consumer.dependencies = dependencies;
+  consumer.start = start;
+  consumer.finish = finish;
+  consumers_.push_back(consumer);
+  return id;
+}
+
+int CloudPasses::addInfo(Cloud::Info &info)
+{
+  // used when the file does not store its statistics
+  auto stats = std::make_shared<RayCloudStats>();
+  auto accumulate = [stats](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                            std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      stats->add(starts[i], ends[i], times[i], colours[i]);
+    }
+  };
+  const int id = add(
+    accumulate, {}, [stats]() { stats->clear(); }, [stats, &info]() { Cloud::getInfo(*stats, info); });
+  consumers_[id].info = &info;
+  return id;
+}
+
+bool CloudPasses::run(const std::string &file_name, bool parallel)
+{
+  // the read that each consumer is run in, -1 if it needs no read
+  std::vector<int> reads(consumers_.size(), 0);
+  num_reads_ = 0;
+  for (size_t i = 0; i < consumers_.size(); i++)
+  {
+    RayCloudStats stats;
+    if (consumers_[i].info && readRayCloudStats(file_name, stats))
+    {
+      Cloud::getInfo(stats, *consumers_[i].info);
+      reads[i] = -1;
+      continue;
+    }
+    for (auto &dependency : consumers_[i].dependencies)
+    {
+      reads[i] = std::max(reads[i], reads[dependency] + 1);
+    }
+    num_reads_ = std::max(num_reads_, reads[i] + 1);
+  }
+
+  for (int read = 0; read < num_reads_; read++)
+  {
+    std::vector<Consumer *> consumers;
+    for (size_t i = 0; i < consumers_.size(); i++)
+    {
+      if (reads[i] == read)
+      {
+        consumers.push_back(&consumers_[i]);
+      }
+    }
+    for (auto &consumer : consumers)
+    {
+      if (consumer->start)
+      {
+        consumer->start();
+      }
+    }
+    auto apply = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                     std::vector<double> &times, std::vector<RGBA> &colours) {
+      if (parallel && consumers.size() > 1)
+      {
+        parallelFor(consumers.size(), [&](size_t i) { consumers[i]->apply(starts, ends, times, colours); }, 1);
+        return;
+      }
+      for (auto &consumer : consumers)
+      {
+        consumer->apply(starts, ends, times, colours);
+      }
+    };
+    if (!Cloud::read(file_name, apply, 1))
+    {
+      return false;
+    }
+    for (auto &consumer : consumers)
+    {
+      if (consumer->finish)
+      {
+        consumer->finish();
+      }
+    }
+  }
+  return true;
+}
+}  // namespace ray
@@ -0,0 +1,56 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYCLOUDPASSES_H
+#define RAYLIB_RAYCLOUDPASSES_H
+
+#include "raylib/raylibconfig.h"
+#include "raycloud.h"
+
+#include <functional>
+
+namespace ray
+{
+/// Runs several consumers over the chunks of a ray cloud file, reading the file as few times as possible.
+/// Consumers that do not depend on each other share a read of the file. A consumer that needs the results of other
+/// consumers is run in a read after theirs, so the number of reads is the length of the longest chain of dependencies.
+class RAYLIB_EXPORT CloudPasses
+{
+public:
+  using Apply = std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                   std::vector<double> &times, std::vector<RGBA> &colours)>;
+
+  /// add a consumer @c apply, which is called on every chunk of the cloud in file order. It is run after the consumers
+  /// in @c dependencies have seen the whole cloud and finished. @c start is called before its first chunk, and
+  /// @c finish after its last. The start functions of a read are called in the order that their consumers were
+  /// added, as are the finish functions. Returns the consumer's id, for use in later dependencies.
+  int add(const Apply &apply, const std::vector<int> &dependencies = {}, const std::function<void()> &start = nullptr,
+          const std::function<void()> &finish = nullptr);
+
+  /// add a consumer that fills @c info, as Cloud::getInfo does. It needs no read when the file stores its statistics
+  int addInfo(Cloud::Info &info);
+
+  /// run the consumers over the cloud file @c file_name. If @c parallel then the consumers that share a read are
+  /// called on each chunk at the same time, so they must not modify the chunk. Returns false if a read fails.
+  bool run(const std::string &file_name, bool parallel = false);
+
+  /// the number of times that the last call to run read the file
+  int numReads() const { return num_reads_; }
+
+private:
+  struct Consumer
+  {
+    Apply apply;
+    std::vector<int> dependencies;
+    std::function<void()> start;
+    std::function<void()> finish;
+    Cloud::Info *info = nullptr;  // for consumers added by addInfo
+  };
+  std::vector<Consumer> consumers_;
+  int num_reads_ = 0;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYCLOUDPASSES_H
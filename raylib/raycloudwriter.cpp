@@ -6,6 +6,9 @@
 #include "raycloudwriter.h"
 #include "raycloud.h"
 
+#include <algorithm>
+#include <functional>
+
 namespace ray
 {
 bool CloudWriter::begin(const std::string &file_name)
@@ -16,6 +19,8 @@ bool CloudWriter::begin(const std::string &file_name)
     return false;
   }
   has_warned_ = false;
+  stats_.clear();
+  time_index_.clear();
   file_name_ = file_name;
   if (!writeRayCloudChunkStart(file_name_, ofs_))
   {
@@ -24,20 +29,171 @@ bool CloudWriter::begin(const std::string &file_name)
   return true;
 }
 
-void CloudWriter::end()
+bool CloudWriter::end()
 {
   if (file_name_.empty())  // no effect if begin has not been called
   {
-    return;
+    return true;
+  }
+  if (suspended_ && !resume())
+  {
+    return false;
   }
-  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs_);
+  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs_, &stats_);
   std::cout << num_rays << " rays saved to " << file_name_ << std::endl;
   ofs_.close();
+  if (!time_index_.end(file_name_))
+  {
+    std::cerr << "Error: could not write the time index " << TimeIndex::fileName(file_name_) << std::endl;
+    return false;
+  }
+  return true;
 }
 
 bool CloudWriter::writeChunk(const Cloud &chunk)
 {
-  return writeRayCloudChunk(ofs_, buffer_, chunk.starts, chunk.ends, chunk.times, chunk.colours, has_warned_);
+  if (suspended_ && !resume())
+  {
+    return false;
+  }
+  time_index_.add(chunk.times);
+  return writeRayCloudChunk(ofs_, buffer_, chunk.starts, chunk.ends, chunk.times, chunk.colours, has_warned_, &stats_);
+}
+
+void CloudWriter::suspend()
+{
+  if (file_name_.empty() || suspended_)
+  {
+    return;
+  }
+  ofs_.close();
+  RayPlyBuffer().swap(buffer_);  // a suspended file holds no write buffer
+  suspended_ = true;
+}
+
+bool CloudWriter::resume()
+{
+  ofs_.open(file_name_, std::ios::binary | std::ios::in | std::ios::out);
+  if (ofs_.fail())
+  {
+    std::cerr << "Error: cannot reopen " << file_name_ << " for writing." << std::endl;
+    return false;
+  }
+  ofs_.seekp(0, std::ios::end);
+  suspended_ = false;
+  return true;
+}
+
+MultiCloudWriter::MultiCloudWriter(size_t max_open_files, size_t max_file_rays, size_t max_buffered_rays)
+  : max_open_files_(std::max<size_t>(max_open_files, 1))
+  , max_file_rays_(max_file_rays)
+  , max_buffered_rays_(max_buffered_rays)
+{}
+
+void MultiCloudWriter::begin(int id, const std::string &file_name)
+{
+  files_[id].name = file_name;
+}
+
+void MultiCloudWriter::addRay(int id, const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time,
+                              const RGBA &colour)
+{
+  files_[id].buffer.addRay(start, end, time, colour);
+  num_buffered_rays_++;
+}
+
+bool MultiCloudWriter::write(int id, File &file)
+{
+  if (file.buffer.ends.empty())
+  {
+    return true;
+  }
+  if (file.open)
+  {
+    open_files_.splice(open_files_.begin(), open_files_, file.lru);
+  }
+  else
+  {
+    if (open_files_.size() >= max_open_files_)
+    {
+      File &oldest = files_[open_files_.back()];
+      oldest.writer.suspend();
+      oldest.open = false;
+      open_files_.pop_back();
+    }
+    if (!file.started)
+    {
+      if (!file.writer.begin(file.name))
+      {
+        return false;
+      }
+      file.started = true;
+    }
+    open_files_.push_front(id);
+    file.lru = open_files_.begin();
+    file.open = true;
+  }
+  if (!file.writer.writeChunk(file.buffer))
+  {
+    return false;
+  }
+  num_buffered_rays_ -= file.buffer.ends.size();
+  file.buffer = Cloud();  // free the storage too, so that the budget bounds the memory held by idle files
+  return true;
+}
+
+bool MultiCloudWriter::flush()
+{
+  for (auto &file : files_)
+  {
+    if (file.second.buffer.ends.size() >= max_file_rays_ && !write(file.first, file.second))
+    {
+      return false;
+    }
+  }
+  if (num_buffered_rays_ <= max_buffered_rays_)
+  {
+    return true;
+  }
+  // over budget, so write out the largest buffers until half of the budget is free
+  std::vector<std::pair<size_t, int>> sizes;
+  for (auto &file : files_)
+  {
+    if (!file.second.buffer.ends.empty())
+    {
+      sizes.push_back(std::make_pair(file.second.buffer.ends.size(), file.first));
+    }
+  }
+  std::sort(sizes.begin(), sizes.end(), std::greater<std::pair<size_t, int>>());
+  for (auto &size : sizes)
+  {
+    if (num_buffered_rays_ <= max_buffered_rays_ / 2)
+    {
+      break;
+    }
+    if (!write(size.second, files_[size.second]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MultiCloudWriter::end()
+{
+  bool success = true;
+  for (auto &file : files_)
+  {
+    success &= write(file.first, file.second);
+  }
+  for (auto &file : files_)
+  {
+    success &= file.second.writer.end();  // has no effect on writers where begin has not been called
+  }
+  files_.clear();
+  open_files_.clear();
+  num_buffered_rays_ = 0;
+  return success;
 }
 
 
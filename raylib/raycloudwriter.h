@@ -7,7 +7,12 @@
 #define RAYLIB_RAYCLOUDWRITER_H
 
 #include "raylib/raylibconfig.h"
+#include "raycloud.h"
 #include "rayply.h"
+#include "raytileindex.h"
+
+#include <list>
+#include <map>
 
 namespace ray
 {
@@ -26,24 +31,88 @@ public:
   bool writeChunk(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
                   std::vector<RGBA> &colours)
   {
-    return writeRayCloudChunk(ofs_, buffer_, starts, ends, times, colours, has_warned_);
+    if (suspended_ && !resume())
+    {
+      return false;
+    }
+    time_index_.add(times);
+    return writeRayCloudChunk(ofs_, buffer_, starts, ends, times, colours, has_warned_, &stats_);
   }
 
-  /// finish writing, and adjust the vertex count at the start.
-  void end();
+  /// finish writing, and adjust the vertex count and statistics at the start. Large clouds also get a time index.
+  /// Returns false if the file or its time index could not be completed
+  bool end();
+
+  /// close the file until the next write, so that many writers can be used without exhausting the open file limit.
+  /// This also frees the write buffer
+  void suspend();
 
   /// return the stored file name
   const std::string &fileName() { return file_name_; }
 
 private:
+  /// reopen a suspended file, to continue writing at its end
+  bool resume();
+
   /// store the output file stream
   std::ofstream ofs_;
   /// store the file name, in order to provide a clear 'saved' message on end()
   std::string file_name_;
   /// ray buffer to avoid repeated reallocations
   RayPlyBuffer buffer_;
+  /// statistics of the rays written so far, stored in the file header on end()
+  RayCloudStats stats_;
+  /// time ranges of the rows written so far, saved beside the file on end()
+  TimeIndex time_index_;
   /// whether a warning has been issued or not. This prevents multiple warnings.
   bool has_warned_;
+  /// whether the file is closed by suspend()
+  bool suspended_ = false;
+};
+
+/// Writes to many ray cloud files at once, such as the cells of a grid. The rays for each file are buffered and
+/// appended to it in blocks, and only a bounded number of the files are open at one time, the least recently
+/// written being suspended to make room.
+class RAYLIB_EXPORT MultiCloudWriter
+{
+public:
+  /// @c max_file_rays is the number of rays buffered for a file before they are written,
+  /// @c max_buffered_rays bounds the rays buffered over all files. A file's buffer is freed once it is written
+  MultiCloudWriter(size_t max_open_files = 256, size_t max_file_rays = 1 << 16, size_t max_buffered_rays = 1 << 22);
+
+  /// whether file @c id has been started
+  bool contains(int id) const { return files_.find(id) != files_.end(); }
+
+  /// start file @c id, it is created on the first write
+  void begin(int id, const std::string &file_name);
+
+  /// add a ray to file @c id, which must have been started with begin()
+  void addRay(int id, const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+
+  /// write out any buffers that have reached their size bound. Call this periodically, such as once per chunk
+  bool flush();
+
+  /// write out all remaining rays and finish all of the files
+  bool end();
+
+private:
+  struct File
+  {
+    std::string name;
+    CloudWriter writer;
+    Cloud buffer;
+    bool started = false;
+    bool open = false;
+    std::list<int>::iterator lru;
+  };
+  bool write(int id, File &file);
+
+  std::map<int, File> files_;
+  std::list<int> open_files_;  // most recently written first
+  size_t max_open_files_;
+  size_t max_file_rays_;
+  size_t max_buffered_rays_;
+  size_t num_buffered_rays_ = 0;
 };
 
 }  // namespace ray
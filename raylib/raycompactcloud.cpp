@@ -0,0 +1,303 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycompactcloud.h"
+#include "raylib/raycloudwriter.h"
+#include "raylib/rayply.h"
+
+namespace ray
+{
+constexpr size_t CompactCloud::kChunkSize;
+
+void CompactCloud::Chunk::reserve(size_t size)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    end[i].reserve(size);
+    ray[i].reserve(size);
+  }
+  times.reserve(size);
+  colours.reserve(size);
+}
+
+void CompactCloud::Chunk::resize(size_t size)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    end[i].resize(size);
+    ray[i].resize(size);
+  }
+  times.resize(size);
+  colours.resize(size);
+}
+
+void CompactCloud::clear()
+{
+  chunks_.clear();
+  num_rays_ = 0;
+}
+
+RayChunkView CompactCloud::chunk(size_t i) const
+{
+  const Chunk &chunk = chunks_[i];
+  RayChunkView view;
+  view.origin = chunk.origin;
+  for (int j = 0; j < 3; j++)
+  {
+    view.end[j] = chunk.end[j].data();
+    view.ray[j] = chunk.ray[j].data();
+  }
+  view.times = chunk.times.data();
+  view.colours = chunk.colours.data();
+  view.size = chunk.times.size();
+  return view;
+}
+
+CompactCloud::Chunk &CompactCloud::chunkForNewRay(const Eigen::Vector3d &origin)
+{
+  if (chunks_.empty() || chunks_.back().times.size() == kChunkSize)
+  {
+    chunks_.emplace_back();
+    chunks_.back().origin = origin;
+    chunks_.back().reserve(kChunkSize);
+  }
+  return chunks_.back();
+}
+
+void CompactCloud::addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour)
+{
+  Chunk &chunk = chunkForNewRay(end);
+  for (int j = 0; j < 3; j++)
+  {
+    chunk.end[j].push_back(static_cast<float>(end[j] - chunk.origin[j]));
+    chunk.ray[j].push_back(static_cast<float>(start[j] - end[j]));
+  }
+  chunk.times.push_back(time);
+  chunk.colours.push_back(colour);
+  num_rays_++;
+}
+
+void CompactCloud::addRays(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                           const std::vector<double> &times, const std::vector<RGBA> &colours)
+{
+  size_t i = 0;
+  while (i < ends.size())
+  {
+    Chunk &chunk = chunkForNewRay(ends[i]);
+    // fill the remainder of the chunk one axis at a time, so each loop writes to a single array
+    const size_t first = chunk.times.size();
+    const size_t count = std::min(kChunkSize - first, ends.size() - i);
+    for (int j = 0; j < 3; j++)
+    {
+      const double origin = chunk.origin[j];
+      chunk.end[j].resize(first + count);
+      chunk.ray[j].resize(first + count);
+      float *chunk_end = &chunk.end[j][first];
+      float *chunk_ray = &chunk.ray[j][first];
+      for (size_t k = 0; k < count; k++)
+      {
+        chunk_end[k] = static_cast<float>(ends[i + k][j] - origin);
+        chunk_ray[k] = static_cast<float>(starts[i + k][j] - ends[i + k][j]);
+      }
+    }
+    chunk.times.insert(chunk.times.end(), times.begin() + i, times.begin() + i + count);
+    chunk.colours.insert(chunk.colours.end(), colours.begin() + i, colours.begin() + i + count);
+    i += count;
+    num_rays_ += count;
+  }
+}
+
+void CompactCloud::removeRay(size_t i)
+{
+  const size_t last = num_rays_ - 1;
+  Chunk &back = chunks_.back();
+  const size_t k = last % kChunkSize;
+  if (i != last)
+  {
+    Chunk &chunk = chunks_[i / kChunkSize];
+    const size_t j = i % kChunkSize;
+    for (int a = 0; a < 3; a++)
+    {
+      chunk.end[a][j] = chunk.origin[a] == back.origin[a] ?
+                          back.end[a][k] :
+                          static_cast<float>(back.origin[a] + (double)back.end[a][k] - chunk.origin[a]);
+      chunk.ray[a][j] = back.ray[a][k];
+    }
+    chunk.times[j] = back.times[k];
+    chunk.colours[j] = back.colours[k];
+  }
+  if (k == 0)
+  {
+    chunks_.pop_back();
+  }
+  else
+  {
+    back.resize(k);
+  }
+  num_rays_--;
+}
+
+RayChunkSpan CompactCloud::beginChunk()
+{
+  chunks_.emplace_back();
+  Chunk &chunk = chunks_.back();
+  chunk.origin.setZero();
+  chunk.resize(kChunkSize);
+  RayChunkSpan span;
+  for (int j = 0; j < 3; j++)
+  {
+    span.end[j] = chunk.end[j].data();
+    span.ray[j] = chunk.ray[j].data();
+  }
+  span.times = chunk.times.data();
+  span.colours = chunk.colours.data();
+  return span;
+}
+
+void CompactCloud::endChunk(size_t size)
+{
+  if (size == 0)
+  {
+    chunks_.pop_back();
+    return;
+  }
+  Chunk &chunk = chunks_.back();
+  if (size < kChunkSize)  // the last chunk, so free its unused space
+  {
+    chunk.resize(size);
+    for (int j = 0; j < 3; j++)
+    {
+      chunk.end[j].shrink_to_fit();
+      chunk.ray[j].shrink_to_fit();
+    }
+    chunk.times.shrink_to_fit();
+    chunk.colours.shrink_to_fit();
+  }
+  num_rays_ += size;
+}
+
+void CompactCloud::translate(const Eigen::Vector3d &offset)
+{
+  for (auto &chunk : chunks_)
+  {
+    chunk.origin += offset;
+  }
+}
+
+Eigen::Vector3d CompactCloud::removeStartPos()
+{
+  Eigen::Vector3d offset(0, 0, 0);
+  if (num_rays_ > 0)
+  {
+    offset = end(0);
+    translate(-offset);
+  }
+  return offset;
+}
+
+bool CompactCloud::load(const std::string &file_name, int min_num_rays)
+{
+  if (!readPly(file_name, *this))
+  {
+    return false;
+  }
+  return (int)rayCount() >= min_num_rays;
+}
+
+void CompactCloud::read(std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                           std::vector<double> &times, std::vector<RGBA> &colours)>
+                          apply) const
+{
+  // By maintaining these buffers below, we avoid almost all memory fragmentation
+  std::vector<Eigen::Vector3d> starts, ends;
+  std::vector<double> times;
+  std::vector<RGBA> colours;
+  for (size_t c = 0; c < chunks_.size(); c++)
+  {
+    const RayChunkView view = chunk(c);
+    starts.resize(view.size);
+    ends.resize(view.size);
+    for (size_t i = 0; i < view.size; i++)
+    {
+      ends[i] = view.endPoint(i);
+      starts[i] = view.startPoint(i);
+    }
+    times.assign(view.times, view.times + view.size);
+    colours.assign(view.colours, view.colours + view.size);
+    apply(starts, ends, times, colours);
+  }
+}
+
+bool CompactCloud::save(const std::string &file_name) const
+{
+  CloudWriter writer;
+  if (!writer.begin(file_name))
+  {
+    return false;
+  }
+  bool success = true;
+  read([&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+           std::vector<RGBA> &colours) { success &= writer.writeChunk(starts, ends, times, colours); });
+  return writer.end() && success;
+}
+
+bool CompactCloud::save(const std::string &file_name, const std::function<bool(size_t i)> &include) const
+{
+  CloudWriter writer;
+  if (!writer.begin(file_name))
+  {
+    return false;
+  }
+  bool success = true;
+  Cloud chunk;
+  chunk.reserve(kChunkSize);
+  for (size_t i = 0; i < num_rays_; i++)
+  {
+    if (include(i))
+    {
+      chunk.addRay(start(i), end(i), time(i), colour(i));
+    }
+    if (chunk.rayCount() == kChunkSize || (i + 1 == num_rays_ && chunk.rayCount() > 0))
+    {
+      success &= writer.writeChunk(chunk);
+      chunk.clear();
+    }
+  }
+  return writer.end() && success;
+}
+
+void CompactCloud::toCloud(Cloud &cloud) const
+{
+  cloud.clear();
+  cloud.reserve(rayCount());
+  read([&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+           std::vector<RGBA> &colours) {
+    cloud.starts.insert(cloud.starts.end(), starts.begin(), starts.end());
+    cloud.ends.insert(cloud.ends.end(), ends.begin(), ends.end());
+    cloud.times.insert(cloud.times.end(), times.begin(), times.end());
+    cloud.colours.insert(cloud.colours.end(), colours.begin(), colours.end());
+  });
+}
+
+void CompactCloud::fromCloud(const Cloud &cloud)
+{
+  clear();
+  addRays(cloud.starts, cloud.ends, cloud.times, cloud.colours);
+}
+
+size_t CompactCloud::memoryUsage() const
+{
+  size_t bytes = chunks_.capacity() * sizeof(Chunk);
+  for (auto &chunk : chunks_)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      bytes += (chunk.end[j].capacity() + chunk.ray[j].capacity()) * sizeof(float);
+    }
+    bytes += chunk.times.capacity() * sizeof(double) + chunk.colours.capacity() * sizeof(RGBA);
+  }
+  return bytes;
+}
+}  // namespace ray
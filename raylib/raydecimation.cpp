@@ -8,11 +8,138 @@
 #include <limits>
 #include <map>
 #include "raycloudwriter.h"
+#include "rayexternalsort.h"
 
 namespace ray
 {
-bool decimateSpatial(const std::string &file_stub, double vox_width)
+namespace
 {
+/// the index of a ray in its file, and the voxel containing its end point. The voxel coordinates are offset by 2^31
+/// so that they order the same as unsigned integers
+struct VoxelRay
+{
+  uint32_t voxel[3];
+  uint64_t index;
+};
+
+/// Orders by the Morton (Z-order) code of the voxel, then by ray index. Rather than forming the 96 bit code, the
+/// axis whose coordinates differ in the most significant bit decides the order
+struct MortonLess
+{
+  static inline bool lessMsb(uint32_t a, uint32_t b) { return a < b && a < (a ^ b); }
+  bool operator()(const VoxelRay &a, const VoxelRay &b) const
+  {
+    int axis = 2;
+    uint32_t axis_diff = a.voxel[2] ^ b.voxel[2];
+    for (int i = 1; i >= 0; i--)
+    {
+      const uint32_t diff = a.voxel[i] ^ b.voxel[i];
+      if (lessMsb(axis_diff, diff))
+      {
+        axis = i;
+        axis_diff = diff;
+      }
+    }
+    if (axis_diff == 0)  // same voxel
+      return a.index < b.index;
+    return a.voxel[axis] < b.voxel[axis];
+  }
+};
+
+/// Spatial decimation using external sorting, so memory is bounded by @c max_memory rather than the number
+/// of occupied voxels. The (voxel, ray index) pairs are sorted into Morton order runs on disk and merged, which
+/// groups each voxel's rays together in file order, so the first ray in each voxel is kept as in decimateSpatial.
+/// The kept indices are then sorted into file order, and a second read of the cloud writes out those rays.
+bool decimateSpatialOutOfCore(const std::string &file_stub, double vox_width, size_t max_memory)
+{
+  ray::CloudWriter writer;
+  if (!writer.begin(file_stub + "_decimated.ply"))
+    return false;
+  const double width = 0.01 * vox_width;
+
+  // A quarter of the budget goes on a set of recently occupied voxels. Any ray landing in one of these cannot be
+  // the first in its voxel, so it is dropped before sorting, which removes most rays from dense clouds.
+  // Half goes on sorting the voxel of each remaining ray, and the last quarter on sorting the kept ray indices.
+  const size_t recent_memory = max_memory / 4;
+  ExternalSorter<VoxelRay, MortonLess> voxel_rays(file_stub + "_voxel_rays", (max_memory / 2) / sizeof(VoxelRay));
+  VoxelSet recent;
+  uint64_t index = 0;
+  bool success = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                      std::vector<ray::RGBA> &) 
+  {
+    for (size_t i = 0; i < ends.size() && success; i++, index++)
+    {
+      Eigen::Vector3i voxel = voxelOf(ends[i], width);
+      if (!recent.insert(voxel))
+        continue;
+      VoxelRay voxel_ray;
+      for (int j = 0; j < 3; j++) 
+      {
+        voxel_ray.voxel[j] = static_cast<uint32_t>(voxel[j]) ^ 0x80000000u;
+      }
+      voxel_ray.index = index;
+      success = voxel_rays.add(voxel_ray);
+      if (recent.memoryUsage() > recent_memory)
+        recent.clear();
+    }
+  };
+  if (!ray::Cloud::read(file_stub + ".ply", add_rays, 1) || !success)
+    return false;
+  recent = VoxelSet();  // release its memory
+
+  // within each voxel the rays are in file order, so keep the first of each
+  if (!voxel_rays.sort())
+    return false;
+  ExternalSorter<uint64_t> kept(file_stub + "_kept_rays", (max_memory / 4) / sizeof(uint64_t));
+  VoxelRay voxel_ray, previous;
+  for (bool first = true; voxel_rays.next(voxel_ray); first = false)
+  {
+    if (first || voxel_ray.voxel[0] != previous.voxel[0] || voxel_ray.voxel[1] != previous.voxel[1] ||
+        voxel_ray.voxel[2] != previous.voxel[2])
+    {
+      if (!kept.add(voxel_ray.index))
+        return false;
+    }
+    previous = voxel_ray;
+  }
+  voxel_rays.clear();
+  if (!kept.sort())
+    return false;
+
+  ray::Cloud chunk;
+  uint64_t next_kept = 0;
+  bool has_kept = kept.next(next_kept);
+  index = 0;
+  auto decimate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<ray::RGBA> &colours) 
+  {
+    chunk.resize(0);
+    // the kept indices are ascending, so those in this chunk are next in the sequence
+    while (has_kept && next_kept < index + ends.size())
+    {
+      size_t i = (size_t)(next_kept - index);
+      chunk.starts.push_back(starts[i]);
+      chunk.ends.push_back(ends[i]);
+      chunk.colours.push_back(colours[i]);
+      chunk.times.push_back(times[i]);
+      has_kept = kept.next(next_kept);
+    }
+    index += ends.size();
+    writer.writeChunk(chunk);
+  };
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
+    return false;
+  writer.end();
+  return true;
+}
+}  // namespace
+
+bool decimateSpatial(const std::string &file_stub, double vox_width, size_t max_memory)
+{
+  if (max_memory > 0)
+    return decimateSpatialOutOfCore(file_stub, vox_width, max_memory);
+
   ray::CloudWriter writer;
   if (!writer.begin(file_stub + "_decimated.ply"))
     return false;
@@ -20,7 +147,7 @@ bool decimateSpatial(const std::string &file_stub, double vox_width)
   // By maintaining these buffers below, we avoid almost all memory fragmentation
   ray::Cloud chunk;
   std::vector<int64_t> subsample;
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  VoxelSet voxel_set;
 
   auto decimate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                       std::vector<double> &times, std::vector<ray::RGBA> &colours) 
@@ -40,7 +167,7 @@ bool decimateSpatial(const std::string &file_stub, double vox_width)
     writer.writeChunk(chunk);
   };
 
-  if (!ray::Cloud::read(file_stub + ".ply", decimate))
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
     return false;
   writer.end();
   return true;
@@ -70,7 +197,7 @@ bool decimateTemporal(const std::string &file_stub, int num_rays)
     writer.writeChunk(chunk);
   };
 
-  if (!ray::Cloud::read(file_stub + ".ply", decimate))
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
     return false;
   writer.end();
   return true;
@@ -84,7 +211,7 @@ bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int
 
   // By maintaining these buffers below, we avoid almost all memory fragmentation
   ray::Cloud chunk;
-  std::map<Eigen::Vector3i, Eigen::Vector2i, ray::Vector3iLess> voxel_map;
+  VoxelMap<Eigen::Vector2i> voxel_map;
   std::vector<Eigen::Vector3i> samples;
 
   auto decimate = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
@@ -96,21 +223,20 @@ bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int
     {
       Eigen::Vector3d coords = ends[i] / voxel_width;
       Eigen::Vector3i coordsi = Eigen::Vector3d(std::floor(coords[0]), std::floor(coords[1]), std::floor(coords[2])).cast<int>();
-      auto found = voxel_map.find(coordsi);
-      if (found == voxel_map.end())
+      auto result = voxel_map.insert(coordsi, Eigen::Vector2i(1,0));
+      if (result.second)
       {
-        voxel_map.insert(std::pair<Eigen::Vector3i, Eigen::Vector2i>(coordsi, Eigen::Vector2i(1,0)));
         samples.push_back(coordsi);
       } 
       else
       {
-        found->second[0]++;
+        (*result.first)[0]++;
       }      
     }
     writer.writeChunk(chunk);
   };
 
-  if (!ray::Cloud::read(file_stub + ".ply", decimate))
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
     return false;
 
   double voxel_width = 0.01 * vox_width;
@@ -123,13 +249,13 @@ bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int
       {
         for (int z = pos[2]-1; z<=pos[2]+1; z++)
         {
-          auto found = voxel_map.find(Eigen::Vector3i(x,y,z));
-          if (found != voxel_map.end())
-            max_num = std::max(max_num, found->second[0]);  // TODO: max of neighbours, or max 2x2 of neighbours?
+          const Eigen::Vector2i *found = voxel_map.find(Eigen::Vector3i(x,y,z));
+          if (found)
+            max_num = std::max(max_num, (*found)[0]);  // TODO: max of neighbours, or max 2x2 of neighbours?
         }
       }
     }
-    voxel_map.find(Eigen::Vector3i(pos[0],pos[1],pos[2]))->second[1] = max_num;
+    (*voxel_map.find(Eigen::Vector3i(pos[0],pos[1],pos[2])))[1] = max_num;
   }
 
   auto finalise = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
@@ -140,12 +266,12 @@ bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int
     {
       Eigen::Vector3d coords = ends[i] / voxel_width;
       Eigen::Vector3i coordsi = Eigen::Vector3d(std::floor(coords[0]), std::floor(coords[1]), std::floor(coords[2])).cast<int>();
-      auto found = voxel_map.find(coordsi);
-      if (found != voxel_map.end())
+      Eigen::Vector2i *found = voxel_map.find(coordsi);
+      if (found)
       {
-        int num = (found->second)[1];
+        int num = (*found)[1];
         double segmentation = std::max(1.0, (double)num / (double)num_rays);
-        int &ends_left = (found->second)[0]; 
+        int &ends_left = (*found)[0]; 
         if (std::fmod((double)ends_left+1.0, segmentation) <= std::fmod((double)ends_left, segmentation))
         {
           chunk.starts.push_back(starts[i]);
@@ -202,7 +328,7 @@ bool decimateRaysSpatial(const std::string &file_stub, double vox_width)
     writer.writeChunk(chunk);
   };
 
-  if (!ray::Cloud::read(file_stub + ".ply", decimate))
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
     return false;
   writer.end();
   return true;
@@ -218,8 +344,8 @@ bool decimateAngular(const std::string &file_stub, double radius_per_length)
 
   int min_index = -20; // about a millimetre
   int max_index = 50;
-  std::vector<std::set<Eigen::Vector3i, ray::Vector3iLess>> voxel_sets(max_index + 1 - min_index);
-  std::vector<std::set<Eigen::Vector3i, ray::Vector3iLess>> visiteds(max_index + 1 - min_index);
+  std::vector<VoxelSet> voxel_sets(max_index + 1 - min_index);
+  std::vector<VoxelSet> visiteds(max_index + 1 - min_index);
   std::vector<int> candidate_indices;  
   const double root2 = std::sqrt(2.0);
   const double logroot2 = std::log(root2);
@@ -241,10 +367,10 @@ bool decimateAngular(const std::string &file_stub, double radius_per_length)
       Eigen::Vector3d coords = ends[i] / voxel_widths[map_index - min_index];
       Eigen::Vector3i coordsi = Eigen::Vector3d(std::floor(coords[0]), std::floor(coords[1]), std::floor(coords[2])).cast<int>();
       int ind = map_index - min_index;
-      if (visiteds[ind].find(coordsi) != visiteds[ind].end()) // this level map has already been visited by a child (smaller ray length)
+      if (visiteds[ind].contains(coordsi)) // this level map has already been visited by a child (smaller ray length)
         continue;
 
-      if (voxel_sets[ind].insert(coordsi).second)
+      if (voxel_sets[ind].insert(coordsi))
       {
         candidate_indices.push_back(index);
         // now insert visiteds to suppress longer rays
@@ -252,7 +378,7 @@ bool decimateAngular(const std::string &file_stub, double radius_per_length)
         double scale = root2;
         pos = Eigen::Vector3d(std::floor((double)coordsi[0]/scale), std::floor((double)coordsi[1]/scale), std::floor((double)coordsi[2]/scale)).cast<int>();
         ind++;
-        while (ind < (int)visiteds.size() && visiteds[ind].insert(pos).second)
+        while (ind < (int)visiteds.size() && visiteds[ind].insert(pos))
         {
           ind++;
           scale *= root2;
@@ -263,7 +389,7 @@ bool decimateAngular(const std::string &file_stub, double radius_per_length)
     writer.writeChunk(chunk);
   };
 
-  if (!ray::Cloud::read(file_stub + ".ply", decimate))
+  if (!ray::Cloud::read(file_stub + ".ply", decimate, 1))
     return false;
 
   std::cout << "finalising" << std::endl;
@@ -287,7 +413,7 @@ bool decimateAngular(const std::string &file_stub, double radius_per_length)
       Eigen::Vector3d coords = ends[i] / voxel_widths[map_index - min_index];
       Eigen::Vector3i coordsi = Eigen::Vector3d(std::floor(coords[0]), std::floor(coords[1]), std::floor(coords[2])).cast<int>();
       int ind = map_index - min_index;
-      if (visiteds[ind].find(coordsi) == visiteds[ind].end()) 
+      if (!visiteds[ind].contains(coordsi)) 
       {
         chunk.starts.push_back(starts[i]);
         chunk.ends.push_back(ends[i]);
@@ -10,12 +10,15 @@
 #include <limits>
 #include "raycloud.h"
 #include "rayutils.h"
+#include "rayvoxelset.h"
 
 namespace ray
 {
 /// @brief subsample to 1 point per @c vox_width wide voxel in metres
 /// This is a spatially even subsampling, but also emphasises outlier as a side-effect
-bool RAYLIB_EXPORT decimateSpatial(const std::string &file_stub, double vox_width);
+/// If @c max_memory is non-zero, the occupied voxels are tracked out of core, in sorted runs on disk, so that the
+/// voxel bookkeeping uses roughly @c max_memory bytes at most. The output is identical either way.
+bool RAYLIB_EXPORT decimateSpatial(const std::string &file_stub, double vox_width, size_t max_memory = 0);
 
 /// @brief subsample to every @c num_rays rays
 /// This is an unbiased subsampling, but will be over-sampled in stationary areas as a side-effect
@@ -42,7 +45,7 @@ struct Subsampler
 {
   inline bool operator()(const Eigen::Vector3i &p, const Eigen::Vector3i &/*target*/, double /*in_length*/, double /*out_length*/, double /*max_length*/)
   {
-    if (voxel_set.insert(p).second)
+    if (voxel_set.insert(p))
     {
       subsample.push_back(index);
       return true;
@@ -50,7 +53,7 @@ struct Subsampler
     return false;
   }
   std::vector<int64_t> subsample;
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  VoxelSet voxel_set;
   int index;
 };
 }  // namespace ray
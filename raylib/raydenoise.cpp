@@ -0,0 +1,527 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raydenoise.h"
+#include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
+#include "raylib/raycompactcloud.h"
+#include "raylib/rayexternalsort.h"
+#include "raylib/raymappedfile.h"
+#include "raylib/rayneighbours.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+namespace ray
+{
+namespace
+{
+template <class CloudT>
+void findIsolatedRays(const CloudT &cloud, double distance, std::vector<bool> &noise, const std::vector<bool> *active)
+{
+  noise.assign(cloud.rayCount(), false);
+  if (cloud.rayCount() == 0)
+  {
+    return;
+  }
+  Eigen::MatrixXd points_p(3, cloud.rayCount());
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    points_p.col(i) = cloud.end(i);
+  }
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  findNeighbours(points_p, 1, indices, dists2, 0.0, cloud.neighbour_cache_dir);
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (active && !(*active)[i])
+    {
+      continue;
+    }
+    noise[i] = cloud.rayBounded(i) && !(dists2(0, i) < 1e10 && dists2(0, i) < sqr(distance));
+  }
+}
+
+template <class CloudT>
+void findOutlierRays(const CloudT &cloud, double sigmas, int search_size, std::vector<bool> &noise, OutlierStats &stats,
+                     const std::vector<bool> *active, std::vector<int> *nearest, std::vector<double> *radii)
+{
+  noise.assign(cloud.rayCount(), false);
+  if (nearest)
+  {
+    nearest->assign(cloud.rayCount(), -1);
+  }
+  if (radii)
+  {
+    radii->assign(cloud.rayCount(), 0.0);
+  }
+  if (cloud.rayCount() == 0)
+  {
+    return;
+  }
+  std::vector<Eigen::Vector3d> centroids;
+  std::vector<Eigen::Vector3d> dimensions;
+  std::vector<Eigen::Matrix3d> matrices;
+  Eigen::MatrixXi indices;
+  cloud.getSurfels(search_size, &centroids, nullptr, &dimensions, &matrices, &indices);
+
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (!cloud.rayBounded(i))
+    {
+      continue;
+    }
+    int num = 0;
+    for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; j++) num = j + 1;
+    if (radii)
+    {
+      // a neighbourhood with fewer neighbours than searched for is bounded only by the extent of the cloud
+      double radius = num < search_size ? std::numeric_limits<double>::infinity() : 0.0;
+      for (int j = 0; j < num; j++)
+      {
+        radius = std::max(radius, (cloud.end(indices(j, i)) - cloud.end(i)).norm());
+      }
+      (*radii)[i] = radius;
+    }
+    if (active && !(*active)[i])
+    {
+      continue;
+    }
+    if (indices(0, i) == Neighbours::kInvalidIndex)  // no neighbours in range, we consider this as noise
+    {
+      noise[i] = true;
+      continue;
+    }
+    int other_i = indices(0, i);
+    if (nearest)
+    {
+      (*nearest)[i] = other_i;
+    }
+    Eigen::Vector3d vec = cloud.end(i) - centroids[other_i];
+    Eigen::Vector3d newVec = matrices[other_i].transpose() * vec;
+    newVec[0] /= dimensions[other_i][0];
+    newVec[1] /= dimensions[other_i][1];
+    newVec[2] /= dimensions[other_i][2];
+    stats.num_neighbours += (double)num;
+    stats.dimensions += dimensions[other_i];
+    stats.count++;
+    double scale2 = newVec.squaredNorm();
+    noise[i] = scale2 > sigmas * sigmas;
+  }
+}
+}  // namespace
+
+void findIsolated(const Cloud &cloud, double distance, std::vector<bool> &noise, const std::vector<bool> *active)
+{
+  findIsolatedRays(cloud, distance, noise, active);
+}
+
+void findIsolated(const CompactCloud &cloud, double distance, std::vector<bool> &noise, const std::vector<bool> *active)
+{
+  findIsolatedRays(cloud, distance, noise, active);
+}
+
+void findOutliers(const Cloud &cloud, double sigmas, int search_size, std::vector<bool> &noise, OutlierStats &stats,
+                  const std::vector<bool> *active, std::vector<int> *nearest, std::vector<double> *radii)
+{
+  findOutlierRays(cloud, sigmas, search_size, noise, stats, active, nearest, radii);
+}
+
+void findOutliers(const CompactCloud &cloud, double sigmas, int search_size, std::vector<bool> &noise,
+                  OutlierStats &stats, const std::vector<bool> *active, std::vector<int> *nearest,
+                  std::vector<double> *radii)
+{
+  findOutlierRays(cloud, sigmas, search_size, noise, stats, active, nearest, radii);
+}
+
+namespace
+{
+/// A ray copied into each tile whose halo contains its end point
+struct DenoiseRay
+{
+  uint32_t tile;
+  uint64_t index;  // in the cloud file
+  double start[3];
+  double end[3];
+  RGBA colour;
+};
+
+/// Orders the rays by tile, and within each tile by their order in the cloud file
+struct DenoiseRayLess
+{
+  inline bool operator()(const DenoiseRay &a, const DenoiseRay &b) const
+  {
+    if (a.tile != b.tile)
+      return a.tile < b.tile;
+    return a.index < b.index;
+  }
+};
+
+/// The rays of the cloud file in a temporary file, ordered by the tile that they end in, so that the rays around a tile
+/// can be gathered without reading the whole cloud again. It is only built once a tile needs a wider halo.
+class TileRayFile
+{
+public:
+  explicit TileRayFile(const std::string &file_stub)
+    : file_stub_(file_stub)
+    , file_name_(file_stub + "_denoise_rays.tmp")
+  {}
+  ~TileRayFile()
+  {
+    file_.close();
+    if (built_)
+      std::remove(file_name_.c_str());
+  }
+  inline bool built() const { return built_; }
+
+  /// write the rays of @c cloud_file to the file, ordered by their @c tile_of end point, then by their file order
+  bool build(const std::string &cloud_file, const std::function<uint32_t(const Eigen::Vector3d &)> &tile_of,
+             size_t sort_items)
+  {
+    built_ = true;
+    ExternalSorter<DenoiseRay, DenoiseRayLess> sorter(file_stub_ + "_denoise_rays", sort_items);
+    uint64_t num_rays = 0;
+    bool success = true;
+    auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &, std::vector<RGBA> &colours) {
+      for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+      {
+        DenoiseRay ray;
+        ray.tile = tile_of(ends[i]);
+        ray.index = num_rays;
+        for (int j = 0; j < 3; j++)
+        {
+          ray.start[j] = starts[i][j];
+          ray.end[j] = ends[i][j];
+        }
+        ray.colour = colours[i];
+        success = sorter.add(ray);
+      }
+    };
+    if (!Cloud::read(cloud_file, add_rays, 1) || !success || !sorter.sort())
+    {
+      return false;
+    }
+    std::ofstream out(file_name_, std::ios::binary | std::ios::out);
+    DenoiseRay ray;
+    for (uint64_t i = 0; sorter.next(ray); i++)
+    {
+      if (tiles_.empty() || tiles_.back() != ray.tile)
+      {
+        tiles_.push_back(ray.tile);
+        firsts_.push_back(i);
+      }
+      out.write(reinterpret_cast<const char *>(&ray), sizeof(ray));
+    }
+    firsts_.push_back(num_rays);
+    out.close();
+    if (out.fail())
+    {
+      std::cerr << "Error: failed to write temporary file " << file_name_ << std::endl;
+      return false;
+    }
+    return file_.open(file_name_);
+  }
+
+  /// call @c func on each ray that ends in the tiles @c first_tile to @c last_tile inclusive
+  bool forEachRay(uint32_t first_tile, uint32_t last_tile, const std::function<void(const DenoiseRay &)> &func)
+  {
+    const size_t first = std::lower_bound(tiles_.begin(), tiles_.end(), first_tile) - tiles_.begin();
+    const size_t last = std::upper_bound(tiles_.begin(), tiles_.end(), last_tile) - tiles_.begin();
+    const uint64_t chunk_size = 1 << 16;
+    for (uint64_t i = firsts_[first]; i < firsts_[last]; i += chunk_size)
+    {
+      const uint64_t count = std::min(chunk_size, firsts_[last] - i);
+      const unsigned char *data = file_.data(i * sizeof(DenoiseRay), count * sizeof(DenoiseRay));
+      if (!data)
+      {
+        std::cerr << "Error: failed to read temporary file " << file_name_ << std::endl;
+        return false;
+      }
+      for (uint64_t j = 0; j < count; j++)
+      {
+        DenoiseRay ray;
+        std::memcpy(&ray, data + j * sizeof(DenoiseRay), sizeof(ray));
+        func(ray);
+      }
+    }
+    return true;
+  }
+
+private:
+  std::string file_stub_;
+  std::string file_name_;
+  bool built_ = false;
+  MappedFile file_;
+  std::vector<uint32_t> tiles_;   // the tiles that rays end in, in order
+  std::vector<uint64_t> firsts_;  // the first ray of each of these tiles in the file, then the total number of rays
+};
+
+/// Classifies the rays of a tile into @c noise. The cloud holds every end point within the horizontal distance
+/// @c margin(point) of each point, and @c in_tile marks the rays to classify. Returns false if any classification may
+/// differ from that on the whole cloud, in which case the tile is processed again with a wider halo.
+typedef std::function<bool(const Cloud &cloud, const std::vector<bool> &in_tile,
+                           const std::function<double(const Eigen::Vector3d &)> &margin, std::vector<bool> &noise)>
+  TileClassifier;
+
+/// Denoise @c file_stub.ply one tile at a time, each with the end points within @c halo of it. When @c classify
+/// reports an uncertain result the tile's halo is doubled, until it is certain or the halo covers the whole cloud
+bool denoiseTiled(const std::string &file_stub, double tile_width, double halo, const TileClassifier &classify,
+                  size_t *num_removed)
+{
+  const std::string file_name = file_stub + ".ply";
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+  {
+    return false;
+  }
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d &max_bound = info.rays_bound.max_bound_;
+  const Eigen::Vector3d extent = max_bound - min_bound;
+  const int tiles_x = 1 + static_cast<int>(extent[0] / tile_width);
+  const int tiles_y = 1 + static_cast<int>(extent[1] / tile_width);
+  if ((double)tiles_x * (double)tiles_y > (double)std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "Error: tile width " << tile_width << " m is too small for the cloud extent" << std::endl;
+    return false;
+  }
+  std::cout << "denoising in " << tiles_x << " x " << tiles_y << " tiles" << std::endl;
+  auto tile_x = [&](double x) {
+    return std::max(0, std::min(static_cast<int>(std::floor((x - min_bound[0]) / tile_width)), tiles_x - 1));
+  };
+  auto tile_y = [&](double y) {
+    return std::max(0, std::min(static_cast<int>(std::floor((y - min_bound[1]) / tile_width)), tiles_y - 1));
+  };
+  // whether @c point is in tile @c tx, @c ty expanded by @c width
+  auto in_region = [&](const Eigen::Vector3d &point, int tx, int ty, double width) {
+    return tile_x(point[0] - width) <= tx && tx <= tile_x(point[0] + width) && tile_y(point[1] - width) <= ty &&
+           ty <= tile_y(point[1] + width);
+  };
+
+  // 1. copy each ray into every tile whose halo contains its end point, sorting them by tile on disk
+  const size_t sort_memory = size_t(1) << 29;
+  ExternalSorter<DenoiseRay, DenoiseRayLess> tile_rays(file_stub + "_denoise_tiles", sort_memory / sizeof(DenoiseRay));
+  uint64_t num_rays = 0;
+  bool success = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+    {
+      for (int ty = tile_y(ends[i][1] - halo); ty <= tile_y(ends[i][1] + halo); ty++)
+      {
+        for (int tx = tile_x(ends[i][0] - halo); tx <= tile_x(ends[i][0] + halo); tx++)
+        {
+          DenoiseRay ray;
+          ray.tile = static_cast<uint32_t>(tx + tiles_x * ty);
+          ray.index = num_rays;
+          for (int j = 0; j < 3; j++)
+          {
+            ray.start[j] = starts[i][j];
+            ray.end[j] = ends[i][j];
+          }
+          ray.colour = colours[i];
+          success = tile_rays.add(ray);
+        }
+      }
+    }
+  };
+  if (!Cloud::read(file_name, add_rays, 1) || !success || !tile_rays.sort())
+  {
+    return false;
+  }
+
+  // 2. classify the rays that end in each tile
+  std::vector<bool> noise(num_rays, false);
+  TileRayFile ray_file(file_stub);
+  Cloud cloud;
+  std::vector<uint64_t> indices;
+  std::vector<bool> in_tile, tile_noise;
+  std::vector<DenoiseRay> gathered;
+  auto own_tile = [&](const Eigen::Vector3d &end) {
+    return static_cast<uint32_t>(tile_x(end[0]) + tiles_x * tile_y(end[1]));
+  };
+  auto classify_tile = [&](int tx, int ty) {
+    double width = halo;
+    for (;;)
+    {
+      // the region holds every end point that is within the halo width of the tile horizontally
+      const double inf = std::numeric_limits<double>::infinity();
+      const double left = tx > 0 ? min_bound[0] + tx * tile_width - width : -inf;
+      const double right = tx < tiles_x - 1 ? min_bound[0] + (tx + 1) * tile_width + width : inf;
+      const double bottom = ty > 0 ? min_bound[1] + ty * tile_width - width : -inf;
+      const double top = ty < tiles_y - 1 ? min_bound[1] + (ty + 1) * tile_width + width : inf;
+      const bool whole_cloud =
+        left <= min_bound[0] && right >= max_bound[0] && bottom <= min_bound[1] && top >= max_bound[1];
+      auto margin = [&](const Eigen::Vector3d &point) {
+        // less a small distance, for the rounding in assigning points to tiles
+        const double eps = 1e-6;
+        return std::min(std::min(point[0] - left, right - point[0]), std::min(point[1] - bottom, top - point[1])) - eps;
+      };
+      in_tile.resize(cloud.rayCount());
+      for (size_t i = 0; i < cloud.rayCount(); i++)
+      {
+        in_tile[i] = tile_x(cloud.ends[i][0]) == tx && tile_y(cloud.ends[i][1]) == ty;
+      }
+      if (classify(cloud, in_tile, margin, tile_noise) || whole_cloud)
+      {
+        break;
+      }
+      // 3. rarely, a neighbourhood reaches past the halo, so gather the tile again with a wider one. The rays are
+      // gathered from the tiles around it in the ray file, which is written the first time that this happens
+      width *= 2.0;
+      if (!ray_file.built() && !ray_file.build(file_name, own_tile, sort_memory / (4 * sizeof(DenoiseRay))))
+      {
+        return false;
+      }
+      gathered.clear();
+      auto gather = [&](const DenoiseRay &ray) {
+        if (in_region(Eigen::Vector3d(ray.end[0], ray.end[1], ray.end[2]), tx, ty, width))
+        {
+          gathered.push_back(ray);
+        }
+      };
+      // one tile either side of the region, for the rounding in assigning points to tiles
+      const int x0 = std::max(tile_x(min_bound[0] + tx * tile_width - width) - 1, 0);
+      const int x1 = std::min(tile_x(min_bound[0] + (tx + 1) * tile_width + width) + 1, tiles_x - 1);
+      const int y0 = std::max(tile_y(min_bound[1] + ty * tile_width - width) - 1, 0);
+      const int y1 = std::min(tile_y(min_bound[1] + (ty + 1) * tile_width + width) + 1, tiles_y - 1);
+      for (int y = y0; y <= y1; y++)
+      {
+        if (!ray_file.forEachRay(static_cast<uint32_t>(x0 + tiles_x * y), static_cast<uint32_t>(x1 + tiles_x * y),
+                                 gather))
+        {
+          return false;
+        }
+      }
+      // in file order, as the tile's rays are
+      std::sort(gathered.begin(), gathered.end(),
+                [](const DenoiseRay &a, const DenoiseRay &b) { return a.index < b.index; });
+      cloud.clear();
+      indices.clear();
+      for (auto &ray : gathered)
+      {
+        cloud.addRay(Eigen::Vector3d(ray.start[0], ray.start[1], ray.start[2]),
+                     Eigen::Vector3d(ray.end[0], ray.end[1], ray.end[2]), 0.0, ray.colour);
+        indices.push_back(ray.index);
+      }
+    }
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (in_tile[i])
+      {
+        noise[indices[i]] = tile_noise[i];
+      }
+    }
+    return true;
+  };
+  DenoiseRay tile_ray;
+  bool has_ray = tile_rays.next(tile_ray);
+  while (has_ray && success)
+  {
+    const uint32_t tile = tile_ray.tile;
+    cloud.clear();
+    indices.clear();
+    for (; has_ray && tile_ray.tile == tile; has_ray = tile_rays.next(tile_ray))
+    {
+      cloud.addRay(Eigen::Vector3d(tile_ray.start[0], tile_ray.start[1], tile_ray.start[2]),
+                   Eigen::Vector3d(tile_ray.end[0], tile_ray.end[1], tile_ray.end[2]), 0.0, tile_ray.colour);
+      indices.push_back(tile_ray.index);
+    }
+    success = classify_tile(static_cast<int>(tile % (uint32_t)tiles_x), static_cast<int>(tile / (uint32_t)tiles_x));
+  }
+  tile_rays.clear();
+  cloud.clear();
+  if (!success)
+  {
+    return false;
+  }
+
+  // 4. write the rays that are not noise, in their original order
+  CloudWriter writer;
+  if (!writer.begin(file_stub + "_denoised.ply"))
+  {
+    return false;
+  }
+  Cloud chunk;
+  uint64_t index = 0;
+  size_t removed = 0;
+  auto write = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                   std::vector<double> &times, std::vector<RGBA> &colours) {
+    chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++, index++)
+    {
+      if (noise[index])
+        removed++;
+      else
+        chunk.addRay(starts[i], ends[i], times[i], colours[i]);
+    }
+    success &= writer.writeChunk(chunk);
+  };
+  if (!Cloud::read(file_name, write, 1))
+  {
+    return false;
+  }
+  writer.end();
+  if (num_removed)
+  {
+    *num_removed = removed;
+  }
+  return success;
+}
+}  // namespace
+
+bool denoiseIsolatedTiled(const std::string &file_stub, double distance, double tile_width, size_t *num_removed)
+{
+  // a halo of the search distance holds every neighbour that could be close enough, so each tile is exact
+  auto classify = [distance](const Cloud &cloud, const std::vector<bool> &in_tile,
+                             const std::function<double(const Eigen::Vector3d &)> &, std::vector<bool> &noise) {
+    findIsolated(cloud, distance, noise, &in_tile);
+    return true;
+  };
+  return denoiseTiled(file_stub, tile_width, 1.01 * distance, classify, num_removed);
+}
+
+bool denoiseOutliersTiled(const std::string &file_stub, double sigmas, double tile_width, OutlierStats &stats,
+                          size_t *num_removed)
+{
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_stub + ".ply", info))
+  {
+    return false;
+  }
+  const int search_size = std::min(10, (int)info.num_rays - 1);
+  std::vector<int> nearest;
+  std::vector<double> radii;
+  auto classify = [&](const Cloud &cloud, const std::vector<bool> &in_tile,
+                      const std::function<double(const Eigen::Vector3d &)> &margin, std::vector<bool> &noise) {
+    OutlierStats tile_stats;
+    findOutliers(cloud, sigmas, search_size, noise, tile_stats, &in_tile, &nearest, &radii);
+    // the classification is exact if the ray's nearest neighbour, and the neighbourhood of that neighbour, are both
+    // within the halo
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (!in_tile[i] || !cloud.rayBounded(i))
+      {
+        continue;
+      }
+      const int other = nearest[i];
+      if (other < 0 || !((cloud.ends[other] - cloud.ends[i]).norm() < margin(cloud.ends[i])) ||
+          !(radii[other] < margin(cloud.ends[other])))
+      {
+        return false;
+      }
+    }
+    stats.dimensions += tile_stats.dimensions;
+    stats.num_neighbours += tile_stats.num_neighbours;
+    stats.count += tile_stats.count;
+    return true;
+  };
+  // neighbourhoods are typically much smaller than this, so few tiles need a second pass
+  const double halo = 0.05 * tile_width;
+  return denoiseTiled(file_stub, tile_width, halo, classify, num_removed);
+}
+}  // namespace ray
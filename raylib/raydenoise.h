@@ -0,0 +1,58 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYDENOISE_H
+#define RAYLIB_RAYDENOISE_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+class Cloud;
+class CompactCloud;
+
+/// Totals over the classified rays of @c findOutliers, for reporting their averages
+struct RAYLIB_EXPORT OutlierStats
+{
+  Eigen::Vector3d dimensions = Eigen::Vector3d::Zero();  ///< sum of the nearest neighbour surfel dimensions
+  double num_neighbours = 0;                             ///< sum of the neighbour counts
+  double count = 0;                                      ///< number of rays with a neighbour
+};
+
+/// Flag in @c noise the bounded rays of @c cloud whose end points are @c distance or further from every other end
+/// point. Only rays with @c active set are classified, all if @c active is null.
+void RAYLIB_EXPORT findIsolated(const Cloud &cloud, double distance, std::vector<bool> &noise,
+                                const std::vector<bool> *active = nullptr);
+void RAYLIB_EXPORT findIsolated(const CompactCloud &cloud, double distance, std::vector<bool> &noise,
+                                const std::vector<bool> *active = nullptr);
+
+/// Flag in @c noise the bounded rays of @c cloud whose end point is more than @c sigmas standard deviations from the
+/// surfel of its nearest neighbour, as found from the @c search_size nearest end points. Only rays with @c active set
+/// are classified, all if @c active is null. For each classified ray, @c nearest is given the index of the nearest
+/// neighbour, or -1 if there is none, and @c radii the distance to its furthest found neighbour.
+void RAYLIB_EXPORT findOutliers(const Cloud &cloud, double sigmas, int search_size, std::vector<bool> &noise,
+                                OutlierStats &stats, const std::vector<bool> *active = nullptr,
+                                std::vector<int> *nearest = nullptr, std::vector<double> *radii = nullptr);
+void RAYLIB_EXPORT findOutliers(const CompactCloud &cloud, double sigmas, int search_size, std::vector<bool> &noise,
+                                OutlierStats &stats, const std::vector<bool> *active = nullptr,
+                                std::vector<int> *nearest = nullptr, std::vector<double> *radii = nullptr);
+
+/// Streamed forms of the two denoise methods above, for clouds larger than memory. The cloud file @c file_stub.ply is
+/// split horizontally into square tiles of @c tile_width metres, and each tile is processed together with a halo of
+/// neighbouring points, before the remaining rays are written to @c file_stub_denoised.ply. The halo is the search
+/// radius for @c denoiseIsolatedTiled. The sigma search has no radius, so a tile is processed again with a wider halo
+/// whenever a neighbourhood reaches outside its halo, gathering the wider halo from a temporary copy of the cloud
+/// ordered by tile. Each tile holds every neighbour that its rays are classified by, but the nearest neighbour search is
+/// approximate (see @c kNearestNeighbourEpsilon) and its ties are broken by the search order, both of which depend on the
+/// points searched. So a small number of rays can be classified differently to the in-memory methods, which remain the
+/// default in raydenoise.
+bool RAYLIB_EXPORT denoiseIsolatedTiled(const std::string &file_stub, double distance, double tile_width,
+                                        size_t *num_removed = nullptr);
+bool RAYLIB_EXPORT denoiseOutliersTiled(const std::string &file_stub, double sigmas, double tile_width,
+                                        OutlierStats &stats, size_t *num_removed = nullptr);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYDENOISE_H
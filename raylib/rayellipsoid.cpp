@@ -6,11 +6,17 @@
 #include "rayellipsoid.h"
 
 #include "raycloud.h"
+#include "raycompactcloud.h"
+#include "raymappedfile.h"
+#include "rayneighbours.h"
 #include "rayprogress.h"
 
-#include <nabo/nabo.h>
-
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
 #include <memory>
+#include <sstream>
 
 #if RAYLIB_WITH_TBB
 #include <tbb/parallel_for.h>
@@ -18,8 +24,112 @@
 
 namespace ray
 {
-void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
-                        const Cloud &cloud, Progress *progress)
+IntersectResult Ellipsoid::intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end) const
+{
+  Eigen::Matrix3d eigen_matd = eigen_mat.cast<double>();
+  const Eigen::Vector3d dir = end - start;
+  // ray-ellipsoid intersection
+  const Eigen::Vector3d to_sphere = pos - start;
+  const Eigen::Vector3d ray = eigen_matd * dir;
+  const double ray_length_sqr = ray.squaredNorm();
+  const Eigen::Vector3d to = eigen_matd * to_sphere;
+
+  double d = to.dot(ray) / ray_length_sqr;
+  const double dist2 = (to - ray * d).squaredNorm();
+
+  if (dist2 > 1.0)  // misses the ellipsoid
+  {
+    return IntersectResult::Miss;
+  }
+
+  const double along_dist = std::sqrt(1.0 - dist2);
+  const double ray_length = std::sqrt(ray_length_sqr);
+  d *= ray_length;
+  if (ray_length < d - along_dist)  // doesn't reach the ellipsoid
+  {
+    return IntersectResult::Miss;
+  }
+
+  const double pass_distance = 0.05;
+  double ratio = pass_distance / dir.norm();
+  // last number requires rays to pass some way past the object
+  const bool pass_through = ray_length * (1.0 - ratio) > d + along_dist;
+  if (pass_through)
+  {
+    return IntersectResult::Passthrough;
+  }
+  return IntersectResult::Hit;
+}
+
+void Ellipsoid::intersect(const RayBatch &rays, std::vector<IntersectResult> &results) const
+{
+  // Most rays miss the ellipsoid by a wide margin. So the distance of closest approach is found for a block of rays
+  // at a time in a branch-free loop that vectorises, then the few rays that come close enough are finished singly.
+  // The arithmetic is the same as the single ray intersect(), in the same order, and this file is compiled without
+  // floating point contraction (see CMakeLists.txt), so no multiply-add is fused in one and not the other. The results
+  // are therefore identical
+  const size_t block_size = 256;
+  double dist2s[block_size], ds[block_size], ray_length_sqrs[block_size];
+  const Eigen::Matrix3d mat = eigen_mat.cast<double>();
+  const double m00 = mat(0, 0), m01 = mat(0, 1), m02 = mat(0, 2);
+  const double m10 = mat(1, 0), m11 = mat(1, 1), m12 = mat(1, 2);
+  const double m20 = mat(2, 0), m21 = mat(2, 1), m22 = mat(2, 2);
+  const double px = pos[0], py = pos[1], pz = pos[2];
+  const double pass_distance = 0.05;
+  results.resize(rays.size());
+  for (size_t first = 0; first < rays.size(); first += block_size)
+  {
+    const size_t count = std::min(rays.size() - first, block_size);
+    const double *sx = &rays.start[0][first], *sy = &rays.start[1][first], *sz = &rays.start[2][first];
+    const double *ex = &rays.end[0][first], *ey = &rays.end[1][first], *ez = &rays.end[2][first];
+    #pragma omp simd
+    for (size_t i = 0; i < count; i++)
+    {
+      const double dx = ex[i] - sx[i], dy = ey[i] - sy[i], dz = ez[i] - sz[i];
+      const double tx = px - sx[i], ty = py - sy[i], tz = pz - sz[i];
+      const double rx = m00 * dx + m01 * dy + m02 * dz;
+      const double ry = m10 * dx + m11 * dy + m12 * dz;
+      const double rz = m20 * dx + m21 * dy + m22 * dz;
+      const double ray_length_sqr = rx * rx + ry * ry + rz * rz;
+      const double ox = m00 * tx + m01 * ty + m02 * tz;
+      const double oy = m10 * tx + m11 * ty + m12 * tz;
+      const double oz = m20 * tx + m21 * ty + m22 * tz;
+      const double d = (ox * rx + oy * ry + oz * rz) / ray_length_sqr;
+      const double qx = ox - rx * d, qy = oy - ry * d, qz = oz - rz * d;
+      dist2s[i] = qx * qx + qy * qy + qz * qz;
+      ds[i] = d;
+      ray_length_sqrs[i] = ray_length_sqr;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+      IntersectResult &result = results[first + i];
+      if (dist2s[i] > 1.0)  // misses the ellipsoid
+      {
+        result = IntersectResult::Miss;
+        continue;
+      }
+      const double along_dist = std::sqrt(1.0 - dist2s[i]);
+      const double ray_length = std::sqrt(ray_length_sqrs[i]);
+      const double d = ds[i] * ray_length;
+      if (ray_length < d - along_dist)  // doesn't reach the ellipsoid
+      {
+        result = IntersectResult::Miss;
+        continue;
+      }
+      const Eigen::Vector3d dir(ex[i] - sx[i], ey[i] - sy[i], ez[i] - sz[i]);
+      const double ratio = pass_distance / dir.norm();
+      const bool pass_through = ray_length * (1.0 - ratio) > d + along_dist;
+      result = pass_through ? IntersectResult::Passthrough : IntersectResult::Hit;
+    }
+  }
+}
+
+namespace
+{
+template <class CloudT>
+void generateCloudEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
+                             Eigen::Vector3d *bounds_max, const CloudT &cloud, Progress *progress)
 {
   ellipsoids->clear();
   ellipsoids->resize(cloud.rayCount());
@@ -27,38 +137,32 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
   const double max_double = std::numeric_limits<double>::max();
   Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
   Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
-  Nabo::Parameters params("bucketSize", 8);
 
   if (progress)
   {
     progress->begin("generateEllipsoids - KDTree", 2);
   }
 
-  Eigen::MatrixXd points_p(3, cloud.ends.size());
+  Eigen::MatrixXd points_p(3, cloud.rayCount());
   for (size_t i = 0; i < cloud.rayCount(); ++i)
   {
-    points_p.col(i) = cloud.ends[i];
+    points_p.col(i) = cloud.end(i);
   }
-  std::unique_ptr<Nabo::NNSearchD> nns(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3));
 
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, cloud.rayCount());
-  dists2.resize(search_size, cloud.rayCount());
-
   if (progress)
   {
     progress->increment();
   }
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  nns.reset(nullptr);
+  findNeighbours(points_p, search_size, indices, dists2);
 
   if (progress)
   {
     progress->increment();
     progress->end();
-    progress->begin("generateEllipsoids", cloud.ends.size());
+    progress->begin("generateEllipsoids", cloud.rayCount());
   }
   const auto generate_ellipsoid = [&](size_t i)  //
   {
@@ -82,12 +186,12 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     scatter.setZero();
     Eigen::Vector3d centroid(0, 0, 0);
     double num_neighbours = 0;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; ++j)
+    for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; ++j)
     {
       int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
-        centroid += cloud.ends[index];
+        centroid += cloud.end(index);
         num_neighbours++;
       }
     }
@@ -96,12 +200,12 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
       return;
     }
     centroid /= num_neighbours;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; j++)
     {
       int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
-        Eigen::Vector3d offset = cloud.ends[index] - centroid;
+        Eigen::Vector3d offset = cloud.end(index) - centroid;
         scatter += offset * offset.transpose();
       }
     }
@@ -121,7 +225,7 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     ellipsoid.eigen_mat.row(0) = (eigen_vector.col(0) / eigen_value[0]).cast<float>();
     ellipsoid.eigen_mat.row(1) = (eigen_vector.col(1) / eigen_value[1]).cast<float>();
     ellipsoid.eigen_mat.row(2) = (eigen_vector.col(2) / eigen_value[2]).cast<float>();
-    ellipsoid.time = cloud.times[i];
+    ellipsoid.time = cloud.time(i);
     ellipsoid.setExtents(eigen_vector, eigen_value);
   };
 
@@ -173,4 +277,230 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     *bounds_max = ellipsoids_max;
   }
 }
+}  // namespace
+
+void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const Cloud &cloud, Progress *progress)
+{
+  generateCloudEllipsoids(ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
+
+void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const CompactCloud &cloud, Progress *progress)
+{
+  generateCloudEllipsoids(ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
+
+namespace
+{
+const char kEllipsoidsMagic[8] = { 'R', 'A', 'Y', 'E', 'L', 'L', 'I', 'P' };
+/// increment when the file layout, or the way that ellipsoids are generated, changes
+const uint32_t kEllipsoidsVersion = 1;
+
+struct EllipsoidsHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t key;
+  uint64_t count;
+  double bounds_min[3];
+  double bounds_max[3];
+};
+
+/// the stored part of an ellipsoid. The remaining members are always the same on generation
+struct EllipsoidRecord
+{
+  double pos[3];
+  double time;
+  float eigen_mat[9];  // row major
+  float extents[3];
+};
+}  // namespace
+
+namespace
+{
+template <class CloudT>
+uint64_t cloudEllipsoidsKey(const CloudT &cloud)
+{
+  uint64_t key = kHashSeed;
+  hashCombine(static_cast<uint64_t>(cloud.rayCount()), key);
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    const Eigen::Vector3d end = cloud.end(i);
+    hashCombine(end[0], key);
+    hashCombine(end[1], key);
+    hashCombine(end[2], key);
+    hashCombine(cloud.time(i), key);
+    hashCombine(static_cast<uint64_t>(cloud.rayBounded(i)), key);
+  }
+  return key;
+}
+}  // namespace
+
+uint64_t ellipsoidsKey(const Cloud &cloud)
+{
+  return cloudEllipsoidsKey(cloud);
+}
+
+uint64_t ellipsoidsKey(const CompactCloud &cloud)
+{
+  return cloudEllipsoidsKey(cloud);
+}
+
+bool saveEllipsoids(const std::string &file_name, uint64_t key, const std::vector<Ellipsoid> &ellipsoids,
+                    const Eigen::Vector3d &bounds_min, const Eigen::Vector3d &bounds_max)
+{
+  // written to a temporary file first, so a concurrent or later run never loads a part-written cache
+  const std::string temp_name = file_name + ".tmp";
+  std::ofstream out(temp_name, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Error: cannot open " << temp_name << " for writing" << std::endl;
+    return false;
+  }
+  EllipsoidsHeader header;
+  std::memcpy(header.magic, kEllipsoidsMagic, sizeof(header.magic));
+  header.version = kEllipsoidsVersion;
+  header.record_size = sizeof(EllipsoidRecord);
+  header.key = key;
+  header.count = ellipsoids.size();
+  for (int i = 0; i < 3; i++)
+  {
+    header.bounds_min[i] = bounds_min[i];
+    header.bounds_max[i] = bounds_max[i];
+  }
+  std::vector<EllipsoidRecord> records(ellipsoids.size());
+  for (size_t i = 0; i < ellipsoids.size(); i++)
+  {
+    const Ellipsoid &ellipsoid = ellipsoids[i];
+    EllipsoidRecord &record = records[i];
+    for (int j = 0; j < 3; j++)
+    {
+      record.pos[j] = ellipsoid.pos[j];
+      record.extents[j] = ellipsoid.extents[j];
+      for (int k = 0; k < 3; k++)
+      {
+        record.eigen_mat[3 * j + k] = ellipsoid.eigen_mat(j, k);
+      }
+    }
+    record.time = ellipsoid.time;
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(records.data()),
+            static_cast<std::streamsize>(records.size() * sizeof(EllipsoidRecord)));
+  out.close();
+  if (out.fail())
+  {
+    std::cerr << "Error: failed writing ellipsoids to " << temp_name << std::endl;
+    std::remove(temp_name.c_str());
+    return false;
+  }
+  return replaceFile(temp_name, file_name);
+}
+
+bool loadEllipsoids(const std::string &file_name, uint64_t key, std::vector<Ellipsoid> *ellipsoids,
+                    Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max)
+{
+  MappedFile file;
+  if (!file.open(file_name))
+  {
+    return false;
+  }
+  EllipsoidsHeader header;
+  const unsigned char *header_data = file.data(0, sizeof(header));
+  if (!header_data)
+  {
+    return false;
+  }
+  std::memcpy(&header, header_data, sizeof(header));
+  if (std::memcmp(header.magic, kEllipsoidsMagic, sizeof(header.magic)) != 0 ||
+      header.version != kEllipsoidsVersion || header.record_size != sizeof(EllipsoidRecord) || header.key != key)
+  {
+    return false;
+  }
+  const unsigned char *records = header.count <= file.size() / sizeof(EllipsoidRecord) ?
+                                   file.data(sizeof(header), header.count * sizeof(EllipsoidRecord)) :
+                                   nullptr;
+  if (!records)
+  {
+    std::cerr << "Warning: " << file_name << " is truncated, regenerating the ellipsoids" << std::endl;
+    return false;
+  }
+  ellipsoids->resize(header.count);
+  for (size_t i = 0; i < header.count; i++)
+  {
+    Ellipsoid &ellipsoid = (*ellipsoids)[i];
+    EllipsoidRecord record;
+    std::memcpy(&record, records + i * sizeof(EllipsoidRecord), sizeof(record));
+    ellipsoid.clear();
+    for (int j = 0; j < 3; j++)
+    {
+      ellipsoid.pos[j] = record.pos[j];
+      ellipsoid.extents[j] = record.extents[j];
+      for (int k = 0; k < 3; k++)
+      {
+        ellipsoid.eigen_mat(j, k) = record.eigen_mat[3 * j + k];
+      }
+    }
+    ellipsoid.time = record.time;
+    ellipsoid.opacity = 1.0;
+  }
+  if (bounds_min)
+  {
+    *bounds_min = Eigen::Vector3d(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]);
+  }
+  if (bounds_max)
+  {
+    *bounds_max = Eigen::Vector3d(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]);
+  }
+  return true;
+}
+
+namespace
+{
+template <class CloudT>
+void generateCloudEllipsoidsCached(const std::string &cache_dir, std::vector<Ellipsoid> *ellipsoids,
+                                   Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max, const CloudT &cloud,
+                                   Progress *progress)
+{
+  if (cache_dir.empty())
+  {
+    generateEllipsoids(ellipsoids, bounds_min, bounds_max, cloud, progress);
+    return;
+  }
+  const uint64_t key = ellipsoidsKey(cloud);
+  std::stringstream file_name;
+  file_name << cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".ellipsoids";
+  if (loadEllipsoids(file_name.str(), key, ellipsoids, bounds_min, bounds_max))
+  {
+    return;
+  }
+  Eigen::Vector3d ellipsoids_min, ellipsoids_max;
+  generateEllipsoids(ellipsoids, &ellipsoids_min, &ellipsoids_max, cloud, progress);
+  saveEllipsoids(file_name.str(), key, *ellipsoids, ellipsoids_min, ellipsoids_max);
+  if (bounds_min)
+  {
+    *bounds_min = ellipsoids_min;
+  }
+  if (bounds_max)
+  {
+    *bounds_max = ellipsoids_max;
+  }
+}
+}  // namespace
+
+void generateEllipsoidsCached(const std::string &cache_dir, std::vector<Ellipsoid> *ellipsoids,
+                              Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max, const Cloud &cloud,
+                              Progress *progress)
+{
+  generateCloudEllipsoidsCached(cache_dir, ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
+
+void generateEllipsoidsCached(const std::string &cache_dir, std::vector<Ellipsoid> *ellipsoids,
+                              Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max, const CompactCloud &cloud,
+                              Progress *progress)
+{
+  generateCloudEllipsoidsCached(cache_dir, ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
 }  // namespace ray
@@ -11,11 +11,14 @@
 #include <Eigen/Dense>
 
 #include <cmath>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 namespace ray
 {
 class Cloud;
+class CompactCloud;
 class Progress;
 
 enum class RAYLIB_EXPORT IntersectResult
@@ -25,6 +28,31 @@ enum class RAYLIB_EXPORT IntersectResult
   Hit,
 };
 
+/// A batch of rays held as a structure of arrays, one array per axis, for intersecting many rays at once
+struct RAYLIB_EXPORT RayBatch
+{
+  std::vector<double> start[3];
+  std::vector<double> end[3];
+
+  inline size_t size() const { return start[0].size(); }
+  inline void clear()
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      start[i].clear();
+      end[i].clear();
+    }
+  }
+  inline void add(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      start[i].push_back(ray_start[i]);
+      end[i].push_back(ray_end[i]);
+    }
+  }
+};
+
 class RAYLIB_EXPORT Ellipsoid
 {
 public:
@@ -41,12 +69,42 @@ public:
   void setExtents(const Eigen::Matrix3d &vecs, const Eigen::Vector3d &vals);
 
   IntersectResult intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end) const;
+  /// Intersect every ray in @c rays, giving the same results as the single ray version in @c results.
+  /// The common early miss test is vectorised over blocks of rays.
+  void intersect(const RayBatch &rays, std::vector<IntersectResult> &results) const;
 };
 
 /// Convert the cloud into a list of ellipsoids, which represent a volume around each cloud point,
 /// shaped by the distribution of its neighbouring points.
 void RAYLIB_EXPORT generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
                                       Eigen::Vector3d *bounds_max, const Cloud &cloud, Progress *progress = nullptr);
+void RAYLIB_EXPORT generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
+                                      Eigen::Vector3d *bounds_max, const CompactCloud &cloud,
+                                      Progress *progress = nullptr);
+
+/// As @c generateEllipsoids, but reusing the ellipsoids of an identical earlier cloud when they are saved in the
+/// directory @c cache_dir. Otherwise they are generated and saved there, to be reused on the next run.
+/// An empty @c cache_dir generates the ellipsoids without a cache.
+void RAYLIB_EXPORT generateEllipsoidsCached(const std::string &cache_dir, std::vector<Ellipsoid> *ellipsoids,
+                                            Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                                            const Cloud &cloud, Progress *progress = nullptr);
+void RAYLIB_EXPORT generateEllipsoidsCached(const std::string &cache_dir, std::vector<Ellipsoid> *ellipsoids,
+                                            Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                                            const CompactCloud &cloud, Progress *progress = nullptr);
+
+/// Key identifying the ellipsoids generated from @c cloud. It is a hash of the ray ends, times and bounded flags that
+/// the ellipsoids depend on, so two clouds with equal keys have the same ellipsoids.
+uint64_t RAYLIB_EXPORT ellipsoidsKey(const Cloud &cloud);
+uint64_t RAYLIB_EXPORT ellipsoidsKey(const CompactCloud &cloud);
+
+/// Save @c ellipsoids and their bounds to @c file_name, with the @c key of the cloud they were generated from
+bool RAYLIB_EXPORT saveEllipsoids(const std::string &file_name, uint64_t key, const std::vector<Ellipsoid> &ellipsoids,
+                                  const Eigen::Vector3d &bounds_min, const Eigen::Vector3d &bounds_max);
+
+/// Load ellipsoids written by @c saveEllipsoids. Returns false if the file is missing, from a different file format
+/// version, or has a different @c key
+bool RAYLIB_EXPORT loadEllipsoids(const std::string &file_name, uint64_t key, std::vector<Ellipsoid> *ellipsoids,
+                                  Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max);
 
 inline void Ellipsoid::clear()
 {
@@ -72,43 +130,6 @@ inline void Ellipsoid::setExtents(const Eigen::Matrix3d &vecs, const Eigen::Vect
   extents[2] = static_cast<float>(std::min(max_rr, std::abs(x[2]) * vals[0] + std::abs(y[2]) * vals[1] + std::abs(z[2]) * vals[2]));
 }
 
-inline IntersectResult Ellipsoid::intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end) const
-{
-  Eigen::Matrix3d eigen_matd = eigen_mat.cast<double>();
-  const Eigen::Vector3d dir = end - start;
-  // ray-ellipsoid intersection
-  const Eigen::Vector3d to_sphere = pos - start;
-  const Eigen::Vector3d ray = eigen_matd * dir;
-  const double ray_length_sqr = ray.squaredNorm();
-  const Eigen::Vector3d to = eigen_matd * to_sphere;
-
-  double d = to.dot(ray) / ray_length_sqr;
-  const double dist2 = (to - ray * d).squaredNorm();
-
-  if (dist2 > 1.0)  // misses the ellipsoid
-  {
-    return IntersectResult::Miss;
-  }
-
-  const double along_dist = std::sqrt(1.0 - dist2);
-  const double ray_length = std::sqrt(ray_length_sqr);
-  d *= ray_length;
-  if (ray_length < d - along_dist)  // doesn't reach the ellipsoid
-  {
-    return IntersectResult::Miss;
-  }
-
-  const double pass_distance = 0.05;
-  double ratio = pass_distance / dir.norm();
-  // last number requires rays to pass some way past the object
-  const bool pass_through = ray_length * (1.0 - ratio) > d + along_dist;
-  if (pass_through)
-  {
-    return IntersectResult::Passthrough;
-  }
-  return IntersectResult::Hit;
-}
-
 }  // namespace ray
 
 #endif  // RAYELLIPSOID_H
@@ -0,0 +1,237 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYEXTERNALSORT_H
+#define RAYLIB_RAYEXTERNALSORT_H
+
+#include "raylib/raylibconfig.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace ray
+{
+/// Sorts more items than fit in memory. Items are buffered until @c max_items are held, then the buffer is
+/// sorted and written to a temporary run file. Reading back k-way merges the runs, so no more than
+/// @c max_items are in memory at any time. If every item fits in the buffer, nothing is written to disk.
+/// T must be trivially copyable, as runs store its raw bytes.
+template <class T, class Less = std::less<T>>
+class ExternalSorter
+{
+public:
+  /// runs are stored in files named @c temp_stub_<n>.tmp, which are removed when the sorter is destroyed
+  ExternalSorter(const std::string &temp_stub, size_t max_items, Less less = Less())
+    : temp_stub_(temp_stub)
+    , max_items_(std::max(max_items, kMinItems))
+    , less_(less)
+    , heap_(HeadGreater{ less })
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "ExternalSorter items are stored as raw bytes");
+  }
+  ~ExternalSorter() { clear(); }
+  ExternalSorter(const ExternalSorter &) = delete;
+  ExternalSorter &operator=(const ExternalSorter &) = delete;
+
+  /// add an item, returns false if the buffer could not be written to disk
+  bool add(const T &item)
+  {
+    if (buffer_.size() >= max_items_ && !writeRun())
+      return false;
+    buffer_.push_back(item);
+    return true;
+  }
+
+  /// sort the items added so far, ready to be read back in order using next(). Returns false on a file error
+  bool sort()
+  {
+    if (runs_.empty())
+    {
+      std::sort(buffer_.begin(), buffer_.end(), less_);
+      buffer_pos_ = 0;
+      return true;
+    }
+    if (!buffer_.empty() && !writeRun())
+      return false;
+    std::vector<T>().swap(buffer_);
+    // keep the number of simultaneously open runs bounded, by merging the oldest runs into larger ones
+    while (runs_.size() > kMaxFanIn)
+    {
+      std::vector<std::string> group(runs_.begin(), runs_.begin() + kMaxFanIn);
+      runs_.erase(runs_.begin(), runs_.begin() + kMaxFanIn);
+      std::string merged_name = runName(num_runs_written_++);
+      std::ofstream merged(merged_name, std::ios::binary | std::ios::out);
+      runs_.push_back(merged_name);
+      if (!openRuns(group))
+        return false;
+      T item;
+      while (popItem(item))
+      {
+        merged.write(reinterpret_cast<const char *>(&item), sizeof(T));
+      }
+      closeRuns(true);
+      merged.close();  // flushes, so that write errors are seen
+      if (merged.fail())
+      {
+        std::cerr << "Error: failed to write temporary file " << merged_name << std::endl;
+        return false;
+      }
+    }
+    return openRuns(runs_);
+  }
+
+  /// the next item in sorted order, returns false once every item has been read
+  bool next(T &item)
+  {
+    if (readers_.empty())
+    {
+      if (buffer_pos_ >= buffer_.size())
+        return false;
+      item = buffer_[buffer_pos_++];
+      return true;
+    }
+    return popItem(item);
+  }
+
+  /// number of run files written, 0 when the sort is entirely in memory
+  size_t numRuns() const { return num_runs_written_; }
+
+  /// discard all items and remove any temporary files
+  void clear()
+  {
+    closeRuns(false);
+    for (auto &run : runs_) std::remove(run.c_str());
+    runs_.clear();
+    std::vector<T>().swap(buffer_);
+    buffer_pos_ = 0;
+  }
+
+private:
+  static constexpr size_t kMaxFanIn = 256;
+  static constexpr size_t kMinItems = 1024;
+
+  /// buffered sequential reader of one sorted run
+  struct RunReader
+  {
+    std::ifstream stream;
+    std::vector<T> items;
+    size_t pos = 0;
+    bool fill()
+    {
+      stream.read(reinterpret_cast<char *>(items.data()), static_cast<std::streamsize>(items.size() * sizeof(T)));
+      size_t count = static_cast<size_t>(stream.gcount()) / sizeof(T);
+      items.resize(count);
+      pos = 0;
+      return count > 0;
+    }
+  };
+  /// heap entries are the head item of each reader, ordered so the least item is on top
+  struct HeadGreater
+  {
+    Less less;
+    bool operator()(const std::pair<T, size_t> &a, const std::pair<T, size_t> &b) const
+    {
+      if (less(b.first, a.first))
+        return true;
+      if (less(a.first, b.first))
+        return false;
+      return a.second > b.second;  // equal items are returned in run order
+    }
+  };
+
+  std::string runName(size_t id) const { return temp_stub_ + "_" + std::to_string(id) + ".tmp"; }
+
+  bool writeRun()
+  {
+    std::sort(buffer_.begin(), buffer_.end(), less_);
+    std::string name = runName(num_runs_written_++);
+    std::ofstream out(name, std::ios::binary | std::ios::out);
+    runs_.push_back(name);
+    out.write(reinterpret_cast<const char *>(buffer_.data()), static_cast<std::streamsize>(buffer_.size() * sizeof(T)));
+    out.close();
+    if (out.fail())
+    {
+      std::cerr << "Error: failed to write temporary file " << name << std::endl;
+      return false;
+    }
+    buffer_.clear();
+    return true;
+  }
+
+  /// open the named runs for merging, sharing the item budget between their read buffers
+  bool openRuns(const std::vector<std::string> &names)
+  {
+    closeRuns(false);
+    const size_t items_per_run = std::max<size_t>(1, max_items_ / names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      std::unique_ptr<RunReader> reader(new RunReader);
+      reader->stream.open(names[i], std::ios::binary | std::ios::in);
+      if (!reader->stream.is_open())
+      {
+        std::cerr << "Error: failed to read temporary file " << names[i] << std::endl;
+        return false;
+      }
+      reader->items.resize(items_per_run);
+      if (reader->fill())
+        heap_.push(std::make_pair(reader->items[reader->pos++], readers_.size()));
+      readers_.push_back(std::move(reader));
+      reader_names_.push_back(names[i]);
+    }
+    return true;
+  }
+
+  /// close the open runs, deleting their files if @c remove_files
+  void closeRuns(bool remove_files)
+  {
+    readers_.clear();
+    heap_ = decltype(heap_)(HeadGreater{ less_ });
+    if (remove_files)
+    {
+      for (auto &name : reader_names_) std::remove(name.c_str());
+      for (auto &name : reader_names_) runs_.erase(std::remove(runs_.begin(), runs_.end(), name), runs_.end());
+    }
+    reader_names_.clear();
+  }
+
+  bool popItem(T &item)
+  {
+    if (heap_.empty())
+      return false;
+    item = heap_.top().first;
+    size_t id = heap_.top().second;
+    heap_.pop();
+    RunReader &reader = *readers_[id];
+    if (reader.pos < reader.items.size() || reader.fill())
+      heap_.push(std::make_pair(reader.items[reader.pos++], id));
+    return true;
+  }
+
+  std::string temp_stub_;
+  size_t max_items_;
+  Less less_;
+  std::vector<T> buffer_;
+  size_t buffer_pos_ = 0;
+  std::vector<std::string> runs_;
+  size_t num_runs_written_ = 0;
+  std::vector<std::unique_ptr<RunReader>> readers_;
+  std::vector<std::string> reader_names_;
+  std::priority_queue<std::pair<T, size_t>, std::vector<std::pair<T, size_t>>, HeadGreater> heap_;
+};
+
+template <class T, class Less>
+constexpr size_t ExternalSorter<T, Less>::kMaxFanIn;
+template <class T, class Less>
+constexpr size_t ExternalSorter<T, Less>::kMinItems;
+}  // namespace ray
+
+#endif  // RAYLIB_RAYEXTERNALSORT_H
@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "rayfinealignment.h"
+#include "rayneighbours.h"
 #include <nabo/nabo.h>
 
 namespace ray
@@ -90,20 +91,14 @@ void FineAlignment::generateSurfels()
     size_t q_size = candidates.size();
     size_t p_size = decimated_points.size();
     const int search_size = std::min(20, (int)p_size - 1);
-    Nabo::NNSearchD *nns;
     Eigen::MatrixXd points_q(3, q_size);
     for (size_t i = 0; i < q_size; i++) points_q.col(i) = candidate_points[i];
-    Eigen::MatrixXd points_p(3, p_size);
-    for (size_t i = 0; i < p_size; i++) points_p.col(i) = decimated_points[i];
-    nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+    Neighbours neighbours(decimated_points);
 
     // Run the search
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
-    nns->knn(points_q, indices, dists2, search_size, 0.01 * max_spacing, 0, max_spacing);
-    delete nns;
+    neighbours.knn(points_q, search_size, indices, dists2, max_spacing, 0.01 * max_spacing);
 
     // Convert these set of nearest neighbours into surfels
     surfels_[c].reserve(q_size);
@@ -113,7 +108,7 @@ void FineAlignment::generateSurfels()
     for (size_t i = 0; i < q_size; i++)
     {
       ids.clear();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) ids.push_back(indices(j, i));
+      for (int j = 0; j < search_size && indices(j, i) != Neighbours::kInvalidIndex; j++) ids.push_back(indices(j, i));
       if (ids.size() < min_points_per_ellipsoid)  // not dense enough
         continue;
 
@@ -0,0 +1,157 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/rayindexgrid.h"
+#include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
+#include "raylib/rayprogress.h"
+#include "raylib/rayparallel.h"
+
+namespace ray
+{
+namespace
+{
+/// call @c visit(index) for each voxel that the ray from @c ray_start to @c ray_end passes through, in order
+template <class Func>
+void walkVoxels(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, const Eigen::Vector3d &box_min,
+                double voxel_width, const Func &visit)
+{
+  Eigen::Vector3d dir = ray_end - ray_start;
+  Eigen::Vector3d dir_sign(sgn(dir[0]), sgn(dir[1]), sgn(dir[2]));
+  Eigen::Vector3d start = (ray_start - box_min) / voxel_width;
+  Eigen::Vector3d end = (ray_end - box_min) / voxel_width;
+  Eigen::Vector3i start_index((int)floor(start[0]), (int)floor(start[1]), (int)floor(start[2]));
+  Eigen::Vector3i end_index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
+  double length_sqr = (end_index - start_index).squaredNorm();
+  Eigen::Vector3i index = start_index;
+  for (;;)
+  {
+    visit(index);
+    if (index == end_index || (index - start_index).squaredNorm() > length_sqr)
+    {
+      break;
+    }
+    Eigen::Vector3d mid = box_min + voxel_width * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
+    Eigen::Vector3d next_boundary = mid + 0.5 * voxel_width * dir_sign;
+    Eigen::Vector3d delta = next_boundary - ray_start;
+    Eigen::Vector3d d(delta[0] / dir[0], delta[1] / dir[1], delta[2] / dir[2]);
+    if (d[0] < d[1] && d[0] < d[2])
+    {
+      index[0] += int(dir_sign[0]);
+    }
+    else if (d[1] < d[0] && d[1] < d[2])
+    {
+      index[1] += int(dir_sign[1]);
+    }
+    else
+    {
+      index[2] += int(dir_sign[2]);
+    }
+  }
+}
+}  // namespace
+
+void RayIndexGrid::init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
+{
+  this->box_min = box_min;
+  this->box_max = box_max;
+  this->voxel_width = voxel_width;
+  Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
+  dims = Eigen::Vector3i(diff.array().ceil().cast<int>());
+  cell_ids_.clear();
+  cell_offsets_.clear();
+  ray_ids_.clear();
+}
+
+template <class CloudT>
+void RayIndexGrid::seedRays(const CloudT &cloud)
+{
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    Eigen::Vector3d end = (cloud.end(i) - box_min) / voxel_width;
+    Eigen::Vector3i index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
+    cell_ids_.insert(index, (uint32_t)cell_ids_.size());
+  }
+}
+
+template <class CloudT>
+void RayIndexGrid::fillRays(const CloudT &cloud, Progress *progress)
+{
+  const size_t num_rays = cloud.rayCount();
+  if (progress)
+  {
+    progress->begin("fillRayGrid", num_rays);
+  }
+  // 1. count the seeded voxels on each ray, then sum them to give each ray's range in the list of ray voxels
+  std::vector<size_t> ray_offsets(num_rays + 1, 0);
+  parallelFor(num_rays, [&](size_t i) {
+    size_t count = 0;
+    walkVoxels(cloud.start(i), cloud.end(i), box_min, voxel_width, [&](const Eigen::Vector3i &index) {
+      if (cell_ids_.contains(index))
+        count++;
+    });
+    ray_offsets[i + 1] = count;
+  }, 1024);
+  for (size_t i = 0; i < num_rays; i++)
+  {
+    ray_offsets[i + 1] += ray_offsets[i];
+  }
+
+  // 2. list the seeded voxels of each ray
+  std::vector<uint32_t> ray_cells(ray_offsets[num_rays]);
+  parallelFor(num_rays, [&](size_t i) {
+    size_t pos = ray_offsets[i];
+    walkVoxels(cloud.start(i), cloud.end(i), box_min, voxel_width, [&](const Eigen::Vector3i &index) {
+      const uint32_t *id = cell_ids_.find(index);
+      if (id)
+        ray_cells[pos++] = *id;
+    });
+    if (progress)
+    {
+      progress->increment();
+    }
+  }, 1024);
+
+  // 3. counting sort the list by voxel. This is stable, so the rays in each voxel are in ascending order
+  cell_offsets_.assign(cell_ids_.size() + 1, 0);
+  for (auto &cell : ray_cells)
+  {
+    cell_offsets_[cell + 1]++;
+  }
+  for (size_t i = 0; i < cell_ids_.size(); i++)
+  {
+    cell_offsets_[i + 1] += cell_offsets_[i];
+  }
+  std::vector<size_t> next(cell_offsets_.begin(), cell_offsets_.end() - 1);
+  ray_ids_.resize(ray_cells.size());
+  for (size_t i = 0; i < num_rays; i++)
+  {
+    for (size_t j = ray_offsets[i]; j < ray_offsets[i + 1]; j++)
+    {
+      ray_ids_[next[ray_cells[j]]++] = (unsigned)i;
+    }
+  }
+}
+
+void RayIndexGrid::seed(const Cloud &cloud)
+{
+  seedRays(cloud);
+}
+
+void RayIndexGrid::seed(const CompactCloud &cloud)
+{
+  seedRays(cloud);
+}
+
+void RayIndexGrid::fill(const Cloud &cloud, Progress *progress)
+{
+  fillRays(cloud, progress);
+}
+
+void RayIndexGrid::fill(const CompactCloud &cloud, Progress *progress)
+{
+  fillRays(cloud, progress);
+}
+}  // namespace ray
@@ -0,0 +1,91 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYINDEXGRID_H
+#define RAYLIB_RAYINDEXGRID_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+#include "rayvoxelset.h"
+
+namespace ray
+{
+class Cloud;
+class CompactCloud;
+class Progress;
+
+/// Index of the rays that pass through each of a set of voxels, for fast lookup of the rays near a location.
+/// The voxels are chosen up front with @c seed(), then @c fill() stores the ray ids of all voxels in a single array,
+/// each voxel holding a contiguous range in ascending ray order (compressed sparse row form). It is built without
+/// locks or per-voxel allocations, by counting the voxels of each ray in parallel then scattering the ids.
+class RAYLIB_EXPORT RayIndexGrid
+{
+public:
+  /// the ids of the rays passing through one voxel
+  class Cell
+  {
+  public:
+    Cell(const unsigned *first, const unsigned *last)
+      : first_(first)
+      , last_(last)
+    {}
+    inline const unsigned *begin() const { return first_; }
+    inline const unsigned *end() const { return last_; }
+    inline size_t size() const { return (size_t)(last_ - first_); }
+    inline bool empty() const { return first_ == last_; }
+
+  private:
+    const unsigned *first_;
+    const unsigned *last_;
+  };
+
+  RayIndexGrid() {}
+  RayIndexGrid(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
+  {
+    init(box_min, box_max, voxel_width);
+  }
+  /// the voxels are relative to @c box_min. Rays are indexed outside of the box too
+  void init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width);
+
+  /// add the voxels containing the end points of @c cloud to the set of voxels to index
+  void seed(const Cloud &cloud);
+  void seed(const CompactCloud &cloud);
+
+  /// index the rays of @c cloud in the seeded voxels that they pass through. Replaces any previous fill
+  void fill(const Cloud &cloud, Progress *progress = nullptr);
+  void fill(const CompactCloud &cloud, Progress *progress = nullptr);
+
+  /// the rays in voxel @c x, @c y, @c z, empty if the voxel wasn't seeded
+  inline Cell cell(int x, int y, int z) const { return cell(Eigen::Vector3i(x, y, z)); }
+  Cell cell(const Eigen::Vector3i &index) const
+  {
+    const uint32_t *id = cell_ids_.find(index);
+    if (!id || cell_offsets_.empty())
+      return Cell(nullptr, nullptr);
+    return Cell(ray_ids_.data() + cell_offsets_[*id], ray_ids_.data() + cell_offsets_[*id + 1]);
+  }
+
+  /// number of seeded voxels
+  inline size_t numCells() const { return cell_ids_.size(); }
+  /// total number of ray ids stored over all voxels
+  inline size_t numEntries() const { return ray_ids_.size(); }
+
+  Eigen::Vector3d box_min, box_max;
+  double voxel_width;
+  Eigen::Vector3i dims;
+
+private:
+  template <class CloudT>
+  void seedRays(const CloudT &cloud);
+  template <class CloudT>
+  void fillRays(const CloudT &cloud, Progress *progress);
+
+  VoxelMap<uint32_t> cell_ids_;
+  std::vector<size_t> cell_offsets_;  // the range of cell i in ray_ids_ is cell_offsets_[i] to cell_offsets_[i+1]
+  std::vector<unsigned> ray_ids_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYINDEXGRID_H
@@ -0,0 +1,127 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raymappedfile.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RAYLIB_MMAP 1
+#else
+#define RAYLIB_MMAP 0
+#endif
+
+namespace ray
+{
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const std::string &file_name)
+{
+  close();
+#if RAYLIB_MMAP
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd == -1)
+  {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+  {
+    size_ = static_cast<size_t>(file_stat.st_size);
+    void *map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      map_ = static_cast<unsigned char *>(map);
+      madvise(map_, size_, MADV_SEQUENTIAL);
+    }
+  }
+  ::close(fd);  // the mapping holds its own reference to the file
+  if (map_)
+  {
+    is_open_ = true;
+    return true;
+  }
+#endif
+  // fall back to buffered reads
+  stream_.open(file_name.c_str(), std::ios::in | std::ios::binary);
+  if (stream_.fail())
+  {
+    return false;
+  }
+  stream_.seekg(0, stream_.end);
+  size_ = static_cast<size_t>(stream_.tellg());
+  stream_.seekg(0, stream_.beg);
+  is_open_ = true;
+  return true;
+}
+
+void MappedFile::close()
+{
+#if RAYLIB_MMAP
+  if (map_)
+  {
+    munmap(map_, size_);
+  }
+#endif
+  map_ = nullptr;
+  if (stream_.is_open())
+  {
+    stream_.close();
+  }
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  size_ = 0;
+  released_ = 0;
+  is_open_ = false;
+}
+
+const unsigned char *MappedFile::data(size_t offset, size_t length)
+{
+  if (!is_open_ || offset > size_ || length > size_ - offset)
+  {
+    return nullptr;
+  }
+  if (map_)
+  {
+    return map_ + offset;
+  }
+  buffer_.resize(length);
+  stream_.clear();
+  stream_.seekg(static_cast<std::streamoff>(offset));
+  if (length > 0 && !stream_.read(reinterpret_cast<char *>(buffer_.data()), static_cast<std::streamsize>(length)))
+  {
+    return nullptr;
+  }
+  return buffer_.data();
+}
+
+void MappedFile::release(size_t offset)
+{
+#if RAYLIB_MMAP
+  if (!map_)
+  {
+    return;
+  }
+  // madvise requires page-aligned ranges
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t end = (std::min(offset, size_) / page_size) * page_size;
+  if (end > released_)
+  {
+    madvise(map_ + released_, end - released_, MADV_DONTNEED);
+    released_ = end;
+  }
+#else
+  (void)offset;
+#endif
+}
+
+}  // namespace ray
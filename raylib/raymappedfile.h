@@ -0,0 +1,55 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYMAPPEDFILE_H
+#define RAYLIB_RAYMAPPEDFILE_H
+
+#include "raylib/raylibconfig.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ray
+{
+/// Read-only random access to the bytes of a binary file. Where the platform supports it the file is
+/// memory-mapped, so reading a range is free of copies. Otherwise the requested ranges are read into
+/// an internal buffer.
+class RAYLIB_EXPORT MappedFile
+{
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /// open @c file_name for reading, returns false on failure
+  bool open(const std::string &file_name);
+  void close();
+  inline bool isOpen() const { return is_open_; }
+  /// total length of the file in bytes
+  inline size_t size() const { return size_; }
+
+  /// Pointer to the @c length bytes at @c offset in the file, or nullptr if the range is not in the file.
+  /// The pointer is valid until the next call to data() or close().
+  const unsigned char *data(size_t offset, size_t length);
+
+  /// Hint that the bytes before @c offset will not be requested again, so their pages can be dropped.
+  /// This keeps the resident memory bounded when streaming through very large files.
+  void release(size_t offset);
+
+private:
+  bool is_open_ = false;
+  size_t size_ = 0;
+  unsigned char *map_ = nullptr;
+  size_t released_ = 0;
+  // fallback when memory mapping is unavailable
+  std::ifstream stream_;
+  std::vector<unsigned char> buffer_;
+};
+
+}  // namespace ray
+
+#endif  // RAYLIB_RAYMAPPEDFILE_H
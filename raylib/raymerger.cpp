@@ -5,7 +5,10 @@
 // Author: Kazys Stepanas, Tom Lowe
 #include "raymerger.h"
 
-#include "raygrid.h"
+#include "raycloudwriter.h"
+#include "raycompactcloud.h"
+#include "raycuboid.h"
+#include "rayexternalsort.h"
 #include "rayprogress.h"
 #include "rayunused.h"
 
@@ -52,8 +55,9 @@ public:
   /// @param merge_type The merging strategy.
   /// @param self_transient True when the @p ellipsoid was generated from @p cloud and we are looking for transient
   /// points within this cloud.
-  void mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud,
-            const Grid<unsigned> &ray_grid, double num_rays, MergeType merge_type, bool self_transient,
+  template <class CloudT>
+  void mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks, const CloudT &cloud,
+            const RayIndexGrid &ray_grid, double num_rays, MergeType merge_type, bool self_transient,
             bool ellipsoid_cloud_first);
 
 private:
@@ -65,6 +69,9 @@ private:
   std::vector<unsigned> test_ray_ids;
   /// Ids of rays which intersect the ellipsoid with a @c IntersectResult::Passthrough result.
   std::vector<unsigned> pass_through_ids;
+  /// The rays to test, gathered for batch intersection, and their results.
+  RayBatch test_rays;
+  std::vector<IntersectResult> test_results;
 };
 
 typedef Eigen::Matrix<double, 6, 1> Vector6i;
@@ -106,8 +113,9 @@ void rayLookup(const Cloud *cloud, std::set<Vector6i, Vector6iLess> &ray_lookup)
   }
 }
 
+template <class CloudT>
 void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks,
-                                    const Cloud &cloud, const Grid<unsigned> &ray_grid, double num_rays,
+                                    const CloudT &cloud, const RayIndexGrid &ray_grid, double num_rays,
                                     MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first)
 {
   if (ellipsoid->transient)
@@ -157,8 +165,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     {
       for (int z = bmin[2]; z <= bmax[2]; z++)
       {
-        auto &ray_list = ray_grid.cell(x, y, z).data;
-        for (auto &ray_id : ray_list)
+        for (auto &ray_id : ray_grid.cell(x, y, z))
         {
           if (ray_tested[ray_id])
           {
@@ -174,11 +181,17 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   double first_intersection_time = std::numeric_limits<double>::max();
   double last_intersection_time = std::numeric_limits<double>::lowest();
   unsigned hits = 0;
+  test_rays.clear();
   for (auto &ray_id : test_ray_ids)
   {
     ray_tested[ray_id] = false;
-
-    switch (ellipsoid->intersect(cloud.starts[ray_id], cloud.ends[ray_id]))
+    test_rays.add(cloud.start(ray_id), cloud.end(ray_id));
+  }
+  ellipsoid->intersect(test_rays, test_results);
+  for (size_t i = 0; i < test_ray_ids.size(); i++)
+  {
+    const unsigned ray_id = test_ray_ids[i];
+    switch (test_results[i])
     {
     default:
     case IntersectResult::Miss:
@@ -189,8 +202,8 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
       break;
     case IntersectResult::Hit:
       ++hits;
-      first_intersection_time = std::min(first_intersection_time, cloud.times[ray_id]);
-      last_intersection_time = std::max(last_intersection_time, cloud.times[ray_id]);
+      first_intersection_time = std::min(first_intersection_time, cloud.time(ray_id));
+      last_intersection_time = std::max(last_intersection_time, cloud.time(ray_id));
       break;
     }
   }
@@ -212,11 +225,11 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     double misses = 0;
     for (auto &ray_id : pass_through_ids)
     {
-      if (cloud.times[ray_id] > last_intersection_time)
+      if (cloud.time(ray_id) > last_intersection_time)
       {
         num_after++;
       }
-      else if (cloud.times[ray_id] < first_intersection_time)
+      else if (cloud.time(ray_id) < first_intersection_time)
       {
         num_before++;
       }
@@ -233,7 +246,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   {
     if (pass_through_ids.size() > 0)
     {
-      if (cloud.times[pass_through_ids[0]] > ellipsoid->time)
+      if (cloud.time(pass_through_ids[0]) > ellipsoid->time)
       {
         num_after = pass_through_ids.size();
       }
@@ -305,8 +318,8 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
       }
 
       unsigned ray_id = pass_through_ids[j];
-      if (!self_transient || cloud.times[ray_id] < first_intersection_time ||
-          cloud.times[ray_id] > last_intersection_time)
+      if (!self_transient || cloud.time(ray_id) < first_intersection_time ||
+          cloud.time(ray_id) > last_intersection_time)
       {
         // remove ray i
         (*transient_ray_marks)[ray_id] = true;
@@ -315,6 +328,72 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   }
 }
 
+namespace
+{
+/// A ray copied into one of the tiles that it passes near, for the tiled filter
+struct TileRay
+{
+  uint32_t tile;
+  uint64_t index;  // in the cloud file
+  double start[3];
+  double end[3];
+  double time;
+  RGBA colour;
+};
+
+/// Orders the rays by tile, and within each tile by their order in the cloud file
+struct TileRayLess
+{
+  inline bool operator()(const TileRay &a, const TileRay &b) const
+  {
+    if (a.tile != b.tile)
+      return a.tile < b.tile;
+    return a.index < b.index;
+  }
+};
+
+/// Writes the results of filtering a CompactCloud to two cloud files a chunk at a time, so that the results are never
+/// held in memory as a whole
+class SplitCloudWriter
+{
+public:
+  bool begin(const std::string &transient_file, const std::string &fixed_file)
+  {
+    return transient_.begin(transient_file) && fixed_.begin(fixed_file);
+  }
+  void add(bool transient, const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour)
+  {
+    Cloud &chunk = transient ? transient_chunk_ : fixed_chunk_;
+    chunk.addRay(start, end, time, colour);
+    (transient ? num_transient_ : num_fixed_)++;
+    if (chunk.rayCount() == CompactCloud::kChunkSize)
+    {
+      success_ &= (transient ? transient_ : fixed_).writeChunk(chunk);
+      chunk.clear();
+    }
+  }
+  /// write the remaining rays and finish both files, returns false if either could not be written
+  bool end()
+  {
+    if (transient_chunk_.rayCount() > 0)
+      success_ &= transient_.writeChunk(transient_chunk_);
+    if (fixed_chunk_.rayCount() > 0)
+      success_ &= fixed_.writeChunk(fixed_chunk_);
+    success_ &= transient_.end();
+    success_ &= fixed_.end();
+    return success_;
+  }
+  inline size_t numTransient() const { return num_transient_; }
+  inline size_t numFixed() const { return num_fixed_; }
+
+private:
+  CloudWriter transient_, fixed_;
+  Cloud transient_chunk_, fixed_chunk_;
+  size_t num_transient_ = 0, num_fixed_ = 0;
+  bool success_ = true;
+};
+}  // namespace
+
 Merger::Merger(const MergerConfig &config)
   : config_(config)
 {}
@@ -332,8 +411,51 @@ bool Merger::filter(const Cloud &cloud, Progress *progress)
 
   clear();
 
+  // Atomic do not support assignment and construction so we can't really retain the vector memory.
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  markFilterTransients(cloud, &transient_ray_marks, progress);
+
+  finaliseFilter(cloud, transient_ray_marks);
+
+  progress->end();
+
+  return true;
+}
+
+bool Merger::filter(const CompactCloud &cloud, const std::string &transient_file, const std::string &fixed_file,
+                    Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  clear();
+
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  markFilterTransients(cloud, &transient_ray_marks, progress);
+
+  SplitCloudWriter writer;
+  if (!writer.begin(transient_file, fixed_file))
+  {
+    return false;
+  }
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    writer.add(ellipsoids_[i].transient || transient_ray_marks[i], cloud.start(i), cloud.end(i), cloud.time(i),
+               filteredColour(cloud.colour(i), i));
+  }
+  ellipsoids_.clear();
+  progress->end();
+  return writer.end();
+}
+
+template <class CloudT>
+void Merger::markFilterTransients(const CloudT &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress)
+{
   Eigen::Vector3d bounds_min, bounds_max;
-  generateEllipsoids(&ellipsoids_, &bounds_min, &bounds_max, cloud, progress);
+  generateEllipsoidsCached(config_.ellipsoid_cache, &ellipsoids_, &bounds_min, &bounds_max, cloud, progress);
 
   const double voxel_size = voxelSizeForCloud(cloud);
   if (config_.voxel_size == 0)
@@ -341,19 +463,207 @@ bool Merger::filter(const Cloud &cloud, Progress *progress)
     std::cout << "estimated required voxel size: " << voxel_size << std::endl;
   }
 
-  Grid<unsigned> ray_grid(bounds_min, bounds_max, voxel_size);
-  seedRayGrid(&ray_grid, cloud);
-  fillRayGrid(&ray_grid, cloud, progress);
+  RayIndexGrid ray_grid(bounds_min, bounds_max, voxel_size);
+  ray_grid.seed(cloud);
+  ray_grid.fill(cloud, progress);
 
-  // Atomic do not support assignment and construction so we can't really retain the vector memory.
-  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
-  markIntersectedEllipsoids(cloud, ray_grid, &transient_ray_marks, config_.num_rays_filter_threshold, true, progress);
+  markIntersectedEllipsoids(cloud, ray_grid, transient_ray_marks, config_.num_rays_filter_threshold, true, progress);
+}
 
-  finaliseFilter(cloud, transient_ray_marks);
+bool Merger::filterTiled(const std::string &file_stub, double tile_width, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+  clear();
+  const std::string file_name = file_stub + ".ply";
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+  {
+    return false;
+  }
+  double voxel_size = config_.voxel_size;
+  if (voxel_size <= 0)
+  {
+    voxel_size = 4.0 * Cloud::estimatePointSpacing(file_name, info.ends_bound, info.num_bounded);
+    std::cout << "estimated required voxel size: " << voxel_size << std::endl;
+  }
+  // each tile is filtered with the rays that pass within this margin of it, so that its ellipsoids near the edge see
+  // their neighbouring points and the rays that pass through them
+  const double margin = std::max(1.0, 4.0 * voxel_size);
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d extent = info.rays_bound.max_bound_ - min_bound;
+  const int tiles_x = 1 + static_cast<int>(extent[0] / tile_width);
+  const int tiles_y = 1 + static_cast<int>(extent[1] / tile_width);
+  if ((double)tiles_x * (double)tiles_y > (double)std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "Error: tile width " << tile_width << " m is too small for the cloud extent" << std::endl;
+    return false;
+  }
+  std::cout << "filtering in " << tiles_x << " x " << tiles_y << " tiles" << std::endl;
+  auto tile_of = [&](double x, double y) {
+    const int tx = std::max(0, std::min(static_cast<int>(std::floor((x - min_bound[0]) / tile_width)), tiles_x - 1));
+    const int ty = std::max(0, std::min(static_cast<int>(std::floor((y - min_bound[1]) / tile_width)), tiles_y - 1));
+    return Eigen::Vector2i(tx, ty);
+  };
 
-  progress->end();
+  // 1. copy each ray into every tile that it passes within the margin of, sorting them by tile on disk
+  const size_t sort_memory = size_t(1) << 29;
+  ExternalSorter<TileRay, TileRayLess> tile_rays(file_stub + "_transient_tiles", sort_memory / sizeof(TileRay));
+  uint64_t num_rays = 0;
+  std::vector<bool> tile_used(static_cast<size_t>(tiles_x) * static_cast<size_t>(tiles_y), false);
+  size_t num_used_tiles = 0;
+  bool success = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+    {
+      const Eigen::Vector3d ray_min = minVector(starts[i], ends[i]);
+      const Eigen::Vector3d ray_max = maxVector(starts[i], ends[i]);
+      const Eigen::Vector2i tile_min = tile_of(ray_min[0] - margin, ray_min[1] - margin);
+      const Eigen::Vector2i tile_max = tile_of(ray_max[0] + margin, ray_max[1] + margin);
+      for (int ty = tile_min[1]; ty <= tile_max[1]; ty++)
+      {
+        for (int tx = tile_min[0]; tx <= tile_max[0]; tx++)
+        {
+          Cuboid tile(min_bound + Eigen::Vector3d(tx * tile_width - margin, ty * tile_width - margin, -margin),
+                      min_bound + Eigen::Vector3d((tx + 1) * tile_width + margin, (ty + 1) * tile_width + margin,
+                                                  extent[2] + margin));
+          Eigen::Vector3d start = starts[i], end = ends[i];
+          if (!tile.clipRay(start, end))
+          {
+            continue;
+          }
+          TileRay tile_ray;
+          tile_ray.tile = static_cast<uint32_t>(tx + tiles_x * ty);
+          if (!tile_used[tile_ray.tile])
+          {
+            tile_used[tile_ray.tile] = true;
+            num_used_tiles++;
+          }
+          tile_ray.index = num_rays;
+          for (int j = 0; j < 3; j++)
+          {
+            tile_ray.start[j] = starts[i][j];
+            tile_ray.end[j] = ends[i][j];
+          }
+          tile_ray.time = times[i];
+          tile_ray.colour = colours[i];
+          success = tile_rays.add(tile_ray);
+        }
+      }
+    }
+  };
+  if (!Cloud::read(file_name, add_rays, 1) || !success || !tile_rays.sort())
+  {
+    return false;
+  }
 
-  return true;
+  // 2. filter each tile in turn. Only the ellipsoids of rays that end in the tile are tested, and the resulting
+  // marks are gathered per ray of the cloud
+  std::vector<bool> transient(num_rays, false);
+  std::vector<uint8_t> opacities, gones;
+  if (config_.colour_cloud)
+  {
+    opacities.resize(num_rays, 255);
+    gones.resize(num_rays, 0);
+  }
+  tile_used.clear();
+  tile_used.shrink_to_fit();
+  progress->begin("transient-filter-tiles", num_used_tiles);  // only the tiles that rays pass through are filtered
+  Cloud cloud;
+  std::vector<uint64_t> indices;
+  auto filter_tile = [&](uint32_t tile) {
+    Progress tile_progress;
+    Eigen::Vector3d bounds_min, bounds_max;
+    // not cached, as the tile clouds are temporary and the cache would gather a file per tile on every run
+    generateEllipsoids(&ellipsoids_, &bounds_min, &bounds_max, cloud);
+    std::vector<bool> in_tile(cloud.rayCount());
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      const Eigen::Vector2i t = tile_of(cloud.ends[i][0], cloud.ends[i][1]);
+      in_tile[i] = static_cast<uint32_t>(t[0] + tiles_x * t[1]) == tile;
+      if (!in_tile[i])
+      {
+        ellipsoids_[i].extents.setZero();  // so it is not tested here. It is tested in the tile that it ends in
+      }
+    }
+    RayIndexGrid ray_grid(bounds_min, bounds_max, voxel_size);
+    ray_grid.seed(cloud);
+    ray_grid.fill(cloud);
+    std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+    markIntersectedEllipsoids(cloud, ray_grid, &transient_ray_marks, config_.num_rays_filter_threshold, true,
+                              &tile_progress);
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (transient_ray_marks[i] || (in_tile[i] && ellipsoids_[i].transient))
+      {
+        transient[indices[i]] = true;
+      }
+      if (in_tile[i] && config_.colour_cloud)
+      {
+        const Ellipsoid &ellipsoid = ellipsoids_[i];
+        opacities[indices[i]] = (uint8_t)(ellipsoid.opacity * 255.0);
+        gones[indices[i]] = (uint8_t)((double)ellipsoid.num_gone / ((double)ellipsoid.num_gone + 10.0) * 255.0);
+      }
+    }
+    progress->increment();
+  };
+  TileRay tile_ray;
+  bool has_ray = tile_rays.next(tile_ray);
+  while (has_ray)
+  {
+    const uint32_t tile = tile_ray.tile;
+    cloud.clear();
+    indices.clear();
+    for (; has_ray && tile_ray.tile == tile; has_ray = tile_rays.next(tile_ray))
+    {
+      cloud.addRay(Eigen::Vector3d(tile_ray.start[0], tile_ray.start[1], tile_ray.start[2]),
+                   Eigen::Vector3d(tile_ray.end[0], tile_ray.end[1], tile_ray.end[2]), tile_ray.time, tile_ray.colour);
+      indices.push_back(tile_ray.index);
+    }
+    filter_tile(tile);
+  }
+  tile_rays.clear();
+  cloud.clear();
+  ellipsoids_.clear();
+  ellipsoids_.shrink_to_fit();
+
+  // 3. split the cloud file into the transient and fixed rays
+  CloudWriter transient_writer, fixed_writer;
+  if (!transient_writer.begin(file_stub + "_transient.ply") || !fixed_writer.begin(file_stub + "_fixed.ply"))
+  {
+    return false;
+  }
+  Cloud transient_chunk, fixed_chunk;
+  uint64_t index = 0;
+  auto split = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                   std::vector<double> &times, std::vector<RGBA> &colours) {
+    transient_chunk.clear();
+    fixed_chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++, index++)
+    {
+      RGBA col = colours[i];
+      if (config_.colour_cloud)
+      {
+        col.red = (uint8_t)0;
+        col.blue = opacities[index];
+        col.green = gones[index];
+      }
+      (transient[index] ? transient_chunk : fixed_chunk).addRay(starts[i], ends[i], times[i], col);
+    }
+    success &= transient_writer.writeChunk(transient_chunk) && fixed_writer.writeChunk(fixed_chunk);
+  };
+  if (!Cloud::read(file_name, split, 1))
+  {
+    return false;
+  }
+  success &= transient_writer.end();
+  success &= fixed_writer.end();
+  progress->end();
+  return success;
 }
 
 bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
@@ -367,7 +677,66 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
 
   clear();
 
-  std::vector<Grid<unsigned>> grids(clouds.size());
+  std::vector<std::vector<Bool>> transient_ray_marks;
+  markMergeTransients(clouds, &transient_ray_marks, progress);
+
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    auto &cloud = clouds[c];
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (transient_ray_marks[c][i])
+      {
+        difference_.addRay(cloud, i);
+      }
+      else
+      {
+        fixed_.addRay(cloud, i);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool Merger::mergeMultiple(const std::vector<CompactCloud> &clouds, const std::string &fixed_file,
+                           const std::string &difference_file, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  clear();
+
+  std::vector<std::vector<Bool>> transient_ray_marks;
+  markMergeTransients(clouds, &transient_ray_marks, progress);
+  ellipsoids_.clear();
+
+  SplitCloudWriter writer;
+  if (!writer.begin(difference_file, fixed_file))
+  {
+    return false;
+  }
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    const CompactCloud &cloud = clouds[c];
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      writer.add(transient_ray_marks[c][i], cloud.start(i), cloud.end(i), cloud.time(i), cloud.colour(i));
+    }
+  }
+  const bool success = writer.end();
+  std::cout << writer.numTransient() << " transients, " << writer.numFixed() << " fixed rays." << std::endl;
+  return success;
+}
+
+template <class CloudT>
+void Merger::markMergeTransients(const std::vector<CloudT> &clouds,
+                                 std::vector<std::vector<Bool>> *transient_ray_marks, Progress *progress)
+{
+  std::vector<RayIndexGrid> grids(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
     const double voxel_size = voxelSizeForCloud(clouds[c]);
@@ -378,28 +747,27 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
     grids[c].init(clouds[c].calcMinBound(), clouds[c].calcMaxBound(), voxel_size);
     for (size_t d = 0; d < clouds.size(); d++)
     {
-      seedRayGrid(&grids[c], clouds[d]);
+      grids[c].seed(clouds[d]);
     }
   }
 
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    fillRayGrid(&grids[c], clouds[c], progress);
+    grids[c].fill(clouds[c], progress);
   }  
 
-  std::vector<std::vector<Bool>> transient_ray_marks;
-  transient_ray_marks.reserve(clouds.size());
+  transient_ray_marks->reserve(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    transient_ray_marks.emplace_back(std::vector<Bool>(clouds[c].rayCount() MARKER_BOOL_INIT));
+    transient_ray_marks->emplace_back(std::vector<Bool>(clouds[c].rayCount() MARKER_BOOL_INIT));
   }
 
   // now for each cloud, look for other clouds that penetrate it
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    generateEllipsoids(&ellipsoids_, nullptr, nullptr, clouds[c], progress);
+    generateEllipsoidsCached(config_.ellipsoid_cache, &ellipsoids_, nullptr, nullptr, clouds[c], progress);
     // just set opacity
-    markIntersectedEllipsoids(clouds[c], grids[c], &transient_ray_marks[c], 0, false, progress);
+    markIntersectedEllipsoids(clouds[c], grids[c], &(*transient_ray_marks)[c], 0, false, progress);
 
     for (size_t d = 0; d < clouds.size(); d++)
     {
@@ -409,36 +777,18 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
       }
       const bool ellipsoid_cloud_first = c < d;  // used when argument order of the files is the merge type
       // use ellipsoid opacity to set transient flag true on transients
-      markIntersectedEllipsoids(clouds[d], grids[d], &transient_ray_marks[d], config_.num_rays_filter_threshold, false,
-                                progress, ellipsoid_cloud_first);
+      markIntersectedEllipsoids(clouds[d], grids[d], &(*transient_ray_marks)[d], config_.num_rays_filter_threshold,
+                                false, progress, ellipsoid_cloud_first);
     }
 
     for (size_t i = 0; i < clouds[c].rayCount(); i++)
     {
       if (ellipsoids_[i].transient)
       {
-        transient_ray_marks[c][i] = true;
+        (*transient_ray_marks)[c][i] = true;
       }
     }
   }
-
-  for (size_t c = 0; c < clouds.size(); c++)
-  {
-    auto &cloud = clouds[c];
-    for (size_t i = 0; i < cloud.rayCount(); i++)
-    {
-      if (transient_ray_marks[c][i])
-      {
-        difference_.addRay(cloud, i);
-      }
-      else
-      {
-        fixed_.addRay(cloud, i);
-      }
-    }
-  }
-
-  return true;
 }
 
 bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress)
@@ -524,13 +874,13 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
   }
   // otherwise we run combine on the altered clouds
   // first, grid the rays for fast lookup
-  Grid<unsigned> grids[2];
+  RayIndexGrid grids[2];
   for (int c = 0; c < 2; c++)
   {
     grids[c].init(clouds[c]->calcMinBound(), clouds[c]->calcMaxBound(), voxelSizeForCloud(*clouds[c]));
-    seedRayGrid(&grids[c], *clouds[0]); // to only fill rays in voxels occupied by cloud 0 or 1
-    seedRayGrid(&grids[c], *clouds[1]);
-    fillRayGrid(&grids[c], *clouds[c], progress);
+    grids[c].seed(*clouds[0]); // to only fill rays in voxels occupied by cloud 0 or 1
+    grids[c].seed(*clouds[1]);
+    grids[c].fill(*clouds[c], progress);
   }
 
   std::vector<Bool> transients[2] = { std::vector<Bool>(clouds[0]->rayCount() MARKER_BOOL_INIT),
@@ -542,7 +892,7 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
     {
       continue;
     }
-    generateEllipsoids(&ellipsoids_, nullptr, nullptr, *clouds[c]);
+    generateEllipsoidsCached(config_.ellipsoid_cache, &ellipsoids_, nullptr, nullptr, *clouds[c]);
 
     // just set opacity
     markIntersectedEllipsoids(*clouds[c], grids[c], &transients[c], 0, false, progress);
@@ -589,88 +939,8 @@ void Merger::clear()
   ellipsoids_.clear();
 }
 
-void Merger::seedRayGrid(Grid<unsigned> *grid, const Cloud &cloud)
-{
-  const auto seed_voxels = [grid, &cloud](unsigned i)
-  {
-    Eigen::Vector3d end = (cloud.ends[i] - grid->box_min) / grid->voxel_width;
-    Eigen::Vector3i index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
-    grid->addCell(index);
-  };
-#if RAYLIB_PARALLEL_GRID
-  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), seed_voxels);
-#else   // RAYLIB_PARALLEL_GRID
-  const unsigned int count = static_cast<unsigned int>(cloud.rayCount());
-//  #pragma omp parallel for schedule(static)
-  for (unsigned int i = 0; i < count; ++i)
-  {
-    seed_voxels(i);
-  }
-#endif  // RAYLIB_PARALLEL_GRID
-}
-
-void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress)
-{
-  if (progress)
-  {
-    progress->begin("fillRayGrid", cloud.rayCount());
-  }
-
-  const auto add_ray = [grid, &cloud, progress](unsigned i)  //
-  {
-    Eigen::Vector3d dir = cloud.ends[i] - cloud.starts[i];
-    Eigen::Vector3d dir_sign(sgn(dir[0]), sgn(dir[1]), sgn(dir[2]));
-    Eigen::Vector3d start = (cloud.starts[i] - grid->box_min) / grid->voxel_width;
-    Eigen::Vector3d end = (cloud.ends[i] - grid->box_min) / grid->voxel_width;
-    Eigen::Vector3i start_index((int)floor(start[0]), (int)floor(start[1]), (int)floor(start[2]));
-    Eigen::Vector3i end_index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
-    double length_sqr = (end_index - start_index).squaredNorm();
-    Eigen::Vector3i index = start_index;
-    for (;;)
-    {
-      grid->insertIfCellExists(index, i);
-      if (index == end_index || (index - start_index).squaredNorm() > length_sqr)
-      {
-        break;
-      }
-      Eigen::Vector3d mid =
-        grid->box_min + grid->voxel_width * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
-      Eigen::Vector3d next_boundary = mid + 0.5 * grid->voxel_width * dir_sign;
-      Eigen::Vector3d delta = next_boundary - cloud.starts[i];
-      Eigen::Vector3d d(delta[0] / dir[0], delta[1] / dir[1], delta[2] / dir[2]);
-      if (d[0] < d[1] && d[0] < d[2])
-      {
-        index[0] += int(dir_sign[0]);
-      }
-      else if (d[1] < d[0] && d[1] < d[2])
-      {
-        index[1] += int(dir_sign[1]);
-      }
-      else
-      {
-        index[2] += int(dir_sign[2]);
-      }
-    }
-
-    if (progress)
-    {
-      progress->increment();
-    }
-  };
-
-#if RAYLIB_PARALLEL_GRID
-  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), add_ray);
-#else   // RAYLIB_PARALLEL_GRID
-  const unsigned int count = static_cast<unsigned int>(cloud.rayCount());
-//  #pragma omp parallel for schedule(static)
-  for (unsigned int i = 0; i < count; ++i)
-  {
-    add_ray(i);
-  }
-#endif  // RAYLIB_PARALLEL_GRID
-}
-
-double Merger::voxelSizeForCloud(const Cloud &cloud) const
+template <class CloudT>
+double Merger::voxelSizeForCloud(const CloudT &cloud) const
 {
   double voxel_size = config_.voxel_size;
   if (voxel_size <= 0)
@@ -688,7 +958,8 @@ double Merger::voxelSizeForCloud(const Cloud &cloud) const
   return voxel_size;
 }
 
-void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
+template <class CloudT>
+void Merger::markIntersectedEllipsoids(const CloudT &cloud, const RayIndexGrid &ray_grid,
                                        std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
                                        Progress *progress, bool ellipsoid_cloud_first)
 {
@@ -730,13 +1001,7 @@ void Merger::finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transie
   // Lastly, generate the new ray clouds from this sphere information
   for (size_t i = 0; i < ellipsoids_.size(); i++)
   {
-    RGBA col = cloud.colours[i];
-    if (config_.colour_cloud)
-    {
-      col.red = (uint8_t)0;
-      col.blue = (uint8_t)(ellipsoids_[i].opacity * 255.0);
-      col.green = (uint8_t)((double)ellipsoids_[i].num_gone / ((double)ellipsoids_[i].num_gone + 10.0) * 255.0);
-    }
+    const RGBA col = filteredColour(cloud.colours[i], i);
 
     if (ellipsoids_[i].transient || transient_ray_marks[i])
     {
@@ -754,4 +1019,16 @@ void Merger::finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transie
     }
   }
 }
+
+RGBA Merger::filteredColour(const RGBA &colour, size_t i) const
+{
+  RGBA col = colour;
+  if (config_.colour_cloud)
+  {
+    col.red = (uint8_t)0;
+    col.blue = (uint8_t)(ellipsoids_[i].opacity * 255.0);
+    col.green = (uint8_t)((double)ellipsoids_[i].num_gone / ((double)ellipsoids_[i].num_gone + 10.0) * 255.0);
+  }
+  return col;
+}
 }  // namespace ray
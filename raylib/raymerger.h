@@ -9,15 +9,17 @@
 
 #include "raycloud.h"
 #include "rayellipsoid.h"
-#include "raygrid.h"
+#include "rayindexgrid.h"
 
 #include <atomic>
 #include <limits>
+#include <string>
 #include <vector>
 
 namespace ray
 {
 class Cloud;
+class CompactCloud;
 class Progress;
 
 /// Mode selection for @c Merger
@@ -40,6 +42,9 @@ struct RAYLIB_EXPORT MergerConfig
   double num_rays_filter_threshold = 20;
   MergeType merge_type = MergeType::Mininum;
   bool colour_cloud = true;
+  /// Existing directory in which to save the ellipsoids of each cloud, for reuse when the same cloud is merged again.
+  /// Empty to regenerate them every time.
+  std::string ellipsoid_cache;
 };
 
 /// A cloud merger which supports filtering 'transient' rays and merging from a ray clouds. A transient ray is one which
@@ -67,43 +72,61 @@ public:
   /// Perform the transient filtering on the given @p cloud .
   bool filter(const Cloud &cloud, Progress *progress = nullptr);
 
+  /// As above, for a cloud held in a CompactCloud. The results are written to @c transient_file and @c fixed_file as
+  /// they are classified, rather than held in @c differenceCloud() and @c fixedCloud(), so no copy of the rays is kept
+  bool filter(const CompactCloud &cloud, const std::string &transient_file, const std::string &fixed_file,
+              Progress *progress = nullptr);
+
+  /// Out-of-core transient filtering of the cloud file @c file_stub.ply, for clouds larger than memory. The scene is
+  /// split horizontally into square tiles of @c tile_width metres, and each tile is filtered in turn together with
+  /// every ray that passes within a margin of it. The results are written to @c file_stub_transient.ply and
+  /// @c file_stub_fixed.ply, rather than held in @c differenceCloud() and @c fixedCloud(). Peak memory is set by the
+  /// rays per tile, plus one bit per ray in the cloud (three bytes with @c colour_cloud). The per-tile ellipsoids are not
+  /// saved to the @c ellipsoid_cache.
+  bool filterTiled(const std::string &file_stub, double tile_width, Progress *progress = nullptr);
+
   /// Multi-merge
   bool mergeMultiple(std::vector<Cloud> &clouds, Progress *progress = nullptr);
 
+  /// Multi-merge of clouds held in CompactClouds. The merged rays are written to @c fixed_file and the removed rays to
+  /// @c difference_file, rather than held in @c fixedCloud() and @c differenceCloud()
+  bool mergeMultiple(const std::vector<CompactCloud> &clouds, const std::string &fixed_file,
+                     const std::string &difference_file, Progress *progress = nullptr);
+
   /// Three way merger
   bool mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress = nullptr);
 
   /// Reset previous results. Memory is retained.
   void clear();
 
-  // seed the ray grid, to tell it which voxels it needs to add rays in
-  void seedRayGrid(Grid<unsigned> *grid, const Cloud &cloud);
+private:
+  template <class CloudT>
+  double voxelSizeForCloud(const CloudT &cloud) const;
 
-  /// Fill a @p grid with with rays from @p cloud . For each ray we add its index to each grid cell it traces through.
-  ///
-  /// The grid bounds must be set sufficiently large to hold the rays before calling. The grid resolution is also set
-  /// before calling
-  ///
-  /// @param grid The grid to populate
-  /// @param cloud The cloud which grid indices reference rays in.
-  /// @param progress Optional progress tracker.
-  /// @todo This needs a more global home
-  static void fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress);
+  /// The transient filter of @c cloud, marking the transient ellipsoids and @c transient_ray_marks
+  template <class CloudT>
+  void markFilterTransients(const CloudT &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress);
 
-private:
-  double voxelSizeForCloud(const Cloud &cloud) const;
+  /// The multi-merge of @c clouds, marking the @c transient_ray_marks of each cloud
+  template <class CloudT>
+  void markMergeTransients(const std::vector<CloudT> &clouds, std::vector<std::vector<Bool>> *transient_ray_marks,
+                           Progress *progress);
 
   /// For all ellipsoids_ intersect with rays in @c cloud (accelerated using @c ray_grid)
   /// depending on config.merge_type, either mark the ellipsoid object as removed, or
   /// mark the ray (through @c transient_ray_marks) as removed.
   /// @c ellipsoid_cloud_first is used only for the 'order' merge type, to choose which to mark
-  void markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
+  template <class CloudT>
+  void markIntersectedEllipsoids(const CloudT &cloud, const RayIndexGrid &ray_grid,
                                  std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
                                  Progress *progress, bool ellipsoid_cloud_first = false);
 
   /// Finalise the cloud filter and populate @c transientResults() and @c fixedResults() .
   void finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transient_ray_marks);
 
+  /// The colour of filtered ray @c i, which has colour @c colour in the cloud
+  RGBA filteredColour(const RGBA &colour, size_t i) const;
+
   Cloud difference_;
   Cloud fixed_;
   MergerConfig config_;
@@ -377,7 +377,7 @@ bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::s
     in_cloud.writeChunk(in_chunk);
     out_cloud.writeChunk(out_chunk);
   };
-  if (!Cloud::read(cloud_name, write_chunk))
+  if (!Cloud::read(cloud_name, write_chunk, 1))
     return false;
   in_cloud.end();
   out_cloud.end();
@@ -0,0 +1,192 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/rayneighbours.h"
+#include "raylib/raymappedfile.h"
+#include "raylib/rayparallel.h"
+
+#include <nabo/nabo.h>
+
+#include <cstring>
+#include <sstream>
+
+namespace ray
+{
+static_assert(Neighbours::kInvalidIndex == Nabo::NNSearchD::InvalidIndex, "invalid index must match libnabo");
+
+struct Neighbours::Tree
+{
+  std::unique_ptr<Nabo::NNSearchD> search;
+};
+
+namespace
+{
+/// queries per block. Large enough to amortise the scheduling, small enough to balance the threads
+const Eigen::Index kQueryBlockSize = 4096;
+
+const char kNeighboursMagic[8] = { 'R', 'A', 'Y', 'N', 'E', 'I', 'G', 'H' };
+const uint32_t kNeighboursVersion = 1;
+
+struct NeighboursHeader
+{
+  char magic[8];
+  uint32_t version;
+  int32_t search_size;
+  uint64_t key;
+  uint64_t count;
+};
+
+uint64_t neighboursKey(const Eigen::MatrixXd &points, int search_size, double max_distance)
+{
+  uint64_t key = kHashSeed;
+  hashCombine(static_cast<uint64_t>(search_size), key);
+  hashCombine(max_distance, key);
+  hashCombine(kNearestNeighbourEpsilon, key);
+  hashCombine(static_cast<uint64_t>(points.cols()), key);
+  const double *values = points.data();
+  for (Eigen::Index i = 0; i < points.size(); i++)
+  {
+    hashCombine(values[i], key);
+  }
+  return key;
+}
+
+bool loadNeighbours(const std::string &file_name, uint64_t key, int search_size, Eigen::Index count,
+                    Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2)
+{
+  MappedFile file;
+  if (!file.open(file_name))
+  {
+    return false;
+  }
+  NeighboursHeader header;
+  const unsigned char *header_data = file.data(0, sizeof(header));
+  if (!header_data)
+  {
+    return false;
+  }
+  std::memcpy(&header, header_data, sizeof(header));
+  if (std::memcmp(header.magic, kNeighboursMagic, sizeof(header.magic)) != 0 || header.version != kNeighboursVersion ||
+      header.key != key || header.search_size != search_size || header.count != static_cast<uint64_t>(count))
+  {
+    return false;
+  }
+  const size_t num_entries = static_cast<size_t>(search_size) * static_cast<size_t>(count);
+  const size_t length = num_entries * (sizeof(int) + sizeof(double));
+  const unsigned char *data = file.data(sizeof(header), length);
+  if (!data)
+  {
+    std::cerr << "Warning: " << file_name << " is truncated, searching for the neighbours again" << std::endl;
+    return false;
+  }
+  indices.resize(search_size, count);
+  dists2.resize(search_size, count);
+  std::memcpy(indices.data(), data, num_entries * sizeof(int));
+  std::memcpy(dists2.data(), data + num_entries * sizeof(int), num_entries * sizeof(double));
+  return true;
+}
+
+bool saveNeighbours(const std::string &file_name, uint64_t key, const Eigen::MatrixXi &indices,
+                    const Eigen::MatrixXd &dists2)
+{
+  // written to a temporary file first, so a concurrent or later run never loads a part-written cache
+  const std::string temp_name = file_name + ".tmp";
+  std::ofstream out(temp_name, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Error: cannot open " << temp_name << " for writing" << std::endl;
+    return false;
+  }
+  NeighboursHeader header;
+  std::memcpy(header.magic, kNeighboursMagic, sizeof(header.magic));
+  header.version = kNeighboursVersion;
+  header.search_size = static_cast<int32_t>(indices.rows());
+  header.key = key;
+  header.count = static_cast<uint64_t>(indices.cols());
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(indices.data()), static_cast<std::streamsize>(indices.size() * sizeof(int)));
+  out.write(reinterpret_cast<const char *>(dists2.data()), static_cast<std::streamsize>(dists2.size() * sizeof(double)));
+  out.close();
+  if (out.fail())
+  {
+    std::cerr << "Error: failed writing neighbours to " << temp_name << std::endl;
+    std::remove(temp_name.c_str());
+    return false;
+  }
+  return replaceFile(temp_name, file_name);
+}
+}  // namespace
+
+Neighbours::Neighbours(const std::vector<Eigen::Vector3d> &points)
+  : points_(3, (Eigen::Index)points.size())
+{
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    points_.col((Eigen::Index)i) = points[i];
+  }
+  build();
+}
+
+Neighbours::Neighbours(const Eigen::MatrixXd &points)
+  : points_(points)
+{
+  build();
+}
+
+Neighbours::~Neighbours() {}
+
+void Neighbours::build()
+{
+  tree_.reset(new Tree);
+  tree_->search.reset(Nabo::NNSearchD::createKDTreeLinearHeap(points_, 3));
+}
+
+void Neighbours::knn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices,
+                     Eigen::MatrixXd &dists2, double max_distance, double epsilon) const
+{
+  const Eigen::Index num_queries = queries.cols();
+  indices.resize(search_size, num_queries);
+  dists2.resize(search_size, num_queries);
+  const Eigen::Index num_blocks = (num_queries + kQueryBlockSize - 1) / kQueryBlockSize;
+  auto search_block = [&](Eigen::Index b) {
+    const Eigen::Index first = b * kQueryBlockSize;
+    const Eigen::Index count = std::min(kQueryBlockSize, num_queries - first);
+    const Eigen::MatrixXd block = queries.middleCols(first, count);
+    Eigen::MatrixXi block_indices(search_size, count);
+    Eigen::MatrixXd block_dists2(search_size, count);
+    if (max_distance != 0.0)
+      tree_->search->knn(block, block_indices, block_dists2, search_size, epsilon, 0, max_distance);
+    else
+      tree_->search->knn(block, block_indices, block_dists2, search_size, epsilon, 0);
+    indices.middleCols(first, count) = block_indices;
+    dists2.middleCols(first, count) = block_dists2;
+  };
+  parallelFor(static_cast<size_t>(num_blocks), [&](size_t b) { search_block(static_cast<Eigen::Index>(b)); }, 1);
+}
+
+void findNeighbours(const Eigen::MatrixXd &points, int search_size, Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2,
+                    double max_distance, const std::string &cache_dir)
+{
+  std::string file_name;
+  uint64_t key = 0;
+  if (!cache_dir.empty())
+  {
+    key = neighboursKey(points, search_size, max_distance);
+    std::stringstream name;
+    name << cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".neighbours";
+    file_name = name.str();
+    if (loadNeighbours(file_name, key, search_size, points.cols(), indices, dists2))
+    {
+      return;
+    }
+  }
+  Neighbours neighbours(points);
+  neighbours.knn(search_size, indices, dists2, max_distance);
+  if (!file_name.empty())
+  {
+    saveNeighbours(file_name, key, indices, dists2);
+  }
+}
+}  // namespace ray
@@ -0,0 +1,64 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYNEIGHBOURS_H
+#define RAYLIB_RAYNEIGHBOURS_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+#include <memory>
+
+namespace ray
+{
+/// Nearest neighbour search over a fixed set of 3D points. The kd-tree is built once, then the queries are
+/// split into blocks that are searched on all threads, giving the same results as a single threaded search.
+class RAYLIB_EXPORT Neighbours
+{
+public:
+  /// marks the unused entries of @c indices, where there are fewer than @c search_size neighbours in range
+  static const int kInvalidIndex = -1;
+
+  explicit Neighbours(const std::vector<Eigen::Vector3d> &points);
+  /// the points are the columns of @c points, which must have 3 rows
+  explicit Neighbours(const Eigen::MatrixXd &points);
+  ~Neighbours();
+  Neighbours(const Neighbours &) = delete;
+  Neighbours &operator=(const Neighbours &) = delete;
+
+  inline size_t size() const { return (size_t)points_.cols(); }
+  inline const Eigen::MatrixXd &points() const { return points_; }
+
+  /// Find the @c search_size nearest points to each column of @c queries. Column i of @c indices and @c dists2 lists
+  /// the point indices and squared distances for query i, nearest first. Points coincident with the query are not
+  /// included, so querying the indexed points does not return the point itself. A @c max_distance of 0 is unlimited.
+  void knn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2,
+           double max_distance = 0.0, double epsilon = kNearestNeighbourEpsilon) const;
+
+  /// Find the @c search_size nearest neighbours of each of the indexed points
+  inline void knn(int search_size, Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2, double max_distance = 0.0,
+                  double epsilon = kNearestNeighbourEpsilon) const
+  {
+    knn(points_, search_size, indices, dists2, max_distance, epsilon);
+  }
+
+private:
+  void build();
+
+  struct Tree;
+  Eigen::MatrixXd points_;  // the tree refers to these, so they are held for its lifetime
+  std::unique_ptr<Tree> tree_;
+};
+
+/// The @c search_size nearest neighbours of each of the columns of @c points amongst themselves, as
+/// @c Neighbours::knn. If @c cache_dir names an existing directory, the results are saved there, keyed by a hash of
+/// the points and search parameters, and reused by later calls on the same points, in this or a later run. Tools that
+/// are run in sequence on the same cloud then only search for neighbours once. Empty, the default, disables the cache.
+void RAYLIB_EXPORT findNeighbours(const Eigen::MatrixXd &points, int search_size, Eigen::MatrixXi &indices,
+                                  Eigen::MatrixXd &dists2, double max_distance = 0.0,
+                                  const std::string &cache_dir = std::string());
+}  // namespace ray
+
+#endif  // RAYLIB_RAYNEIGHBOURS_H
@@ -0,0 +1,71 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYPARALLEL_H
+#define RAYLIB_RAYPARALLEL_H
+
+#include "raylib/raylibconfig.h"
+
+#include <cstddef>
+
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#else
+#include <omp.h>
+#endif  // RAYLIB_WITH_TBB
+
+namespace ray
+{
+/// the number of threads that parallelFor will use
+inline int maxThreads()
+{
+#if RAYLIB_WITH_TBB
+  return tbb::this_task_arena::max_concurrency();
+#else
+  return omp_get_max_threads();
+#endif  // RAYLIB_WITH_TBB
+}
+
+/// call @c func(i) for i in 0 to @c n-1, in parallel, using TBB if available or OpenMP otherwise.
+/// With OpenMP, a @c chunk of 0 splits the range evenly between the threads, which suits uniform work. Otherwise the
+/// iterations are handed out @c chunk at a time, which balances uneven work. TBB balances the work itself.
+/// Ranges shorter than @c min_parallel_size are run on the calling thread, where threading would cost more than it saves
+template <class Func>
+void parallelFor(size_t n, const Func &func, size_t chunk = 0, size_t min_parallel_size = 2)
+{
+  if (n < min_parallel_size)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      func(i);
+    }
+    return;
+  }
+#if RAYLIB_WITH_TBB
+  (void)chunk;
+  tbb::parallel_for<size_t>(0, n, func);
+#else
+  if (chunk == 0)
+  {
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+      func(i);
+    }
+  }
+  else
+  {
+    #pragma omp parallel for schedule(dynamic, chunk)
+    for (size_t i = 0; i < n; i++)
+    {
+      func(i);
+    }
+  }
+#endif  // RAYLIB_WITH_TBB
+}
+}  // namespace ray
+
+#endif  // RAYLIB_RAYPARALLEL_H
@@ -4,12 +4,21 @@
 //
 // Author: Thomas Lowe
 #include "rayply.h"
+#include "raylib/raycompactcloud.h"
+#include "raylib/raymappedfile.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
+#include "raylib/raytileindex.h"
 #include "raymesh.h"
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 // #define OUTPUT_MOMENTS // useful when setting up unit test expected ray clouds
 
 namespace ray
@@ -21,6 +30,12 @@ unsigned long chunk_header_length = 0;
 unsigned long point_cloud_chunk_header_length = 0;
 unsigned long vertex_size_pos = 0;
 unsigned long point_cloud_vertex_size_pos = 0;
+unsigned long stats_pos = 0;
+
+// the statistics comment in the ray cloud header. Its values are written over the padding when the file is ended
+const std::string stats_comment = "comment raycloud_stats";
+const int stats_version = 1;
+const int stats_width = 1000;
 
 enum DataType
 {
@@ -45,6 +60,9 @@ bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
   out << "ply" << std::endl;
   out << "format binary_little_endian 1.0" << std::endl;
   out << "comment generated by raycloudtools library" << std::endl;
+  out << stats_comment;
+  stats_pos = out.tellp();
+  out << std::string(stats_width, ' ') << std::endl;  // filled in by writeRayCloudChunkEnd
   out << "element vertex ";
   for (int i = 0; i < num_zeros; i++)
     out << "0";  // fill in with zeros. I will replace rightmost characters later, to give actual number
@@ -80,7 +98,7 @@ bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
 
 bool writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices, const std::vector<Eigen::Vector3d> &starts,
                         const std::vector<Eigen::Vector3d> &ends, const std::vector<double> &times,
-                        const std::vector<RGBA> &colours, bool &has_warned)
+                        const std::vector<RGBA> &colours, bool &has_warned, RayCloudStats *stats)
 {
   if (ends.size() == 0)
   {
@@ -138,6 +156,14 @@ bool writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices, const std::v
     vertices[i] << (float)ends[i][0], (float)ends[i][1], (float)ends[i][2], u.f[0], u.f[1], (float)n[0], (float)n[1],
       (float)n[2], (float &)colours[i];
 #endif
+    if (stats)
+    {
+      stats->addWritten(starts[i], ends[i], times[i], colours[i]);
+    }
+  }
+  if (stats)
+  {
+    stats->num_rows += ends.size();
   }
   out.write((const char *)&vertices[0], sizeof(RayPlyEntry) * vertices.size());
   if (!out.good())
@@ -148,7 +174,7 @@ bool writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices, const std::v
   return true;
 }
 
-unsigned long writeRayCloudChunkEnd(std::ofstream &out)
+unsigned long writeRayCloudChunkEnd(std::ofstream &out, const RayCloudStats *stats)
 {
   const unsigned long size = static_cast<unsigned long>(out.tellp()) - chunk_header_length;
   const unsigned long number_of_rays = size / sizeof(RayPlyEntry);
@@ -157,9 +183,110 @@ unsigned long writeRayCloudChunkEnd(std::ofstream &out)
   std::string str = stream.str();
   out.seekp(vertex_size_pos - str.length());
   out << str;
+  // the stats are only stored if they cover every ray in the file
+  if (stats && stats->num_rows == number_of_rays)
+  {
+    const std::string line = " " + stats->toString();
+    if (line.length() <= (size_t)stats_width)
+    {
+      out.seekp(stats_pos);
+      out << line;
+    }
+  }
   return number_of_rays;
 }
 
+void RayCloudStats::clear()
+{
+  const double min_s = std::numeric_limits<double>::max();
+  const double max_s = std::numeric_limits<double>::lowest();
+  num_rows = num_rays = num_bounded = 0;
+  ends_min = starts_min = rays_min = Eigen::Vector3d(min_s, min_s, min_s);
+  ends_max = starts_max = rays_max = Eigen::Vector3d(max_s, max_s, max_s);
+  min_time = min_s;
+  max_time = max_s;
+  ends_sum.setZero();
+  start_pos.setZero();
+  end_pos.setZero();
+}
+
+std::string RayCloudStats::toString() const
+{
+  std::stringstream values;
+  values.precision(17);  // enough to read back the same doubles
+  values << stats_version << " " << num_rows << " " << num_rays << " " << num_bounded << " " << min_time << " "
+         << max_time;
+  const Eigen::Vector3d *vectors[] = { &ends_min, &ends_max, &starts_min, &starts_max, &rays_min,
+                                       &rays_max, &ends_sum, &start_pos,  &end_pos };
+  for (auto &vec : vectors)
+  {
+    values << " " << (*vec)[0] << " " << (*vec)[1] << " " << (*vec)[2];
+  }
+  return values.str();
+}
+
+bool RayCloudStats::fromString(const std::string &text)
+{
+  std::istringstream values(text);
+  int version = 0;
+  values >> version;
+  if (!values || version != stats_version)
+  {
+    return false;  // not yet written, or an unknown format
+  }
+  values >> num_rows >> num_rays >> num_bounded >> min_time >> max_time;
+  Eigen::Vector3d *vectors[] = { &ends_min, &ends_max, &starts_min, &starts_max, &rays_min,
+                                 &rays_max, &ends_sum, &start_pos,  &end_pos };
+  for (auto &vec : vectors)
+  {
+    values >> (*vec)[0] >> (*vec)[1] >> (*vec)[2];
+  }
+  return !values.fail();
+}
+
+void RayCloudStats::addWritten(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time,
+                               const RGBA &colour)
+{
+  // the ray as it is read back from the file, which skips rays with nans
+  const Eigen::Vector3d n = start - end;
+#if RAYLIB_DOUBLE_RAYS
+  const Eigen::Vector3d read_end = end;
+#else
+  const Eigen::Vector3d read_end((float)end[0], (float)end[1], (float)end[2]);
+#endif
+  const Eigen::Vector3d normal((float)n[0], (float)n[1], (float)n[2]);
+  if (read_end == read_end && normal == normal)
+  {
+    add(read_end + normal, read_end, time, colour);
+  }
+}
+
+void RayCloudStats::add(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour)
+{
+  if (colour.alpha > 0)
+  {
+    ends_min = minVector(ends_min, end);
+    ends_max = maxVector(ends_max, end);
+    ends_sum += end;
+    num_bounded++;
+  }
+  num_rays++;
+  starts_min = minVector(starts_min, start);
+  starts_max = maxVector(starts_max, start);
+  rays_min = minVector(rays_min, minVector(start, end));
+  rays_max = maxVector(rays_max, maxVector(start, end));
+  if (time < min_time)
+  {
+    start_pos = start;
+  }
+  min_time = std::min(min_time, time);
+  if (time > max_time)
+  {
+    end_pos = start;
+  }
+  max_time = std::max(max_time, time);
+}
+
 // Save the polygon file to disk
 bool writePlyRayCloud(const std::string &file_name, const std::vector<Eigen::Vector3d> &starts,
                       const std::vector<Eigen::Vector3d> &ends, const std::vector<double> &times,
@@ -175,14 +302,23 @@ bool writePlyRayCloud(const std::string &file_name, const std::vector<Eigen::Vec
   if (!writeRayCloudChunkStart(file_name, ofs))
     return false;
   RayPlyBuffer buffer;
+  RayCloudStats stats;
   bool has_warned = false;
   // TODO: could split this into chunks aswell, it would allow saving out files roughly twice as large
-  if (!writeRayCloudChunk(ofs, buffer, starts, ends, times, rgb, has_warned))
+  if (!writeRayCloudChunk(ofs, buffer, starts, ends, times, rgb, has_warned, &stats))
   {
     return false;
   }
-  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs);
+  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs, &stats);
   std::cout << num_rays << " rays saved to " << file_name << std::endl;
+  ofs.close();
+  TimeIndex time_index;
+  time_index.add(times);
+  if (!time_index.end(file_name))
+  {
+    std::cerr << "Error: could not write the time index " << TimeIndex::fileName(file_name) << std::endl;
+    return false;
+  }
   return true;
 }
 
@@ -326,13 +462,27 @@ bool writePlyPointCloud(const std::string &file_name, const std::vector<Eigen::V
   return true;
 }
 
-bool readPly(const std::string &file_name, bool is_ray_cloud,
-             std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                                std::vector<double> &times, std::vector<RGBA> &colours)>
-               apply, 
-             double max_intensity, bool times_optional, size_t chunk_size)
+namespace
+{
+/// Where each field lies within a PLY vertex row, as parsed from the file header
+struct PlyLayout
+{
+  size_t row_size = 0;
+  size_t data_start = 0;  // byte offset of the first vertex row
+  size_t num_rows = 0;
+  size_t num_vertices = 0;  // as given in the header
+  std::string stats;        // the values of the statistics comment, if present
+  int offset = -1, normal_offset = -1, time_offset = -1, colour_offset = -1;
+  int intensity_offset = -1;
+  bool time_is_float = false;
+  bool pos_is_float = false;
+  bool normal_is_float = false;
+  DataType intensity_type = kDTnone;
+};
+
+/// Parse the PLY header of @c file_name into @c layout
+bool readPlyHeader(const std::string &file_name, bool is_ray_cloud, PlyLayout &layout)
 {
-  std::cout << "reading: " << file_name << std::endl;
   std::ifstream input(file_name.c_str(), std::ios::in | std::ios::binary);
   if (input.fail())
   {
@@ -341,12 +491,6 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
   }
   std::string line;
   int row_size = 0;
-  int offset = -1, normal_offset = -1, time_offset = -1, colour_offset = -1;
-  int intensity_offset = -1;
-  bool time_is_float = false;
-  bool pos_is_float = false;
-  bool normal_is_float = false;
-  DataType intensity_type = kDTnone;
   int rowsteps[] = { int(sizeof(float)), int(sizeof(double)), int(sizeof(unsigned short)), int(sizeof(unsigned char)), int(sizeof(int)),
                      0 };  // to match each DataType enum
 
@@ -362,6 +506,15 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
       std::cerr << "ASCII PLY not supported " << file_name << std::endl;
       return false;
     }
+    if (line.compare(0, stats_comment.length(), stats_comment) == 0)
+    {
+      layout.stats = line.substr(stats_comment.length());
+      continue;
+    }
+    if (line.compare(0, 15, "element vertex ") == 0)
+    {
+      layout.num_vertices = std::strtoul(line.c_str() + 15, nullptr, 10);
+    }
 
     // support multiple data types
     DataType data_type = kDTnone;
@@ -378,52 +531,52 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
 
     if (line == "property float x" || line == "property double x")
     {
-      offset = row_size;
+      layout.offset = row_size;
       if (line.find("float") != std::string::npos)
-        pos_is_float = true;
+        layout.pos_is_float = true;
     }
     if (line == "property float rayx" || line == "property double rayx")
     {
 #if RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
+      if (layout.normal_offset == -1)
 #endif
       {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
+        layout.normal_offset = row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
       }
     }
     if (line == "property float nx" || line == "property double nx")
     {
 #if !RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
+      if (layout.normal_offset == -1)
 #endif
       {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
+        layout.normal_offset = row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
       }
     }
     if (line.find("time") != std::string::npos)
     {
-      time_offset = row_size;
+      layout.time_offset = row_size;
       if (line.find("float") != std::string::npos)
-        time_is_float = true;
+        layout.time_is_float = true;
     }
     if (line.find("intensity") != std::string::npos)
     {
-      intensity_offset = row_size;
-      intensity_type = data_type;
+      layout.intensity_offset = row_size;
+      layout.intensity_type = data_type;
     }
     if (line == "property uchar red" || line == "property uint8 red")
-      colour_offset = row_size;
+      layout.colour_offset = row_size;
 
     row_size += rowsteps[data_type];
   }
-  if (offset == -1)
+  if (layout.offset == -1)
   {
     std::cerr << "could not find position properties of file: " << file_name << std::endl;
     return false;
   }
-  if (is_ray_cloud && normal_offset == -1)
+  if (is_ray_cloud && layout.normal_offset == -1)
   {
     std::cerr << "could not find normal properties of file: " << file_name << std::endl;
     std::cerr << "ray clouds store the ray starts using the normal field" << std::endl;
@@ -433,268 +586,558 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
   std::streampos start = input.tellg();
   input.seekg(0, input.end);
   size_t length = input.tellg() - start;
-  input.seekg(start);
-  size_t size = length / row_size;
+  layout.row_size = static_cast<size_t>(row_size);
+  layout.data_start = static_cast<size_t>(start);
+  layout.num_rows = length / layout.row_size;
+  return true;
+}
 
-  ray::Progress progress;
-  ray::ProgressThread progress_thread(progress);
-  size_t num_chunks = (size + (chunk_size - 1)) / chunk_size;
-  progress.begin("read and process", num_chunks);
+/// A chunk of decoded rays, in the form passed to the readPly callback
+struct PlyChunk
+{
+  std::vector<Eigen::Vector3d> starts;
+  std::vector<Eigen::Vector3d> ends;
+  std::vector<double> times;
+  std::vector<RGBA> colours;
+  std::vector<uint8_t> intensities;
+  size_t last_row = 0;  // file index of the last ray in the chunk
 
-  std::vector<unsigned char> vertices(row_size);
-  bool warning_set = false;
-  if (size == 0)
+  void reserve(size_t size)
   {
-    std::cerr << "no entries found in ply file" << std::endl;
-    return false;
+    starts.reserve(size);
+    ends.reserve(size);
+    times.reserve(size);
+    colours.reserve(size);
   }
-  if (time_offset == -1)
+  void clear()
   {
-    if (times_optional)
-    {
-      std::cout << "Warning: no times provided in file, applying 1 second difference per ray consecutively, starting at 0 seconds" << std::endl;
-    }
+    starts.clear();
+    ends.clear();
+    times.clear();
+    colours.clear();
+    intensities.clear();
+  }
+};
+
+template <typename T>
+inline T readField(const unsigned char *data)
+{
+  T value;
+  std::memcpy(&value, data, sizeof(T));  // rows are packed, so fields can be unaligned
+  return value;
+}
+
+template <typename T>
+inline Eigen::Vector3d readVector(const unsigned char *data)
+{
+  T vec[3];
+  std::memcpy(vec, data, sizeof(vec));
+  return Eigen::Vector3d(vec[0], vec[1], vec[2]);
+}
+
+/// Decodes blocks of PLY vertex rows into rays. The per-field type checks are resolved once per block
+/// by dispatching to a loop specialised on the position, normal and time types.
+class PlyDecoder
+{
+public:
+  PlyDecoder(const PlyLayout &layout, bool is_ray_cloud, double max_intensity)
+    : layout_(layout)
+    , is_ray_cloud_(is_ray_cloud)
+    , max_intensity_(max_intensity)
+  {}
+
+  /// decode the @c num_rows packed rows at @c rows, the first being row @c first_row of the file,
+  /// appending the valid rays to @c chunk
+  void decode(const unsigned char *rows, size_t first_row, size_t num_rows, PlyChunk &chunk)
+  {
+    if (layout_.pos_is_float)
+      decodeWithNormal<float>(rows, first_row, num_rows, chunk);
     else
-    {
-      std::cerr << "error: no time information found in " << file_name << std::endl;
-      return false;
-    }
+      decodeWithNormal<double>(rows, first_row, num_rows, chunk);
   }
-  if (colour_offset == -1)
+
+  /// decode the @c num_rows rows at @c rows of a ray cloud with float positions and normals, into @c span of a
+  /// CompactCloud chunk that holds @c count rays. The floats are stored unchanged, with a zero chunk origin.
+  /// Returns the new number of rays in the chunk
+  size_t decodeCompact(const unsigned char *rows, size_t first_row, size_t num_rows, const RayChunkSpan &span,
+                       size_t count)
   {
-    std::cout << "warning: no colour information found in " << file_name
-              << ", setting colours red->green->blue based on time" << std::endl;
+    if (layout_.time_is_float)
+      return decodeCompactRows<float>(rows, first_row, num_rows, span, count);
+    return decodeCompactRows<double>(rows, first_row, num_rows, span, count);
   }
-  if (!is_ray_cloud && intensity_offset != -1)
+
+  /// fill in the missing fields and apply the point cloud alpha conventions on a completed chunk
+  void finalise(PlyChunk &chunk)
   {
-    if (colour_offset != -1)
+    if (layout_.time_offset == -1)
     {
-      std::cout << "warning: intensity and colour information both found in file. Replacing alpha with intensity value."
-                << std::endl;
+      chunk.times.resize(chunk.ends.size());
+      for (size_t j = 0; j < chunk.times.size(); j++) 
+      {
+        chunk.times[j] = (double)(chunk.last_row + j);
+      }
     }
-    else
+    if (layout_.colour_offset == -1)
     {
-      std::cout << "intensity information found in file, storing this in the ray cloud 8-bit alpha channel."
-                << std::endl;
+      colourByTime(chunk.times, chunk.colours);
+    }
+    if (!is_ray_cloud_)
+    {
+      if (layout_.intensity_offset != -1)
+      {
+        for (size_t j = 0; j < chunk.intensities.size(); j++)
+        {
+          chunk.colours[j].alpha = chunk.intensities[j];
+        }
+      }
+      for (auto &colour : chunk.colours)
+      {
+        if (colour.alpha == 0)
+        {
+          // colour zero-intensity rays black. This is a helpful debug tool.
+          colour.red = colour.green = colour.blue = 0;
+        }
+        else
+        {
+          any_returns_ = true;
+        }
+      }
     }
   }
 
-  // pre-reserving avoids memory fragmentation
-  std::vector<Eigen::Vector3d> ends;
-  std::vector<Eigen::Vector3d> starts;
-  std::vector<double> times;
-  std::vector<ray::RGBA> colours;
-  std::vector<uint8_t> intensities;
-  size_t reserve_size = std::min(chunk_size, size);
-  ends.reserve(reserve_size);
-  starts.reserve(reserve_size);
-  if (time_offset != -1)
-    times.reserve(reserve_size);
-  if (colour_offset != -1)
-    colours.reserve(reserve_size);
-  if (intensity_offset != -1)
-    intensities.reserve(reserve_size);
-  bool any_returns = false;
-  int identical_times = 0;
-  double last_time = std::numeric_limits<double>::lowest();
-  double last_unique_time = std::numeric_limits<double>::lowest();
-  
-  for (size_t i = 0; i < size; i++)
+  int identicalTimes() const { return identical_times_; }
+  bool anyReturns() const { return any_returns_; }
+
+private:
+  template <typename PosT>
+  void decodeWithNormal(const unsigned char *rows, size_t first_row, size_t num_rows, PlyChunk &chunk)
   {
-    input.read((char *)&vertices[0], row_size);
-    Eigen::Vector3d end;
-    if (pos_is_float)
-    {
-      Eigen::Vector3f e = (Eigen::Vector3f &)vertices[offset];
-      end = Eigen::Vector3d(e[0], e[1], e[2]);
-    }
+    if (layout_.normal_is_float)
+      decodeWithTime<PosT, float>(rows, first_row, num_rows, chunk);
     else
-    {
-      end = (Eigen::Vector3d &)vertices[offset];
-    }
-    bool end_valid = end == end;
-    if (!warning_set)
+      decodeWithTime<PosT, double>(rows, first_row, num_rows, chunk);
+  }
+  template <typename PosT, typename NormalT>
+  void decodeWithTime(const unsigned char *rows, size_t first_row, size_t num_rows, PlyChunk &chunk)
+  {
+    if (layout_.time_is_float)
+      decodeRows<PosT, NormalT, float>(rows, first_row, num_rows, chunk);
+    else
+      decodeRows<PosT, NormalT, double>(rows, first_row, num_rows, chunk);
+  }
+
+  template <typename PosT, typename NormalT, typename TimeT>
+  void decodeRows(const unsigned char *rows, size_t first_row, size_t num_rows, PlyChunk &chunk);
+  template <typename TimeT>
+  size_t decodeCompactRows(const unsigned char *rows, size_t first_row, size_t num_rows, const RayChunkSpan &span,
+                           size_t count);
+
+  /// whether the end point @c end of row @c i is valid, warning once of invalid or suspicious values
+  bool validEnd(const Eigen::Vector3d &end, size_t i)
+  {
+    const bool end_valid = end == end;
+    if (!warning_set_)
     {
       if (!end_valid)
       {
         std::cout << "warning, NANs in point " << i << ", removing all NANs." << std::endl;
-        warning_set = true;
+        warning_set_ = true;
       }
       if (std::abs(end[0]) > 100000.0)
       {
         std::cout << "warning: very large data in point " << i << ", suspicious: " << end.transpose() << std::endl;
-        warning_set = true;
+        warning_set_ = true;
+      }
+    }
+    return end_valid;
+  }
+  /// whether the ray start, stored in @c normal, of row @c i is valid, warning once of invalid or suspicious values
+  bool validNormal(const Eigen::Vector3d &normal, size_t i)
+  {
+    const bool norm_valid = normal == normal;
+    if (!warning_set_)
+    {
+      if (!norm_valid)
+      {
+        std::cout << "warning, NANs in raystart stored in normal " << i << ", removing all such rays." << std::endl;
+        warning_set_ = true;
       }
     }
-    if (!end_valid)
+    if (!norm_valid)
+      return false;
+    if (std::abs(normal[0]) > 100000.0 && !warning_set_)
+    {
+      std::cerr << "Error: very large ray length in ray index " << i << " " << normal.transpose() << ", bad input." << std::endl;
+      std::cerr << "Use rayexport then rayimport the exported point cloud with a fixed trajectory file" << std::endl;
+      warning_set_ = true;
+    }
+    return true;
+  }
+
+  uint8_t intensityAlpha(const unsigned char *row) const
+  {
+    double intensity;
+    if (layout_.intensity_type == kDTfloat)
+      intensity = (double)readField<float>(row + layout_.intensity_offset);
+    else if (layout_.intensity_type == kDTdouble)
+      intensity = readField<double>(row + layout_.intensity_offset);
+    else  // (intensity_type == kDTushort)
+      intensity = (double)readField<unsigned short>(row + layout_.intensity_offset);
+    if (intensity >= 0.0)
+    {
+      // only intensity exactly 0 will be used for alpha=0 in uint_8 format.
+      intensity = std::ceil(255.0 * clamped(intensity / max_intensity_, 0.0, 1.0));  
+    }
+    // support for special codes for out of range cases, defined by intensity:
+    // -1 non-return of unknown length
+    // -2 the object is within minimum range, so range is not certain but small
+    // -3 outside maximum range, so range is uncertain but large
+    else if (intensity == -1.0) 
+    {
+      intensity = 0.0;
+    }
+    else // here a range is specified, just low certainty. We choose to this range.
+    {
+      intensity = 1.0;
+    }
+    return static_cast<uint8_t>(intensity);
+  }
+
+  PlyLayout layout_;
+  bool is_ray_cloud_;
+  double max_intensity_;
+  bool warning_set_ = false;
+  bool any_returns_ = false;
+  int identical_times_ = 0;
+  double last_time_ = std::numeric_limits<double>::lowest();
+  double last_unique_time_ = std::numeric_limits<double>::lowest();
+};
+
+template <typename PosT, typename NormalT, typename TimeT>
+void PlyDecoder::decodeRows(const unsigned char *rows, size_t first_row, size_t num_rows, PlyChunk &chunk)
+{
+  const bool has_time = layout_.time_offset != -1;
+  const bool has_colour = layout_.colour_offset != -1;
+  const bool has_intensity = !is_ray_cloud_ && layout_.intensity_offset != -1;
+  // size the output for the whole block, then trim off the invalid rows at the end
+  size_t count = chunk.ends.size();
+  chunk.starts.resize(count + num_rows);
+  chunk.ends.resize(count + num_rows);
+  if (has_time)
+    chunk.times.resize(count + num_rows);
+  if (has_colour)
+    chunk.colours.resize(count + num_rows);
+  if (has_intensity)
+    chunk.intensities.resize(count + num_rows);
+
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    const unsigned char *row = rows + r * layout_.row_size;
+    const size_t i = first_row + r;
+    Eigen::Vector3d end = readVector<PosT>(row + layout_.offset);
+    if (!validEnd(end, i))
       continue;
 
     Eigen::Vector3d normal(0, 0, 0);
-    if (is_ray_cloud)
+    if (is_ray_cloud_)
     {
-      if (normal_is_float)
-      {
-        Eigen::Vector3f n = (Eigen::Vector3f &)vertices[normal_offset];
-        normal = Eigen::Vector3d(n[0], n[1], n[2]);
-      }
-      else
-      {
-        normal = (Eigen::Vector3d &)vertices[normal_offset];
-      }
-      bool norm_valid = normal == normal;
-      if (!warning_set)
-      {
-        if (!norm_valid)
-        {
-          std::cout << "warning, NANs in raystart stored in normal " << i << ", removing all such rays." << std::endl;
-          warning_set = true;
-        }
-      }
-      if (!norm_valid)
+      normal = readVector<NormalT>(row + layout_.normal_offset);
+      if (!validNormal(normal, i))
         continue;
-      if (std::abs(normal[0]) > 100000.0 && !warning_set)
-      {
-        std::cerr << "Error: very large ray length in ray index " << i << " " << normal.transpose() << ", bad input." << std::endl;
-        std::cerr << "Use rayexport then rayimport the exported point cloud with a fixed trajectory file" << std::endl;
-        warning_set = true;
-      }        
     }
 
-    starts.push_back(end + normal);
-    ends.push_back(end);
-    if (time_offset != -1)
+    chunk.starts[count] = end + normal;
+    chunk.ends[count] = end;
+    if (has_time)
     {
-      double time;
-      if (time_is_float)
+      double time = (double)readField<TimeT>(row + layout_.time_offset);
+      if (!is_ray_cloud_)
       {
-        time = (double)((float &)vertices[time_offset]);
-      }
-      else
-      {  
-        time = (double &)vertices[time_offset];
-      }
-      if (!is_ray_cloud)
-      {
-        if (time==last_unique_time)
+        if (time == last_unique_time_)
         {
           const double time_delta = 1e-6; // this is a sufficient difference for rayrestore (see time_eps in rayrestore.cpp)
-          time = last_time + time_delta;
-          identical_times++;
+          time = last_time_ + time_delta;
+          identical_times_++;
         }
         else
         {
-          last_unique_time = time;
+          last_unique_time_ = time;
         }
-        last_time = time;
+        last_time_ = time;
       }
-      times.push_back(time);
+      chunk.times[count] = time;
+    }
+    if (has_colour)
+    {
+      chunk.colours[count] = readField<RGBA>(row + layout_.colour_offset);
+    }
+    if (has_intensity)
+    {
+      chunk.intensities[count] = intensityAlpha(row);
     }
+    chunk.last_row = i;
+    count++;
+  }
+
+  chunk.starts.resize(count);
+  chunk.ends.resize(count);
+  if (has_time)
+    chunk.times.resize(count);
+  if (has_colour)
+    chunk.colours.resize(count);
+  if (has_intensity)
+    chunk.intensities.resize(count);
+}
 
-    if (colour_offset != -1)
+template <typename TimeT>
+size_t PlyDecoder::decodeCompactRows(const unsigned char *rows, size_t first_row, size_t num_rows,
+                                     const RayChunkSpan &span, size_t count)
+{
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    const unsigned char *row = rows + r * layout_.row_size;
+    const size_t i = first_row + r;
+    float end[3], ray[3];
+    std::memcpy(end, row + layout_.offset, sizeof(end));
+    std::memcpy(ray, row + layout_.normal_offset, sizeof(ray));
+    if (!validEnd(Eigen::Vector3d(end[0], end[1], end[2]), i) || !validNormal(Eigen::Vector3d(ray[0], ray[1], ray[2]), i))
+      continue;
+    for (int j = 0; j < 3; j++)
     {
-      RGBA colour = (RGBA &)vertices[colour_offset];
-      colours.push_back(colour);
+      span.end[j][count] = end[j];
+      span.ray[j][count] = ray[j];
     }
-    if (!is_ray_cloud)
+    span.times[count] = (double)readField<TimeT>(row + layout_.time_offset);
+    span.colours[count] = readField<RGBA>(row + layout_.colour_offset);
+    count++;
+  }
+  return count;
+}
+
+/// Calls @c produce on a background thread to fill items, which are passed in the same order to @c consume on
+/// the calling thread. Up to @c num_ahead items are produced in advance, so producing and consuming overlap.
+/// @c produce returns false when it has no more items.
+template <class Item, class Produce, class Consume>
+void runPipelined(size_t num_ahead, Produce produce, Consume consume)
+{
+  std::vector<Item> items(num_ahead + 1);
+  std::deque<Item *> free_items, ready_items;
+  for (auto &item : items)
+  {
+    free_items.push_back(&item);
+  }
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool finished = false;
+  std::thread producer([&]() {
+    for (;;)
     {
-      if (intensity_offset != -1)
-      {
-        double intensity;
-        if (intensity_type == kDTfloat)
-          intensity = (double)((float &)vertices[intensity_offset]);
-        else if (intensity_type == kDTdouble)
-          intensity = (double &)vertices[intensity_offset];
-        else  // (intensity_type == kDTushort)
-          intensity = (double)((unsigned short &)vertices[intensity_offset]);
-        if (intensity >= 0.0)
-        {
-          // only intensity exactly 0 will be used for alpha=0 in uint_8 format.
-          intensity = std::ceil(255.0 * clamped(intensity / max_intensity, 0.0, 1.0));  
-        }
-        // support for special codes for out of range cases, defined by intensity:
-        // -1 non-return of unknown length
-        // -2 the object is within minimum range, so range is not certain but small
-        // -3 outside maximum range, so range is uncertain but large
-        else if (intensity == -1.0) 
-        {
-          intensity = 0.0;
-        }
-        else // here a range is specified, just low certainty. We choose to this range.
-        {
-          intensity = 1.0;
-        }
-        intensities.push_back(static_cast<uint8_t>(intensity));
-      }
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [&] { return !free_items.empty(); });
+      Item *item = free_items.front();
+      free_items.pop_front();
+      lock.unlock();
+
+      bool produced = produce(*item);
+      lock.lock();
+      if (produced)
+        ready_items.push_back(item);
+      else
+        finished = true;
+      lock.unlock();
+      condition.notify_all();
+      if (!produced)
+        break;
+    }
+  });
+  for (;;)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return !ready_items.empty() || finished; });
+    if (ready_items.empty())
+      break;
+    Item *item = ready_items.front();
+    ready_items.pop_front();
+    lock.unlock();
+
+    consume(*item);
+    lock.lock();
+    free_items.push_back(item);
+    lock.unlock();
+    condition.notify_all();
+  }
+  producer.join();
+}
+}  // namespace
+
+bool readRayCloudStats(const std::string &file_name, RayCloudStats &stats)
+{
+  PlyLayout layout;
+  if (!readPlyHeader(file_name, true, layout) || layout.stats.empty())
+  {
+    return false;
+  }
+  // the stats are only valid for the rays that they were written with
+  return stats.fromString(layout.stats) && layout.row_size == sizeof(RayPlyEntry) && stats.num_rows == layout.num_rows &&
+         stats.num_rows == layout.num_vertices;
+}
+
+namespace
+{
+/// read the rows of the ply file given by @c row_ranges, or all of its rows if it is null
+bool readPlyRanges(const std::string &file_name, bool is_ray_cloud,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply,
+                   double max_intensity, bool times_optional, size_t chunk_size, size_t prefetch_chunks,
+                   const std::vector<std::pair<size_t, size_t>> *row_ranges)
+{
+  std::cout << "reading: " << file_name << std::endl;
+  PlyLayout layout;
+  if (!readPlyHeader(file_name, is_ray_cloud, layout))
+  {
+    return false;
+  }
+  if (layout.num_rows == 0)
+  {
+    std::cerr << "no entries found in ply file" << std::endl;
+    return false;
+  }
+  const std::vector<std::pair<size_t, size_t>> all_rows = { { 0, layout.num_rows } };
+  const std::vector<std::pair<size_t, size_t>> &ranges = row_ranges ? *row_ranges : all_rows;
+  size_t size = 0;
+  for (size_t r = 0; r < ranges.size(); r++)
+  {
+    if (ranges[r].first + ranges[r].second > layout.num_rows || (r > 0 && ranges[r].first < ranges[r - 1].first))
+    {
+      std::cerr << "Error: row ranges are not in order within the " << layout.num_rows << " rows of " << file_name
+                << std::endl;
+      return false;
     }
-    if (ends.size() == chunk_size || i == size - 1)
+    size += ranges[r].second;
+  }
+  if (size == 0)
+  {
+    return true;  // no rows were requested
+  }
+  if (layout.time_offset == -1)
+  {
+    if (times_optional)
     {
-      if (time_offset == -1)
-      {
-        times.resize(ends.size());
-        for (size_t j = 0; j < times.size(); j++) 
-        {
-          times[j] = (double)(i + j);
-        }
-      }
-      if (colour_offset == -1)
-      {
-        colourByTime(times, colours);
-      }
-      if (!is_ray_cloud)
+      std::cout << "Warning: no times provided in file, applying 1 second difference per ray consecutively, starting at 0 seconds" << std::endl;
+    }
+    else
+    {
+      std::cerr << "error: no time information found in " << file_name << std::endl;
+      return false;
+    }
+  }
+  if (layout.colour_offset == -1)
+  {
+    std::cout << "warning: no colour information found in " << file_name
+              << ", setting colours red->green->blue based on time" << std::endl;
+  }
+  if (!is_ray_cloud && layout.intensity_offset != -1)
+  {
+    if (layout.colour_offset != -1)
+    {
+      std::cout << "warning: intensity and colour information both found in file. Replacing alpha with intensity value."
+                << std::endl;
+    }
+    else
+    {
+      std::cout << "intensity information found in file, storing this in the ray cloud 8-bit alpha channel."
+                << std::endl;
+    }
+  }
+
+  MappedFile file;
+  if (!file.open(file_name))
+  {
+    std::cerr << "Couldn't open file: " << file_name << std::endl;
+    return false;
+  }
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+  size_t num_chunks = (size + (chunk_size - 1)) / chunk_size;
+  progress.begin("read and process", num_chunks);
+
+  PlyDecoder decoder(layout, is_ray_cloud, max_intensity);
+  // rows are decoded straight out of the file mapping in blocks, this bounds the fallback read buffer
+  const size_t max_block_rows = 1 << 20;
+  bool success = true;
+  size_t range = 0;
+  size_t row = ranges[0].first;
+  // decode the next chunk of rays, returns false when there are none left
+  auto decode_chunk = [&](PlyChunk &chunk) 
+  {
+    chunk.clear();
+    chunk.reserve(std::min(chunk_size, size));  // pre-reserving avoids memory fragmentation
+    // fill the chunk, topping it up when invalid rows have been removed
+    while (chunk.ends.size() < chunk_size && range < ranges.size())
+    {
+      const size_t range_end = ranges[range].first + ranges[range].second;
+      if (row >= range_end)
       {
-        if (intensity_offset != -1)
-        {
-          for (size_t j = 0; j < intensities.size(); j++)
-          {
-            colours[j].alpha = intensities[j];
-            // colour zero-intensity rays black. This is a helpful debug tool.
-            if (intensities[j] == 0)
-            {
-              colours[j].red = colours[j].green = colours[j].blue = 0;
-            }
-            else
-            {
-              any_returns = true;
-            }
-          }
-        }
-        else
+        if (++range < ranges.size())
         {
-          for (size_t j = 0; j < colours.size(); j++)
-          {
-            if (colours[j].alpha == 0)
-            {
-              // colour zero-intensity rays black. This is a helpful debug tool.
-              colours[j].red = colours[j].green = colours[j].blue = 0;
-            }
-            else
-            {
-              any_returns = true;
-            }
-          }
+          row = ranges[range].first;
         }
+        continue;
       }
-      apply(starts, ends, times, colours);
-      starts.clear();
-      ends.clear();
-      times.clear();
-      colours.clear();
-      intensities.clear();
-      progress.increment();
-
-      if (!is_ray_cloud && i==size-1 && identical_times > 0)
+      size_t num_rows = std::min({ chunk_size - chunk.ends.size(), range_end - row, max_block_rows });
+      const unsigned char *rows = file.data(layout.data_start + row * layout.row_size, num_rows * layout.row_size);
+      if (!rows)
       {
-        std::cout << std::endl;
-        std::cout << "warning: " << identical_times << "/" << size << " rays have identical times," << std::endl;
-        std::cout << "since rayrestore relies on unique time stamps, a 1 microsecond increment has been applied for these times." << std::endl;
+        std::cerr << "error reading from file: " << file_name << std::endl;
+        success = false;
+        return false;
       }
+      decoder.decode(rows, row, num_rows, chunk);
+      row += num_rows;
+    }
+    file.release(layout.data_start + row * layout.row_size);
+    if (chunk.ends.empty())
+    {
+      return false;
     }
+    decoder.finalise(chunk);
+    return true;
+  };
+  auto apply_chunk = [&](PlyChunk &chunk) 
+  {
+    apply(chunk.starts, chunk.ends, chunk.times, chunk.colours);
+    progress.increment();
+  };
+  if (prefetch_chunks > 0)
+  {
+    runPipelined<PlyChunk>(prefetch_chunks, decode_chunk, apply_chunk);
+  }
+  else
+  {
+    PlyChunk chunk;
+    while (decode_chunk(chunk))
+    {
+      apply_chunk(chunk);
+    }
+  }
+  if (!is_ray_cloud && decoder.identicalTimes() > 0)
+  {
+    std::cout << std::endl;
+    std::cout << "warning: " << decoder.identicalTimes() << "/" << size << " rays have identical times," << std::endl;
+    std::cout << "since rayrestore relies on unique time stamps, a 1 microsecond increment has been applied for these times." << std::endl;
   }
   progress.end();
   progress_thread.requestQuit();
   progress_thread.join();
+  if (!success)
+  {
+    return false;
+  }
 
-  if (!is_ray_cloud && any_returns == false) // no return rays
+  if (!is_ray_cloud && !decoder.anyReturns()) // no return rays
   {
     std::cerr << "Error: ray cloud has no identified points; all rays are zero-intensity non-returns," << std::endl;
     std::cerr << "many functions will not operate on this degerenate case." << std::endl;
@@ -705,6 +1148,27 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
   return true;
 }
 
+}  // namespace
+
+bool readPly(const std::string &file_name, bool is_ray_cloud,
+             std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                std::vector<double> &times, std::vector<RGBA> &colours)>
+               apply, 
+             double max_intensity, bool times_optional, size_t chunk_size, size_t prefetch_chunks)
+{
+  return readPlyRanges(file_name, is_ray_cloud, apply, max_intensity, times_optional, chunk_size, prefetch_chunks,
+                       nullptr);
+}
+
+bool readRayCloudRows(const std::string &file_name, const std::vector<std::pair<size_t, size_t>> &row_ranges,
+                      std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                         std::vector<double> &times, std::vector<RGBA> &colours)>
+                        apply,
+                      size_t chunk_size, size_t prefetch_chunks)
+{
+  return readPlyRanges(file_name, true, apply, 0, false, chunk_size, prefetch_chunks, &row_ranges);
+}
+
 bool readPly(const std::string &file_name, std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
              std::vector<double> &times, std::vector<RGBA> &colours, bool is_ray_cloud, double max_intensity)
 {
@@ -721,6 +1185,73 @@ bool readPly(const std::string &file_name, std::vector<Eigen::Vector3d> &starts,
   return readPly(file_name, is_ray_cloud, apply, max_intensity, std::numeric_limits<size_t>::max());
 }
 
+bool readPly(const std::string &file_name, CompactCloud &cloud)
+{
+  cloud.clear();
+  PlyLayout layout;
+  if (!readPlyHeader(file_name, true, layout))
+  {
+    return false;
+  }
+  if (!layout.pos_is_float || !layout.normal_is_float || layout.time_offset == -1 || layout.colour_offset == -1)
+  {
+    // not the standard ray cloud layout, so the rays are converted in double precision as they are added
+    auto add = [&cloud](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &times, std::vector<RGBA> &colours) {
+      cloud.addRays(starts, ends, times, colours);
+    };
+    return readPly(file_name, true, add, 0, false, 1000000);
+  }
+  std::cout << "reading: " << file_name << std::endl;
+  if (layout.num_rows == 0)
+  {
+    std::cerr << "no entries found in ply file" << std::endl;
+    return false;
+  }
+  MappedFile file;
+  if (!file.open(file_name))
+  {
+    std::cerr << "Couldn't open file: " << file_name << std::endl;
+    return false;
+  }
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+  const size_t chunk_size = CompactCloud::kChunkSize;
+  progress.begin("read and process", (layout.num_rows + (chunk_size - 1)) / chunk_size);
+
+  // the rows are decoded straight from the file mapping into each chunk of the cloud, topping the chunk up when
+  // invalid rows have been removed
+  PlyDecoder decoder(layout, true, 0);
+  bool success = true;
+  size_t row = 0;
+  while (row < layout.num_rows && success)
+  {
+    const RayChunkSpan span = cloud.beginChunk();
+    size_t count = 0;
+    while (count < chunk_size && row < layout.num_rows)
+    {
+      const size_t num_rows = std::min(chunk_size - count, layout.num_rows - row);
+      const unsigned char *rows = file.data(layout.data_start + row * layout.row_size, num_rows * layout.row_size);
+      if (!rows)
+      {
+        std::cerr << "error reading from file: " << file_name << std::endl;
+        success = false;
+        break;
+      }
+      count = decoder.decodeCompact(rows, row, num_rows, span, count);
+      row += num_rows;
+    }
+    file.release(layout.data_start + row * layout.row_size);
+    cloud.endChunk(count);
+    progress.increment();
+  }
+  progress.end();
+  progress_thread.requestQuit();
+  progress_thread.join();
+  return success;
+}
+
 bool writePlyMesh(const std::string &file_name, const Mesh &mesh, bool flip_normals)
 {
   std::cout << "saving to " << file_name << ", " << mesh.vertices().size() << " vertices." << std::endl;
@@ -1010,8 +1541,10 @@ bool readPlyMesh(const std::string &file, Mesh &mesh)
   return true;
 }
 
-bool convertCloud(const std::string &in_name, const std::string &out_name,
-                  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply)
+bool convertCloudChunks(const std::string &in_name, const std::string &out_name,
+                        std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                           std::vector<double> &times, std::vector<RGBA> &colours)>
+                          apply)
 {
   std::ofstream ofs;
   if (!writeRayCloudChunkStart(out_name, ofs))
@@ -1019,25 +1552,49 @@ bool convertCloud(const std::string &in_name, const std::string &out_name,
     return false;
   }
   ray::RayPlyBuffer buffer;
+  RayCloudStats stats;
+  TimeIndex time_index;
 
   bool has_warned = false;
-  // run the function 'apply' on each ray as it is read in, and write it out, one chunk at a time
-  auto applyToChunk = [&apply, &buffer, &ofs, &has_warned](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                                              std::vector<double> &times, std::vector<ray::RGBA> &colours) {
-    for (size_t i = 0; i < ends.size(); i++)
+  bool success = true;
+  // We can adjust the chunk arguments directly as they are non-const and their modification doesn't have
+  // side effects
+  auto applyToChunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                          std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    if (!success)
     {
-      // We can adjust the applyToChunk arguments directly as they are non-const and their modification doesn't have
-      // side effects
-      apply(starts[i], ends[i], times[i], colours[i]);
+      return;  // the output file has failed, so the remaining chunks are not written
     }
-    ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours, has_warned);
+    apply(starts, ends, times, colours);
+    time_index.add(times);
+    success = ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours, has_warned, &stats);
   };
-  if (!ray::readPly(in_name, true, applyToChunk, 0))
+  if (!ray::readPly(in_name, true, applyToChunk, 0, false, 1000000, 1) || !success)
   {
     return false;
   }
-  ray::writeRayCloudChunkEnd(ofs);
+  ray::writeRayCloudChunkEnd(ofs, &stats);
+  ofs.close();
+  if (!time_index.end(out_name))
+  {
+    std::cerr << "Error: could not write the time index " << TimeIndex::fileName(out_name) << std::endl;
+    return false;
+  }
   return true;
 }
 
+bool convertCloud(const std::string &in_name, const std::string &out_name,
+                  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply)
+{
+  // run the function 'apply' on each ray as it is read in
+  auto applyToRays = [&apply](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                              std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      apply(starts[i], ends[i], times[i], colours[i]);
+    }
+  };
+  return convertCloudChunks(in_name, out_name, applyToRays);
+}
+
 }  // namespace ray
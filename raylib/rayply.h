@@ -22,12 +22,43 @@ using RayPlyEntry = Eigen::Matrix<float, 9, 1>;  // structure of raycloud cloud
 using PointPlyBuffer = std::vector<PointPlyEntry>;
 using RayPlyBuffer = std::vector<RayPlyEntry>;  // buffer for storing a list of rays to be written
 
+/// Summary statistics of a ray cloud file, gathered while it is written and stored in its header. This lets
+/// Cloud::getInfo read them without passing over the rays. The rays are accumulated as they will be read back from
+/// the file, so the values match those calculated from the rays
+struct RAYLIB_EXPORT RayCloudStats
+{
+  RayCloudStats() { clear(); }
+  /// reset to the statistics of an empty cloud
+  void clear();
+  /// accumulate a ray, as read from the file
+  void add(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+  /// the statistics as a line of text, which fromString reads back exactly. fromString returns false if the text
+  /// is not a valid set of statistics
+  std::string toString() const;
+  bool fromString(const std::string &text);
+  /// accumulate a ray that is being written to the file, as it will be read back. Rays with nans are skipped
+  void addWritten(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+
+  unsigned long num_rows;  // rows in the file, including any invalid rays that are skipped when reading
+  unsigned long num_rays;
+  unsigned long num_bounded;
+  Eigen::Vector3d ends_min, ends_max;  // bounded end points only
+  Eigen::Vector3d starts_min, starts_max;
+  Eigen::Vector3d rays_min, rays_max;  // all start and end points
+  double min_time, max_time;
+  Eigen::Vector3d ends_sum;  // sum of the bounded end points
+  Eigen::Vector3d start_pos, end_pos;  // the ray starts at the minimum and maximum times
+};
+
 /// read in a .ply file into the fields given by reference
 /// Note that @c max_intensity is only used when reading in a point cloud. Intensities are already stored in the
 /// colour alpha channel in ray clouds.
 bool RAYLIB_EXPORT readPly(const std::string &file_name, std::vector<Eigen::Vector3d> &starts,
                            std::vector<Eigen::Vector3d> &ends, std::vector<double> &times, std::vector<RGBA> &colours,
                            bool is_ray_cloud, double max_intensity = 0);
+/// read in a ray cloud .ply file into @c cloud. Rays with float positions and ray vectors, as written by raycloudtools,
+/// are decoded straight into the cloud's float arrays, so they take no double precision copy on the way
+bool RAYLIB_EXPORT readPly(const std::string &file_name, class CompactCloud &cloud);
 /// read in a .ply file that represents a triangular mesh, into the @c Mesh structure
 bool RAYLIB_EXPORT readPlyMesh(const std::string &file, class Mesh &mesh);
 
@@ -38,11 +69,24 @@ bool RAYLIB_EXPORT writePlyMesh(const std::string &file_name, const class Mesh &
 /// @c chunk_size is the number of rays to read at one time. This method can be used on large clouds where
 /// the full set of rays is not required to be in memory at one time.
 /// @c times_optional flag allows clouds to be read with no time stamps
+/// @c prefetch_chunks is the number of chunks decoded ahead on a background thread while @c apply runs. 0 reads
+/// serially, 1 is double buffered, 2 triple buffered. @c apply is always called on the calling thread, in file order.
 bool RAYLIB_EXPORT readPly(const std::string &file_name, bool is_ray_cloud,
                            std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                               std::vector<double> &times, std::vector<RGBA> &colours)>
                              apply, 
-                           double max_intensity, bool times_optional = false, size_t chunk_size = 1000000);
+                           double max_intensity, bool times_optional = false, size_t chunk_size = 1000000,
+                           size_t prefetch_chunks = 0);
+
+/// read only some of the rays of ray cloud file @c file_name, calling @c apply one chunk at a time as readPly does.
+/// @c row_ranges is a list of the first row and number of rows of each range to read, in increasing order
+bool RAYLIB_EXPORT readRayCloudRows(const std::string &file_name,
+                                    const std::vector<std::pair<size_t, size_t>> &row_ranges,
+                                    std::function<void(std::vector<Eigen::Vector3d> &starts,
+                                                       std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                       std::vector<RGBA> &colours)>
+                                      apply,
+                                    size_t chunk_size = 1000000, size_t prefetch_chunks = 0);
 
 
 /// write a .ply file representing a point cloud
@@ -59,8 +103,14 @@ bool RAYLIB_EXPORT writeRayCloudChunkStart(const std::string &file_name, std::of
 bool RAYLIB_EXPORT writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices,
                                       const std::vector<Eigen::Vector3d> &starts,
                                       const std::vector<Eigen::Vector3d> &ends, const std::vector<double> &times,
-                                      const std::vector<RGBA> &colours, bool &has_warned);
-unsigned long RAYLIB_EXPORT writeRayCloudChunkEnd(std::ofstream &out);
+                                      const std::vector<RGBA> &colours, bool &has_warned,
+                                      RayCloudStats *stats = nullptr);
+/// finishes the file. If the @c stats of all written chunks are given then they are stored in the header
+unsigned long RAYLIB_EXPORT writeRayCloudChunkEnd(std::ofstream &out, const RayCloudStats *stats = nullptr);
+
+/// read the statistics stored in the header of ray cloud @c file_name. Returns false if there are none, or they do
+/// not match the file's contents
+bool RAYLIB_EXPORT readRayCloudStats(const std::string &file_name, RayCloudStats &stats);
 
 /// Chunked version of writePlyPointCloud
 bool RAYLIB_EXPORT writePointCloudChunkStart(const std::string &file_name, std::ofstream &out);
@@ -72,6 +122,15 @@ void RAYLIB_EXPORT writePointCloudChunkEnd(std::ofstream &out);
 /// Simple function for converting a ray cloud according to the per-ray function @c apply
 bool convertCloud(const std::string &in_name, const std::string &out_name,
                   std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply);
+
+/// Convert a ray cloud one chunk at a time, where @c apply modifies each chunk of rays in place. This avoids the
+/// per-ray call of convertCloud, and lets @c apply use the parallel kernels in raytransform.h. The next chunk is
+/// decoded on a background thread while @c apply runs and the previous chunk is written.
+bool RAYLIB_EXPORT convertCloudChunks(
+  const std::string &in_name, const std::string &out_name,
+  std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                     std::vector<double> &times, std::vector<RGBA> &colours)>
+    apply);
 }  // namespace ray
 
 #endif  // RAYLIB_RAYPLY_H
@@ -24,11 +24,18 @@ ProgressThread::~ProgressThread()
   join();
 }
 
+void ProgressThread::requestQuit()
+{
+  std::unique_lock<std::mutex> guard(quit_mutex_);
+  quit_flag_ = true;
+  quit_condition_.notify_all();
+}
+
 void ProgressThread::join()
 {
   if (running_)
   {
-    quit_flag_ = true;
+    requestQuit();
     thread_.join();
     running_ = false;
   }
@@ -58,7 +65,8 @@ void ProgressThread::run()
       showProgress(current, false, nullptr);
       current.read(&last);
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::unique_lock<std::mutex> guard(quit_mutex_);
+    quit_condition_.wait_for(guard, std::chrono::milliseconds(200), [this] { return quit_flag_.load(); });
   }
 
   // Past update.
@@ -11,6 +11,8 @@
 #include "rayprogress.h"
 
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 namespace ray
@@ -30,7 +32,8 @@ public:
   /// Destructor ensuring the thread is joined.
   ~ProgressThread();
 
-  void requestQuit() { quit_flag_ = true; }
+  /// Ask the thread to finish, waking it immediately rather than at its next update.
+  void requestQuit();
   void join();
 
 private:
@@ -40,6 +43,8 @@ private:
 
   Progress &progress_;
   std::atomic_bool quit_flag_;
+  std::mutex quit_mutex_;
+  std::condition_variable quit_condition_;
   std::atomic_bool running_;
   std::thread thread_;
 };
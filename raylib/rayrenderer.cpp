@@ -13,7 +13,9 @@
 #include "xtiffio.h"   /* for TIFF */
 #endif
 #include <fstream>
+#include <limits>
 #include "rayunused.h"
+#include "rayparallel.h"
 
 #define DENSITY_MIN_RAYS 10  // larger is more accurate but more blurred. 0 for no adaptive blending
 
@@ -269,107 +271,275 @@ bool writeGeoTiffFloat(const std::string &filename, int x, int y, const float *d
 }
 #endif
 
+/// One ray's pass through one voxel
+struct DensityGrid::VoxelSegment
+{
+  int64_t brick;
+  float length;
+  uint16_t voxel;  // index within the brick
+  bool hit;
+};
+
+/// Used with walkGrid to record the voxel segments of a ray, into one bin per partition of the bricks
+struct DensityGrid::SegmentRecorder
+{
+  const DensityGrid &grid;
+  std::vector<VoxelSegment> *bins;
+  size_t num_bins;
+  bool bounded;
+
+  inline bool operator()(const Eigen::Vector3i &p, const Eigen::Vector3i &target, double in_length, double out_length,
+                         double max_length)
+  {
+    VoxelSegment segment;
+    const Eigen::Vector3i inds = grid.clampToGrid(p);  // as in touchVoxel
+    segment.brick = grid.getBrickIndex(inds);
+    segment.voxel = static_cast<uint16_t>(getInBrickIndex(inds));
+    segment.hit = p == target && bounded;
+    // the same arithmetic as DensityGrid::operator(), so the lengths are identical
+    if (segment.hit)
+    {
+      double length_in_voxel = std::min(out_length, max_length) - in_length;
+      segment.length = static_cast<float>(length_in_voxel * grid.voxel_width_);
+    }
+    else
+    {
+      segment.length = static_cast<float>((out_length - in_length) * grid.voxel_width_);
+    }
+    bins[static_cast<size_t>(segment.brick) % num_bins].push_back(segment);
+    return false;
+  }
+};
+
 /// Calculate the surface area per cubic metre within each voxel of the grid. Assuming an unbiased distribution
 /// of surface angles.
 void DensityGrid::calculateDensities(const std::string &file_name)
 {
-  auto calculate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
-                       std::vector<RGBA> &colours) {
-    for (size_t i = 0; i < ends.size(); ++i)
+  const size_t num_threads = static_cast<size_t>(maxThreads());
+  if (num_threads <= 1)
+  {
+    auto calculate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &, std::vector<RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); ++i)
+      {
+        Eigen::Vector3d start = starts[i];
+        Eigen::Vector3d end = ends[i];
+        if (!bounds_.clipRay(start, end, 1e-10))
+        {
+          continue; // ray is outside of bounds
+        }
+        bounded_ = colours[i].alpha > 0;
+        walkGrid((start - bounds_.min_bound_) / voxel_width_, (end - bounds_.min_bound_) / voxel_width_, *this);
+      }
+    };
+    Cloud::read(file_name, bounds_, calculate);
+    return;
+  }
+
+  // Each thread walks a contiguous range of the rays, recording the voxel segments rather than adding them, binned
+  // by the partition of the bricks that they fall in. Each partition is then owned by one thread, which adds the
+  // segments from every range in turn. So each voxel accumulates its rays in the same order as the serial walk,
+  // giving bit-identical floating point sums, with no locking.
+  const size_t batch_size = 1 << 15;  // bounds the memory used by the recorded segments
+  std::vector<std::vector<VoxelSegment>> bins(num_threads * num_threads);  // [range][partition]
+  std::vector<std::vector<int64_t>> new_bricks(num_threads);
+  const uint32_t pending_brick = std::numeric_limits<uint32_t>::max();
+  auto calculate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &, std::vector<RGBA> &colours) {
+    for (size_t batch_start = 0; batch_start < ends.size(); batch_start += batch_size)
     {
-      Eigen::Vector3d start = starts[i];
-      Eigen::Vector3d end = ends[i];
-      if (!bounds_.clipRay(start, end, 1e-10))
+      const size_t batch_count = std::min(batch_size, ends.size() - batch_start);
+      parallelFor(num_threads, [&](size_t range) {
+        SegmentRecorder recorder{ *this, &bins[range * num_threads], num_threads, false };
+        for (size_t partition = 0; partition < num_threads; partition++)
+        {
+          recorder.bins[partition].clear();
+        }
+        const size_t first = batch_start + (batch_count * range) / num_threads;
+        const size_t last = batch_start + (batch_count * (range + 1)) / num_threads;
+        for (size_t i = first; i < last; ++i)
+        {
+          Eigen::Vector3d start = starts[i];
+          Eigen::Vector3d end = ends[i];
+          if (!bounds_.clipRay(start, end, 1e-10))
+          {
+            continue; // ray is outside of bounds
+          }
+          recorder.bounded = colours[i].alpha > 0;
+          walkGrid((start - bounds_.min_bound_) / voxel_width_, (end - bounds_.min_bound_) / voxel_width_, recorder);
+        }
+      });
+      // find the newly reached bricks of each partition, then allocate them serially
+      parallelFor(num_threads, [&](size_t partition) {
+        new_bricks[partition].clear();
+        for (size_t range = 0; range < num_threads; range++)
+        {
+          for (auto &segment : bins[range * num_threads + partition])
+          {
+            uint32_t &id = brick_ids_[segment.brick];
+            if (id == 0)
+            {
+              id = pending_brick;
+              new_bricks[partition].push_back(segment.brick);
+            }
+          }
+        }
+      });
+      for (auto &bricks : new_bricks)
       {
-        continue; // ray is outside of bounds
+        for (auto &brick : bricks)
+        {
+          bricks_.emplace_back(new Voxel[brick_size]);
+          brick_ids_[brick] = (uint32_t)bricks_.size();
+        }
       }
-      bounded_ = colours[i].alpha > 0;
-      walkGrid((start - bounds_.min_bound_) / voxel_width_, (end - bounds_.min_bound_) / voxel_width_, *this);
+      parallelFor(num_threads, [&](size_t partition) {
+        for (size_t range = 0; range < num_threads; range++)
+        {
+          for (auto &segment : bins[range * num_threads + partition])
+          {
+            Voxel &voxel = bricks_[brick_ids_[segment.brick] - 1][segment.voxel];
+            if (segment.hit)
+            {
+              voxel.addHitRay(segment.length);
+            }
+            else
+            {
+              voxel.addMissRay(segment.length);
+            }
+          }
+        }
+      });
     }
   };
-  Cloud::read(file_name, calculate);
+  Cloud::read(file_name, bounds_, calculate);
 }
 
 // This is a form of windowed average over the Moore neighbourhood (3x3x3) window.
+DensityGrid::Voxel DensityGrid::fusedVoxel(const Eigen::Vector3i &inds, double &num_hit_points,
+                                           double &num_hit_points_unsatisfied) const
+{
+  auto at = [&](int x, int y, int z) -> const Voxel & { return voxel(inds + Eigen::Vector3i(x, y, z)); };
+  const Voxel &centre = at(0, 0, 0);
+  if (centre.numHits() > 0)
+    num_hit_points++;
+#if DENSITY_MIN_RAYS > 0
+  float needed = DENSITY_MIN_RAYS - centre.numRays();
+#else
+  float needed = -1.0f;
+#endif
+  Voxel voxel = centre;
+  if (needed < 0.0)
+    return voxel;
+  Voxel neighbours = at(-1, 0, 0);
+  neighbours += at(1, 0, 0);
+  neighbours += at(0, -1, 0);
+  neighbours += at(0, 1, 0);
+  neighbours += at(0, 0, -1);
+  neighbours += at(0, 0, 1);
+  if (neighbours.numRays() >= needed)
+  {
+    voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
+    return voxel;
+  }
+  voxel += neighbours;
+  needed -= neighbours.numRays();
+
+  neighbours = at(-1, -1, 0);
+  neighbours += at(-1, 1, 0);
+  neighbours += at(1, -1, 0);
+  neighbours += at(1, 1, 0);
+
+  neighbours += at(-1, 0, -1);
+  neighbours += at(-1, 0, 1);
+  neighbours += at(1, 0, -1);
+  neighbours += at(1, 0, 1);
+
+  neighbours += at(0, -1, -1);
+  neighbours += at(0, -1, 1);
+  neighbours += at(0, 1, -1);
+  neighbours += at(0, 1, 1);
+  if (neighbours.numRays() >= needed)
+  {
+    voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
+    return voxel;
+  }
+  voxel += neighbours;
+  needed -= neighbours.numRays();
+
+  neighbours = at(-1, -1, -1);
+  neighbours += at(-1, -1, 1);
+  neighbours += at(-1, 1, -1);
+  neighbours += at(1, -1, -1);
+  neighbours += at(-1, 1, 1);
+  neighbours += at(1, -1, 1);
+  neighbours += at(1, 1, -1);
+  neighbours += at(1, 1, 1);
+  if (neighbours.numRays() >= needed)
+  {
+    voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
+    return voxel;
+  }
+  voxel += neighbours;
+  if (centre.numHits() > 0)
+    num_hit_points_unsatisfied++;
+  return voxel;
+}
+
 void DensityGrid::addNeighbourPriors()
 {
 #if DENSITY_MIN_RAYS > 0
-  const int X = 1;
-  const int Y = voxel_dims_[0];
-  const int Z = voxel_dims_[0] * voxel_dims_[1];
-  DensityGrid::Voxel neighbours;
   double num_hit_points = 0.0;
   double num_hit_points_unsatisfied = 0.0;
 
-  // This simple 3x3x3 convolution needs to be a bit sneaky to avoid having to double the memory cost.
-  // well, not that sneaky, we just shift the output -1,-1,-1 for each cell
-  for (int x = 1; x < voxel_dims_[0] - 1; x++)
+  // The fused value of each interior voxel is written one voxel back along each axis, to its -1,-1,-1 neighbour.
+  // Voxels of the last two layers on each axis, which receive no value, are unchanged. So an output brick depends
+  // only on the input bricks from itself to +1,+1,+1 bricks away. Processing the bricks in increasing order, each
+  // input brick is last read by its own output, so the output can replace it without doubling the memory cost,
+  // and only bricks with an allocated input brick in that range need processing.
+  std::unique_ptr<Voxel[]> output(new Voxel[brick_size]);
+  const Eigen::Vector3i interior_max = voxel_dims_ - Eigen::Vector3i(2, 2, 2);
+  Eigen::Vector3i brick;
+  for (brick[0] = 0; brick[0] < brick_dims_[0]; brick[0]++)
   {
-    for (int y = 1; y < voxel_dims_[1] - 1; y++)
+    for (brick[1] = 0; brick[1] < brick_dims_[1]; brick[1]++)
     {
-      for (int z = 1; z < voxel_dims_[2] - 1; z++)
+      for (brick[2] = 0; brick[2] < brick_dims_[2]; brick[2]++)
       {
-        const int ind = getIndex(Eigen::Vector3i(x, y, z));
-        if (voxels_[ind].numHits() > 0)
-          num_hit_points++;
-        float needed = DENSITY_MIN_RAYS - voxels_[ind].numRays();
-        const DensityGrid::Voxel corner_vox = voxels_[ind - X - Y - Z];
-        voxels_[ind - X - Y - Z] = voxels_[ind];  // move centre up to corner
-        DensityGrid::Voxel &voxel = voxels_[ind - X - Y - Z];
-        if (needed < 0.0)
-          continue;
-        neighbours = voxels_[ind - X];
-        neighbours += voxels_[ind + X];
-        neighbours += voxels_[ind - Y];
-        neighbours += voxels_[ind + Y];
-        neighbours += voxels_[ind - Z];
-        neighbours += voxels_[ind + Z];
-        if (neighbours.numRays() >= needed)
+        bool has_input = false;
+        for (int i = 0; i < 8 && !has_input; i++)
         {
-          voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
-          continue;
+          const Eigen::Vector3i input = brick + Eigen::Vector3i(i & 1, (i >> 1) & 1, i >> 2);
+          has_input = input[0] < brick_dims_[0] && input[1] < brick_dims_[1] && input[2] < brick_dims_[2] &&
+                      isAllocated(input * brick_width);
         }
-        voxel += neighbours;
-        needed -= neighbours.numRays();
-
-        neighbours = voxels_[ind - X - Y];
-        neighbours += voxels_[ind - X + Y];
-        neighbours += voxels_[ind + X - Y];
-        neighbours += voxels_[ind + X + Y];
-
-        neighbours += voxels_[ind - X - Z];
-        neighbours += voxels_[ind - X + Z];
-        neighbours += voxels_[ind + X - Z];
-        neighbours += voxels_[ind + X + Z];
-
-        neighbours += voxels_[ind - Y - Z];
-        neighbours += voxels_[ind - Y + Z];
-        neighbours += voxels_[ind + Y - Z];
-        neighbours += voxels_[ind + Y + Z];
-        if (neighbours.numRays() >= needed)
-        {
-          voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
+        if (!has_input)
           continue;
+        bool has_output = false;
+        const Eigen::Vector3i min_voxel = brick * brick_width;
+        for (int i = 0; i < brick_size; i++)
+        {
+          Eigen::Vector3i inds =
+            min_voxel + Eigen::Vector3i(i % brick_width, (i / brick_width) % brick_width, i / (brick_width * brick_width));
+          if (inds[0] >= voxel_dims_[0] || inds[1] >= voxel_dims_[1] || inds[2] >= voxel_dims_[2])
+          {
+            output[i] = Voxel();
+          }
+          else if (inds[0] >= interior_max[0] || inds[1] >= interior_max[1] || inds[2] >= interior_max[2])
+          {
+            output[i] = voxel(inds);
+          }
+          else
+          {
+            output[i] = fusedVoxel(inds + Eigen::Vector3i(1, 1, 1), num_hit_points, num_hit_points_unsatisfied);
+          }
+          has_output = has_output || output[i].numRays() != 0.0f || output[i].pathLength() != 0.0f;
         }
-        voxel += neighbours;
-        needed -= neighbours.numRays();
-
-        neighbours = corner_vox;
-        neighbours += voxels_[ind - X - Y + Z];
-        neighbours += voxels_[ind - X + Y - Z];
-        neighbours += voxels_[ind + X - Y - Z];
-        neighbours += voxels_[ind - X + Y + Z];
-        neighbours += voxels_[ind + X - Y + Z];
-        neighbours += voxels_[ind + X + Y - Z];
-        neighbours += voxels_[ind + X + Y + Z];
-        if (neighbours.numRays() >= needed)
+        if (has_output || isAllocated(min_voxel))
         {
-          voxel += neighbours * (needed / neighbours.numRays());  // add minimal amount to reach DENSITY_MIN_RAYS
-          continue;
+          Voxel *voxels = &touchVoxel(min_voxel);
+          std::copy(output.get(), output.get() + brick_size, voxels);
         }
-        voxel += neighbours;
-        if (voxels_[ind].numHits() > 0)
-          num_hit_points_unsatisfied++;
       }
     }
   }
@@ -442,13 +612,18 @@ bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirect
         for (int y = 0; y < height; y++)
         {
           double total_density = 0.0;
+          Eigen::Vector3i ind;
+          ind[ax1] = x;
+          ind[ax2] = y;
           for (int z = 0; z < depth; z++)
           {
-            Eigen::Vector3i ind;
             ind[axis] = z;
-            ind[ax1] = x;
-            ind[ax2] = y;
-            total_density += grid.voxels()[grid.getIndex(ind)].density();
+            if (!grid.isAllocated(ind))  // skip to the next brick, as this one has no density
+            {
+              z += DensityGrid::brick_width - 1 - z % DensityGrid::brick_width;
+              continue;
+            }
+            total_density += grid.voxel(ind).density();
           }
           pixels[x + width * y] = Eigen::Vector4d(total_density, total_density, total_density, total_density);
         }
@@ -456,78 +631,139 @@ bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirect
     }
     else  // otherwise we use a common algorithm, specialising on render style only per-ray
     {
+      // calls add_pixel(index) for each pixel that ray i contributes to
+      auto for_each_pixel = [&](const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                                size_t i, const auto &add_pixel) {
+        if (style != RenderStyle::Rays)
+        {
+          const Eigen::Vector3d point = style == RenderStyle::Starts ? starts[i] : ends[i];
+          const Eigen::Vector3i p = ((point - bounds.min_bound_) / pix_width).cast<int>();
+          add_pixel(p[ax1] + width * p[ax2]);
+          return;
+        }
+        Eigen::Vector3d cloud_start = starts[i];
+        Eigen::Vector3d cloud_end = ends[i];
+        // clip to within the image (since we exclude unbounded rays from the image bounds)
+        if (!bounds.clipRay(cloud_start, cloud_end))
+        {
+          return;
+        }
+        Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
+        Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
+        const Eigen::Vector3d dir = cloud_end - cloud_start;
+
+        // fast approximate 2D line rendering requires picking the long axis to iterate along
+        const bool x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
+        const int axis_long = x_long ? ax1 : ax2;
+        const int axis_short = x_long ? ax2 : ax1;
+        const int width_long = x_long ? 1 : width;
+        const int width_short = x_long ? width : 1;
+        const int max_short = x_long ? height - 1 : width - 1;
+
+        const double gradient = dir[axis_short] / dir[axis_long];
+        if (dir[axis_long] < 0.0)
+          std::swap(start, end);  // this lets us iterate from low up to high values
+        const int start_long = static_cast<int>(start[axis_long]);
+        const int end_long = static_cast<int>(end[axis_long]);
+        // place a pixel at the height of each midpoint (of the pixel) in the long axis
+        const double start_mid_point = 0.5 + static_cast<double>(start_long);
+        double height = start[axis_short] + (start_mid_point - start[axis_long]) * gradient;
+        for (int l = start_long; l <= end_long; l++, height += gradient)
+        {
+          // the midpoint height can overhang the image edge by up to half a pixel at the ends of the line
+          const int s = std::min(static_cast<int>(height), max_short);
+          add_pixel(width_long * l + width_short * s);
+        }
+      };
+      // accumulates the colour of ray i into pixel @c pix
+      auto shade = [&](const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                       const std::vector<RGBA> &colours, size_t i, Eigen::Vector4d &pix) {
+        const RGBA &colour = colours[i];
+        const Eigen::Vector3d col = Eigen::Vector3d(colour.red, colour.green, colour.blue) / 255.0;
+        switch (style)  // render the image according to the chosen style
+        {
+        case RenderStyle::Ends:
+        case RenderStyle::Starts:
+        case RenderStyle::Height:
+        {
+          const Eigen::Vector3d point = style == RenderStyle::Starts ? starts[i] : ends[i];
+          const double depth = (point[axis] - bounds.min_bound_[axis]) / pix_width;
+          if (depth * dir > pix[3] * dir || pix[3] == 0.0)  // using 0.0 precisely as a flag here
+          {
+            pix = Eigen::Vector4d(col[0], col[1], col[2], depth);
+          }
+          break;
+        }
+        case RenderStyle::Mean:
+        case RenderStyle::Sum:
+        case RenderStyle::Rays:
+          // using 4 dimensions helps us to accumulate colours in a greater variety of ways
+          pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+          break;
+        default:
+          break;
+        }
+      };
+
+      // The pixels are divided into interleaved blocks, each owned by one thread. Each thread finds the pixels of a
+      // contiguous range of rays, binned by the owner of the pixel. Each owner then shades its pixels, taking the
+      // ranges in order, so every pixel accumulates its rays in the same order as a serial render and the image is
+      // identical for any number of threads, without locks or per-thread copies of the image.
+      const size_t num_threads = static_cast<size_t>(maxThreads());
+      const size_t batch_size = 1 << 15;  // bounds the memory used by the binned pixels
+      const int block_shift = 12;         // 4096 pixels per block
+      struct PixelRay
+      {
+        int pixel;
+        uint32_t ray;
+      };
+      std::vector<std::vector<PixelRay>> bins(num_threads * num_threads);  // [range][owner]
+
       // this lambda expression lets us chunk load the ray cloud file, so we don't run out of RAM
       auto render = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
                         std::vector<RGBA> &colours) {
-        for (size_t i = 0; i < ends.size(); i++)
+        if (num_threads <= 1)
         {
-          const RGBA &colour = colours[i];
-          if (colour.alpha == 0)
-            continue;
-          const Eigen::Vector3d col = Eigen::Vector3d(colour.red, colour.green, colour.blue) / 255.0;
-          const Eigen::Vector3d point = style == RenderStyle::Starts ? starts[i] : ends[i];
-          const Eigen::Vector3d pos = (point - bounds.min_bound_) / pix_width;
-          const Eigen::Vector3i p = (pos).cast<int>();
-          const int x = p[ax1], y = p[ax2];
-          // using 4 dimensions helps us to accumulate colours in a greater variety of ways
-          Eigen::Vector4d &pix = pixels[x + width * y];
-          switch (style)  // render the image according to the chosen style
+          for (size_t i = 0; i < ends.size(); i++)
           {
-          case RenderStyle::Ends:
-          case RenderStyle::Starts:
-          case RenderStyle::Height:
-            if (pos[axis] * dir > pix[3] * dir || pix[3] == 0.0)  // using 0.0 precisely as a flag here
+            if (colours[i].alpha == 0)
+              continue;
+            for_each_pixel(starts, ends, i, [&](int pixel) { shade(starts, ends, colours, i, pixels[pixel]); });
+          }
+          return;
+        }
+        for (size_t batch_start = 0; batch_start < ends.size(); batch_start += batch_size)
+        {
+          const size_t batch_count = std::min(batch_size, ends.size() - batch_start);
+          parallelFor(num_threads, [&](size_t range) {
+            std::vector<PixelRay> *range_bins = &bins[range * num_threads];
+            for (size_t owner = 0; owner < num_threads; owner++)
             {
-              pix = Eigen::Vector4d(col[0], col[1], col[2], pos[axis]);
+              range_bins[owner].clear();
             }
-            break;
-          case RenderStyle::Mean:
-            pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-            break;
-          case RenderStyle::Sum:
-            pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-            break;
-          case RenderStyle::Rays:
-          {
-            Eigen::Vector3d cloud_start = starts[i];
-            Eigen::Vector3d cloud_end = ends[i];
-            // clip to within the image (since we exclude unbounded rays from the image bounds)
-            if (!bounds.clipRay(cloud_start, cloud_end))
+            const size_t first = batch_start + (batch_count * range) / num_threads;
+            const size_t last = batch_start + (batch_count * (range + 1)) / num_threads;
+            for (size_t i = first; i < last; i++)
             {
-              continue;
+              if (colours[i].alpha == 0)
+                continue;
+              for_each_pixel(starts, ends, i, [&](int pixel) {
+                range_bins[((size_t)pixel >> block_shift) % num_threads].push_back(PixelRay{ pixel, (uint32_t)i });
+              });
             }
-            Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
-            Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
-            const Eigen::Vector3d dir = cloud_end - cloud_start;
-
-            // fast approximate 2D line rendering requires picking the long axis to iterate along
-            const bool x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
-            const int axis_long = x_long ? ax1 : ax2;
-            const int axis_short = x_long ? ax2 : ax1;
-            const int width_long = x_long ? 1 : width;
-            const int width_short = x_long ? width : 1;
-
-            const double gradient = dir[axis_short] / dir[axis_long];
-            if (dir[axis_long] < 0.0)
-              std::swap(start, end);  // this lets us iterate from low up to high values
-            const int start_long = static_cast<int>(start[axis_long]);
-            const int end_long = static_cast<int>(end[axis_long]);
-            // place a pixel at the height of each midpoint (of the pixel) in the long axis
-            const double start_mid_point = 0.5 + static_cast<double>(start_long);
-            double height = start[axis_short] + (start_mid_point - start[axis_long]) * gradient;
-            for (int l = start_long; l <= end_long; l++, height += gradient)
+          });
+          parallelFor(num_threads, [&](size_t owner) {
+            for (size_t range = 0; range < num_threads; range++)
             {
-              const int s = static_cast<int>(height);
-              pixels[width_long * l + width_short * s] += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+              for (auto &pixel_ray : bins[range * num_threads + owner])
+              {
+                shade(starts, ends, colours, pixel_ray.ray, pixels[pixel_ray.pixel]);
+              }
             }
-            break;
-          }
-          default:
-            break;
-          }
+          });
         }
       };
-      if (!Cloud::read(cloud_file, render))
+      if (!Cloud::read(cloud_file, render, 1))
         return false;
     }
 
@@ -10,6 +10,8 @@
 #include "raypose.h"
 #include "rayutils.h"
 
+#include <memory>
+
 namespace ray
 {
 /// Supported view directions on cloud data
@@ -53,18 +55,23 @@ bool RAYLIB_EXPORT writeGeoTiffFloat(const std::string &filename, int x, int y,
 /// It is most effective as a measure of leaf area per volume on vegetation, and is described in:
 /// Lowe, Thomas, et al. "Canopy Density Estimation in Perennial Horticulture Crops Using 3D Spinning LiDAR SLAM."
 /// arXiv preprint arXiv:2007.15652 (2020).
+/// The grid is sparse. Voxels are allocated in cubic bricks of @c brick_width when a ray first passes through them,
+/// so the regions that no ray reaches (typically below ground, and above canopy) cost only a brick table entry.
 struct RAYLIB_EXPORT DensityGrid
 {
   static const int min_voxel_hits = 2;
   static constexpr double spherical_distribution_scale =
     2.0;  // average area scale due to a spherical uniform distribution of leave angles relative to the rays
+  static const int brick_width = 8;
+  static const int brick_size = brick_width * brick_width * brick_width;
 
   DensityGrid(const Cuboid &grid_bounds, double vox_width, const Eigen::Vector3i &dims)
     : bounds_(grid_bounds)
     , voxel_width_(vox_width)
     , voxel_dims_(dims)
   {
-    voxels_.resize(dims[0] * dims[1] * dims[2]);
+    brick_dims_ = (dims + Eigen::Vector3i::Constant(brick_width - 1)) / brick_width;
+    brick_ids_.resize((size_t)brick_dims_[0] * (size_t)brick_dims_[1] * (size_t)brick_dims_[2], 0);
   }
 
   /// This specific voxel class represents a density
@@ -94,27 +101,65 @@ struct RAYLIB_EXPORT DensityGrid
     float path_length_;
   };
 
-  /// This streams in a ray cloud file, and fills in the voxel density information
+  /// This streams in a ray cloud file, and fills in the voxel density information.
+  /// The rays are walked in parallel, and the result is identical to walking them serially, whatever the thread count
   void calculateDensities(const std::string &file_name);
   /// To void low-ray-count voxels giving unstable density estimates, we fuse with neighbour information
   /// up to a specified minimum number of rays. Specified in DENSITY_MIN_RAYS
   void addNeighbourPriors();
   /// Note, for performance, this index function does not check that the specified indices are in valid bounds.
   /// It is up to the calling function to assure this condition
-  inline int getIndex(const Eigen::Vector3i &inds) const;
-  inline int getIndexFromPos(const Eigen::Vector3d &pos) const;
-  /// Return the vector of density voxels
-  inline const std::vector<Voxel> &voxels() const { return voxels_; }
+  inline int64_t getIndex(const Eigen::Vector3i &inds) const;
+  inline int64_t getIndexFromPos(const Eigen::Vector3d &pos) const;
+  /// The voxel at the given indices, or at the index given by getIndex. Voxels that no ray has reached are empty
+  inline const Voxel &voxel(const Eigen::Vector3i &inds) const;
+  inline const Voxel &voxel(int64_t index) const;
+  /// whether the brick containing the voxel at @c inds has been allocated. If not, the voxel is empty
+  inline bool isAllocated(const Eigen::Vector3i &inds) const { return brick_ids_[getBrickIndex(inds)] != 0; }
+  /// the total number of voxels in the grid, allocated or not
+  inline size_t numVoxels() const { return (size_t)voxel_dims_[0] * (size_t)voxel_dims_[1] * (size_t)voxel_dims_[2]; }
+  /// heap memory used by the grid, in bytes
+  inline size_t memoryUsage() const
+  {
+    return brick_ids_.capacity() * sizeof(uint32_t) + bricks_.size() * brick_size * sizeof(Voxel);
+  }
   inline Eigen::Vector3i dimensions(){ return voxel_dims_; }
   inline Cuboid bounds(){ return bounds_; }
   inline double voxelWidth() const { return voxel_width_; }
   // used in walking grid only
   inline bool operator()(const Eigen::Vector3i &p, const Eigen::Vector3i &target, double in_length, double out_length, double max_length);
 private:
+  inline int64_t getBrickIndex(const Eigen::Vector3i &inds) const
+  {
+    return (int64_t)(inds[0] / brick_width) +
+           (int64_t)brick_dims_[0] * ((int64_t)(inds[1] / brick_width) + (int64_t)brick_dims_[1] * (inds[2] / brick_width));
+  }
+  static inline int getInBrickIndex(const Eigen::Vector3i &inds)
+  {
+    return (inds[0] % brick_width) + brick_width * ((inds[1] % brick_width) + brick_width * (inds[2] % brick_width));
+  }
+  /// @c inds clamped to the grid. Rays are clipped to the grid bounds, but an end point on the upper bound (or a clip
+  /// just outside the lower bound) still falls one voxel outside it
+  inline Eigen::Vector3i clampToGrid(const Eigen::Vector3i &inds) const
+  {
+    return inds.cwiseMax(Eigen::Vector3i::Zero()).cwiseMin(voxel_dims_ - Eigen::Vector3i::Ones());
+  }
+  /// the voxel at @c inds, allocating its brick if necessary. @c inds is clamped to the grid
+  inline Voxel &touchVoxel(const Eigen::Vector3i &inds);
+  /// the neighbour-fused value of the voxel at @c inds, used by addNeighbourPriors
+  Voxel fusedVoxel(const Eigen::Vector3i &inds, double &num_hit_points, double &num_hit_points_unsatisfied) const;
+  /// used by the parallel ray walk in calculateDensities
+  struct VoxelSegment;
+  struct SegmentRecorder;
+
   Cuboid bounds_;
-  std::vector<Voxel> voxels_;
   double voxel_width_;
   Eigen::Vector3i voxel_dims_;
+  Eigen::Vector3i brick_dims_;
+  /// per brick, 1 + its index in @c bricks_, or 0 if it is not allocated
+  std::vector<uint32_t> brick_ids_;
+  std::vector<std::unique_ptr<Voxel[]>> bricks_;
+  Voxel empty_voxel_;
   bool bounded_;
 };
 
@@ -162,26 +207,49 @@ void DensityGrid::Voxel::addMissRay(float length)
   path_length_ += length;
   num_rays_++;
 }
-int DensityGrid::getIndex(const Eigen::Vector3i &inds) const
+int64_t DensityGrid::getIndex(const Eigen::Vector3i &inds) const
 {
-  return inds[0] + inds[1] * voxel_dims_[0] + inds[2] * voxel_dims_[0] * voxel_dims_[1];
+  return (int64_t)inds[0] + (int64_t)voxel_dims_[0] * ((int64_t)inds[1] + (int64_t)voxel_dims_[1] * (int64_t)inds[2]);
 }
-int DensityGrid::getIndexFromPos(const Eigen::Vector3d &pos) const
+int64_t DensityGrid::getIndexFromPos(const Eigen::Vector3d &pos) const
 {
   Eigen::Vector3d gridspace = (pos - bounds_.min_bound_) / voxel_width_;
   return getIndex(gridspace.cast<int>());
 }
+const DensityGrid::Voxel &DensityGrid::voxel(const Eigen::Vector3i &inds) const
+{
+  const uint32_t id = brick_ids_[getBrickIndex(inds)];
+  return id == 0 ? empty_voxel_ : bricks_[id - 1][getInBrickIndex(inds)];
+}
+const DensityGrid::Voxel &DensityGrid::voxel(int64_t index) const
+{
+  const int64_t slice = (int64_t)voxel_dims_[0] * (int64_t)voxel_dims_[1];
+  const int64_t z = index / slice;
+  const int64_t xy = index - z * slice;
+  return voxel(Eigen::Vector3i((int)(xy % voxel_dims_[0]), (int)(xy / voxel_dims_[0]), (int)z));
+}
+DensityGrid::Voxel &DensityGrid::touchVoxel(const Eigen::Vector3i &grid_inds)
+{
+  const Eigen::Vector3i inds = clampToGrid(grid_inds);
+  uint32_t &id = brick_ids_[getBrickIndex(inds)];
+  if (id == 0)
+  {
+    bricks_.emplace_back(new Voxel[brick_size]);
+    id = (uint32_t)bricks_.size();
+  }
+  return bricks_[id - 1][getInBrickIndex(inds)];
+}
 inline bool DensityGrid::operator()(const Eigen::Vector3i &p, const Eigen::Vector3i &target, double in_length, double out_length, double max_length)
 {
-  int index = getIndex(p);
+  Voxel &voxel = touchVoxel(p);
   if (p == target && bounded_)
   {
     double length_in_voxel = std::min(out_length, max_length) - in_length;
-    voxels_[index].addHitRay(static_cast<float>(length_in_voxel * voxel_width_));
+    voxel.addHitRay(static_cast<float>(length_in_voxel * voxel_width_));
   }
   else
   {
-    voxels_[index].addMissRay(static_cast<float>((out_length - in_length) * voxel_width_));
+    voxel.addMissRay(static_cast<float>((out_length - in_length) * voxel_width_));
   }
   return false;
 }
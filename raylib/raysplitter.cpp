@@ -47,13 +47,42 @@ bool split(const std::string &file_name, const std::string &in_name, const std::
     in_chunk.clear();
     out_chunk.clear();
   };
-  if (!Cloud::read(file_name, per_chunk))
+  if (!Cloud::read(file_name, per_chunk, 1))
     return false;
   in_writer.end();
   out_writer.end();
   return true;
 }
 
+bool splitTimeWindow(const std::string &file_name, const std::string &in_name, double min_time, double max_time)
+{
+  if (max_time < min_time)
+  {
+    std::cerr << "Error: time window end " << max_time << " is before its start " << min_time << std::endl;
+    return false;
+  }
+  CloudWriter writer;
+  if (!writer.begin(in_name))
+    return false;
+  Cloud chunk;
+  bool written = true;
+  auto per_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (times[i] >= min_time && times[i] <= max_time)
+      {
+        chunk.addRay(starts[i], ends[i], times[i], colours[i]);
+      }
+    }
+    written = writer.writeChunk(chunk) && written;
+    chunk.clear();
+  };
+  if (!Cloud::read(file_name, min_time, max_time, per_chunk, 1))
+    return false;
+  return writer.end() && written;
+}
+
 /// Special case for splitting around a plane.
 bool splitPlane(const std::string &file_name, const std::string &in_name, const std::string &out_name,
                 const Eigen::Vector3d &plane)
@@ -100,7 +129,7 @@ bool splitPlane(const std::string &file_name, const std::string &in_name, const
     in_chunk.clear();
     out_chunk.clear();
   };
-  if (!readPly(file_name, true, per_chunk, 0))
+  if (!Cloud::read(file_name, per_chunk, 1))
     return false;
 
   inside_writer.end();
@@ -226,7 +255,7 @@ bool splitCapsule(const std::string &file_name, const std::string &in_name, cons
     in_chunk.clear();
     out_chunk.clear();
   };
-  if (!readPly(file_name, true, per_chunk, 0))
+  if (!Cloud::read(file_name, per_chunk, 1))
     return false;
 
   inside_writer.end();
@@ -283,7 +312,7 @@ bool splitBox(const std::string &file_name, const std::string &in_name, const st
     in_chunk.clear();
     out_chunk.clear();
   };
-  if (!readPly(file_name, true, per_chunk, 0))
+  if (!Cloud::read(file_name, per_chunk, 1))
     return false;
 
   inside_writer.end();
@@ -291,6 +320,40 @@ bool splitBox(const std::string &file_name, const std::string &in_name, const st
   return true;
 }
 
+bool splitBoxInside(const std::string &file_name, const std::string &in_name, const Eigen::Vector3d &centre,
+                    const Eigen::Vector3d &extents)
+{
+  CloudWriter writer;
+  if (!writer.begin(in_name))
+    return false;
+  Cloud chunk;
+  bool written = true;
+  const Cuboid cuboid(centre - extents, centre + extents);
+  auto per_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      Eigen::Vector3d start = starts[i];
+      Eigen::Vector3d end = ends[i];
+      if (cuboid.clipRay(start, end))  // the same inside part as splitBox
+      {
+        RGBA col = colours[i];
+        if (!cuboid.intersects(ends[i]))  // mark as unbounded
+        {
+          col.red = col.green = col.blue = col.alpha = 0;
+        }
+        chunk.addRay(start, end, times[i], col);
+      }
+    }
+    written = writer.writeChunk(chunk) && written;
+    chunk.clear();
+  };
+  // only the tiles that overlap the box are read, when the cloud has a tile index
+  if (!Cloud::read(file_name, cuboid, per_chunk, 1))
+    return false;
+  return writer.end() && written;
+}
+
 /// Special case for splitting based on a grid.
 bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub, const Eigen::Vector3d &cell_width,
                double overlap)
@@ -340,114 +403,89 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
     std::cerr << "error: output of over 50,000 files is probably a mistake, exiting" << std::endl;
     return false;
   }
-  const int max_open_files = 256;
-  if (length > max_open_files)
-  {
-    std::cout << "Warning: nominally more than " << max_open_files << " file pointers will be open at once." << std::endl;
-    std::cout << "Diving the operation into " << 1+length/max_open_files << " passes" << std::endl;
-  }
-  for (int pass = 0; pass<length; pass+=max_open_files)
-  {
-    if (pass > 0)
+  // a single pass, the rays are buffered per cell and appended to each cell's file in blocks
+  MultiCloudWriter cells;
+  bool success = true;
+
+  // splitting performed per chunk
+  auto per_chunk = [&min_index, &max_index, &width, min_time, &dimensions, &cells, length, &cell_width,
+                    &cloud_name_stub, &overlap, &success](std::vector<Eigen::Vector3d> &starts,
+                                                std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
     {
-      std::cout << "Running pass " << 1 + pass/max_open_files << " / " << 1+length/max_open_files << std::endl;
-    }
-    std::vector<CloudWriter> cells(max_open_files);
-    std::vector<Cloud> chunks(max_open_files);
-
-    // splitting performed per chunk
-    auto per_chunk = [&min_index, &max_index, &width, min_time, &dimensions, &cells, &chunks, length, &cell_width,
-                      &cloud_name_stub, &overlap, &pass, &max_open_files ](std::vector<Eigen::Vector3d> &starts,
-                                                  std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
-                                                  std::vector<RGBA> &colours) {
-      for (size_t i = 0; i < ends.size(); i++)
+      // get set of cells that the ray may intersect
+      const Eigen::Vector3d from(0.5 + starts[i][0] / width[0], 0.5 + starts[i][1] / width[1], 0.5 + starts[i][2] / width[2]);
+      const Eigen::Vector3d to(0.5 + ends[i][0] / width[0], 0.5 + ends[i][1] / width[1], 0.5 + ends[i][2] / width[2]);
+      const Eigen::Vector3d pos0 = minVector(from, to) - Eigen::Vector3d(overlap, overlap, 0.0);
+      const Eigen::Vector3d pos1 = maxVector(from, to) + Eigen::Vector3d(overlap, overlap, 0.0);
+      Eigen::Vector3i minI = Eigen::Vector3d(std::floor(pos0[0]), std::floor(pos0[1]), std::floor(pos0[2])).cast<int>();
+      Eigen::Vector3i maxI = Eigen::Vector3d(std::ceil(pos1[0]), std::ceil(pos1[1]), std::ceil(pos1[2])).cast<int>();
+      if (overlap > 0.0)
       {
-        // get set of cells that the ray may intersect
-        const Eigen::Vector3d from(0.5 + starts[i][0] / width[0], 0.5 + starts[i][1] / width[1], 0.5 + starts[i][2] / width[2]);
-        const Eigen::Vector3d to(0.5 + ends[i][0] / width[0], 0.5 + ends[i][1] / width[1], 0.5 + ends[i][2] / width[2]);
-        const Eigen::Vector3d pos0 = minVector(from, to) - Eigen::Vector3d(overlap, overlap, 0.0);
-        const Eigen::Vector3d pos1 = maxVector(from, to) + Eigen::Vector3d(overlap, overlap, 0.0);
-        Eigen::Vector3i minI = Eigen::Vector3d(std::floor(pos0[0]), std::floor(pos0[1]), std::floor(pos0[2])).cast<int>();
-        Eigen::Vector3i maxI = Eigen::Vector3d(std::ceil(pos1[0]), std::ceil(pos1[1]), std::ceil(pos1[2])).cast<int>();
-        if (overlap > 0.0)
-        {
-          minI = maxVector(minI, min_index);
-          maxI = minVector(maxI, max_index);
-        }
-        const long int t = static_cast<long int>(std::floor(0.5 + times[i] / width[3]));
-        for (int x = minI[0]; x < maxI[0]; x++)
+        minI = maxVector(minI, min_index);
+        maxI = minVector(maxI, max_index);
+      }
+      const long int t = static_cast<long int>(std::floor(0.5 + times[i] / width[3]));
+      for (int x = minI[0]; x < maxI[0]; x++)
+      {
+        for (int y = minI[1]; y < maxI[1]; y++)
         {
-          for (int y = minI[1]; y < maxI[1]; y++)
+          for (int z = minI[2]; z < maxI[2]; z++)
           {
-            for (int z = minI[2]; z < maxI[2]; z++)
+            const int time_dif = static_cast<int>(t - min_time);
+            int index = (x - min_index[0]) + dimensions[0] * (y - min_index[1]) +
+                              dimensions[0] * dimensions[1] * (z - min_index[2]) +
+                              dimensions[0] * dimensions[1] * dimensions[2] * time_dif;
+            if (index < 0 || index >= length)
             {
-              const int time_dif = static_cast<int>(t - min_time);
-              int index = (x - min_index[0]) + dimensions[0] * (y - min_index[1]) +
-                                dimensions[0] * dimensions[1] * (z - min_index[2]) +
-                                dimensions[0] * dimensions[1] * dimensions[2] * time_dif;
-              if (index < 0 || index >= length)
+              std::cout << "Error: bad index: " << index << std::endl;  // this should not happen
+              return;
+            }
+            // do actual clipping here....
+            const Eigen::Vector3d box_min(((double)x - 0.5) * width[0] - overlap,
+                                          ((double)y - 0.5) * width[1] - overlap, ((double)z - 0.5) * width[2]);
+            const Eigen::Vector3d box_max(((double)x + 0.5) * width[0] + overlap,
+                                          ((double)y + 0.5) * width[1] + overlap, ((double)z + 0.5) * width[2]);
+            const Cuboid cuboid(box_min, box_max);
+            Eigen::Vector3d start = starts[i];
+            Eigen::Vector3d end = ends[i];
+
+            if (cuboid.clipRay(start, end))
+            {
+              RGBA col = colours[i];
+              if (!cells.contains(index))  // first time in this cell, so start writing to a new file
               {
-                std::cout << "Error: bad index: " << index << std::endl;  // this should not happen
-                return;
+                std::stringstream name;
+                name << cloud_name_stub;
+                if (cell_width[0] > 0.0)
+                  name << "_" << x;
+                if (cell_width[1] > 0.0)
+                  name << "_" << y;
+                if (cell_width[2] > 0.0)
+                  name << "_" << z;
+                if (cell_width[3] > 0.0)
+                  name << "_" << t;
+                name << ".ply";
+                cells.begin(index, name.str());
               }
-              index -= pass;
-              if (index < 0 || index >= max_open_files)
-                continue;
-              // do actual clipping here....
-              const Eigen::Vector3d box_min(((double)x - 0.5) * width[0] - overlap,
-                                            ((double)y - 0.5) * width[1] - overlap, ((double)z - 0.5) * width[2]);
-              const Eigen::Vector3d box_max(((double)x + 0.5) * width[0] + overlap,
-                                            ((double)y + 0.5) * width[1] + overlap, ((double)z + 0.5) * width[2]);
-              const Cuboid cuboid(box_min, box_max);
-              Eigen::Vector3d start = starts[i];
-              Eigen::Vector3d end = ends[i];
-
-              if (cuboid.clipRay(start, end))
+              if (!cuboid.intersects(ends[i]))  // end point is outside, so mark an unbounded ray
               {
-                RGBA col = colours[i];
-                if (cells[index].fileName().empty())  // first time in this cell, so start writing to a new file
-                {
-                  std::stringstream name;
-                  name << cloud_name_stub;
-                  if (cell_width[0] > 0.0)
-                    name << "_" << x;
-                  if (cell_width[1] > 0.0)
-                    name << "_" << y;
-                  if (cell_width[2] > 0.0)
-                    name << "_" << z;
-                  if (cell_width[3] > 0.0)
-                    name << "_" << t;
-                  name << ".ply";
-                  cells[index].begin(name.str());
-                }
-                if (!cuboid.intersects(ends[i]))  // end point is outside, so mark an unbounded ray
-                {
-                  col.red = col.green = col.blue = col.alpha = 0;
-                }
-                chunks[index].addRay(start, end, times[i], col);
+                col.red = col.green = col.blue = col.alpha = 0;
               }
+              cells.addRay(index, start, end, times[i], col);
             }
           }
         }
       }
-      for (int i = 0; i < max_open_files; i++)
-      {
-        if (chunks[i].ends.size() > 0)
-        {
-          cells[i].writeChunk(chunks[i]);
-          chunks[i].clear();
-        }
-      }
-    };
-    if (!Cloud::read(file_name, per_chunk))
-      return false;
-
-    for (int i = 0; i < max_open_files; i++)
-    {
-      cells[i].end();  // has no effect on writers where begin has not been called
     }
-  }
-  return true;
+    success &= cells.flush();
+  };
+  if (!Cloud::read(file_name, per_chunk, 1))
+    return false;
+
+  success &= cells.end();
+  return success;
 }
 
 class RGBALess
@@ -488,79 +526,45 @@ bool splitColour(const std::string &file_name, const std::string &cloud_name_stu
     std::cerr << "Error: " << num_colours << " colours generates more than the maximum number of files: " << max_total_files << std::endl;
     return false;
   }
-  const int max_files_at_once = 512;  // operating systems will fail with too many open file pointers.
   std::cout << "splitting into: " << num_colours << " files" << std::endl;
-  if (num_colours > max_files_at_once)
-  {
-    std::cout << "Warning: cloud has more unique colours than allowed for simultaneous files " << max_files_at_once << " so using multiple passes." << std::endl;
-  }
-  
-  int chunk_size = std::min(num_colours, max_files_at_once);
-
-  for (int batch = 0; batch < num_colours; batch+=max_files_at_once)
-  {
-    if (batch > 0)
-    {
-      std::cout << "Running pass " << 1+batch/max_files_at_once << " / " << 1 + num_colours / max_files_at_once << std::endl;
-    }
-    std::vector<CloudWriter> cells(chunk_size);
-    std::vector<Cloud> chunks(chunk_size);
-
-    int batch_max = std::min(num_colours, batch + max_files_at_once);
-    if (num_colours > max_files_at_once)
+  // a single pass, the rays are buffered per colour and appended to each colour's file in blocks
+  MultiCloudWriter cells;
+  bool success = true;
+
+  // splitting performed per chunk
+  auto per_chunk = [&vox_map, &cells, &cloud_name_stub, &success, seg_colour](
+                    std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                    std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
     {
-      std::cout << "batch processing colours " << batch << ", to " << batch_max << std::endl;
-    }
-    // splitting performed per chunk
-    auto per_chunk = [&vox_map, &batch, &max_files_at_once, &chunk_size, &cells, &chunks, &cloud_name_stub, &num_colours, seg_colour](
-                      std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                      std::vector<double> &times, std::vector<RGBA> &colours) {
-      for (size_t i = 0; i < ends.size(); i++)
+      RGBA colour = colours[i];
+      const auto &vox = vox_map.find(colour);
+      if (vox != vox_map.end())
       {
-        RGBA colour = colours[i];
-        const auto &vox = vox_map.find(colour);
-        if (vox != vox_map.end())
+        int index = vox->second;
+        if (!cells.contains(index))  // first time in this cell, so start writing to a new file
         {
-          int index = vox->second - batch;
-          if (index < 0 || index >= max_files_at_once)
+          std::stringstream name;
+          if (seg_colour)
           {
-            continue; // ignores as this ray will not go into this batch
+            name << cloud_name_stub << "_" << convertColourToInt(colour) << ".ply";
           }
-
-          if (cells[index].fileName().empty())  // first time in this cell, so start writing to a new file
+          else
           {
-            std::stringstream name;
-            if (seg_colour)
-            {
-              name << cloud_name_stub << "_" << convertColourToInt(colour) << ".ply";
-            }
-            else
-            {
-              name << cloud_name_stub << "_" << (int)colour.red << "_" << (int)colour.green << "_" << (int)colour.blue << ".ply";
-            }
-            cells[index].begin(name.str());
+            name << cloud_name_stub << "_" << (int)colour.red << "_" << (int)colour.green << "_" << (int)colour.blue << ".ply";
           }
-          chunks[index].addRay(starts[i], ends[i], times[i], colours[i]);
-        }
-      }
-      for (int i = 0; i < chunk_size; i++)
-      {
-        if (chunks[i].ends.size() > 0)
-        {
-          cells[i].writeChunk(chunks[i]);
-          chunks[i].clear();
+          cells.begin(index, name.str());
         }
+        cells.addRay(index, starts[i], ends[i], times[i], colours[i]);
       }
-    };
-    if (!Cloud::read(file_name, per_chunk))
-      return false;
-
-    for (int i = 0; i < chunk_size; i++)
-    {
-      cells[i].end();  // has no effect on writers where begin has not been called
     }
-  }
-  return true;
+    success &= cells.flush();
+  };
+  if (!Cloud::read(file_name, per_chunk, 1))
+    return false;
+
+  success &= cells.end();
+  return success;
 }
 
 }  // namespace ray
@@ -17,6 +17,11 @@ namespace ray
 bool RAYLIB_EXPORT split(const std::string &file_name, const std::string &in_name, const std::string &out_name,
                          std::function<bool(const Cloud &cloud, int i)> is_outside);
 
+/// Write the rays of a ray cloud with times from @c min_time to @c max_time to file @c in_name. There is no outside
+/// file, so when the cloud has a time index only the parts of the file in this interval are read
+bool RAYLIB_EXPORT splitTimeWindow(const std::string &file_name, const std::string &in_name, double min_time,
+                                   double max_time);
+
 /// Split a ray cloud around a plane. This splits individual rays, to maintain the validity of the cloud
 /// Each ray goes into file @c in_name or @c out_name depending on the side of the plane
 bool RAYLIB_EXPORT splitPlane(const std::string &file_name, const std::string &in_name, const std::string &out_name,
@@ -28,6 +33,12 @@ bool RAYLIB_EXPORT splitPlane(const std::string &file_name, const std::string &i
 bool RAYLIB_EXPORT splitBox(const std::string &file_name, const std::string &in_name, const std::string &out_name,
                             const Eigen::Vector3d &centre, const Eigen::Vector3d &extents);
 
+/// Write the part of a ray cloud inside the cuboid defined by @c centre and @c extents to file @c in_name, as splitBox
+/// does. There is no outside file, so when the cloud has a tile index (see indexCloud) only the tiles that overlap
+/// the box are read
+bool RAYLIB_EXPORT splitBoxInside(const std::string &file_name, const std::string &in_name,
+                                  const Eigen::Vector3d &centre, const Eigen::Vector3d &extents);
+
 /// Split a ray cloud into a grid of files, named with suffix _X_Y_Z.ply, for each grid coordinate X,Y,Z.
 /// Aligned so that cell 0,0,0 is centred at 0,0,0, and has dimensions @c cell_width
 /// @c overlap generates larger cells so that they overlap by the specified value
@@ -0,0 +1,415 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raytileindex.h"
+#include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
+#include "raylib/rayexternalsort.h"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+
+namespace ray
+{
+namespace
+{
+const std::string index_title = "ray cloud tile index";
+const std::string time_index_title = "ray cloud time index";
+const int index_version = 1;
+
+/// A ray to be written to the indexed cloud, in the tile of its end point
+struct IndexRay
+{
+  uint32_t tile;
+  uint64_t index;  // in the input cloud file
+  double start[3];
+  double end[3];
+  double time;
+  RGBA colour;
+};
+
+/// Orders the rays by tile, and within each tile by their order in the input cloud file
+struct IndexRayLess
+{
+  inline bool operator()(const IndexRay &a, const IndexRay &b) const
+  {
+    if (a.tile != b.tile)
+      return a.tile < b.tile;
+    return a.index < b.index;
+  }
+};
+
+/// the file name without its .ply extension
+std::string nameStub(const std::string &file_name)
+{
+  const std::string ext = ".ply";
+  if (file_name.length() >= ext.length() && file_name.compare(file_name.length() - ext.length(), ext.length(), ext) == 0)
+  {
+    return file_name.substr(0, file_name.length() - ext.length());
+  }
+  return file_name;
+}
+
+/// whether the index with statistics @c stats still matches the cloud file. The cloud's statistics change whenever its
+/// rays do, so they identify the cloud that was indexed
+bool matchesCloud(const RayCloudStats &stats, const std::string &cloud_file, const std::string &index_file)
+{
+  RayCloudStats cloud_stats;
+  if (!readRayCloudStats(cloud_file, cloud_stats) || cloud_stats.toString() != stats.toString())
+  {
+    std::cerr << "Warning: " << cloud_file << " has changed since it was indexed, ignoring " << index_file << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+std::string TileIndex::fileName(const std::string &cloud_file)
+{
+  return nameStub(cloud_file) + "_tiles.txt";
+}
+
+bool TileIndex::load(const std::string &cloud_file)
+{
+  std::ifstream in(fileName(cloud_file));
+  if (!in.good())
+  {
+    return false;  // the cloud is not indexed
+  }
+  std::string line;
+  std::getline(in, line);
+  if (line != index_title + " " + std::to_string(index_version))
+  {
+    std::cerr << "Warning: unknown tile index format in " << fileName(cloud_file) << ", ignoring it" << std::endl;
+    return false;
+  }
+  size_t num_tiles = 0;
+  std::string stats_line;
+  in >> tile_width >> num_tiles;
+  std::getline(in, line);
+  std::getline(in, stats_line);
+  tiles.resize(num_tiles);
+  for (auto &tile : tiles)
+  {
+    in >> tile.first_row >> tile.num_rows >> tile.min_time >> tile.max_time;
+    for (int i = 0; i < 3; i++) in >> tile.ends_bound.min_bound_[i];
+    for (int i = 0; i < 3; i++) in >> tile.ends_bound.max_bound_[i];
+    for (int i = 0; i < 3; i++) in >> tile.rays_bound.min_bound_[i];
+    for (int i = 0; i < 3; i++) in >> tile.rays_bound.max_bound_[i];
+  }
+  if (in.fail() || !stats.fromString(stats_line))
+  {
+    std::cerr << "Warning: could not read tile index " << fileName(cloud_file) << ", ignoring it" << std::endl;
+    return false;
+  }
+  return matchesCloud(stats, cloud_file, fileName(cloud_file));
+}
+
+bool TileIndex::save(const std::string &cloud_file) const
+{
+  std::ofstream out(fileName(cloud_file));
+  if (!out.good())
+  {
+    std::cerr << "Error: cannot open " << fileName(cloud_file) << " for writing" << std::endl;
+    return false;
+  }
+  out.precision(17);  // enough to read back the same doubles
+  out << index_title << " " << index_version << std::endl;
+  out << tile_width << " " << tiles.size() << std::endl;
+  out << stats.toString() << std::endl;
+  for (auto &tile : tiles)
+  {
+    out << tile.first_row << " " << tile.num_rows << " " << tile.min_time << " " << tile.max_time;
+    const Eigen::Vector3d *vectors[] = { &tile.ends_bound.min_bound_, &tile.ends_bound.max_bound_,
+                                         &tile.rays_bound.min_bound_, &tile.rays_bound.max_bound_ };
+    for (auto &vec : vectors)
+    {
+      out << " " << (*vec)[0] << " " << (*vec)[1] << " " << (*vec)[2];
+    }
+    out << std::endl;
+  }
+  return out.good();
+}
+
+std::vector<std::pair<size_t, size_t>> TileIndex::rowRanges(const Cuboid &bounds) const
+{
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (auto &tile : tiles)
+  {
+    if (!tile.rays_bound.overlaps(bounds))
+    {
+      continue;
+    }
+    // join consecutive tiles into one range
+    if (!ranges.empty() && ranges.back().first + ranges.back().second == tile.first_row)
+    {
+      ranges.back().second += tile.num_rows;
+    }
+    else
+    {
+      ranges.push_back(std::make_pair(tile.first_row, tile.num_rows));
+    }
+  }
+  return ranges;
+}
+
+std::string TimeIndex::fileName(const std::string &cloud_file)
+{
+  return nameStub(cloud_file) + "_times.txt";
+}
+
+void TimeIndex::removeFile(const std::string &cloud_file)
+{
+  const std::string file_name = fileName(cloud_file);
+  std::string line;
+  {
+    std::ifstream in(file_name);
+    if (!in.good())
+    {
+      return;
+    }
+    std::getline(in, line);
+  }
+  if (line.compare(0, time_index_title.size(), time_index_title) == 0)
+  {
+    std::remove(file_name.c_str());
+  }
+}
+
+void TimeIndex::renameFile(const std::string &from_cloud, const std::string &to_cloud)
+{
+  removeFile(to_cloud);
+  if (std::ifstream(fileName(from_cloud)).good())
+  {
+    std::rename(fileName(from_cloud).c_str(), fileName(to_cloud).c_str());
+  }
+}
+
+void TimeIndex::clear()
+{
+  blocks.clear();
+  num_rows = 0;
+}
+
+void TimeIndex::add(const std::vector<double> &times)
+{
+  for (auto &time : times)
+  {
+    if (num_rows++ % block_rows == 0)
+    {
+      blocks.push_back({ time, time });
+      continue;
+    }
+    Block &block = blocks.back();
+    block.min_time = std::min(block.min_time, time);
+    block.max_time = std::max(block.max_time, time);
+  }
+}
+
+bool TimeIndex::end(const std::string &cloud_file)
+{
+  if (blocks.size() <= 1)
+  {
+    // the whole cloud would be read anyway. Remove any index of an earlier cloud of the same name
+    removeFile(cloud_file);
+    return true;
+  }
+  // the statistics are only stored when the file has all of the added rows
+  if (!readRayCloudStats(cloud_file, stats) || stats.num_rows != num_rows)
+  {
+    return false;
+  }
+  return save(cloud_file);
+}
+
+bool TimeIndex::load(const std::string &cloud_file)
+{
+  std::ifstream in(fileName(cloud_file));
+  if (!in.good())
+  {
+    return false;  // the cloud is not indexed
+  }
+  std::string line;
+  std::getline(in, line);
+  if (line != time_index_title + " " + std::to_string(index_version))
+  {
+    std::cerr << "Warning: unknown time index format in " << fileName(cloud_file) << ", ignoring it" << std::endl;
+    return false;
+  }
+  size_t num_blocks = 0;
+  std::string stats_line;
+  in >> block_rows >> num_blocks;
+  std::getline(in, line);
+  std::getline(in, stats_line);
+  blocks.resize(num_blocks);
+  for (auto &block : blocks)
+  {
+    in >> block.min_time >> block.max_time;
+  }
+  if (in.fail() || block_rows == 0 || !stats.fromString(stats_line))
+  {
+    std::cerr << "Warning: could not read time index " << fileName(cloud_file) << ", ignoring it" << std::endl;
+    return false;
+  }
+  num_rows = stats.num_rows;
+  if (num_blocks != (num_rows + block_rows - 1) / block_rows)
+  {
+    std::cerr << "Warning: time index " << fileName(cloud_file) << " has the wrong number of blocks, ignoring it"
+              << std::endl;
+    return false;
+  }
+  return matchesCloud(stats, cloud_file, fileName(cloud_file));
+}
+
+bool TimeIndex::save(const std::string &cloud_file) const
+{
+  std::ofstream out(fileName(cloud_file));
+  if (!out.good())
+  {
+    std::cerr << "Error: cannot open " << fileName(cloud_file) << " for writing" << std::endl;
+    return false;
+  }
+  out.precision(17);  // enough to read back the same doubles
+  out << time_index_title << " " << index_version << std::endl;
+  out << block_rows << " " << blocks.size() << std::endl;
+  out << stats.toString() << std::endl;
+  for (auto &block : blocks)
+  {
+    out << block.min_time << " " << block.max_time << std::endl;
+  }
+  return out.good();
+}
+
+std::vector<std::pair<size_t, size_t>> TimeIndex::rowRanges(double min_time, double max_time) const
+{
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    if (blocks[i].max_time < min_time || blocks[i].min_time > max_time)
+    {
+      continue;
+    }
+    const size_t first_row = i * block_rows;
+    const size_t block_size = std::min(block_rows, num_rows - first_row);
+    // join consecutive blocks into one range
+    if (!ranges.empty() && ranges.back().first + ranges.back().second == first_row)
+    {
+      ranges.back().second += block_size;
+    }
+    else
+    {
+      ranges.push_back(std::make_pair(first_row, block_size));
+    }
+  }
+  return ranges;
+}
+
+bool indexCloud(const std::string &in_file, const std::string &out_file, double tile_width)
+{
+  Cloud::Info info;
+  if (!Cloud::getInfo(in_file, info))
+  {
+    return false;
+  }
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d extent = info.rays_bound.max_bound_ - min_bound;
+  const int tiles_x = 1 + static_cast<int>(extent[0] / tile_width);
+  const int tiles_y = 1 + static_cast<int>(extent[1] / tile_width);
+  if ((double)tiles_x * (double)tiles_y > (double)std::numeric_limits<int32_t>::max())
+  {
+    std::cerr << "Error: tile width " << tile_width << " m is too small for the cloud extent" << std::endl;
+    return false;
+  }
+  std::cout << "indexing in " << tiles_x << " x " << tiles_y << " tiles" << std::endl;
+  auto tile_x = [&](double x) {
+    return std::max(0, std::min(static_cast<int>(std::floor((x - min_bound[0]) / tile_width)), tiles_x - 1));
+  };
+  auto tile_y = [&](double y) {
+    return std::max(0, std::min(static_cast<int>(std::floor((y - min_bound[1]) / tile_width)), tiles_y - 1));
+  };
+
+  // 1. sort the rays by the tile of their end point, on disk
+  const size_t sort_memory = size_t(1) << 29;
+  ExternalSorter<IndexRay, IndexRayLess> index_rays(nameStub(out_file) + "_index", sort_memory / sizeof(IndexRay));
+  uint64_t num_rays = 0;
+  bool success = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && success; i++, num_rays++)
+    {
+      IndexRay ray;
+      ray.tile = static_cast<uint32_t>(tile_x(ends[i][0]) + tiles_x * tile_y(ends[i][1]));
+      ray.index = num_rays;
+      for (int j = 0; j < 3; j++)
+      {
+        ray.start[j] = starts[i][j];
+        ray.end[j] = ends[i][j];
+      }
+      ray.time = times[i];
+      ray.colour = colours[i];
+      success = index_rays.add(ray);
+    }
+  };
+  if (!Cloud::read(in_file, add_rays, 1) || !success || !index_rays.sort())
+  {
+    return false;
+  }
+
+  // 2. write the rays one tile after another, recording where each tile is in the file
+  CloudWriter writer;
+  if (!writer.begin(out_file))
+  {
+    return false;
+  }
+  TileIndex index;
+  index.tile_width = tile_width;
+  const size_t chunk_size = 1000000;
+  Cloud chunk;
+  RayCloudStats tile_stats;  // of the rays as they are read back from the file
+  size_t row = 0;
+  IndexRay index_ray;
+  bool has_ray = index_rays.next(index_ray);
+  while (has_ray && success)
+  {
+    const uint32_t tile = index_ray.tile;
+    tile_stats.clear();
+    const size_t first_row = row;
+    for (; has_ray && index_ray.tile == tile; has_ray = index_rays.next(index_ray), row++)
+    {
+      const Eigen::Vector3d start(index_ray.start[0], index_ray.start[1], index_ray.start[2]);
+      const Eigen::Vector3d end(index_ray.end[0], index_ray.end[1], index_ray.end[2]);
+      tile_stats.addWritten(start, end, index_ray.time, index_ray.colour);
+      chunk.addRay(start, end, index_ray.time, index_ray.colour);
+      if (chunk.rayCount() == chunk_size)
+      {
+        success &= writer.writeChunk(chunk);
+        chunk.clear();
+      }
+    }
+    TileIndex::Tile entry;
+    entry.first_row = first_row;
+    entry.num_rows = row - first_row;
+    entry.min_time = tile_stats.min_time;
+    entry.max_time = tile_stats.max_time;
+    entry.ends_bound = Cuboid(tile_stats.ends_min, tile_stats.ends_max);
+    entry.rays_bound = Cuboid(tile_stats.rays_min, tile_stats.rays_max);
+    index.tiles.push_back(entry);
+  }
+  success &= writer.writeChunk(chunk);
+  success &= writer.end();
+  index_rays.clear();
+  if (!success)
+  {
+    return false;
+  }
+  if (!readRayCloudStats(out_file, index.stats))
+  {
+    std::cerr << "Error: " << out_file << " has no statistics to index it by" << std::endl;
+    return false;
+  }
+  return index.save(out_file);
+}
+}  // namespace ray
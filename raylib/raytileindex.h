@@ -0,0 +1,93 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYTILEINDEX_H
+#define RAYLIB_RAYTILEINDEX_H
+
+#include "raylib/raylibconfig.h"
+#include "raycuboid.h"
+#include "rayply.h"
+#include "rayutils.h"
+
+namespace ray
+{
+/// The directory of a ray cloud file whose rays are grouped into square spatial tiles. It is stored beside the cloud
+/// file, and lets the rays in a region of the cloud be read without reading the rest of the file. The cloud file is
+/// an ordinary ray cloud, readable as any other. Such clouds are made by indexCloud.
+struct RAYLIB_EXPORT TileIndex
+{
+  /// a tile is a consecutive set of rows of the cloud file
+  struct Tile
+  {
+    size_t first_row;
+    size_t num_rows;
+    double min_time, max_time;
+    Cuboid ends_bound;  // the bounded end points
+    Cuboid rays_bound;  // the whole rays
+  };
+  double tile_width = 0.0;
+  RayCloudStats stats;  // of the whole cloud file, so that an index that no longer matches its file is not used
+  std::vector<Tile> tiles;
+
+  /// the name of the index file of the ray cloud file @c cloud_file
+  static std::string fileName(const std::string &cloud_file);
+
+  /// load the index of @c cloud_file. Returns false if it has none, or if the cloud file has changed since it was made
+  bool load(const std::string &cloud_file);
+  /// save as the index of @c cloud_file
+  bool save(const std::string &cloud_file) const;
+
+  /// the first row and number of rows of each tile that may have rays overlapping @c bounds, in file order
+  std::vector<std::pair<size_t, size_t>> rowRanges(const Cuboid &bounds) const;
+};
+
+/// The time ranges of consecutive blocks of rows of a ray cloud file, stored beside it. This lets the rays in a time
+/// window be read without reading the rest of the file. It is written alongside the cloud by CloudWriter and
+/// writePlyRayCloud, and only for clouds of more than one block.
+struct RAYLIB_EXPORT TimeIndex
+{
+  /// the time range of a block of rows
+  struct Block
+  {
+    double min_time, max_time;
+  };
+  size_t block_rows = size_t(1) << 20;  // rows per block, the last block may have fewer
+  RayCloudStats stats;  // of the whole cloud file, so that an index that no longer matches its file is not used
+  std::vector<Block> blocks;
+  size_t num_rows = 0;  // rows added so far
+
+  /// the name of the index file of the ray cloud file @c cloud_file
+  static std::string fileName(const std::string &cloud_file);
+  /// remove the index file of @c cloud_file, such as when the cloud file is removed. A file of that name that is not a
+  /// time index is left alone
+  static void removeFile(const std::string &cloud_file);
+  /// move the index file of @c from_cloud to be that of @c to_cloud, such as when the cloud file is renamed. Any old
+  /// index of @c to_cloud is removed
+  static void renameFile(const std::string &from_cloud, const std::string &to_cloud);
+
+  /// start a new index, before the cloud is written
+  void clear();
+  /// add the next rows of the cloud, in the order that they are written
+  void add(const std::vector<double> &times);
+  /// finish the index once the cloud file @c cloud_file is complete, saving it if the cloud has more than one block
+  /// and removing any old index file otherwise
+  bool end(const std::string &cloud_file);
+
+  /// load the index of @c cloud_file. Returns false if it has none, or if the cloud file has changed since it was made
+  bool load(const std::string &cloud_file);
+  /// save as the index of @c cloud_file
+  bool save(const std::string &cloud_file) const;
+
+  /// the first row and number of rows of the blocks that may have times in @c min_time to @c max_time, in file order
+  std::vector<std::pair<size_t, size_t>> rowRanges(double min_time, double max_time) const;
+};
+
+/// Write the rays of ray cloud file @c in_file to @c out_file grouped into square tiles of width @c tile_width, with
+/// the tile index that lets Cloud::read(file_name, bounds, apply) read only the tiles that overlap the bounds.
+/// The rays in each tile stay in their original order. @c in_file is sorted on disk, so it need not fit in memory
+bool RAYLIB_EXPORT indexCloud(const std::string &in_file, const std::string &out_file, double tile_width);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYTILEINDEX_H
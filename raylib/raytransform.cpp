@@ -0,0 +1,121 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raytransform.h"
+#include "raylib/rayparallel.h"
+
+namespace ray
+{
+namespace
+{
+/// rays per block. Small enough that a block's positions stay in cache, large enough to amortise the scheduling
+const size_t kBlockSize = 4096;
+static_assert(sizeof(Eigen::Vector3d) == 3 * sizeof(double), "positions must be contiguous to map as a matrix");
+
+/// call @c process(first, count) on consecutive blocks of the @c num_rays rays, in parallel
+template <class Func>
+void forEachBlock(size_t num_rays, const Func &process)
+{
+  const size_t num_blocks = (num_rays + kBlockSize - 1) / kBlockSize;
+  auto process_block = [&](size_t b) {
+    const size_t first = b * kBlockSize;
+    process(first, std::min(kBlockSize, num_rays - first));
+  };
+  parallelFor(num_blocks, process_block);
+}
+
+/// the @c count positions from @c first, as a 3 x count matrix
+inline Eigen::Map<Eigen::Matrix3Xd> positions(std::vector<Eigen::Vector3d> &vectors, size_t first, size_t count)
+{
+  return Eigen::Map<Eigen::Matrix3Xd>(vectors[first].data(), 3, (Eigen::Index)count);
+}
+
+inline void setRGB(const Eigen::Vector3d &col, RGBA &colour)
+{
+  colour.red = uint8_t(255.0 * col[0]);
+  colour.green = uint8_t(255.0 * col[1]);
+  colour.blue = uint8_t(255.0 * col[2]);
+}
+}  // namespace
+
+void translateRays(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                   std::vector<double> &times, const Eigen::Vector3d &translation, double time_delta)
+{
+  forEachBlock(ends.size(), [&](size_t first, size_t count) {
+    positions(starts, first, count).colwise() += translation;
+    positions(ends, first, count).colwise() += translation;
+    double *block_times = &times[first];
+    for (size_t i = 0; i < count; i++)
+    {
+      block_times[i] += time_delta;
+    }
+  });
+}
+
+void rotateRays(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                const Eigen::Quaterniond &rotation)
+{
+  // the quaternion product, rather than a rotation matrix, so that the rounding matches rotating each ray on its own
+  forEachBlock(ends.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      starts[i] = rotation * starts[i];
+      ends[i] = rotation * ends[i];
+    }
+  });
+}
+
+void setRayColours(std::vector<RGBA> &colours, const RGBA &colour)
+{
+  forEachBlock(colours.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      colours[i].red = colour.red;
+      colours[i].green = colour.green;
+      colours[i].blue = colour.blue;
+    }
+  });
+}
+
+void setRayAlphas(std::vector<RGBA> &colours, uint8_t alpha)
+{
+  forEachBlock(colours.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      colours[i].alpha = alpha;
+    }
+  });
+}
+
+void colourRaysBySpectrum(const std::vector<double> &values, double wavelength, std::vector<RGBA> &colours)
+{
+  forEachBlock(values.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      setRGB(redGreenBlueSpectrum(values[i] / wavelength), colours[i]);
+    }
+  });
+}
+
+void colourRaysByHeight(const std::vector<Eigen::Vector3d> &ends, double wavelength, std::vector<RGBA> &colours)
+{
+  forEachBlock(ends.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      setRGB(redGreenBlueSpectrum(ends[i][2] / wavelength), colours[i]);
+    }
+  });
+}
+
+void colourRaysByAlpha(std::vector<RGBA> &colours)
+{
+  forEachBlock(colours.size(), [&](size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++)
+    {
+      setRGB(redGreenBlueGradient(colours[i].alpha / 255.0), colours[i]);
+    }
+  });
+}
+}  // namespace ray
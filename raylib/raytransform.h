@@ -0,0 +1,45 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYTRANSFORM_H
+#define RAYLIB_RAYTRANSFORM_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+/// In-place transforms of a whole chunk of rays, for use with e.g. convertCloudChunks. Each splits the chunk
+/// into blocks across the available threads, and treats the vector of positions within a block as a 3xN matrix,
+/// so the inner loops are plain arithmetic on contiguous memory that the compiler can vectorise.
+
+/// translate the rays by @c translation, and their times by @c time_delta
+void RAYLIB_EXPORT translateRays(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                 std::vector<double> &times, const Eigen::Vector3d &translation,
+                                 double time_delta = 0.0);
+
+/// rotate the rays about the origin by @c rotation
+void RAYLIB_EXPORT rotateRays(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                              const Eigen::Quaterniond &rotation);
+
+/// set the red, green and blue of every ray to those of @c colour, leaving alpha unchanged
+void RAYLIB_EXPORT setRayColours(std::vector<RGBA> &colours, const RGBA &colour);
+
+/// set the alpha of every ray to @c alpha
+void RAYLIB_EXPORT setRayAlphas(std::vector<RGBA> &colours, uint8_t alpha);
+
+/// colour the rays by a red-green-blue spectrum of @c values, repeating every @c wavelength. Alpha is unchanged
+void RAYLIB_EXPORT colourRaysBySpectrum(const std::vector<double> &values, double wavelength,
+                                        std::vector<RGBA> &colours);
+
+/// colour the ray end points by a red-green-blue spectrum of their height, repeating every @c wavelength metres
+void RAYLIB_EXPORT colourRaysByHeight(const std::vector<Eigen::Vector3d> &ends, double wavelength,
+                                      std::vector<RGBA> &colours);
+
+/// colour the rays by a red-green-blue gradient of their alpha channel
+void RAYLIB_EXPORT colourRaysByAlpha(std::vector<RGBA> &colours);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYTRANSFORM_H
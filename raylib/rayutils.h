@@ -14,7 +14,10 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -52,6 +55,43 @@ inline int runWithMemoryCheck(std::function<bool(int argc, char *argv[])> main_f
   }    
 }
 
+/// Mix @c value into the 64 bit hash @c key. Used to key cached results by the data they were computed from
+inline void hashCombine(uint64_t value, uint64_t &key)
+{
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  key = (key ^ value) * 0x100000001b3ULL;
+}
+
+/// Mix the bits of @c value into the 64 bit hash @c key
+inline void hashCombine(double value, uint64_t &key)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  hashCombine(bits, key);
+}
+
+/// The starting value of a hash, for @c hashCombine
+const uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+/// Move the finished file @c temp_name to @c file_name, replacing any file already there. Files written to a temporary
+/// name and moved into place are never seen part written, even if the writing process is interrupted
+inline bool replaceFile(const std::string &temp_name, const std::string &file_name)
+{
+  if (std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+  {
+    std::remove(file_name.c_str());  // not every platform renames over an existing file
+    if (std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+    {
+      std::cerr << "Error: cannot rename " << temp_name << " to " << file_name << std::endl;
+      std::remove(temp_name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
 inline std::vector<std::string> split(const std::string &s, char delim)
 {
   std::vector<std::string> result;
@@ -110,27 +150,6 @@ public:
   }
 };
 
-inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
-                           std::vector<int64_t> &indices, std::set<Eigen::Vector3i, Vector3iLess> &vox_set)
-{
-  for (int64_t i = 0; i < (int64_t)points.size(); i++)
-  {
-    Eigen::Vector3i voxel(int(std::floor(points[i][0] / voxel_width)), int(std::floor(points[i][1] / voxel_width)),
-                          int(std::floor(points[i][2] / voxel_width)));
-    if (vox_set.insert(voxel).second)
-    {
-      indices.push_back(i);
-    }
-  }
-}
-
-inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
-                           std::vector<int64_t> &indices)
-{
-  std::set<Eigen::Vector3i, Vector3iLess> vox_set;
-  voxelSubsample(points, voxel_width, indices, vox_set);
-}
-
 /// Square a value
 template <class T>
 inline T sqr(const T &val)
@@ -0,0 +1,275 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYVOXELSET_H
+#define RAYLIB_RAYVOXELSET_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+#include <cstdint>
+#include <map>
+#include <type_traits>
+#include <utility>
+
+namespace ray
+{
+/// Compact hash map from voxel to value, using open addressing with linear probing.
+/// Each voxel is packed into a 64-bit key of 21 bits per axis, relative to the first voxel inserted. The table is
+/// kept between 3/8 and 3/4 full, so with no value type it costs 11 to 21 bytes per voxel, where a
+/// std::set<Eigen::Vector3i> costs 64 bytes per voxel (a tree node plus allocator overhead, measured with raybench).
+/// Voxels more than a million voxels from the first one go in an ordered fallback map, so the map is exact
+/// for any voxel coordinates.
+template <class T>
+class VoxelMap
+{
+public:
+  /// number of voxels in the map
+  size_t size() const { return size_ + overflow_.size(); }
+  bool empty() const { return size() == 0; }
+  void clear()
+  {
+    keys_.clear();
+    values_.clear();
+    overflow_.clear();
+    size_ = 0;
+    shift_ = 64;
+    has_origin_ = false;
+  }
+  /// size the table to hold @c num_voxels without rehashing
+  void reserve(size_t num_voxels)
+  {
+    size_t capacity = kMinCapacity;
+    while (capacity * 3 < num_voxels * 4) capacity *= 2;
+    if (capacity > keys_.size())
+      rehash(capacity);
+  }
+
+  /// insert @c voxel with @c value if it is not already in the map.
+  /// Returns a pointer to the voxel's value, and whether it was inserted.
+  std::pair<T *, bool> insert(const Eigen::Vector3i &voxel, const T &value = T())
+  {
+    if (!has_origin_)
+    {
+      origin_ = voxel;
+      has_origin_ = true;
+    }
+    uint64_t key;
+    if (!packKey(voxel, key))
+    {
+      auto result = overflow_.insert(std::make_pair(voxel, value));
+      return std::make_pair(&result.first->second, result.second);
+    }
+    if ((size_ + 1) * 4 > keys_.size() * 3)
+    {
+      rehash(std::max(kMinCapacity, keys_.size() * 2));
+    }
+    const size_t mask = keys_.size() - 1;
+    size_t i = slot(key);
+    while (keys_[i] != kEmpty)
+    {
+      if (keys_[i] == key)
+        return std::make_pair(valuePtr(i), false);
+      i = (i + 1) & mask;
+    }
+    keys_[i] = key;
+    if (kHasValues)
+      values_[i] = value;
+    size_++;
+    return std::make_pair(valuePtr(i), true);
+  }
+
+  /// the value of @c voxel, or nullptr if it is not in the map
+  T *find(const Eigen::Vector3i &voxel)
+  {
+    uint64_t key;
+    if (!packKey(voxel, key))
+    {
+      auto it = overflow_.find(voxel);
+      return it == overflow_.end() ? nullptr : &it->second;
+    }
+    size_t i = findSlot(key);
+    return i == kNotFound ? nullptr : valuePtr(i);
+  }
+  const T *find(const Eigen::Vector3i &voxel) const { return const_cast<VoxelMap<T> *>(this)->find(voxel); }
+  bool contains(const Eigen::Vector3i &voxel) const { return find(voxel) != nullptr; }
+
+  /// remove @c voxel from the map, returns whether it was present
+  bool erase(const Eigen::Vector3i &voxel)
+  {
+    uint64_t key;
+    if (!packKey(voxel, key))
+    {
+      return overflow_.erase(voxel) > 0;
+    }
+    size_t i = findSlot(key);
+    if (i == kNotFound)
+      return false;
+    // backward shift deletion, so no tombstones are needed
+    const size_t mask = keys_.size() - 1;
+    for (size_t j = (i + 1) & mask; keys_[j] != kEmpty; j = (j + 1) & mask)
+    {
+      const size_t home = slot(keys_[j]);
+      // move entry j into the gap at i unless its home slot lies cyclically within (i, j]
+      const bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!stays)
+      {
+        keys_[i] = keys_[j];
+        if (kHasValues)
+          values_[i] = std::move(values_[j]);
+        i = j;
+      }
+    }
+    keys_[i] = kEmpty;
+    size_--;
+    return true;
+  }
+
+  /// approximate heap memory used, in bytes
+  size_t memoryUsage() const
+  {
+    return keys_.capacity() * sizeof(uint64_t) + values_.capacity() * sizeof(T) +
+           overflow_.size() * (sizeof(Eigen::Vector3i) + sizeof(T) + 4 * sizeof(void *));
+  }
+
+private:
+  static constexpr bool kHasValues = !std::is_empty<T>::value;
+  static constexpr uint64_t kEmpty = ~uint64_t(0);  // packed keys use 63 bits, so this is never a key
+  static constexpr size_t kNotFound = ~size_t(0);
+  static constexpr size_t kMinCapacity = 16;
+  static constexpr int kAxisBits = 21;
+  static constexpr int64_t kAxisHalfRange = int64_t(1) << (kAxisBits - 1);
+
+  /// pack the voxel into a key, returns false if it is out of range of the origin
+  inline bool packKey(const Eigen::Vector3i &voxel, uint64_t &key) const
+  {
+    if (!has_origin_)
+    {
+      key = kEmpty;
+      return true;  // nothing has been inserted, so the key can't match anything
+    }
+    key = 0;
+    for (int i = 0; i < 3; i++)
+    {
+      const int64_t offset = (int64_t)voxel[i] - (int64_t)origin_[i] + kAxisHalfRange;
+      if (offset < 0 || offset >= 2 * kAxisHalfRange)
+        return false;
+      key |= (uint64_t)offset << (kAxisBits * i);
+    }
+    return true;
+  }
+  /// Fibonacci hashing, the top bits of the product are the slot index
+  inline size_t slot(uint64_t key) const { return (size_t)((key * 0x9E3779B97F4A7C15ull) >> shift_); }
+  inline size_t findSlot(uint64_t key) const
+  {
+    if (keys_.empty() || key == kEmpty)
+      return kNotFound;
+    const size_t mask = keys_.size() - 1;
+    for (size_t i = slot(key); keys_[i] != kEmpty; i = (i + 1) & mask)
+    {
+      if (keys_[i] == key)
+        return i;
+    }
+    return kNotFound;
+  }
+  inline T *valuePtr(size_t i) { return kHasValues ? &values_[i] : &no_value_; }
+
+  void rehash(size_t capacity)
+  {
+    std::vector<uint64_t> old_keys(capacity, kEmpty);
+    std::vector<T> old_values(kHasValues ? capacity : 0);
+    old_keys.swap(keys_);
+    old_values.swap(values_);
+    shift_ = 64;
+    for (size_t c = capacity; c > 1; c /= 2) shift_--;
+    const size_t mask = capacity - 1;
+    for (size_t j = 0; j < old_keys.size(); j++)
+    {
+      if (old_keys[j] == kEmpty)
+        continue;
+      size_t i = slot(old_keys[j]);
+      while (keys_[i] != kEmpty) i = (i + 1) & mask;
+      keys_[i] = old_keys[j];
+      if (kHasValues)
+        values_[i] = std::move(old_values[j]);
+    }
+  }
+
+  std::vector<uint64_t> keys_;
+  std::vector<T> values_;
+  size_t size_ = 0;
+  int shift_ = 64;
+  bool has_origin_ = false;
+  Eigen::Vector3i origin_;
+  std::map<Eigen::Vector3i, T, Vector3iLess> overflow_;
+  T no_value_;
+};
+
+template <class T>
+constexpr bool VoxelMap<T>::kHasValues;
+template <class T>
+constexpr uint64_t VoxelMap<T>::kEmpty;
+template <class T>
+constexpr size_t VoxelMap<T>::kNotFound;
+template <class T>
+constexpr size_t VoxelMap<T>::kMinCapacity;
+template <class T>
+constexpr int VoxelMap<T>::kAxisBits;
+template <class T>
+constexpr int64_t VoxelMap<T>::kAxisHalfRange;
+
+/// Compact set of voxels, with the memory cost of a VoxelMap with no values
+class VoxelSet
+{
+public:
+  /// insert @c voxel, returns true if it was not already in the set
+  bool insert(const Eigen::Vector3i &voxel) { return map_.insert(voxel).second; }
+  bool contains(const Eigen::Vector3i &voxel) const { return map_.contains(voxel); }
+  /// remove @c voxel, returns true if it was in the set
+  bool erase(const Eigen::Vector3i &voxel) { return map_.erase(voxel); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  void clear() { map_.clear(); }
+  void reserve(size_t num_voxels) { map_.reserve(num_voxels); }
+  /// approximate heap memory used, in bytes
+  size_t memoryUsage() const { return map_.memoryUsage(); }
+
+private:
+  struct NoValue
+  {
+  };
+  VoxelMap<NoValue> map_;
+};
+
+/// the voxel of width @c voxel_width containing @c point
+inline Eigen::Vector3i voxelOf(const Eigen::Vector3d &point, double voxel_width)
+{
+  return Eigen::Vector3i(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
+                         int(std::floor(point[2] / voxel_width)));
+}
+
+/// add the index of each point that is the first in its voxel to @c indices, with @c vox_set holding the
+/// voxels already occupied. The set can be shared across successive chunks of points.
+inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
+                           std::vector<int64_t> &indices, VoxelSet &vox_set)
+{
+  for (int64_t i = 0; i < (int64_t)points.size(); i++)
+  {
+    if (vox_set.insert(voxelOf(points[i], voxel_width)))
+    {
+      indices.push_back(i);
+    }
+  }
+}
+
+inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
+                           std::vector<int64_t> &indices)
+{
+  VoxelSet vox_set;
+  voxelSubsample(points, voxel_width, indices, vox_set);
+}
+}  // namespace ray
+
+#endif  // RAYLIB_RAYVOXELSET_H
@@ -0,0 +1,478 @@
+// Copyright (c) 2024
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
+#include "raylib/raydecimation.h"
+#include "raylib/rayellipsoid.h"
+#include "raylib/rayply.h"
+#include "raylib/rayrenderer.h"
+#include "raylib/raytileindex.h"
+#include "raylib/rayvoxelset.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define RAYBENCH_MALLINFO 1
+#endif
+
+/// Micro-benchmarks of raylib's performance critical paths. Each reports its throughput, and where there is
+/// a simpler reference implementation, the throughput of that too.
+namespace raybench
+{
+using Clock = std::chrono::high_resolution_clock;
+
+/// Seconds since @c start
+double elapsed(const Clock::time_point &start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// Bytes currently allocated on the heap, or 0 where this can't be measured
+size_t heapUsage()
+{
+#if RAYBENCH_MALLINFO
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;  // large blocks are memory-mapped, and counted separately
+#else
+  return 0;
+#endif
+}
+
+void report(const std::string &name, size_t count, double seconds, const std::string &unit)
+{
+  std::cout << "  " << name << ": " << seconds << " s, " << static_cast<double>(count) / seconds << " " << unit
+            << "/s" << std::endl;
+}
+
+/// Generate a random ray cloud of @c num_rays rays, written to @c file_name
+bool generateCloud(const std::string &file_name, size_t num_rays)
+{
+  ray::Cloud cloud;
+  cloud.starts.resize(num_rays);
+  cloud.ends.resize(num_rays);
+  cloud.times.resize(num_rays);
+  cloud.colours.resize(num_rays);
+  for (size_t i = 0; i < num_rays; i++)
+  {
+    cloud.starts[i] = Eigen::Vector3d(0.001 * (double)i, 0.0, 1.5);
+    cloud.ends[i] = cloud.starts[i] + Eigen::Vector3d::Random() * 20.0;
+    cloud.times[i] = 0.001 * (double)i;
+    cloud.colours[i] = ray::RGBA(uint8_t(i), uint8_t(i / 256), 128, 255);
+  }
+  return ray::writePlyRayCloud(file_name, cloud.starts, cloud.ends, cloud.times, cloud.colours);
+}
+
+/// Remove the ray cloud file @c file_name, and the time index that is written beside large clouds
+void removeCloud(const std::string &file_name)
+{
+  std::remove(file_name.c_str());
+  ray::TimeIndex::removeFile(file_name);
+}
+
+/// The row by row stream decoding that readPly used before it decoded in bulk. Only supports the
+/// ray cloud layout written by raylib.
+size_t streamReadRayCloud(const std::string &file_name, size_t chunk_size)
+{
+  std::ifstream input(file_name.c_str(), std::ios::in | std::ios::binary);
+  std::string line;
+  while (line != "end_header" && getline(input, line))
+    ;
+#if RAYLIB_DOUBLE_RAYS
+  using PosT = double;
+#else
+  using PosT = float;
+#endif
+  const size_t time_offset = 3 * sizeof(PosT);
+  const size_t normal_offset = time_offset + sizeof(double);
+  const size_t colour_offset = normal_offset + 3 * sizeof(float);
+  const size_t row_size = sizeof(ray::RayPlyEntry);
+  std::vector<unsigned char> vertex(row_size);
+  std::vector<Eigen::Vector3d> starts, ends;
+  std::vector<double> times;
+  std::vector<ray::RGBA> colours;
+  size_t total = 0;
+  while (input.read((char *)&vertex[0], row_size))
+  {
+    Eigen::Matrix<PosT, 3, 1> e = (Eigen::Matrix<PosT, 3, 1> &)vertex[0];
+    Eigen::Vector3d end(e[0], e[1], e[2]);
+    Eigen::Vector3f n = (Eigen::Vector3f &)vertex[normal_offset];
+    starts.push_back(end + Eigen::Vector3d(n[0], n[1], n[2]));
+    ends.push_back(end);
+    times.push_back((double &)vertex[time_offset]);
+    colours.push_back((ray::RGBA &)vertex[colour_offset]);
+    if (ends.size() == chunk_size)
+    {
+      total += ends.size();
+      starts.clear();
+      ends.clear();
+      times.clear();
+      colours.clear();
+    }
+  }
+  return total + ends.size();
+}
+
+/// Throughput of reading a ray cloud file in chunks
+void readPly(size_t num_rays)
+{
+  const std::string file_name = "raybench_read.ply";
+  if (!generateCloud(file_name, num_rays))
+  {
+    return;
+  }
+  const size_t chunk_size = 1000000;
+  size_t count = 0;
+  auto start = Clock::now();
+  streamReadRayCloud(file_name, chunk_size);
+  double stream_time = elapsed(start);
+
+  auto apply = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                   std::vector<ray::RGBA> &) { count += ends.size(); };
+  start = Clock::now();
+  ray::readPly(file_name, true, apply, 0, false, chunk_size);
+  double read_time = elapsed(start);
+
+  // with some per-chunk work, which prefetching overlaps with the decoding
+  double sum = 0.0;
+  auto process = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                     std::vector<ray::RGBA> &) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      sum += (ends[i] - starts[i]).norm();
+    }
+  };
+  start = Clock::now();
+  ray::readPly(file_name, true, process, 0, false, chunk_size);
+  double process_time = elapsed(start);
+  start = Clock::now();
+  ray::readPly(file_name, true, process, 0, false, chunk_size, 1);
+  double prefetch_time = elapsed(start);
+
+  std::cout << "readPly, " << count << " rays:" << std::endl;
+  report("row stream (reference)", num_rays, stream_time, "rays");
+  report("readPly", count, read_time, "rays");
+  report("readPly and process", count, process_time, "rays");
+  report("readPly and process, prefetched", count, prefetch_time, "rays");
+  removeCloud(file_name);
+}
+/// Throughput and memory of the voxel set used for spatial decimation, against a std::set
+void voxelSet(size_t num_points)
+{
+  // points on a noisy surface, as in a typical scan, at 1 cm voxels
+  std::vector<Eigen::Vector3d> points(num_points);
+  for (auto &point : points)
+  {
+    Eigen::Vector3d pos = Eigen::Vector3d::Random() * 50.0;
+    pos[2] = 0.1 * pos[2] + std::sin(pos[0] * 0.1);
+    point = pos;
+  }
+  const double voxel_width = 0.01;
+  std::cout << "voxel set, " << num_points << " points:" << std::endl;
+
+  size_t heap = heapUsage();
+  auto start = Clock::now();
+  size_t num_voxels = 0;
+  {
+    std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+    for (auto &point : points)
+    {
+      voxel_set.insert(ray::voxelOf(point, voxel_width));
+    }
+    num_voxels = voxel_set.size();
+    double set_time = elapsed(start);
+    size_t set_memory = heapUsage() - heap;
+    report("std::set (reference) insert", num_points, set_time, "points");
+    if (set_memory > 0)
+      std::cout << "    " << (double)set_memory / (double)num_voxels << " bytes per voxel" << std::endl;
+  }
+
+  heap = heapUsage();
+  start = Clock::now();
+  ray::VoxelSet voxel_set;
+  for (auto &point : points)
+  {
+    voxel_set.insert(ray::voxelOf(point, voxel_width));
+  }
+  double hash_time = elapsed(start);
+  size_t hash_memory = heapUsage() - heap;
+  report("VoxelSet insert", num_points, hash_time, "points");
+  std::cout << "    " << (double)voxel_set.memoryUsage() / (double)voxel_set.size() << " bytes per voxel";
+  if (hash_memory > 0)
+    std::cout << " (" << (double)hash_memory / (double)voxel_set.size() << " measured)";
+  std::cout << std::endl;
+  if (voxel_set.size() != num_voxels)
+  {
+    std::cout << "error: VoxelSet has " << voxel_set.size() << " voxels, std::set has " << num_voxels << std::endl;
+  }
+
+  start = Clock::now();
+  size_t found = 0;
+  for (auto &point : points)
+  {
+    found += voxel_set.contains(ray::voxelOf(point + Eigen::Vector3d(0.005, 0, 0), voxel_width)) ? 1 : 0;
+  }
+  report("VoxelSet lookup", num_points, elapsed(start), "points");
+  std::cout << "    " << found << " found" << std::endl;
+}
+
+/// Memory per ray and load throughput of the compact cloud, against Cloud
+void compactCloud(size_t num_rays)
+{
+  const std::string file_name = "raybench_compact.ply";
+  if (!generateCloud(file_name, num_rays))
+  {
+    return;
+  }
+  std::cout << "compact cloud, " << num_rays << " rays:" << std::endl;
+  size_t heap = heapUsage();
+  auto start = Clock::now();
+  ray::Cloud cloud;
+  cloud.load(file_name);
+  report("Cloud (reference) load", num_rays, elapsed(start), "rays");
+  size_t cloud_memory = heapUsage() - heap;
+  if (cloud_memory > 0)
+    std::cout << "    " << (double)cloud_memory / (double)num_rays << " bytes per ray" << std::endl;
+
+  heap = heapUsage();
+  start = Clock::now();
+  ray::CompactCloud compact;
+  compact.load(file_name);
+  report("CompactCloud load", num_rays, elapsed(start), "rays");
+  size_t compact_memory = heapUsage() - heap;
+  std::cout << "    " << (double)compact.memoryUsage() / (double)num_rays << " bytes per ray";
+  if (compact_memory > 0)
+    std::cout << " (" << (double)compact_memory / (double)num_rays << " measured)";
+  std::cout << std::endl;
+
+  double max_error = 0.0;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    max_error = std::max(max_error, (compact.end(i) - cloud.ends[i]).norm());
+    max_error = std::max(max_error, (compact.start(i) - cloud.starts[i]).norm());
+  }
+  std::cout << "    maximum difference from Cloud: " << max_error << " m" << std::endl;
+  removeCloud(file_name);
+}
+
+/// Throughput and memory of the density grid used by rayrender density, against a dense grid of the same bounds
+void densityGrid(size_t num_rays)
+{
+  // short range scans from a grid of scan positions, within a 200 x 200 x 30 m plot, as in a forest survey. Most of the
+  // plot's volume is not reached by any ray
+  const std::string file_name = "raybench_density.ply";
+  ray::Cloud cloud;
+  const int scans_per_side = 10;
+  const double plot_width = 200.0, plot_height = 30.0;
+  for (size_t i = 0; i < num_rays; i++)
+  {
+    const int scan = (int)(i % (scans_per_side * scans_per_side));
+    const double spacing = plot_width / (double)scans_per_side;
+    Eigen::Vector3d start(spacing * (0.5 + (double)(scan % scans_per_side)),
+                          spacing * (0.5 + (double)(scan / scans_per_side)), 1.5);
+    Eigen::Vector3d end = start + Eigen::Vector3d::Random().normalized() * (6.0 + 4.0 * ray::random(-1.0, 1.0));
+    end[2] = std::max(end[2], 0.0);
+    cloud.addRay(start, end, (double)i, ray::RGBA(128, 128, 128, 255));
+  }
+  cloud.addRay(Eigen::Vector3d(0, 0, 1.5), Eigen::Vector3d(0, 0, 0), 0.0, ray::RGBA(128, 128, 128, 255));
+  cloud.addRay(Eigen::Vector3d(plot_width, plot_width, 1.5), Eigen::Vector3d(plot_width, plot_width, plot_height), 0.0,
+               ray::RGBA(128, 128, 128, 255));
+  if (!ray::writePlyRayCloud(file_name, cloud.starts, cloud.ends, cloud.times, cloud.colours))
+  {
+    return;
+  }
+  ray::Cloud::Info info;
+  ray::Cloud::getInfo(file_name, info);
+  const double voxel_width = 0.1;
+  ray::Cuboid bounds = info.ends_bound;
+  const Eigen::Vector3d extent = bounds.max_bound_ - bounds.min_bound_;
+  const Eigen::Vector3i dims = (extent / voxel_width).cast<int>() + Eigen::Vector3i(2, 2, 2);
+  bounds.min_bound_ -= Eigen::Vector3d(voxel_width, voxel_width, voxel_width);
+
+  std::cout << "density grid, " << num_rays << " rays:" << std::endl;
+  auto start = Clock::now();
+  ray::DensityGrid grid(bounds, voxel_width, dims);
+  grid.calculateDensities(file_name);
+  report("calculateDensities", num_rays, elapsed(start), "rays");
+  start = Clock::now();
+  grid.addNeighbourPriors();
+  report("addNeighbourPriors", grid.numVoxels(), elapsed(start), "voxels");
+  const double dense_memory = (double)grid.numVoxels() * sizeof(ray::DensityGrid::Voxel);
+  std::cout << "    " << (double)grid.memoryUsage() / 1e6 << " MB, against " << dense_memory / 1e6 << " MB dense" << std::endl;
+  removeCloud(file_name);
+}
+
+/// Throughput of the plan view renders, in a per-point and a per-ray style
+void render(size_t num_rays)
+{
+  const std::string file_name = "raybench_render.ply";
+  if (!generateCloud(file_name, num_rays))
+  {
+    return;
+  }
+  ray::Cloud::Info info;
+  ray::Cloud::getInfo(file_name, info);
+  const double pixel_width = 0.2;
+  std::cout << "render, " << num_rays << " rays:" << std::endl;
+  const std::map<std::string, ray::RenderStyle> styles = { { "ends", ray::RenderStyle::Ends },
+                                                           { "mean", ray::RenderStyle::Mean },
+                                                           { "rays", ray::RenderStyle::Rays } };
+  for (auto &style : styles)
+  {
+    auto start = Clock::now();
+    ray::renderCloud(file_name, info.ends_bound, ray::ViewDirection::Top, style.second, pixel_width,
+                     "raybench_render.hdr", "", false);
+    report(style.first, num_rays, elapsed(start), "rays");
+  }
+  removeCloud(file_name);
+  std::remove("raybench_render.hdr");
+}
+
+/// Single core throughput of the ray-ellipsoid intersection used by the transient filter, one ray at a time and
+/// batched
+void ellipsoidIntersect(size_t num_rays)
+{
+  // ellipsoids of a few cm to a metre at random orientations, each tested against a batch of rays that end nearby, as
+  // in the rays gathered from the grid cells around an ellipsoid
+  const size_t batch_size = 64;
+  const size_t num_ellipsoids = 1024;
+  std::vector<ray::Ellipsoid> ellipsoids(num_ellipsoids);
+  for (auto &ellipsoid : ellipsoids)
+  {
+    ellipsoid.pos = Eigen::Vector3d::Random() * 10.0;
+    const Eigen::Matrix3d rotation = Eigen::Quaterniond(Eigen::Vector4d::Random()).normalized().toRotationMatrix();
+    const Eigen::Vector3d radii(ray::random(0.02, 1.0), ray::random(0.02, 1.0), ray::random(0.02, 0.2));
+    ellipsoid.eigen_mat = (radii.cwiseInverse().asDiagonal() * rotation.transpose()).cast<float>();
+  }
+  std::vector<ray::RayBatch> batches(num_ellipsoids);
+  for (size_t i = 0; i < num_ellipsoids; i++)
+  {
+    for (size_t j = 0; j < batch_size; j++)
+    {
+      const Eigen::Vector3d end = ellipsoids[i].pos + Eigen::Vector3d::Random() * 1.5;
+      batches[i].add(end + Eigen::Vector3d::Random() * 20.0, end);
+    }
+  }
+  const size_t num_passes = std::max<size_t>(1, num_rays / (num_ellipsoids * batch_size));
+  const size_t count = num_passes * num_ellipsoids * batch_size;
+  std::cout << "ellipsoid intersection, " << count << " rays, single core:" << std::endl;
+
+  std::vector<ray::IntersectResult> scalar_results(num_ellipsoids * batch_size);
+  auto start = Clock::now();
+  for (size_t pass = 0; pass < num_passes; pass++)
+  {
+    for (size_t i = 0; i < num_ellipsoids; i++)
+    {
+      const ray::RayBatch &batch = batches[i];
+      for (size_t j = 0; j < batch_size; j++)
+      {
+        const Eigen::Vector3d ray_start(batch.start[0][j], batch.start[1][j], batch.start[2][j]);
+        const Eigen::Vector3d ray_end(batch.end[0][j], batch.end[1][j], batch.end[2][j]);
+        scalar_results[i * batch_size + j] = ellipsoids[i].intersect(ray_start, ray_end);
+      }
+    }
+  }
+  report("one ray at a time (reference)", count, elapsed(start), "rays");
+
+  std::vector<ray::IntersectResult> results;
+  size_t num_different = 0;
+  size_t num_intersected = 0;
+  start = Clock::now();
+  for (size_t pass = 0; pass < num_passes; pass++)
+  {
+    for (size_t i = 0; i < num_ellipsoids; i++)
+    {
+      ellipsoids[i].intersect(batches[i], results);
+      if (pass == 0)
+      {
+        for (size_t j = 0; j < batch_size; j++)
+        {
+          num_different += results[j] != scalar_results[i * batch_size + j] ? 1 : 0;
+          num_intersected += results[j] != ray::IntersectResult::Miss ? 1 : 0;
+        }
+      }
+    }
+  }
+  report("batched", count, elapsed(start), "rays");
+  std::cout << "    " << num_intersected << " of " << num_ellipsoids * batch_size << " rays intersect" << std::endl;
+  if (num_different > 0)
+  {
+    std::cout << "error: " << num_different << " batched results differ from the single ray results" << std::endl;
+  }
+}
+
+/// Spatial decimation held in memory, against the out-of-core version with a small memory budget
+void decimateSpatial(size_t num_rays)
+{
+  const std::string file_stub = "raybench_decimate";
+  if (!generateCloud(file_stub + ".ply", num_rays))
+  {
+    return;
+  }
+  const double vox_width = 1.0;  // cm
+  const size_t max_memory = 16 * 1024 * 1024;
+  std::cout << "spatial decimation, " << num_rays << " rays:" << std::endl;
+  auto start = Clock::now();
+  ray::decimateSpatial(file_stub, vox_width);
+  report("in memory", num_rays, elapsed(start), "rays");
+  std::rename((file_stub + "_decimated.ply").c_str(), (file_stub + "_in_memory.ply").c_str());
+
+  start = Clock::now();
+  ray::decimateSpatial(file_stub, vox_width, max_memory);
+  report("out of core, 16 MB", num_rays, elapsed(start), "rays");
+
+  std::ifstream in_memory(file_stub + "_in_memory.ply", std::ios::binary);
+  std::ifstream out_of_core(file_stub + "_decimated.ply", std::ios::binary);
+  std::string a((std::istreambuf_iterator<char>(in_memory)), std::istreambuf_iterator<char>());
+  std::string b((std::istreambuf_iterator<char>(out_of_core)), std::istreambuf_iterator<char>());
+  if (a != b)
+  {
+    std::cout << "error: the out-of-core decimation differs from the in-memory one" << std::endl;
+  }
+  removeCloud(file_stub + ".ply");
+  removeCloud(file_stub + "_in_memory.ply");
+  removeCloud(file_stub + "_decimated.ply");
+}
+}  // namespace raybench
+
+int main(int argc, char *argv[])
+{
+  std::map<std::string, std::function<void(size_t)>> benchmarks = { { "compactcloud", raybench::compactCloud },
+                                                                    { "decimatespatial", raybench::decimateSpatial },
+                                                                    { "densitygrid", raybench::densityGrid },
+                                                                    { "ellipsoid", raybench::ellipsoidIntersect },
+                                                                    { "readply", raybench::readPly },
+                                                                    { "render", raybench::render },
+                                                                    { "voxelset", raybench::voxelSet } };
+  std::string name = argc > 1 ? argv[1] : "all";
+  size_t size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5000000;
+  if (name != "all" && benchmarks.find(name) == benchmarks.end())
+  {
+    std::cout << "usage: raybench [benchmark] [size]" << std::endl;
+    std::cout << "benchmarks: all";
+    for (auto &bench : benchmarks)
+    {
+      std::cout << ", " << bench.first;
+    }
+    std::cout << std::endl;
+    return 1;
+  }
+  for (auto &bench : benchmarks)
+  {
+    if (name == "all" || name == bench.first)
+    {
+      bench.second(size);
+    }
+  }
+  return 0;
+}
@@ -5,12 +5,17 @@
 // Author: Thomas Lowe
 
 #include "raycloud.h"
+#include "raycompactcloud.h"
 #include "raymesh.h"
 #include "rayply.h"
 #include "rayforeststructure.h"
+#include "raymappedfile.h"
+#include "raytileindex.h"
 #include <vector>
 #include <gtest/gtest.h>
 #include <cstdlib>
+#include <fstream>
+#include <iterator>
 
 /// Raycloud testing framework. In each test, the statistics of the resulting clouds are compared to the statistics
 /// of the cloud when it was confirmed to be operating correctly. 
@@ -169,6 +174,274 @@ namespace raytest
     compareMoments(cloud.getMoments(), {-0.467731, 1.05075, 1.43662, 2.20441, 1.60162, 0.106775, -0.77974, 1.03139, 1.57353, 3.67521, 2.64766, 0.485084, 17.3995, 10.279, 0.311066, 0.759795, 0.425206, 0.951355, 0.321609, 0.226785, 0.39073, 0.215125});
   }  
 
+  /// Indexes a forest into tiles, then checks that reading a box through the index gives exactly the rays in the box,
+  /// and that the index is ignored once the cloud has changed
+  TEST(Basic, RayIndexBox)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    EXPECT_TRUE(ray::indexCloud("forest.ply", "forest_indexed.ply", 4.0));
+    const ray::Cuboid box(Eigen::Vector3d(-3.0, -2.0, -100.0), Eigen::Vector3d(1.0, 2.0, 100.0));
+    // the rays that pass through the box, in file order
+    auto in_box = [&box](const ray::Cloud &cloud) {
+      ray::Cloud result;
+      for (size_t i = 0; i < cloud.ends.size(); i++)
+      {
+        Eigen::Vector3d start = cloud.starts[i], end = cloud.ends[i];
+        if (box.clipRay(start, end))
+        {
+          result.addRay(cloud.starts[i], cloud.ends[i], cloud.times[i], cloud.colours[i]);
+        }
+      }
+      return result;
+    };
+    ray::Cloud full;
+    EXPECT_TRUE(full.load("forest_indexed.ply"));
+    const ray::Cloud expected = in_box(full);
+    EXPECT_GT(expected.ends.size(), (size_t)0);
+
+    ray::TileIndex index;
+    EXPECT_TRUE(index.load("forest_indexed.ply"));
+    ray::Cloud read;
+    auto add_chunk = [&read](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                             std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        read.addRay(starts[i], ends[i], times[i], colours[i]);
+      }
+    };
+    EXPECT_TRUE(ray::readRayCloudRows("forest_indexed.ply", index.rowRanges(box), add_chunk));
+    EXPECT_LT(read.ends.size(), full.ends.size());  // some tiles are skipped
+    const ray::Cloud found = in_box(read);
+    EXPECT_EQ(found.ends.size(), expected.ends.size());
+    for (size_t i = 0; i < found.ends.size() && i < expected.ends.size(); i++)
+    {
+      EXPECT_EQ(found.starts[i], expected.starts[i]);
+      EXPECT_EQ(found.ends[i], expected.ends[i]);
+      EXPECT_EQ(found.times[i], expected.times[i]);
+    }
+
+    // raysplit reads the box through the index too
+    EXPECT_EQ(command("raysplit forest_indexed.ply box -1,0,0 2,2,100 inside"), 0);
+    ray::Cloud inside;
+    EXPECT_TRUE(inside.load("forest_indexed_inside.ply"));
+    EXPECT_EQ(inside.ends.size(), expected.ends.size());
+
+    // once the cloud changes, its index no longer matches and a bounded read reads the whole cloud
+    full.translate(Eigen::Vector3d(0.0, 0.0, 1.0));
+    full.save("forest_indexed.ply");
+    EXPECT_FALSE(index.load("forest_indexed.ply"));
+    read.clear();
+    EXPECT_TRUE(ray::Cloud::read("forest_indexed.ply", box, add_chunk));
+    EXPECT_EQ(read.ends.size(), full.ends.size());
+  }
+
+  /// Checks which rows a time index gives for a time window, on hand made blocks of two rows
+  TEST(Basic, TimeIndexRowRanges)
+  {
+    ray::TimeIndex index;
+    index.block_rows = 2;
+    index.add({ 0.0, 1.0, 5.0, 6.0, 2.0, 3.0, 9.0 });
+    EXPECT_EQ(index.blocks.size(), (size_t)4);
+    typedef std::vector<std::pair<size_t, size_t>> Ranges;
+    EXPECT_EQ(index.rowRanges(0.0, 1.0), Ranges({ { 0, 2 } }));
+    EXPECT_EQ(index.rowRanges(1.5, 5.5), Ranges({ { 2, 4 } }));  // consecutive blocks are joined
+    EXPECT_EQ(index.rowRanges(0.5, 2.5), Ranges({ { 0, 2 }, { 4, 2 } }));
+    EXPECT_EQ(index.rowRanges(8.0, 10.0), Ranges({ { 6, 1 } }));  // the last block is short
+    EXPECT_TRUE(index.rowRanges(7.0, 8.0).empty());
+  }
+
+  /// Indexes the times of a forest in small blocks, then checks that a time bounded read gives exactly the rays in the
+  /// time window, and that the index is removed once the cloud is saved as a single block
+  TEST(Basic, TimeIndexRead)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Cloud full;
+    EXPECT_TRUE(full.load("forest.ply"));
+    ray::TimeIndex index;
+    index.block_rows = 10000;
+    index.add(full.times);
+    EXPECT_TRUE(index.end("forest.ply"));
+    EXPECT_TRUE(index.load("forest.ply"));
+    EXPECT_EQ(index.block_rows, (size_t)10000);
+
+    const double min_time = full.times[full.times.size() / 3];
+    const double max_time = full.times[full.times.size() / 2];
+    std::vector<double> expected;
+    for (auto &time : full.times)
+    {
+      if (time >= min_time && time <= max_time)
+      {
+        expected.push_back(time);
+      }
+    }
+    EXPECT_GT(expected.size(), (size_t)0);
+    size_t num_read = 0;
+    std::vector<double> found;
+    auto add_chunk = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &times, std::vector<ray::RGBA> &) {
+      num_read += ends.size();
+      for (auto &time : times)
+      {
+        if (time >= min_time && time <= max_time)
+        {
+          found.push_back(time);
+        }
+      }
+    };
+    EXPECT_TRUE(ray::Cloud::read("forest.ply", min_time, max_time, add_chunk));
+    EXPECT_LT(num_read, full.times.size());  // some blocks are skipped
+    EXPECT_EQ(found, expected);
+
+    // a cloud of one block has no time index
+    full.save("forest.ply");
+    EXPECT_FALSE(std::ifstream(ray::TimeIndex::fileName("forest.ply")).good());
+
+    // and a file of the same name that is not a time index is not removed
+    std::ofstream(ray::TimeIndex::fileName("forest.ply")) << "tree times" << std::endl;
+    full.save("forest.ply");
+    EXPECT_TRUE(std::ifstream(ray::TimeIndex::fileName("forest.ply")).good());
+    std::remove(ray::TimeIndex::fileName("forest.ply").c_str());
+  }
+
+  /// Reads a small cloud through the memory-mapped reader, checking its bytes against a stream read of the same file,
+  /// the decoded rays against the saved rays, and that a truncated file is rejected
+  TEST(Basic, PlyMappedRead)
+  {
+    ray::Cloud cloud;
+    for (int i = 0; i < 1000; i++)
+    {
+      const Eigen::Vector3d start(0.01 * i, -0.02 * i, 1.0);
+      const Eigen::Vector3d end = start + Eigen::Vector3d(0.5, 0.25 * (i % 7), -1.0);
+      ray::RGBA colour;
+      colour.red = (uint8_t)i;
+      colour.green = (uint8_t)(3 * i);
+      colour.blue = (uint8_t)(7 * i);
+      colour.alpha = (i % 10) == 0 ? 0 : 255;
+      cloud.addRay(start, end, 100.0 + 0.001 * i, colour);
+    }
+    cloud.save("mapped.ply");
+
+    std::ifstream stream("mapped.ply", std::ios::in | std::ios::binary);
+    const std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    ray::MappedFile file;
+    EXPECT_TRUE(file.open("mapped.ply"));
+    EXPECT_EQ(file.size(), bytes.size());
+    const unsigned char *data = file.data(0, bytes.size());
+    EXPECT_TRUE(data != nullptr);
+    EXPECT_TRUE(data && std::equal(bytes.begin(), bytes.end(), data));
+    EXPECT_TRUE(file.data(bytes.size() - 10, 20) == nullptr);  // past the end of the file
+    file.close();
+
+    ray::Cloud loaded;
+    EXPECT_TRUE(loaded.load("mapped.ply"));
+    EXPECT_EQ(loaded.ends.size(), cloud.ends.size());
+    for (size_t i = 0; i < loaded.ends.size() && i < cloud.ends.size(); i++)
+    {
+      EXPECT_LT((loaded.starts[i] - cloud.starts[i]).norm(), 1e-5);
+      EXPECT_LT((loaded.ends[i] - cloud.ends[i]).norm(), 1e-5);
+      EXPECT_DOUBLE_EQ(loaded.times[i], cloud.times[i]);
+      EXPECT_EQ(loaded.colours[i].red, cloud.colours[i].red);
+      EXPECT_EQ(loaded.colours[i].green, cloud.colours[i].green);
+      EXPECT_EQ(loaded.colours[i].blue, cloud.colours[i].blue);
+      EXPECT_EQ(loaded.colours[i].alpha, cloud.colours[i].alpha);
+    }
+
+    // a file cut short of the rows that its header lists gives its whole rows, as the stream reader did
+    const size_t cut = 100;
+    std::ofstream short_file("mapped_short.ply", std::ios::out | std::ios::binary);
+    short_file.write(reinterpret_cast<const char *>(bytes.data()), (std::streamsize)(bytes.size() - cut));
+    short_file.close();
+    ray::Cloud truncated;
+    EXPECT_TRUE(truncated.load("mapped_short.ply"));
+    const size_t row_size = sizeof(ray::RayPlyEntry);
+    EXPECT_EQ(truncated.ends.size(), cloud.ends.size() - (cut + row_size - 1) / row_size);
+    for (size_t i = 0; i < truncated.ends.size() && i < cloud.ends.size(); i++)
+    {
+      EXPECT_EQ(truncated.ends[i], loaded.ends[i]);
+      EXPECT_EQ(truncated.times[i], loaded.times[i]);
+    }
+  }
+
+  /// Reads a forest in many small chunks with and without prefetching, checking that the chunks arrive identically and in
+  /// file order, and that row ranges outside the file or out of order are rejected
+  TEST(Basic, PlyPrefetchRead)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    const size_t chunk_size = 1000;
+    auto read_chunks = [&](size_t prefetch_chunks, std::vector<std::vector<double>> &chunks) {
+      auto add_chunk = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
+                           std::vector<double> &times, std::vector<ray::RGBA> &) {
+        EXPECT_EQ(ends.size(), times.size());
+        chunks.push_back(times);
+      };
+      return ray::readPly("forest.ply", true, add_chunk, 0, false, chunk_size, prefetch_chunks);
+    };
+    std::vector<std::vector<double>> serial, prefetched, double_buffered;
+    EXPECT_TRUE(read_chunks(0, serial));
+    EXPECT_TRUE(read_chunks(3, prefetched));
+    EXPECT_TRUE(read_chunks(1, double_buffered));
+    EXPECT_GT(serial.size(), (size_t)10);
+    EXPECT_EQ(prefetched, serial);
+    EXPECT_EQ(double_buffered, serial);
+
+    ray::Cloud full;
+    EXPECT_TRUE(full.load("forest.ply"));
+    std::vector<double> times;
+    for (auto &chunk : prefetched)
+    {
+      times.insert(times.end(), chunk.begin(), chunk.end());
+    }
+    EXPECT_EQ(times, full.times);  // in file order
+
+    // the row ranges must be within the file and in order
+    auto no_rays = [](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &, std::vector<double> &,
+                      std::vector<ray::RGBA> &) {};
+    const size_t num_rows = full.ends.size();
+    EXPECT_TRUE(ray::readRayCloudRows("forest.ply", { { 10, 5 }, { 100, 50 } }, no_rays, chunk_size, 2));
+    EXPECT_FALSE(ray::readRayCloudRows("forest.ply", { { num_rows - 5, 10 } }, no_rays, chunk_size, 2));
+    EXPECT_FALSE(ray::readRayCloudRows("forest.ply", { { 100, 50 }, { 10, 5 } }, no_rays, chunk_size, 2));
+  }
+
+  /// Loads a forest into a compact cloud, checking that its rays are those that Cloud loads, and that saving,
+  /// translating and removing rays keep them
+  TEST(Basic, CompactCloudLoad)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("forest.ply"));
+    ray::CompactCloud compact;
+    EXPECT_TRUE(compact.load("forest.ply"));
+    EXPECT_EQ(compact.rayCount(), cloud.rayCount());
+    EXPECT_GT(compact.chunkCount(), (size_t)1);
+    for (size_t i = 0; i < compact.rayCount() && i < cloud.rayCount(); i++)
+    {
+      EXPECT_EQ(compact.start(i), cloud.starts[i]);
+      EXPECT_EQ(compact.end(i), cloud.ends[i]);
+      EXPECT_EQ(compact.time(i), cloud.times[i]);
+      EXPECT_EQ(compact.colour(i).alpha, cloud.colours[i].alpha);
+    }
+    EXPECT_EQ(compact.calcMinBound(), cloud.calcMinBound());
+    EXPECT_EQ(compact.calcMaxBound(), cloud.calcMaxBound());
+
+    EXPECT_TRUE(compact.save("forest_compact.ply"));
+    ray::Cloud saved;
+    EXPECT_TRUE(saved.load("forest_compact.ply"));
+    EXPECT_EQ(saved.ends, cloud.ends);
+    EXPECT_EQ(saved.times, cloud.times);
+
+    const Eigen::Vector3d offset(1000.0, -2000.0, 10.0);
+    compact.translate(offset);
+    EXPECT_EQ(compact.end(0), cloud.ends[0] + offset);
+    compact.translate(-offset);
+
+    // removing a ray moves the last ray into its place
+    const size_t count = compact.rayCount();
+    compact.removeRay(1);
+    EXPECT_EQ(compact.rayCount(), count - 1);
+    EXPECT_EQ(compact.end(1), cloud.ends[count - 1]);
+    EXPECT_EQ(compact.time(1), cloud.times[count - 1]);
+  }
+
   /// Creates a room and runs raytransients, comparing the identified transients ray cloud to the expected results
   TEST(Basic, RayTransients)
   {
@@ -189,6 +462,47 @@ namespace raytest
     compareMoments(cloud.getMoments(), {9.66298, 21.3454, 31.7177, 6.0926, 5.75511, 0.56438, 9.69155, 21.3605, 33.0883, 6.10555, 5.82564, 3.20507, 62.683, 36.1903, 0.514327, 0.504407, 0.413534, 1, 0.372377, 0.365965, 0.391709, 0});
   }
 
+  /// Extracts the trees of a forest on a flat ground mesh, comparing them to those of a serial reconstruction. The
+  /// branches of each generation are reconstructed in parallel using the forest's taper from the start of the
+  /// generation, which changes the radii slightly. So the number of segments and the moments are only required to be
+  /// within 0.1% of the serial reconstruction's
+  TEST(Basic, RayExtractTreesTaper)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Mesh mesh;
+    const int grid = 30;
+    for (int y = 0; y <= grid; y++)
+    {
+      for (int x = 0; x <= grid; x++)
+      {
+        mesh.vertices().push_back(Eigen::Vector3d(x - 0.5 * grid, y - 0.5 * grid, -0.06));
+      }
+    }
+    for (int y = 0; y < grid; y++)
+    {
+      for (int x = 0; x < grid; x++)
+      {
+        const int i = y * (grid + 1) + x;
+        mesh.indexList().push_back(Eigen::Vector3i(i, i + 1, i + grid + 2));
+        mesh.indexList().push_back(Eigen::Vector3i(i, i + grid + 2, i + grid + 1));
+      }
+    }
+    EXPECT_TRUE(ray::writePlyMesh("forest_ground.ply", mesh));
+    EXPECT_EQ(command("rayextract trees forest.ply forest_ground.ply"), 0);
+
+    ray::ForestStructure forest;
+    EXPECT_TRUE(forest.load("forest_trees.txt"));
+    size_t num_segments = 0;
+    for (auto &tree : forest.trees)
+    {
+      num_segments += tree.segments().size();
+    }
+    const double serial_segments = 4347;
+    EXPECT_NEAR((double)num_segments, serial_segments, 0.001 * serial_segments);
+    compareMomentsPercentageError(forest.getMoments(),
+                                  { 20, 13.256, 885.977, 1.4942, 0.12478, 2.36752, 21918, 0, 108.65 }, 0.1);
+  }
+
 #if RAYLIB_WITH_QHULL
   /// Creates a terrain ray cloud, then wraps it from below, comparing the mesh to the expected results
   TEST(Basic, RayWrap)